@@ -1,914 +1,2171 @@
-#include <rtdevice.h>
-#include <rtthread.h>
-
-#include <dfs_file.h>
-#include <dfs_fs.h>
-
-#include "fx_api.h"
-#include "fx_directory.h"
-
-#include <stdio.h>
-#include <string.h>
-
-extern VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr);
-
-static rt_mutex_t lock = NULL;
-
-static inline void filex_lock(void)
-{
-    rt_mutex_take(lock, RT_WAITING_FOREVER);
-}
-
-static inline void filex_unlock(void)
-{
-    rt_mutex_release(lock);
-}
-
-#ifndef FLIEX_MEDIA_MEMORY_SIZE
-#define FLIEX_MEDIA_MEMORY_SIZE 4096     /* Size */
-#endif /* FLIEX_MEDIA_MEMORY_SIZE */
-
-typedef struct filex_media {
-    rt_list_t list;
-    FX_MEDIA media;
-    unsigned char media_memory[FLIEX_MEDIA_MEMORY_SIZE];
-#ifdef FX_ENABLE_FAULT_TOLERANT
-    unsigned char fault_tolerant_memory[FLIEX_MEDIA_MEMORY_SIZE];
-#endif
-} filex_media_t;
-
-typedef struct filex_dir {
-    FX_DIR_ENTRY entry;
-    char name_buffer[FX_MAX_LONG_NAME_LEN];
-    int is_root;
-    FX_MEDIA * media;
-} filex_dir_t;
-
-rt_list_t filex_media_list;
-
-static filex_media_t * _filex_get_media(rt_device_t dev_id)
-{
-    rt_list_t * entry;
-    filex_media_t * media;
-    filex_lock();
-    for(entry = filex_media_list.next; entry->next != &filex_media_list; entry = entry->next) 
-    {
-        media = rt_list_entry(entry, filex_media_t, list);
-        if(media->media.fx_media_driver_info == dev_id)
-        {
-            filex_unlock();
-            return media;
-        }
-    }
-    filex_unlock();
-    return NULL;
-}
-
-static int _filex_result_to_dfs(int result)
-{
-    int status = 0;
-
-    switch (result)
-    {
-    case FX_SUCCESS:
-        break;
-
-    case FX_IO_ERROR:
-        status = -EIO;
-        break; // Error during device operation
-
-    case FX_ALREADY_CREATED:
-        status = -EEXIST;
-        break; // Entry already exists
-
-    case FX_NOT_DIRECTORY:
-        status = -ENOTDIR;
-        break; // Entry is not a dir
-
-    case FX_NOT_A_FILE:
-        status = -EISDIR;
-        break; // Entry is a dir
-
-    case FX_DIR_NOT_EMPTY:
-        status = -ENOTEMPTY;
-        break; // Dir is not empty
-
-    case FX_INVALID_OPTION:
-        status = -EINVAL;
-        break; // Invalid parameter
-
-    case FX_NO_MORE_SPACE:
-        status = -ENOSPC;
-        break; // No space left on device
-
-    case FX_NOT_ENOUGH_MEMORY:
-        status = -ENOMEM;
-        break; // No more memory available
-
-    case FX_FILE_CORRUPT:
-        status = -52;
-        break; // Corrupted
-
-    default:
-        status = -result;
-        break;
-    }
-
-    return status;
-}
-
-
-static int _dfs_filex_mount(struct dfs_filesystem* dfs, unsigned long rwflag, const void* data)
-{
-    int result;
-    rt_device_t dev_id = dfs->dev_id;
-    filex_media_t * filex_media;
-
-    /* Check Device Type */
-    if (dev_id->type != RT_Device_Class_MTD && dev_id->type != RT_Device_Class_Block)
-    {
-        rt_kprintf("The memory device type must be MTD or Block!\n");
-        return -EINVAL;
-    }
-    /* if do mkfs */
-    filex_media = _filex_get_media(dev_id);
-    if(filex_media == NULL)
-    {
-        filex_media = calloc(sizeof(filex_media_t), 1);
-        if(filex_media == NULL) 
-        {
-            return -ENOMEM;
-        }
-        filex_lock();
-        rt_list_insert_before(&filex_media_list, &filex_media->list);
-        filex_unlock();
-    }
-    filex_lock();
-    result =  fx_media_open(&filex_media->media, dev_id->parent.name, rt_fx_disk_driver, dev_id, filex_media->media_memory, sizeof(filex_media->media_memory));
-    /* Check the media open status.  */
-    if (result != FX_SUCCESS)
-    {
-
-        /* Error, break the loop!  */
-        rt_list_remove(&filex_media->list);
-        free(filex_media);
-        filex_unlock();
-        return _filex_result_to_dfs(result);
-    }
-
-    dfs->data = filex_media;
-    filex_unlock();
-
-    return RT_EOK;
-}
-
-static int _dfs_filex_unmount(struct dfs_filesystem* dfs)
-{
-    int result;
-    filex_media_t * filex_media;
-
-    RT_ASSERT(dfs != RT_NULL);
-    RT_ASSERT(dfs->data != RT_NULL);
-    filex_lock();
-
-    filex_media = (filex_media_t*)dfs->data;
-    result =  fx_media_close(&filex_media->media);
-    
-    if (result == FX_SUCCESS)
-    {
-        dfs->data = NULL;
-        rt_list_remove(&filex_media->list);
-        free(filex_media);
-    }
-    filex_unlock();
-    return _filex_result_to_dfs(result);
-}
-
-
-
-static int _dfs_filex_fat_mkfs(rt_device_t dev_id)
-{
-    uint32_t sectors_count;
-    uint32_t sectors_begin;
-    uint32_t sectors_size;
-    filex_media_t * filex_media;
-    int result;
-    if(dev_id == RT_NULL)
-    {
-        rt_kprintf("dev_id is NULL %s,%d\n", __func__, __LINE__);
-        return -EINVAL;
-    }
-    /* Check Device Type */
-    if (dev_id->type != RT_Device_Class_MTD && dev_id->type != RT_Device_Class_Block)
-    {
-        rt_kprintf("The memory device type must be MTD or Block!\n");
-        return -EINVAL;
-    }
-    filex_lock();
-    switch(dev_id->type)
-    {
-#ifdef RT_MTD_NOR_DEVICE
-    case RT_Device_Class_MTD:
-        sectors_count = RT_MTD_NOR_DEVICE(dev_id)->block_end - RT_MTD_NOR_DEVICE(dev_id)->block_start;
-        sectors_begin = RT_MTD_NOR_DEVICE(dev_id)->block_start;
-        sectors_size = RT_MTD_NOR_DEVICE(dev_id)->block_size;
-        break;
-#endif
-    case RT_Device_Class_Block:
-        {
-            struct rt_device_blk_geometry geometry;
-            rt_memset(&geometry, 0, sizeof(geometry));
-            result = rt_device_control(dev_id,
-                                    RT_DEVICE_CTRL_BLK_GETGEOME,
-                                    &geometry);
-            if( result != RT_EOK )
-            {
-                rt_kprintf("device : %s cmd RT_DEVICE_CTRL_BLK_GETGEOME failed.\r\n");
-                filex_unlock();
-                return result;
-            }
-            sectors_count = geometry.sector_count;
-            sectors_size = geometry.bytes_per_sector;
-            sectors_begin = 0;
-            break;
-        }
-    default:
-        filex_unlock();
-        return -EINVAL;
-    }
-    filex_media = _filex_get_media(dev_id);
-    if(filex_media == NULL)
-    {
-        filex_media = calloc(sizeof(filex_media_t), 1);
-        if(filex_media == NULL) 
-        {
-            filex_unlock();
-            return -ENOMEM;
-        }
-        rt_list_insert_before(&filex_media_list, &filex_media->list);
-    }
-
-    result = fx_media_format(&filex_media->media,
-                    rt_fx_disk_driver,               // Driver entry
-                    dev_id,              // RAM disk memory pointer
-                    filex_media->media_memory,                 // Media buffer pointer
-                    sizeof(filex_media->media_memory),         // Media buffer size
-                    dev_id->parent.name,                // Volume Name
-                    1,                            // Number of FATs
-                    32,                           // Directory Entries
-                    sectors_begin,                            // Hidden sectors
-                    sectors_count,                          // Total sectors
-                    sectors_size,                          // Sector size
-                    4096 / sectors_size,                            // Sectors per cluster
-                    1,                            // Heads
-                    1);                           // Sectors per track
-
-    if (result != FX_SUCCESS)
-    {
-
-        /* Error, break the loop!  */
-        rt_list_remove(&filex_media->list);
-        free(filex_media);
-        filex_unlock();
-        return _filex_result_to_dfs(result);
-    }
-
-#ifdef FX_ENABLE_FAULT_TOLERANT
-        result = fx_fault_tolerant_enable(&filex_media->media, filex_media->fault_tolerant_memory, sizeof(filex_media->fault_tolerant_memory));
-
-        if (result != FX_SUCCESS)
-        {
-
-            /* Error, break the loop!  */
-            rt_list_remove(&filex_media->list);
-            free(filex_media);
-        }
-#endif /* FX_ENABLE_FAULT_TOLERANT */
-    filex_unlock();
-    return _filex_result_to_dfs(result);
-    
-}
-
-#ifdef FX_ENABLE_EXFAT
-static int _dfs_filex_exfat_mkfs(rt_device_t dev_id)
-{
-    uint32_t sectors_count;
-    uint32_t sectors_begin;
-    uint32_t sectors_size;
-    filex_media_t * filex_media;
-    if(dev_id == RT_NULL)
-    {
-        rt_kprintf("dev_id is NULL %s,%d\n", __func__, __LINE__);
-        return -EINVAL;
-    }
-    /* Check Device Type */
-    if (dev_id->type != RT_Device_Class_MTD && dev_id->type != RT_Device_Class_Block)
-    {
-        rt_kprintf("The memory device type must be MTD or Block!\n");
-        return -EINVAL;
-    }
-    filex_lock();
-    switch(dev_id->type)
-    {
-#ifdef RT_MTD_NOR_DEVICE
-    case RT_Device_Class_MTD:
-        sectors_count = RT_MTD_NOR_DEVICE(dev_id)->block_start - RT_MTD_NOR_DEVICE(dev_id)->block_end;
-        sectors_begin = RT_MTD_NOR_DEVICE(dev_id)->block_start;
-        sectors_size = RT_MTD_NOR_DEVICE(dev_id)->block_size;
-        break;
-#endif
-    case RT_Device_Class_Block:
-        {
-            struct rt_device_blk_geometry geometry;
-            rt_memset(&geometry, 0, sizeof(geometry));
-            result = rt_device_control(dev_id,
-                                    RT_DEVICE_CTRL_BLK_GETGEOME,
-                                    &geometry);
-            if( result != RT_EOK )
-            {
-                rt_kprintf("device : %s cmd RT_DEVICE_CTRL_BLK_GETGEOME failed.\r\n");
-                filex_unlock();
-                return result;
-            }
-            sectors_count = geometry.sector_count;
-            sectors_size = geometry.bytes_per_sector;
-            sectors_begin = 0;
-            break;
-        }
-    default:
-        filex_unlock();
-        return -EINVAL;
-    }
-    filex_media = _filex_get_media(dev_id);
-    if(filex_media == NULL)
-    {
-        filex_media = calloc(sizeof(filex_media_t), 1);
-        if(filex_media == NULL) 
-        {
-            filex_unlock();
-            return -ENOMEM;
-        }
-        rt_list_insert_before(&filex_media_list, &filex_media->list);
-    }
-
-    result = fx_media_exFAT_format(&filex_media->media,
-                          rt_fx_disk_driver,         // Driver entry
-                          dev_id,        // RAM disk memory pointer
-                          filex_media->media_memory,           // Media buffer pointer
-                          sizeof(filex_media->media_memory),   // Media buffer size
-                          dev_id->parent.name,          // Volume Name
-                          1,                      // Number of FATs
-                          sectors_begin,                      // Hidden sectors
-                          sectors_count,                    // Total sectors
-                          sectors_size,                    // Sector size
-                          8,                      // exFAT Sectors per cluster
-                          12345,                  // Volume ID
-                          1);                     // Boundary unit
-    if (result != FX_SUCCESS)
-    {
-
-        /* Error, break the loop!  */
-        rt_list_remove(&filex_media->list);
-        free(filex_media);
-        filex_unlock();
-        return _filex_result_to_dfs(result);
-    }
-
-#ifdef FX_ENABLE_FAULT_TOLERANT
-        result = fx_fault_tolerant_enable(&filex_media->media, filex_media->fault_tolerant_memory, sizeof(filex_media->fault_tolerant_memory));
-
-        if (result != FX_SUCCESS)
-        {
-
-            /* Error, break the loop!  */
-            rt_list_remove(&filex_media->list);
-            free(filex_media);
-        }
-#endif /* FX_ENABLE_FAULT_TOLERANT */
-    filex_unlock();
-    return _filex_result_to_dfs(result);
-    
-}
-#endif /* FX_ENABLE_EXFAT */
-
-
-static int _dfs_filex_statfs(struct dfs_filesystem* dfs, struct statfs* buf)
-{
-    int result;
-    filex_media_t * filex_media;
-    ULONG64 available_bytes;
-
-    RT_ASSERT(buf != RT_NULL);
-    RT_ASSERT(dfs != RT_NULL);
-    RT_ASSERT(dfs->data != RT_NULL);
-
-    filex_media = (filex_media_t*)dfs->data;
-    filex_lock();
-    result = fx_media_extended_space_available(&filex_media->media, &available_bytes);
-
-    if (result != FX_SUCCESS)
-    {
-        filex_unlock();
-        return _filex_result_to_dfs(result);
-    }
-
-    buf->f_bsize = filex_media->media.fx_media_bytes_per_sector;
-    buf->f_blocks = filex_media->media.fx_media_total_sectors;
-    buf->f_bfree = available_bytes / buf->f_bsize;
-    filex_unlock();
-    return _filex_result_to_dfs(result);
-}
-
-static int _dfs_filex_unlink(struct dfs_filesystem* dfs, const char* path)
-{
-    filex_media_t * filex_media;
-    int result;
-
-    RT_ASSERT(dfs != RT_NULL);
-    RT_ASSERT(dfs->data != RT_NULL);
-
-    filex_media = (filex_media_t*)dfs->data;
-    filex_lock();
-
-    result = fx_file_delete(&filex_media->media, (char *)path);
-    if(result == FX_NOT_A_FILE)
-    {
-        result = fx_directory_delete(&filex_media->media, (char *)path);
-    }
-    filex_unlock();
-    return _filex_result_to_dfs(result);
-}
-
-static int _dfs_filex_stat(struct dfs_filesystem* dfs, const char* path, struct stat* st)
-{
-    filex_media_t * filex_media;
-    int result;
-    FX_DIR_ENTRY dir_entry;
-
-    RT_ASSERT(dfs != RT_NULL);
-    RT_ASSERT(dfs->data != RT_NULL);
-    RT_ASSERT(st != RT_NULL);
-
-    filex_media = (filex_media_t*)dfs->data;
-    filex_lock();
-    dir_entry.fx_dir_entry_name = filex_media->media.fx_media_name_buffer + FX_MAX_LONG_NAME_LEN;
-    dir_entry.fx_dir_entry_short_name[0] = 0;
-    result =  _fx_directory_search(&filex_media->media, (char *)path, &dir_entry, FX_NULL, FX_NULL);
-
-    /* Determine if the search was successful.  */
-    if (result != FX_SUCCESS)
-    {
-        /* Return the error code.  */
-        filex_unlock();
-        return _filex_result_to_dfs(result);
-    }
-
-    memset(st, 0, sizeof(struct stat));
-    st->st_mode = S_IRUSR | S_IRGRP | S_IROTH;
-
-    if(!(dir_entry.fx_dir_entry_attributes & FX_READ_ONLY))
-    {
-        st->st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
-    }
-
-    if(dir_entry.fx_dir_entry_attributes & FX_DIRECTORY)
-    {
-        st->st_mode |= S_IFDIR;
-    }
-    else
-    {
-        st->st_mode |= S_IFREG | S_IXUSR | S_IXGRP | S_IXOTH;
-    }
-    st->st_size = dir_entry.fx_dir_entry_file_size;
-    st->st_atime =dir_entry.fx_dir_entry_last_accessed_date;
-    st->st_mtime = dir_entry.fx_dir_entry_time;
-    st->st_ctime = st->st_mtime;
-
-    filex_unlock();
-    return _filex_result_to_dfs(FX_SUCCESS);
-}
-
-static int _dfs_filex_rename(struct dfs_filesystem* dfs, const char* from, const char* to)
-{
-    filex_media_t * filex_media;
-    int result;
-
-    RT_ASSERT(dfs != RT_NULL);
-    RT_ASSERT(dfs->data != RT_NULL);
-
-    filex_media = (filex_media_t*)dfs->data;
-    filex_lock();
-    result = fx_directory_rename(&filex_media->media, (char *)from, (char *)to);
-    if(result == FX_NOT_DIRECTORY)
-    {
-        result = fx_file_rename(&filex_media->media, (char *)from, (char *)to);
-    }
-    filex_unlock();
-    return _filex_result_to_dfs(result);
-}
-
-/******************************************************************************
- * file operations
- ******************************************************************************/
-static int _dfs_filex_open(struct dfs_fd* file)
-{
-    struct dfs_filesystem* dfs;
-    filex_media_t * filex_media;
-    int result;
-    int flags = 0;
-
-    RT_ASSERT(file != RT_NULL);
-    RT_ASSERT(file->data != RT_NULL);
-
-    dfs = (struct dfs_filesystem*)file->data;
-    filex_media = (filex_media_t*)dfs->data;
-    filex_lock();
-    if (file->flags & O_DIRECTORY)
-    {
-        filex_dir_t *dir_entry = calloc(sizeof(filex_dir_t), 1);
-
-        if (dir_entry == NULL)
-        {
-            rt_kprintf("ERROR:no memory!\n");
-            result = -ENOMEM;
-            goto _error_dir;
-        }
-        dir_entry->media = &filex_media->media;
-        if(strcmp(file->path, "/") == 0 || strcmp(file->path, "\\") == 0)
-        {
-            dir_entry->is_root = 1;
-            file->data = (void*)dir_entry;
-            filex_unlock();
-            return _filex_result_to_dfs(FX_SUCCESS);
-        }
-        dir_entry->is_root = 0;
-        if (file->flags & O_CREAT)
-        {
-            result = fx_directory_create(&filex_media->media, file->path);
-            if (result != FX_SUCCESS)
-            {
-                goto _error_dir;
-            }
-            fx_media_flush(&filex_media->media);
-        }
-        dir_entry->entry.fx_dir_entry_name = dir_entry->name_buffer;
-        dir_entry->entry.fx_dir_entry_short_name[0] = 0;
-        result =  _fx_directory_search(&filex_media->media, file->path, &dir_entry->entry, FX_NULL, FX_NULL);
-        /* Determine if the search was successful.  */
-        if (result != FX_SUCCESS)
-        {
-            /* Return the error code.  */
-            goto _error_dir;
-        }
-        else
-        {
-            file->data = (void*)dir_entry;
-            filex_unlock();
-            return _filex_result_to_dfs(result);
-        }
-
-    _error_dir:
-        if (dir_entry != NULL)
-        {
-            free(dir_entry);
-        }
-        file->data = NULL;
-        filex_unlock();
-        return _filex_result_to_dfs(result);
-    }
-    else
-    {
-        FX_FILE* file_entry = calloc(sizeof(FX_FILE), 1);
-        if (file_entry == RT_NULL)
-        {
-            rt_kprintf("ERROR:no memory!\n");
-            result = -ENOMEM;
-
-            goto _error_file;
-        }
-
-        if ((file->flags & 3) == O_RDONLY)
-            flags |= FX_OPEN_FOR_READ;
-        if ((file->flags & 3) == O_WRONLY)
-            flags |= FX_OPEN_FOR_WRITE;
-        if ((file->flags & 3) == O_RDWR)
-            flags |= FX_OPEN_FOR_READ | FX_OPEN_FOR_WRITE;
-
-        if (file->flags & O_CREAT)
-        {
-            result = fx_file_create(&filex_media->media, file->path);
-            if((file->flags & O_EXCL) && (result == FX_ALREADY_CREATED))
-            {
-                result = -EEXIST;
-                goto _error_file;
-            }
-            if(result == FX_ALREADY_CREATED)
-            {
-                result = FX_SUCCESS;
-            }
-            if(result != FX_SUCCESS)
-            {
-                goto _error_file;
-            }
-        }
-
-        result = fx_file_open(&filex_media->media, file_entry, file->path, flags);
-        if (result != FX_SUCCESS)
-        {
-            goto _error_file;
-        }
-        else
-        {
-            if(file->flags & O_TRUNC)
-            {
-                fx_file_truncate_release(file_entry, 0);
-            }
-            if(file->flags & O_APPEND)
-            {
-                fx_file_relative_seek(file_entry, 0, FX_SEEK_END);
-            }
-            file->data = (void*)file_entry;
-            file->pos = file_entry->fx_file_current_file_offset;
-            file->size = file_entry->fx_file_current_file_size;
-            filex_unlock();
-            return _filex_result_to_dfs(result);
-        }
-
-    _error_file:
-        if (file_entry != RT_NULL)
-        {
-            free(file_entry);
-        }
-        file->data = NULL;
-        filex_unlock();
-        return _filex_result_to_dfs(result);
-    }
-}
-
-static int _dfs_filex_close(struct dfs_fd* file)
-{
-    int result = FX_SUCCESS;
-    RT_ASSERT(file != RT_NULL);
-
-    if (file->type == FT_DIRECTORY)
-    {
-        if(file->data != NULL)
-        {
-            free(file->data);
-            file->data = NULL;
-        }
-        result = FX_SUCCESS;
-    }
-    else
-    {
-        FX_FILE* file_entry = (FX_FILE*)file->data;
-        filex_lock();
-        if(file_entry != NULL)
-        {
-            result = fx_file_close(file_entry);
-            if(result == FX_SUCCESS)
-            {
-                free(file->data);
-                file->data = NULL;
-            }
-            fx_media_flush(file_entry->fx_file_media_ptr);
-        }
-        filex_unlock();
-    }
-    
-    return _filex_result_to_dfs(result);
-}
-
-static int _dfs_filex_ioctl(struct dfs_fd* file, int cmd, void* args)
-{
-    return -ENOSYS;
-}
-
-static int _dfs_filex_read(struct dfs_fd* file, void* buf, size_t len)
-{
-    FX_FILE* file_entry = (FX_FILE*)file->data;
-    int result;
-    ULONG actual_size;
-
-    RT_ASSERT(file != RT_NULL);
-    RT_ASSERT(file->data != RT_NULL);
-
-
-    if (file->type == FT_DIRECTORY)
-    {
-        return 0;
-    }
-    filex_lock();
-    result = fx_file_read(file_entry, buf, len, &actual_size);
-    if (result != FX_SUCCESS)
-    {
-        filex_unlock();
-        return 0;
-    }
-
-    /* update position */
-    file->pos = file_entry->fx_file_current_file_offset;
-    filex_unlock();
-    return actual_size;
-}
-
-static int _dfs_filex_write(struct dfs_fd* file, const void* buf, size_t len)
-{
-    FX_FILE* file_entry = (FX_FILE*)file->data;
-    int result;
-
-    RT_ASSERT(file != RT_NULL);
-    RT_ASSERT(file->data != RT_NULL);
-
-    if (file->type == FT_DIRECTORY)
-    {
-        return 0;
-    }
-    filex_lock();
-    result = fx_file_write(file_entry, (void *)buf, len);
-
-    if (result != FX_SUCCESS)
-    {
-        filex_unlock();
-        return 0;
-    }
-
-    /* update position and file size */
-    file->pos = file_entry->fx_file_current_file_offset;
-    file->size = file_entry->fx_file_current_file_size;
-    filex_unlock();
-    return len;
-}
-
-static int _dfs_filex_flush(struct dfs_fd* file)
-{
-    FX_FILE* file_entry = (FX_FILE*)file->data;
-    int result;
-
-    RT_ASSERT(file != RT_NULL);
-    RT_ASSERT(file->data != RT_NULL);
-    filex_lock();
-    result = fx_media_flush(file_entry->fx_file_media_ptr);
-
-    filex_unlock();
-    return _filex_result_to_dfs(result);
-}
-
-static int _dfs_filex_lseek(struct dfs_fd* file, rt_off_t offset)
-{
-    int result;
-    RT_ASSERT(file != RT_NULL);
-    RT_ASSERT(file->data != RT_NULL);
-    filex_lock();
-    if (file->type == FT_REGULAR)
-    {
-        FX_FILE* file_entry = (FX_FILE*)file->data;
-        result = fx_file_seek(file_entry, offset);
-        if (result != FX_SUCCESS)
-        {
-            filex_unlock();
-            return _filex_result_to_dfs(result);
-        }
-
-        file->pos = file_entry->fx_file_current_file_offset;
-    }
-    else if (file->type == FT_DIRECTORY)
-    {
-        file->pos = offset;
-    }
-    filex_unlock();
-    return (file->pos);
-}
-
-static int _dfs_filex_getdents(struct dfs_fd* file, struct dirent* dirp, uint32_t count)
-{
-    filex_dir_t *dir_entry;
-    int result;
-    ULONG index;
-    ULONG offset;
-    struct dirent* d;
-    FX_DIR_ENTRY dest_entry;
-
-    RT_ASSERT(file->data != RT_NULL);
-    
-
-    dir_entry = (filex_dir_t*)(file->data);
-
-    /* make integer count */
-    count = (count / sizeof(struct dirent)) * sizeof(struct dirent);
-    if (count == 0)
-    {
-        return -EINVAL;
-    }
-    filex_lock();
-    offset = file->pos / sizeof(struct dirent);
-
-    index = 0;
-    dest_entry.fx_dir_entry_name = malloc(FX_MAX_LONG_NAME_LEN);
-    RT_ASSERT(dest_entry.fx_dir_entry_name);
-    while (1)
-    {
-        d = dirp + index;
-
-        dest_entry.fx_dir_entry_short_name[0] = 0;
-        result = _fx_directory_entry_read(dir_entry->media, dir_entry->is_root ? NULL : &dir_entry->entry, &offset, &dest_entry);
-        if (result != FX_SUCCESS)
-        {
-            break;
-        }
-
-#ifdef FX_ENABLE_EXFAT
-        if (dest_entry.fx_dir_entry_type == FX_EXFAT_DIR_ENTRY_TYPE_END_MARKER)
-#else
-        if ((UCHAR)dest_entry.fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_DONE)
-#endif /* FX_ENABLE_EXFAT */
-        {
-            break;
-        }
-
-        d->d_type = DT_UNKNOWN;
-
-        if(dest_entry.fx_dir_entry_attributes & FX_DIRECTORY)
-        {
-            d->d_type |= DT_DIR;
-        }
-        else
-        {
-            d->d_type |= DT_REG;
-        }
-        
-
-        d->d_namlen = (rt_uint8_t)rt_strlen(dest_entry.fx_dir_entry_name);
-        d->d_reclen = (rt_uint16_t)sizeof(struct dirent);
-        strncpy(d->d_name, dest_entry.fx_dir_entry_name, d->d_namlen + 1);
-
-        index++;
-        offset++;
-        if (index * sizeof(struct dirent) >= count)
-        {
-            break;
-        }
-    }
-
-    file->pos = offset * sizeof(struct dirent);
-    free(dest_entry.fx_dir_entry_name);
-    filex_unlock();
-    return index * sizeof(struct dirent);
-}
-
-static const struct dfs_file_ops _dfs_filex_fops = {
-    _dfs_filex_open,
-    _dfs_filex_close,
-    _dfs_filex_ioctl,
-    _dfs_filex_read,
-    _dfs_filex_write,
-    _dfs_filex_flush,
-    _dfs_filex_lseek,
-    _dfs_filex_getdents,
-    //    RT_NULL, /* poll interface */
-};
-
-static const struct dfs_filesystem_ops _dfs_filex_fat_ops = {
-    "fat",
-    DFS_FS_FLAG_DEFAULT,
-    &_dfs_filex_fops,
-
-    _dfs_filex_mount,
-    _dfs_filex_unmount,
-    _dfs_filex_fat_mkfs,
-    _dfs_filex_statfs,
-    _dfs_filex_unlink,
-    _dfs_filex_stat,
-    _dfs_filex_rename,
-};
-
-#ifdef FX_ENABLE_EXFAT
-static const struct dfs_filesystem_ops _dfs_filex_exfat_ops = {
-    "exfat",
-    DFS_FS_FLAG_DEFAULT,
-    &_dfs_filex_fops,
-
-    _dfs_filex_mount,
-    _dfs_filex_unmount,
-    _dfs_filex_exfat_mkfs,
-    _dfs_filex_statfs,
-    _dfs_filex_unlink,
-    _dfs_filex_stat,
-    _dfs_filex_rename,
-};
-
-#endif
-
-int dfs_filex_init(void)
-{
-    lock = rt_mutex_create("filex", RT_IPC_FLAG_FIFO);
-    fx_system_initialize();
-    RT_ASSERT(lock);
-#ifdef FX_ENABLE_EXFAT
-    dfs_register(&_dfs_filex_exfat_ops);
-#endif
-    rt_list_init(&filex_media_list);
-    /* register ram file system */
-    return dfs_register(&_dfs_filex_fat_ops);
-}
-INIT_COMPONENT_EXPORT(dfs_filex_init);
+#include <rtdevice.h>
+#include <rtthread.h>
+
+#include <dfs_file.h>
+#include <dfs_fs.h>
+
+#include "fx_api.h"
+#include "fx_directory.h"
+#include "fx_utility.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FX_ENABLE_FAULT_TOLERANT
+#include "fx_fault_tolerant.h"
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+#include <stdio.h>
+#include <string.h>
+
+/* With FILEX_USING_QOS the lock orders callers by class instead, see
+   dfs_filex_qos.c.  */
+#ifndef FILEX_USING_QOS
+static rt_mutex_t lock = NULL;
+
+void filex_lock(void)
+{
+    rt_mutex_take(lock, RT_WAITING_FOREVER);
+}
+
+void filex_unlock(void)
+{
+    rt_mutex_release(lock);
+}
+#endif /* FILEX_USING_QOS */
+
+rt_list_t filex_media_list;
+
+/* Primes the FileX search cache so the fx_file_open or fx_file_create that
+   follows finds the entry without scanning the directory again.  */
+void filex_search_cache_prime(FX_MEDIA * media, CHAR * path, FX_DIR_ENTRY * entry, FX_DIR_ENTRY * directory)
+{
+#ifndef FX_MEDIA_DISABLE_SEARCH_CACHE
+    if (rt_strlen(path) < FX_MAX_LAST_NAME_LEN)
+    {
+        rt_strncpy(media->fx_media_last_found_name, path, FX_MAX_LAST_NAME_LEN);
+        rt_strncpy(media->fx_media_last_found_file_name, entry->fx_dir_entry_name, FX_MAX_LONG_NAME_LEN);
+        media->fx_media_last_found_entry = *entry;
+        media->fx_media_last_found_entry.fx_dir_entry_name = media->fx_media_last_found_file_name;
+        media->fx_media_last_found_directory_valid = (directory != FX_NULL);
+        if (directory != FX_NULL)
+        {
+            media->fx_media_last_found_directory = *directory;
+        }
+    }
+#endif /* FX_MEDIA_DISABLE_SEARCH_CACHE */
+}
+
+static filex_media_t * _filex_get_media(rt_device_t dev_id)
+{
+    rt_list_t * entry;
+    filex_media_t * media;
+    filex_lock();
+    for(entry = filex_media_list.next; entry->next != &filex_media_list; entry = entry->next) 
+    {
+        media = rt_list_entry(entry, filex_media_t, list);
+        if(media->media.fx_media_driver_info == dev_id)
+        {
+            filex_unlock();
+            return media;
+        }
+    }
+    filex_unlock();
+    return NULL;
+}
+
+static int _filex_result_to_dfs(int result)
+{
+    int status = 0;
+
+    switch (result)
+    {
+    case FX_SUCCESS:
+        break;
+
+    case FX_IO_ERROR:
+        status = -EIO;
+        break; // Error during device operation
+
+    case FX_ALREADY_CREATED:
+        status = -EEXIST;
+        break; // Entry already exists
+
+    case FX_NOT_FOUND:
+    case FX_INVALID_PATH:
+        status = -ENOENT;
+        break; // No such entry
+
+    case FX_NOT_DIRECTORY:
+        status = -ENOTDIR;
+        break; // Entry is not a dir
+
+    case FX_NOT_A_FILE:
+        status = -EISDIR;
+        break; // Entry is a dir
+
+    case FX_DIR_NOT_EMPTY:
+        status = -ENOTEMPTY;
+        break; // Dir is not empty
+
+    case FX_INVALID_OPTION:
+        status = -EINVAL;
+        break; // Invalid parameter
+
+    case FX_NO_MORE_SPACE:
+        status = -ENOSPC;
+        break; // No space left on device
+
+    case FX_NOT_ENOUGH_MEMORY:
+        status = -ENOMEM;
+        break; // No more memory available
+
+    case FX_FILE_CORRUPT:
+        status = -52;
+        break; // Corrupted
+
+    case FX_WRITE_PROTECT:
+        status = -EROFS;
+        break; // Read only media
+
+    case FX_ACCESS_ERROR:
+        status = -EBUSY;
+        break; // Entry is in use
+
+    case FX_NOT_IMPLEMENTED:
+        status = -ENOSYS;
+        break; // Not supported on this media
+
+    default:
+        status = -result;
+        break;
+    }
+
+    return status;
+}
+
+/* DFS keeps the position in an off_t and the size in a size_t, which may
+   be 32 bits.  The 64-bit FileX offset stays the reference; DFS gets it
+   clamped, and FILEX_IOCTL_SEEK64 reaches the rest of the file.  */
+#define FILEX_OFF_MAX                           ((ULONG64)(~(rt_uint64_t)0 >> (65 - 8 * sizeof(off_t))))
+
+rt_inline off_t _filex_clamp_off(ULONG64 offset)
+{
+    return (offset > FILEX_OFF_MAX) ? (off_t)FILEX_OFF_MAX : (off_t)offset;
+}
+
+rt_inline size_t _filex_clamp_size(ULONG64 size)
+{
+    return (size > (ULONG64)(size_t)~0) ? (size_t)~0 : (size_t)size;
+}
+
+
+#ifdef FX_ENABLE_FAULT_TOLERANT
+/* RT_TRUE when the media has a log that enabling fault tolerance would
+   replay or clean up, read straight from the boot sector and the log.  */
+static rt_bool_t _filex_fault_tolerant_pending(FX_MEDIA * media)
+{
+    FX_FAULT_TOLERANT_LOG_HEADER * header;
+    FX_FAULT_TOLERANT_FAT_CHAIN * chain;
+    FX_FAULT_TOLERANT_LOG_CONTENT * content;
+    rt_bool_t pending = RT_FALSE;
+    UCHAR * sector;
+    ULONG cluster;
+
+    sector = rt_malloc(media->fx_media_bytes_per_sector);
+    if (sector == RT_NULL)
+    {
+        return RT_FALSE;
+    }
+
+    if (fx_media_read(media, 0, sector) == FX_SUCCESS)
+    {
+        cluster = _fx_utility_32_unsigned_read(sector + FX_FAULT_TOLERANT_BOOT_INDEX);
+        if ((cluster >= FX_FAT_ENTRY_START) && (cluster < media->fx_media_total_clusters + FX_FAT_ENTRY_START) &&
+            (fx_media_read(media, media->fx_media_data_sector_start +
+                           (cluster - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster, sector) == FX_SUCCESS))
+        {
+            header = (FX_FAULT_TOLERANT_LOG_HEADER *)(sector + FX_FAULT_TOLERANT_LOG_HEADER_OFFSET);
+            chain = (FX_FAULT_TOLERANT_FAT_CHAIN *)(sector + FX_FAULT_TOLERANT_FAT_CHAIN_OFFSET);
+            content = (FX_FAULT_TOLERANT_LOG_CONTENT *)(sector + FX_FAULT_TOLERANT_LOG_CONTENT_OFFSET);
+            pending = (_fx_utility_32_unsigned_read((UCHAR *)&header->fx_fault_tolerant_log_header_id) == FX_FAULT_TOLERANT_ID) &&
+                      ((_fx_utility_16_unsigned_read((UCHAR *)&content->fx_fault_tolerant_log_content_count) != 0) ||
+                       (chain->fx_fault_tolerant_FAT_chain_flag & FX_FAULT_TOLERANT_FLAG_FAT_CHAIN_VALID));
+        }
+    }
+
+    rt_free(sector);
+    return pending;
+}
+
+/* Enables the log on an opened media, which also replays whatever an
+   interrupted transaction left behind.  Not for read-only mounts.  */
+static UINT _filex_fault_tolerant_enable(filex_media_t * filex_media, const struct dfs_filex_mount_options * options)
+{
+    rt_size_t size = FILEX_FAULT_TOLERANT_LOG_SIZE;
+    UINT result;
+
+    if (options != RT_NULL)
+    {
+        if (options->flags & FILEX_MOUNT_NO_FAULT_TOLERANT)
+        {
+            return FX_SUCCESS;
+        }
+        if (options->fault_tolerant_log_size)
+        {
+            size = options->fault_tolerant_log_size;
+        }
+    }
+
+    filex_media->fault_tolerant_memory = rt_malloc(size);
+    if (filex_media->fault_tolerant_memory == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    filex_media->fault_tolerant_size = size;
+
+    result = fx_fault_tolerant_enable(&filex_media->media, filex_media->fault_tolerant_memory, size);
+    if (result != FX_SUCCESS)
+    {
+        rt_free(filex_media->fault_tolerant_memory);
+        filex_media->fault_tolerant_memory = RT_NULL;
+        filex_media->fault_tolerant_size = 0;
+    }
+    return result;
+}
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+static int _dfs_filex_mount(struct dfs_filesystem* dfs, unsigned long rwflag, const void* data)
+{
+    int result;
+    rt_device_t dev_id = dfs->dev_id;
+    filex_media_t * filex_media;
+    const struct dfs_filex_mount_options * options = (const struct dfs_filex_mount_options *)data;
+
+    /* Check Device Type */
+    if (dev_id->type != RT_Device_Class_MTD && dev_id->type != RT_Device_Class_Block)
+    {
+        rt_kprintf("The memory device type must be MTD or Block!\n");
+        return -EINVAL;
+    }
+    /* if do mkfs */
+    filex_media = _filex_get_media(dev_id);
+    if(filex_media == NULL)
+    {
+        filex_media = filex_pool_alloc(FILEX_POOL_MEDIA, sizeof(filex_media_t));
+        if(filex_media == NULL) 
+        {
+            return -ENOMEM;
+        }
+        filex_lock();
+        rt_list_insert_before(&filex_media_list, &filex_media->list);
+        filex_unlock();
+    }
+    filex_lock();
+    result =  fx_media_open(&filex_media->media, dev_id->parent.name, rt_fx_disk_driver, dev_id, filex_media->media_memory, sizeof(filex_media->media_memory));
+    /* Check the media open status.  */
+    if (result != FX_SUCCESS)
+    {
+
+        /* Error, break the loop!  */
+        rt_list_remove(&filex_media->list);
+        filex_pool_free(FILEX_POOL_MEDIA, filex_media);
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+
+    filex_media->read_only = (rwflag & MS_RDONLY) ? RT_TRUE : RT_FALSE;
+    if (filex_media->read_only)
+    {
+#ifdef FX_ENABLE_FAULT_TOLERANT
+        /* The log cannot be replayed without writing, and the volume is
+           not consistent until it is.  */
+        if (_filex_fault_tolerant_pending(&filex_media->media))
+        {
+            rt_kprintf("filex: %s has an unfinished fault tolerant log, mount it read-write once to replay it\n",
+                       dev_id->parent.name);
+            fx_media_close(&filex_media->media);
+            rt_list_remove(&filex_media->list);
+            filex_pool_free(FILEX_POOL_MEDIA, filex_media);
+            filex_unlock();
+            return -EROFS;
+        }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+        /* FileX refuses every change with FX_WRITE_PROTECT from now on.  */
+        filex_media->media.fx_media_driver_write_protect = FX_TRUE;
+#ifdef FILEX_USING_CONCURRENT_READ
+        result = filex_read_cache_init(filex_media);
+        if (result != FX_SUCCESS)
+        {
+            rt_kprintf("filex: reads on %s stay serialized: %d\n", dev_id->parent.name, result);
+        }
+#endif /* FILEX_USING_CONCURRENT_READ */
+    }
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+    else
+    {
+        /* Before the log is replayed, recovery writes the FAT too.  */
+        result = filex_secondary_fat_init(filex_media, (options != RT_NULL) ? options->fat_map_sectors : 0);
+        if (result != FX_SUCCESS)
+        {
+            rt_kprintf("filex: secondary FAT map on %s failed: %d\n", dev_id->parent.name, result);
+        }
+    }
+#endif /* FILEX_USING_LAZY_SECONDARY_FAT */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    /* Enabling writes the log, which a read-only mount must not.  */
+    result = filex_media->read_only ? FX_SUCCESS : _filex_fault_tolerant_enable(filex_media, options);
+    if (result != FX_SUCCESS)
+    {
+        rt_kprintf("filex: fault tolerant log on %s failed: %d\n", dev_id->parent.name, result);
+        fx_media_close(&filex_media->media);
+#ifdef FILEX_USING_CONCURRENT_READ
+        filex_read_cache_release(filex_media);
+#endif /* FILEX_USING_CONCURRENT_READ */
+        rt_list_remove(&filex_media->list);
+        filex_pool_free(FILEX_POOL_MEDIA, filex_media);
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+#ifdef FILEX_USING_FAT_MIRROR
+    if (options != RT_NULL && (options->flags & FILEX_MOUNT_FAT_MIRROR) && !filex_media->read_only)
+    {
+        /* Not fatal, the volume works the same without it.  */
+        result = filex_fat_mirror_load(filex_media);
+        if (result != FX_SUCCESS)
+        {
+            rt_kprintf("filex: FAT mirror on %s not loaded: %d\n", dev_id->parent.name, result);
+        }
+    }
+#endif /* FILEX_USING_FAT_MIRROR */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_media->group_open = RT_FALSE;
+#endif /* FILEX_USING_GROUP_COMMIT */
+#ifdef FILEX_USING_DIR_INDEX
+    filex_dir_index_reset(filex_media);
+#endif /* FILEX_USING_DIR_INDEX */
+#ifdef FILEX_USING_DEFERRED_DELETE
+    if (!filex_media->read_only)
+    {
+        filex_deferred_delete_load(filex_media);
+    }
+#endif /* FILEX_USING_DEFERRED_DELETE */
+#ifdef FILEX_USING_CACHE_WARMUP
+    filex_warmup_load(filex_media);
+#endif /* FILEX_USING_CACHE_WARMUP */
+
+    dfs->data = filex_media;
+    filex_unlock();
+
+    return RT_EOK;
+}
+
+static int _dfs_filex_unmount(struct dfs_filesystem* dfs)
+{
+    int result;
+    filex_media_t * filex_media;
+
+    RT_ASSERT(dfs != RT_NULL);
+    RT_ASSERT(dfs->data != RT_NULL);
+    filex_lock();
+
+    filex_media = (filex_media_t*)dfs->data;
+#ifdef FILEX_USING_BACKGROUND_CHECK
+    filex_check_stop(filex_media);
+#endif /* FILEX_USING_BACKGROUND_CHECK */
+#ifdef FILEX_USING_DEFRAG
+    filex_defrag_release(filex_media);
+#endif /* FILEX_USING_DEFRAG */
+#ifdef FILEX_USING_HANDLE_CACHE
+    filex_handle_release(filex_media);
+#endif /* FILEX_USING_HANDLE_CACHE */
+#ifdef FILEX_USING_CACHE_WARMUP
+    if (!filex_media->read_only)
+    {
+        filex_warmup_save(filex_media);
+    }
+#endif /* FILEX_USING_CACHE_WARMUP */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_commit(filex_media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+    result =  fx_media_close(&filex_media->media);
+    
+    if (result == FX_SUCCESS)
+    {
+        dfs->data = NULL;
+        rt_list_remove(&filex_media->list);
+#ifdef FILEX_USING_DIR_INDEX
+        filex_dir_index_reset(filex_media);
+#endif /* FILEX_USING_DIR_INDEX */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+        if (filex_media->fault_tolerant_memory != RT_NULL)
+        {
+            rt_free(filex_media->fault_tolerant_memory);
+        }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+#ifdef FILEX_USING_CONCURRENT_READ
+        filex_read_cache_release(filex_media);
+#endif /* FILEX_USING_CONCURRENT_READ */
+        filex_pool_free(FILEX_POOL_MEDIA, filex_media);
+    }
+    filex_unlock();
+    return _filex_result_to_dfs(result);
+}
+
+
+
+#ifdef FILEX_USING_BLOCK_MAP
+/* Formats with sectors smaller than the device block when configured, the
+   block map puts them together again.  */
+static void _filex_mkfs_sector_size(uint32_t * sectors_count, uint32_t * sectors_begin, uint32_t * sectors_size)
+{
+    uint32_t size = FILEX_MKFS_SECTOR_SIZE;
+    uint32_t ratio;
+
+    if ((size == 0) || (size >= *sectors_size))
+    {
+        return;
+    }
+    ratio = *sectors_size / size;
+    *sectors_count *= ratio;
+    *sectors_begin *= ratio;
+    *sectors_size = size;
+}
+#endif /* FILEX_USING_BLOCK_MAP */
+
+static int _dfs_filex_fat_mkfs(rt_device_t dev_id)
+{
+    uint32_t sectors_count;
+    uint32_t sectors_begin;
+    uint32_t sectors_size;
+    filex_media_t * filex_media;
+    int result;
+    if(dev_id == RT_NULL)
+    {
+        rt_kprintf("dev_id is NULL %s,%d\n", __func__, __LINE__);
+        return -EINVAL;
+    }
+    /* Check Device Type */
+    if (dev_id->type != RT_Device_Class_MTD && dev_id->type != RT_Device_Class_Block)
+    {
+        rt_kprintf("The memory device type must be MTD or Block!\n");
+        return -EINVAL;
+    }
+    filex_lock();
+    switch(dev_id->type)
+    {
+#ifdef RT_MTD_NOR_DEVICE
+    case RT_Device_Class_MTD:
+        sectors_count = RT_MTD_NOR_DEVICE(dev_id)->block_end - RT_MTD_NOR_DEVICE(dev_id)->block_start;
+        sectors_begin = RT_MTD_NOR_DEVICE(dev_id)->block_start;
+        sectors_size = RT_MTD_NOR_DEVICE(dev_id)->block_size;
+        break;
+#endif
+    case RT_Device_Class_Block:
+        {
+            struct rt_device_blk_geometry geometry;
+            rt_memset(&geometry, 0, sizeof(geometry));
+            result = rt_device_control(dev_id,
+                                    RT_DEVICE_CTRL_BLK_GETGEOME,
+                                    &geometry);
+            if( result != RT_EOK )
+            {
+                rt_kprintf("device : %s cmd RT_DEVICE_CTRL_BLK_GETGEOME failed.\r\n");
+                filex_unlock();
+                return result;
+            }
+            sectors_count = geometry.sector_count;
+            sectors_size = geometry.bytes_per_sector;
+            sectors_begin = 0;
+            break;
+        }
+    default:
+        filex_unlock();
+        return -EINVAL;
+    }
+#ifdef FILEX_USING_BLOCK_MAP
+    _filex_mkfs_sector_size(&sectors_count, &sectors_begin, &sectors_size);
+#endif /* FILEX_USING_BLOCK_MAP */
+    filex_media = _filex_get_media(dev_id);
+    if(filex_media == NULL)
+    {
+        filex_media = filex_pool_alloc(FILEX_POOL_MEDIA, sizeof(filex_media_t));
+        if(filex_media == NULL) 
+        {
+            filex_unlock();
+            return -ENOMEM;
+        }
+        rt_list_insert_before(&filex_media_list, &filex_media->list);
+    }
+
+    result = fx_media_format(&filex_media->media,
+                    rt_fx_disk_driver,               // Driver entry
+                    dev_id,              // RAM disk memory pointer
+                    filex_media->media_memory,                 // Media buffer pointer
+                    sizeof(filex_media->media_memory),         // Media buffer size
+                    dev_id->parent.name,                // Volume Name
+                    FILEX_MKFS_FAT_COPIES,        // Number of FATs
+                    32,                           // Directory Entries
+                    sectors_begin,                            // Hidden sectors
+                    sectors_count,                          // Total sectors
+                    sectors_size,                          // Sector size
+                    4096 / sectors_size,                            // Sectors per cluster
+                    1,                            // Heads
+                    1);                           // Sectors per track
+
+    if (result != FX_SUCCESS)
+    {
+
+        /* Error, break the loop!  */
+        rt_list_remove(&filex_media->list);
+        filex_pool_free(FILEX_POOL_MEDIA, filex_media);
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+
+#ifdef FILEX_USING_DIR_INDEX
+    /* Indexes of the previous volume are meaningless now.  */
+    filex_dir_index_reset(filex_media);
+#endif /* FILEX_USING_DIR_INDEX */
+    filex_unlock();
+    return _filex_result_to_dfs(result);
+    
+}
+
+#ifdef FX_ENABLE_EXFAT
+static int _dfs_filex_exfat_mkfs(rt_device_t dev_id)
+{
+    uint32_t sectors_count;
+    uint32_t sectors_begin;
+    uint32_t sectors_size;
+    filex_media_t * filex_media;
+    int result;
+    if(dev_id == RT_NULL)
+    {
+        rt_kprintf("dev_id is NULL %s,%d\n", __func__, __LINE__);
+        return -EINVAL;
+    }
+    /* Check Device Type */
+    if (dev_id->type != RT_Device_Class_MTD && dev_id->type != RT_Device_Class_Block)
+    {
+        rt_kprintf("The memory device type must be MTD or Block!\n");
+        return -EINVAL;
+    }
+    filex_lock();
+    switch(dev_id->type)
+    {
+#ifdef RT_MTD_NOR_DEVICE
+    case RT_Device_Class_MTD:
+        sectors_count = RT_MTD_NOR_DEVICE(dev_id)->block_end - RT_MTD_NOR_DEVICE(dev_id)->block_start;
+        sectors_begin = RT_MTD_NOR_DEVICE(dev_id)->block_start;
+        sectors_size = RT_MTD_NOR_DEVICE(dev_id)->block_size;
+        break;
+#endif
+    case RT_Device_Class_Block:
+        {
+            struct rt_device_blk_geometry geometry;
+            rt_memset(&geometry, 0, sizeof(geometry));
+            result = rt_device_control(dev_id,
+                                    RT_DEVICE_CTRL_BLK_GETGEOME,
+                                    &geometry);
+            if( result != RT_EOK )
+            {
+                rt_kprintf("device : %s cmd RT_DEVICE_CTRL_BLK_GETGEOME failed.\r\n");
+                filex_unlock();
+                return result;
+            }
+            sectors_count = geometry.sector_count;
+            sectors_size = geometry.bytes_per_sector;
+            sectors_begin = 0;
+            break;
+        }
+    default:
+        filex_unlock();
+        return -EINVAL;
+    }
+#ifdef FILEX_USING_BLOCK_MAP
+    _filex_mkfs_sector_size(&sectors_count, &sectors_begin, &sectors_size);
+#endif /* FILEX_USING_BLOCK_MAP */
+    filex_media = _filex_get_media(dev_id);
+    if(filex_media == NULL)
+    {
+        filex_media = filex_pool_alloc(FILEX_POOL_MEDIA, sizeof(filex_media_t));
+        if(filex_media == NULL) 
+        {
+            filex_unlock();
+            return -ENOMEM;
+        }
+        rt_list_insert_before(&filex_media_list, &filex_media->list);
+    }
+
+    result = fx_media_exFAT_format(&filex_media->media,
+                          rt_fx_disk_driver,         // Driver entry
+                          dev_id,        // RAM disk memory pointer
+                          filex_media->media_memory,           // Media buffer pointer
+                          sizeof(filex_media->media_memory),   // Media buffer size
+                          dev_id->parent.name,          // Volume Name
+                          1,                      // Number of FATs
+                          sectors_begin,                      // Hidden sectors
+                          sectors_count,                    // Total sectors
+                          sectors_size,                    // Sector size
+                          8,                      // exFAT Sectors per cluster
+                          12345,                  // Volume ID
+                          1);                     // Boundary unit
+    if (result != FX_SUCCESS)
+    {
+
+        /* Error, break the loop!  */
+        rt_list_remove(&filex_media->list);
+        filex_pool_free(FILEX_POOL_MEDIA, filex_media);
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+
+#ifdef FILEX_USING_DIR_INDEX
+    /* Indexes of the previous volume are meaningless now.  */
+    filex_dir_index_reset(filex_media);
+#endif /* FILEX_USING_DIR_INDEX */
+    filex_unlock();
+    return _filex_result_to_dfs(result);
+    
+}
+#endif /* FX_ENABLE_EXFAT */
+
+
+static int _dfs_filex_statfs(struct dfs_filesystem* dfs, struct statfs* buf)
+{
+    int result;
+    filex_media_t * filex_media;
+    ULONG64 available_bytes;
+
+    RT_ASSERT(buf != RT_NULL);
+    RT_ASSERT(dfs != RT_NULL);
+    RT_ASSERT(dfs->data != RT_NULL);
+
+    filex_media = (filex_media_t*)dfs->data;
+    filex_lock();
+    result = fx_media_extended_space_available(&filex_media->media, &available_bytes);
+
+    if (result != FX_SUCCESS)
+    {
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+
+    buf->f_bsize = filex_media->media.fx_media_bytes_per_sector;
+    buf->f_blocks = filex_media->media.fx_media_total_sectors;
+    buf->f_bfree = available_bytes / buf->f_bsize;
+    filex_unlock();
+    return _filex_result_to_dfs(result);
+}
+
+static int _dfs_filex_unlink(struct dfs_filesystem* dfs, const char* path)
+{
+    filex_media_t * filex_media;
+    int result;
+#ifdef FILEX_USING_DIR_INDEX
+    filex_dir_index_removal_t removal;
+#endif /* FILEX_USING_DIR_INDEX */
+
+    RT_ASSERT(dfs != RT_NULL);
+    RT_ASSERT(dfs->data != RT_NULL);
+
+    filex_media = (filex_media_t*)dfs->data;
+    filex_lock();
+
+#ifdef FILEX_USING_HANDLE_CACHE
+    filex_handle_evict(filex_media, path);
+#endif /* FILEX_USING_HANDLE_CACHE */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_begin(filex_media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+#ifdef FILEX_USING_DIR_INDEX
+    filex_dir_index_locate(filex_media, (char *)path, &removal);
+#endif /* FILEX_USING_DIR_INDEX */
+#ifdef FILEX_USING_DEFERRED_DELETE
+    result = filex_deferred_delete(filex_media, (char *)path);
+#else
+    result = fx_file_delete(&filex_media->media, (char *)path);
+#endif /* FILEX_USING_DEFERRED_DELETE */
+    if(result == FX_NOT_A_FILE)
+    {
+        result = fx_directory_delete(&filex_media->media, (char *)path);
+    }
+#ifdef FILEX_USING_DIR_INDEX
+    /* A refused delete leaves the entry, and the index, as they were.  */
+    if (result == FX_SUCCESS)
+    {
+        filex_dir_index_remove(filex_media, &removal);
+    }
+#endif /* FILEX_USING_DIR_INDEX */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_end(filex_media, result);
+#endif /* FILEX_USING_GROUP_COMMIT */
+    filex_unlock();
+    return _filex_result_to_dfs(result);
+}
+
+/* Finds path the cheapest way configured.  Without scan only the indexes
+   are asked: FX_NOT_IMPLEMENTED then means they could not tell, any other
+   error is a definite answer.  */
+static UINT _filex_search(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry, rt_bool_t scan)
+{
+    UINT result = FX_NOT_IMPLEMENTED;
+
+#ifdef FILEX_USING_DIR_INDEX
+    if (filex_dir_index_search(filex_media, path, entry) == FX_SUCCESS)
+    {
+        return FX_SUCCESS;
+    }
+#endif /* FILEX_USING_DIR_INDEX */
+#ifdef FILEX_USING_EXFAT_HASH
+    result = filex_exfat_search(filex_media, path, entry);
+#endif /* FILEX_USING_EXFAT_HASH */
+    if (scan && (result == FX_NOT_IMPLEMENTED))
+    {
+        result = _fx_directory_search(&filex_media->media, path, entry, FX_NULL, FX_NULL);
+    }
+#ifdef FILEX_USING_DIR_INDEX
+    if (result == FX_SUCCESS)
+    {
+        filex_dir_index_add(filex_media, path, entry);
+    }
+#endif /* FILEX_USING_DIR_INDEX */
+    return result;
+}
+
+static int _dfs_filex_stat(struct dfs_filesystem* dfs, const char* path, struct stat* st)
+{
+    filex_media_t * filex_media;
+    int result;
+    FX_DIR_ENTRY dir_entry;
+
+    RT_ASSERT(dfs != RT_NULL);
+    RT_ASSERT(dfs->data != RT_NULL);
+    RT_ASSERT(st != RT_NULL);
+
+    filex_media = (filex_media_t*)dfs->data;
+    filex_lock();
+    dir_entry.fx_dir_entry_name = filex_media->media.fx_media_name_buffer + FX_MAX_LONG_NAME_LEN;
+    dir_entry.fx_dir_entry_short_name[0] = 0;
+    result = _filex_search(filex_media, (char *)path, &dir_entry, RT_TRUE);
+
+    /* Determine if the search was successful.  */
+    if (result != FX_SUCCESS)
+    {
+        /* Return the error code.  */
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IRUSR | S_IRGRP | S_IROTH;
+
+    if(!(dir_entry.fx_dir_entry_attributes & FX_READ_ONLY))
+    {
+        st->st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+    }
+
+    if(dir_entry.fx_dir_entry_attributes & FX_DIRECTORY)
+    {
+        st->st_mode |= S_IFDIR;
+    }
+    else
+    {
+        st->st_mode |= S_IFREG | S_IXUSR | S_IXGRP | S_IXOTH;
+    }
+    st->st_size = _filex_clamp_off(dir_entry.fx_dir_entry_file_size);
+    st->st_atime =dir_entry.fx_dir_entry_last_accessed_date;
+    st->st_mtime = dir_entry.fx_dir_entry_time;
+    st->st_ctime = st->st_mtime;
+
+    filex_unlock();
+    return _filex_result_to_dfs(FX_SUCCESS);
+}
+
+static int _dfs_filex_rename(struct dfs_filesystem* dfs, const char* from, const char* to)
+{
+    filex_media_t * filex_media;
+    int result;
+#ifdef FILEX_USING_DIR_INDEX
+    filex_dir_index_removal_t removal;
+#endif /* FILEX_USING_DIR_INDEX */
+
+    RT_ASSERT(dfs != RT_NULL);
+    RT_ASSERT(dfs->data != RT_NULL);
+
+    filex_media = (filex_media_t*)dfs->data;
+    filex_lock();
+#ifdef FILEX_USING_HANDLE_CACHE
+    filex_handle_evict(filex_media, from);
+    filex_handle_evict(filex_media, to);
+#endif /* FILEX_USING_HANDLE_CACHE */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_begin(filex_media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+#ifdef FILEX_USING_DIR_INDEX
+    filex_dir_index_locate(filex_media, (char *)from, &removal);
+#endif /* FILEX_USING_DIR_INDEX */
+    result = fx_directory_rename(&filex_media->media, (char *)from, (char *)to);
+    if(result == FX_NOT_DIRECTORY)
+    {
+        result = fx_file_rename(&filex_media->media, (char *)from, (char *)to);
+    }
+#ifdef FILEX_USING_DIR_INDEX
+    if (result == FX_SUCCESS)
+    {
+        filex_dir_index_remove(filex_media, &removal);
+        /* The new name went in behind the index of its directory.  */
+        filex_dir_index_forget(filex_media, (char *)to);
+    }
+#endif /* FILEX_USING_DIR_INDEX */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_end(filex_media, result);
+#endif /* FILEX_USING_GROUP_COMMIT */
+    filex_unlock();
+    return _filex_result_to_dfs(result);
+}
+
+/******************************************************************************
+ * file operations
+ ******************************************************************************/
+static int _dfs_filex_open(struct dfs_fd* file)
+{
+    struct dfs_filesystem* dfs;
+    filex_media_t * filex_media;
+    int result;
+    int flags = 0;
+
+    RT_ASSERT(file != RT_NULL);
+    RT_ASSERT(file->data != RT_NULL);
+
+    dfs = (struct dfs_filesystem*)file->data;
+    filex_media = (filex_media_t*)dfs->data;
+    if (filex_media->read_only && ((file->flags & (O_CREAT | O_TRUNC)) || ((file->flags & 3) != O_RDONLY)))
+    {
+        return -EROFS;
+    }
+    filex_lock();
+    if (file->flags & O_DIRECTORY)
+    {
+        filex_dir_t *dir_entry = filex_pool_alloc(FILEX_POOL_DIR, sizeof(filex_dir_t));
+
+        if (dir_entry == NULL)
+        {
+            rt_kprintf("ERROR:no memory!\n");
+            result = FX_NOT_ENOUGH_MEMORY;
+            goto _error_dir;
+        }
+        dir_entry->media = &filex_media->media;
+        if(strcmp(file->path, "/") == 0 || strcmp(file->path, "\\") == 0)
+        {
+            dir_entry->is_root = 1;
+            file->data = (void*)dir_entry;
+            filex_unlock();
+            return _filex_result_to_dfs(FX_SUCCESS);
+        }
+        dir_entry->is_root = 0;
+        if (file->flags & O_CREAT)
+        {
+#ifdef FILEX_USING_GROUP_COMMIT
+            filex_group_begin(filex_media);
+            result = fx_directory_create(&filex_media->media, file->path);
+            filex_group_end(filex_media, result);
+#else
+            result = fx_directory_create(&filex_media->media, file->path);
+#endif /* FILEX_USING_GROUP_COMMIT */
+            if (result != FX_SUCCESS)
+            {
+                goto _error_dir;
+            }
+#ifdef FILEX_USING_GROUP_COMMIT
+            /* The group commit writes it out.  */
+            if (!filex_media->media.fx_media_fault_tolerant_enabled)
+#endif /* FILEX_USING_GROUP_COMMIT */
+            fx_media_flush(&filex_media->media);
+        }
+        dir_entry->entry.fx_dir_entry_name = dir_entry->name_buffer;
+        dir_entry->entry.fx_dir_entry_short_name[0] = 0;
+        result = _filex_search(filex_media, file->path, &dir_entry->entry, RT_TRUE);
+        /* Determine if the search was successful.  */
+        if (result != FX_SUCCESS)
+        {
+            /* Return the error code.  */
+            goto _error_dir;
+        }
+        else
+        {
+            file->data = (void*)dir_entry;
+            filex_unlock();
+            return _filex_result_to_dfs(result);
+        }
+
+    _error_dir:
+        if (dir_entry != NULL)
+        {
+            filex_pool_free(FILEX_POOL_DIR, dir_entry);
+        }
+        file->data = NULL;
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+    else
+    {
+        FX_FILE* file_entry = RT_NULL;
+        UINT search_result;
+#ifdef FILEX_USING_GROUP_COMMIT
+        rt_bool_t grouped = RT_FALSE;
+#endif /* FILEX_USING_GROUP_COMMIT */
+
+        if ((file->flags & 3) == O_RDONLY)
+            flags |= FX_OPEN_FOR_READ;
+        if ((file->flags & 3) == O_WRONLY)
+            flags |= FX_OPEN_FOR_WRITE;
+        if ((file->flags & 3) == O_RDWR)
+            flags |= FX_OPEN_FOR_READ | FX_OPEN_FOR_WRITE;
+
+#ifdef FILEX_USING_DEFRAG
+        if (flags & FX_OPEN_FOR_WRITE)
+        {
+            filex_defrag_cancel(filex_media, file->path);
+        }
+#endif /* FILEX_USING_DEFRAG */
+#ifdef FILEX_USING_HANDLE_CACHE
+        if (!(file->flags & (O_EXCL | O_TRUNC)))
+        {
+            file_entry = filex_handle_take(filex_media, file->path, flags);
+        }
+        if (file_entry != RT_NULL)
+        {
+            /* Entry and cluster chain are still known, only the offset
+               starts over.  */
+            fx_file_extended_seek(file_entry, 0);
+            if(file->flags & O_APPEND)
+            {
+                fx_file_extended_relative_seek(file_entry, 0, FX_SEEK_END);
+            }
+            file->data = (void*)file_entry;
+            file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+            file->size = _filex_clamp_size(file_entry->fx_file_current_file_size);
+            filex_unlock();
+            return _filex_result_to_dfs(FX_SUCCESS);
+        }
+        /* Other cached handles of the file would be left behind a truncate
+           or refuse the open for write.  */
+        filex_handle_evict(filex_media, file->path);
+#endif /* FILEX_USING_HANDLE_CACHE */
+
+        file_entry = filex_pool_alloc(FILEX_POOL_FILE, sizeof(FX_FILE));
+        if (file_entry == RT_NULL)
+        {
+            rt_kprintf("ERROR:no memory!\n");
+            result = FX_NOT_ENOUGH_MEMORY;
+
+            goto _error_file;
+        }
+#ifdef FILEX_USING_GROUP_COMMIT
+        if (file->flags & (O_CREAT | O_TRUNC))
+        {
+            filex_group_begin(filex_media);
+            grouped = RT_TRUE;
+        }
+#endif /* FILEX_USING_GROUP_COMMIT */
+
+        /* A hit also primes the FileX search cache for fx_file_open, a miss
+           leaves the scan to FileX itself.  */
+        file_entry->fx_file_dir_entry.fx_dir_entry_name = file_entry->fx_file_name_buffer;
+        search_result = _filex_search(filex_media, file->path, &file_entry->fx_file_dir_entry, RT_FALSE);
+
+        if (file->flags & O_CREAT)
+        {
+            result = FX_NOT_IMPLEMENTED;
+            if (search_result == FX_SUCCESS)
+            {
+                result = FX_ALREADY_CREATED;
+            }
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+            if (result == FX_NOT_IMPLEMENTED)
+            {
+                result = filex_dir_index_create(filex_media, file->path);
+                if (result == FX_SUCCESS)
+                {
+                    search_result = _filex_search(filex_media, file->path, &file_entry->fx_file_dir_entry, RT_FALSE);
+                }
+            }
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+            if (result == FX_NOT_IMPLEMENTED)
+            {
+                result = fx_file_create(&filex_media->media, file->path);
+            }
+            if((file->flags & O_EXCL) && (result == FX_ALREADY_CREATED))
+            {
+                goto _error_file;
+            }
+            if(result == FX_ALREADY_CREATED)
+            {
+                result = FX_SUCCESS;
+            }
+            if(result != FX_SUCCESS)
+            {
+                goto _error_file;
+            }
+        }
+        else if (search_result != FX_SUCCESS && search_result != FX_NOT_IMPLEMENTED)
+        {
+            result = search_result;
+            goto _error_file;
+        }
+
+        result = fx_file_open(&filex_media->media, file_entry, file->path, flags);
+        if (result != FX_SUCCESS)
+        {
+            goto _error_file;
+        }
+        else
+        {
+#ifdef FILEX_USING_DIR_INDEX
+            if (search_result != FX_SUCCESS)
+            {
+                filex_dir_index_add(filex_media, file->path, &file_entry->fx_file_dir_entry);
+            }
+#endif /* FILEX_USING_DIR_INDEX */
+            if(file->flags & O_TRUNC)
+            {
+                fx_file_extended_truncate_release(file_entry, 0);
+            }
+            if(file->flags & O_APPEND)
+            {
+                fx_file_extended_relative_seek(file_entry, 0, FX_SEEK_END);
+            }
+            file->data = (void*)file_entry;
+            file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+            file->size = _filex_clamp_size(file_entry->fx_file_current_file_size);
+#ifdef FILEX_USING_GROUP_COMMIT
+            if (grouped)
+            {
+                filex_group_end(filex_media, result);
+            }
+#endif /* FILEX_USING_GROUP_COMMIT */
+            filex_unlock();
+            return _filex_result_to_dfs(result);
+        }
+
+    _error_file:
+        if (file_entry != RT_NULL)
+        {
+            filex_pool_free(FILEX_POOL_FILE, file_entry);
+        }
+        file->data = NULL;
+#ifdef FILEX_USING_GROUP_COMMIT
+        if (grouped)
+        {
+            filex_group_end(filex_media, result);
+        }
+#endif /* FILEX_USING_GROUP_COMMIT */
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+}
+
+static int _dfs_filex_close(struct dfs_fd* file)
+{
+    int result = FX_SUCCESS;
+    RT_ASSERT(file != RT_NULL);
+
+    if (file->type == FT_DIRECTORY)
+    {
+        if(file->data != NULL)
+        {
+            filex_pool_free(FILEX_POOL_DIR, file->data);
+            file->data = NULL;
+        }
+        result = FX_SUCCESS;
+    }
+    else
+    {
+        FX_FILE* file_entry = (FX_FILE*)file->data;
+#ifdef FILEX_USING_COPY
+        /* A copy job must be done with file_entry before it goes.  */
+        filex_copy_cancel(file);
+#endif /* FILEX_USING_COPY */
+        filex_lock();
+        if(file_entry != NULL)
+        {
+            FX_MEDIA * media = file_entry->fx_file_media_ptr;
+#if defined(FILEX_USING_GROUP_COMMIT) || defined(FILEX_USING_HANDLE_CACHE)
+            filex_media_t * filex_media = rt_container_of(media, filex_media_t, media);
+#endif
+            rt_bool_t flush = RT_TRUE;
+
+#ifdef FILEX_USING_RING_LOG
+            filex_ring_detach(file_entry);
+#endif /* FILEX_USING_RING_LOG */
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+            filex_seek_forget(file_entry);
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+#ifdef FILEX_USING_RECORD
+            /* Writes out the staged tail and gives back the clusters
+               allocated ahead of it.  */
+            filex_record_stop(file_entry);
+#endif /* FILEX_USING_RECORD */
+#ifdef FILEX_USING_HANDLE_CACHE
+            /* A cached handle stays open in FileX; the flush writes its
+               directory entry when it has written anything.  */
+            if (filex_handle_put(filex_media, file->path, file_entry))
+            {
+                flush = file_entry->fx_file_modified;
+                file->data = NULL;
+            }
+            else
+#endif /* FILEX_USING_HANDLE_CACHE */
+            {
+#ifdef FILEX_USING_GROUP_COMMIT
+                filex_group_begin(filex_media);
+                result = fx_file_close(file_entry);
+                filex_group_end(filex_media, result);
+#else
+                result = fx_file_close(file_entry);
+#endif /* FILEX_USING_GROUP_COMMIT */
+                if(result == FX_SUCCESS)
+                {
+                    filex_pool_free(FILEX_POOL_FILE, file->data);
+                    file->data = NULL;
+                }
+            }
+#ifdef FILEX_USING_GROUP_COMMIT
+            /* The group commit writes it out.  */
+            if (media->fx_media_fault_tolerant_enabled)
+            {
+                flush = RT_FALSE;
+            }
+#endif /* FILEX_USING_GROUP_COMMIT */
+            if (flush)
+            {
+                fx_media_flush(media);
+            }
+        }
+        filex_unlock();
+    }
+    
+    return _filex_result_to_dfs(result);
+}
+
+#ifdef FILEX_USING_READDIR_PLUS
+static rt_bool_t _filex_entry_is_end(FX_MEDIA * media, FX_DIR_ENTRY * entry)
+{
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return entry->fx_dir_entry_type == FX_EXFAT_DIR_ENTRY_TYPE_END_MARKER;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    return (UCHAR)entry->fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_DONE;
+}
+
+/* Deleted entries, volume labels and exFAT system entries are not listed.  */
+static rt_bool_t _filex_entry_is_listed(FX_MEDIA * media, FX_DIR_ENTRY * entry)
+{
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return entry->fx_dir_entry_type == FX_EXFAT_DIR_ENTRY_TYPE_FILE_DIRECTORY;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    return ((UCHAR)entry->fx_dir_entry_name[0] != (UCHAR)FX_DIR_ENTRY_FREE) &&
+           !(entry->fx_dir_entry_attributes & FX_VOLUME);
+}
+
+/* The getdents walk, handing out everything the entry already holds so
+   callers do not stat every name again.  Shares the position with
+   getdents.  */
+static int _filex_readdir_plus(struct dfs_fd* file, struct filex_readdir_plus * request)
+{
+    filex_dir_t *dir_entry = (filex_dir_t*)file->data;
+    struct filex_dirent_plus * d;
+    FX_DIR_ENTRY dest_entry;
+    rt_uint32_t index = 0;
+    ULONG offset;
+
+    if (file->type != FT_DIRECTORY || dir_entry == RT_NULL)
+    {
+        return -ENOTDIR;
+    }
+    if (request == RT_NULL || request->entries == RT_NULL)
+    {
+        return -EINVAL;
+    }
+
+    filex_lock();
+    offset = file->pos / sizeof(struct dirent);
+    while (index < request->count)
+    {
+        d = &request->entries[index];
+
+        /* Names land straight in the caller's buffer.  */
+        dest_entry.fx_dir_entry_name = d->name;
+        dest_entry.fx_dir_entry_short_name[0] = 0;
+        if (_fx_directory_entry_read(dir_entry->media, dir_entry->is_root ? NULL : &dir_entry->entry, &offset, &dest_entry) != FX_SUCCESS ||
+            _filex_entry_is_end(dir_entry->media, &dest_entry))
+        {
+            break;
+        }
+        offset++;
+        if (!_filex_entry_is_listed(dir_entry->media, &dest_entry))
+        {
+            continue;
+        }
+
+        d->size = dest_entry.fx_dir_entry_file_size;
+        d->cluster = dest_entry.fx_dir_entry_cluster;
+        d->attributes = (rt_uint16_t)dest_entry.fx_dir_entry_attributes;
+        d->modified_date = (rt_uint16_t)dest_entry.fx_dir_entry_date;
+        d->modified_time = (rt_uint16_t)dest_entry.fx_dir_entry_time;
+        d->created_date = (rt_uint16_t)dest_entry.fx_dir_entry_created_date;
+        d->created_time = (rt_uint16_t)dest_entry.fx_dir_entry_created_time;
+        d->accessed_date = (rt_uint16_t)dest_entry.fx_dir_entry_last_accessed_date;
+        index++;
+    }
+
+    file->pos = offset * sizeof(struct dirent);
+    request->count = index;
+    filex_unlock();
+    return 0;
+}
+#endif /* FILEX_USING_READDIR_PLUS */
+
+/* The mount an open file or directory belongs to.  */
+rt_inline filex_media_t * _filex_fd_media(struct dfs_fd* file)
+{
+    if (file->data == RT_NULL)
+    {
+        return RT_NULL;
+    }
+    if (file->type == FT_DIRECTORY)
+    {
+        return rt_container_of(((filex_dir_t *)file->data)->media, filex_media_t, media);
+    }
+    return rt_container_of(((FX_FILE *)file->data)->fx_file_media_ptr, filex_media_t, media);
+}
+
+#ifdef FILEX_USING_CONCURRENT_READ
+rt_inline rt_bool_t _filex_read_concurrent(FX_MEDIA * media)
+{
+    return rt_container_of(media, filex_media_t, media)->read_cache[0].buffer != RT_NULL;
+}
+#endif /* FILEX_USING_CONCURRENT_READ */
+
+/* Brings the DFS position and size of a regular file up to date after
+   work done on its FileX handle outside the file operations.  Called with
+   filex_lock held.  */
+void filex_fd_update(struct dfs_fd* file)
+{
+    FX_FILE* file_entry = (FX_FILE*)file->data;
+
+    file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+    file->size = _filex_clamp_size(file_entry->fx_file_current_file_size);
+}
+
+/* Moves a regular file to offset, or to its end when offset is past it.
+   Called with filex_lock held.  */
+static UINT _filex_file_seek(struct dfs_fd* file, ULONG64 offset)
+{
+    FX_FILE* file_entry = (FX_FILE*)file->data;
+    UINT result;
+
+#ifdef FILEX_USING_CONCURRENT_READ
+    /* Concurrent reads keep the position in the handle's offset alone.  */
+    if (_filex_read_concurrent(file_entry->fx_file_media_ptr))
+    {
+        file_entry->fx_file_current_file_offset = (offset < file_entry->fx_file_current_file_size) ?
+                                                  offset : file_entry->fx_file_current_file_size;
+        file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+        return FX_SUCCESS;
+    }
+#endif /* FILEX_USING_CONCURRENT_READ */
+#ifdef FILEX_USING_RING_LOG
+    if (filex_ring_active(file_entry))
+    {
+        file->pos = filex_ring_seek(file_entry, (offset < 0xFFFFFFFF) ? (ULONG)offset : 0xFFFFFFFF);
+        return FX_SUCCESS;
+    }
+#endif /* FILEX_USING_RING_LOG */
+#ifdef FILEX_USING_RECORD
+    result = filex_record_sync(file_entry);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+#endif /* FILEX_USING_RECORD */
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+    filex_seek_prepare(file_entry, offset);
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+    result = fx_file_extended_seek(file_entry, offset);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+    filex_seek_note(file_entry);
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+
+    file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+    return FX_SUCCESS;
+}
+
+static int _dfs_filex_ioctl(struct dfs_fd* file, int cmd, void* args)
+{
+    RT_ASSERT(file != RT_NULL);
+
+    switch (cmd)
+    {
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+    case FILEX_IOCTL_DIR_COMPACT:
+    {
+        filex_dir_t * dir_entry = (filex_dir_t *)file->data;
+        int result;
+
+        if (file->type != FT_DIRECTORY || dir_entry == RT_NULL)
+        {
+            return -ENOTDIR;
+        }
+        filex_lock();
+#ifdef FILEX_USING_HANDLE_CACHE
+        /* Compaction refuses to move the entries of open files.  */
+        filex_handle_release(rt_container_of(dir_entry->media, filex_media_t, media));
+#endif /* FILEX_USING_HANDLE_CACHE */
+        result = filex_dir_index_compact(rt_container_of(dir_entry->media, filex_media_t, media),
+                                         dir_entry->is_root ? FX_NULL : &dir_entry->entry);
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+
+#ifdef FILEX_USING_READDIR_PLUS
+    case FILEX_IOCTL_DIR_READ_PLUS:
+        return _filex_readdir_plus(file, (struct filex_readdir_plus *)args);
+#endif /* FILEX_USING_READDIR_PLUS */
+
+#ifdef FILEX_USING_SECTOR_CACHE
+    case FILEX_IOCTL_CACHE_STATS:
+    {
+        filex_media_t * filex_media = _filex_fd_media(file);
+
+        if (filex_media == RT_NULL || args == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        filex_lock();
+        filex_cache_stats_get(&filex_media->media, (struct filex_cache_stats *)args);
+        filex_unlock();
+        return 0;
+    }
+#endif /* FILEX_USING_SECTOR_CACHE */
+
+#ifdef FILEX_USING_BACKGROUND_CHECK
+    case FILEX_IOCTL_CHECK_START:
+    case FILEX_IOCTL_CHECK_PROGRESS:
+    {
+        filex_media_t * filex_media = _filex_fd_media(file);
+        int result = FX_SUCCESS;
+
+        if (filex_media == RT_NULL || args == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        filex_lock();
+        if (cmd == FILEX_IOCTL_CHECK_START)
+        {
+            result = filex_check_start(filex_media, *(rt_uint32_t *)args);
+        }
+        else
+        {
+            filex_check_progress_get(filex_media, (struct filex_check_progress *)args);
+        }
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_BACKGROUND_CHECK */
+
+#ifdef FILEX_USING_DEFRAG
+    case FILEX_IOCTL_DEFRAG:
+    case FILEX_IOCTL_FRAGMENTS:
+    {
+        filex_media_t * filex_media = _filex_fd_media(file);
+        FX_FILE * file_entry = (FX_FILE *)file->data;
+        struct filex_fragments * fragments = (struct filex_fragments *)args;
+        ULONG clusters;
+        ULONG count;
+        int result;
+
+        if (file->type != FT_REGULAR || file_entry == RT_NULL || filex_media == RT_NULL)
+        {
+            return -EBADF;
+        }
+        if (cmd == FILEX_IOCTL_FRAGMENTS && fragments == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        filex_lock();
+        if (cmd == FILEX_IOCTL_DEFRAG)
+        {
+            /* Runs once the file is closed.  */
+            result = filex_defrag_queue(filex_media, file->path);
+        }
+        else
+        {
+            result = filex_defrag_measure(&filex_media->media, file_entry->fx_file_first_physical_cluster, &clusters, &count);
+            fragments->clusters = clusters;
+            fragments->fragments = count;
+        }
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+
+    case FILEX_IOCTL_DEFRAG_STATS:
+    {
+        filex_media_t * filex_media = _filex_fd_media(file);
+
+        if (filex_media == RT_NULL || args == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        filex_lock();
+        rt_memcpy(args, &filex_media->defrag_stats, sizeof(struct filex_defrag_stats));
+        filex_unlock();
+        return 0;
+    }
+#endif /* FILEX_USING_DEFRAG */
+
+#ifdef FILEX_USING_QOS
+    case FILEX_IOCTL_QOS_CLASS:
+    {
+        if (args == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        /* The calling thread, not the file.  */
+        return _filex_result_to_dfs(filex_qos_set(RT_NULL, *(int *)args));
+    }
+#endif /* FILEX_USING_QOS */
+
+#ifdef FILEX_USING_TRACE
+    case FILEX_IOCTL_TRACE_READ:
+    {
+        if (args == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        filex_trace_read((struct filex_trace_read *)args);
+        return 0;
+    }
+#endif /* FILEX_USING_TRACE */
+
+#ifdef FILEX_USING_CACHE_WARMUP
+    case FILEX_IOCTL_WARMUP_SAVE:
+    {
+        filex_media_t * filex_media = _filex_fd_media(file);
+        int result;
+
+        if (filex_media == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        /* After boot is the time: what the cache holds is the boot path.  */
+        filex_lock();
+        result = filex_warmup_save(filex_media);
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_CACHE_WARMUP */
+
+#ifdef FILEX_USING_COPY
+    case FILEX_IOCTL_COPY:
+    {
+        if (file->type != FT_REGULAR || file->data == RT_NULL)
+        {
+            return -EBADF;
+        }
+        if (args == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        /* Takes filex_lock per buffer itself.  */
+        return _filex_result_to_dfs(filex_copy_start(file, (struct filex_copy *)args));
+    }
+#endif /* FILEX_USING_COPY */
+
+    case FILEX_IOCTL_SEEK64:
+    {
+        struct filex_seek64 * seek = (struct filex_seek64 *)args;
+        FX_FILE * file_entry = (FX_FILE *)file->data;
+        rt_int64_t base = 0;
+        int result;
+
+        if (file->type != FT_REGULAR || file_entry == RT_NULL || seek == RT_NULL)
+        {
+            return -EINVAL;
+        }
+        filex_lock();
+#ifdef FILEX_USING_RING_LOG
+        /* A ring is never larger than lseek reaches.  */
+        if (filex_ring_active(file_entry))
+        {
+            filex_unlock();
+            return -EINVAL;
+        }
+#endif /* FILEX_USING_RING_LOG */
+#ifdef FILEX_USING_RECORD
+        /* The staged tail decides where the current offset and the end are.  */
+        result = filex_record_sync(file_entry);
+        if (result != FX_SUCCESS)
+        {
+            filex_unlock();
+            return _filex_result_to_dfs(result);
+        }
+#endif /* FILEX_USING_RECORD */
+        if (seek->whence == SEEK_CUR)
+        {
+            base = (rt_int64_t)file_entry->fx_file_current_file_offset;
+        }
+        else if (seek->whence == SEEK_END)
+        {
+            base = (rt_int64_t)file_entry->fx_file_current_file_size;
+        }
+        else if (seek->whence != SEEK_SET)
+        {
+            filex_unlock();
+            return -EINVAL;
+        }
+        if (base + seek->offset < 0)
+        {
+            filex_unlock();
+            return -EINVAL;
+        }
+
+        result = _filex_file_seek(file, (ULONG64)(base + seek->offset));
+        seek->position = file_entry->fx_file_current_file_offset;
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+
+#ifdef FILEX_USING_RECORD
+    case FILEX_IOCTL_RECORD:
+    {
+        int result;
+
+        if (file->type != FT_REGULAR || file->data == RT_NULL)
+        {
+            return -EBADF;
+        }
+        filex_lock();
+        result = filex_record_start((FX_FILE *)file->data, (const struct filex_record_mode *)args);
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_RECORD */
+
+#ifdef FILEX_USING_RING_LOG
+    case FILEX_IOCTL_RING:
+    {
+        int result;
+
+        if (file->type != FT_REGULAR || file->data == RT_NULL)
+        {
+            return -EBADF;
+        }
+        filex_lock();
+        result = filex_ring_attach((FX_FILE *)file->data, (const struct filex_ring_mode *)args);
+        if (result == FX_SUCCESS)
+        {
+            /* From here on the fd sees the records held, oldest first.  */
+            file->pos = 0;
+            file->size = filex_ring_used((FX_FILE *)file->data);
+        }
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_RING_LOG */
+
+    default:
+        break;
+    }
+    return -ENOSYS;
+}
+
+static int _dfs_filex_read(struct dfs_fd* file, void* buf, size_t len)
+{
+    FX_FILE* file_entry = (FX_FILE*)file->data;
+    int result;
+    ULONG actual_size;
+
+    RT_ASSERT(file != RT_NULL);
+    RT_ASSERT(file->data != RT_NULL);
+
+
+    if (file->type == FT_DIRECTORY)
+    {
+        return 0;
+    }
+#ifdef FILEX_USING_CONCURRENT_READ
+    if (_filex_read_concurrent(file_entry->fx_file_media_ptr))
+    {
+        /* The handle's own offset is the 64-bit position.  */
+        result = filex_concurrent_read(file_entry, file_entry->fx_file_current_file_offset, buf, len, &actual_size);
+        if (result != FX_SUCCESS)
+        {
+            return _filex_result_to_dfs(result);
+        }
+        file_entry->fx_file_current_file_offset += actual_size;
+        file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+        return actual_size;
+    }
+#endif /* FILEX_USING_CONCURRENT_READ */
+    filex_lock();
+#ifdef FILEX_USING_RING_LOG
+    if (filex_ring_active(file_entry))
+    {
+        result = filex_ring_read(file_entry, buf, len, &actual_size);
+        file->pos = filex_ring_tell(file_entry);
+        file->size = filex_ring_used(file_entry);
+        filex_unlock();
+        return (result == FX_SUCCESS) ? (int)actual_size : _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_RING_LOG */
+#ifdef FILEX_USING_RECORD
+    result = filex_record_sync(file_entry);
+    if (result != FX_SUCCESS)
+    {
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_RECORD */
+    result = fx_file_read(file_entry, buf, len, &actual_size);
+    if (result != FX_SUCCESS)
+    {
+        filex_unlock();
+        /* At the end of the file FileX fails the read, DFS wants 0.  */
+        return (result == FX_END_OF_FILE) ? 0 : _filex_result_to_dfs(result);
+    }
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+    filex_seek_note(file_entry);
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+
+    /* update position */
+    file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+    filex_unlock();
+    return actual_size;
+}
+
+static int _dfs_filex_write(struct dfs_fd* file, const void* buf, size_t len)
+{
+    FX_FILE* file_entry = (FX_FILE*)file->data;
+    int result;
+
+    RT_ASSERT(file != RT_NULL);
+    RT_ASSERT(file->data != RT_NULL);
+
+    if (file->type == FT_DIRECTORY)
+    {
+        return 0;
+    }
+    filex_lock();
+#ifdef FILEX_USING_RING_LOG
+    /* Ring appends write data and header sectors only, no metadata.  */
+    if (filex_ring_active(file_entry))
+    {
+        result = filex_ring_append(file_entry, buf, len);
+        file->pos = filex_ring_tell(file_entry);
+        file->size = filex_ring_used(file_entry);
+        filex_unlock();
+        return (result == FX_SUCCESS) ? (int)len : _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_RING_LOG */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_begin(rt_container_of(file_entry->fx_file_media_ptr, filex_media_t, media));
+#endif /* FILEX_USING_GROUP_COMMIT */
+#ifdef FILEX_USING_RECORD
+    result = filex_record_write(file_entry, buf, len);
+#else
+    result = fx_file_write(file_entry, (void *)buf, len);
+#endif /* FILEX_USING_RECORD */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_end(rt_container_of(file_entry->fx_file_media_ptr, filex_media_t, media), result);
+#endif /* FILEX_USING_GROUP_COMMIT */
+
+    if (result != FX_SUCCESS)
+    {
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+    filex_seek_note(file_entry);
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+
+    /* update position and file size */
+#ifdef FILEX_USING_RECORD
+    /* Staged bytes are past the FileX offset, and may be past its size.  */
+    file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset + filex_record_staged(file_entry));
+    file->size = _filex_clamp_size(file_entry->fx_file_current_file_size);
+    if (file->size < (size_t)file->pos)
+    {
+        file->size = file->pos;
+    }
+#else
+    file->pos = _filex_clamp_off(file_entry->fx_file_current_file_offset);
+    file->size = _filex_clamp_size(file_entry->fx_file_current_file_size);
+#endif /* FILEX_USING_RECORD */
+    filex_unlock();
+    return len;
+}
+
+#ifdef FILEX_USING_QOS
+/* Ring files move whole records in one call.  */
+static rt_bool_t _filex_qos_sliced(struct dfs_fd* file)
+{
+    rt_bool_t sliced = RT_TRUE;
+
+    if (file->type == FT_DIRECTORY)
+    {
+        return RT_FALSE;
+    }
+#ifdef FILEX_USING_RING_LOG
+    filex_lock();
+    sliced = !filex_ring_active((FX_FILE*)file->data);
+    filex_unlock();
+#endif /* FILEX_USING_RING_LOG */
+    return sliced;
+}
+
+/* Long reads and writes go a slice at a time, each charged to the class
+   of the caller and under its own hold of filex_lock, so callers of a
+   higher class get in between.  A slice that fails ends the call with
+   what the earlier ones moved, or with its error when they moved nothing.  */
+static int _dfs_filex_read_sliced(struct dfs_fd* file, void* buf, size_t len)
+{
+    size_t done = 0;
+    size_t slice;
+    int result;
+
+    if (!_filex_qos_sliced(file))
+    {
+        filex_qos_admit(len);
+        return _dfs_filex_read(file, buf, len);
+    }
+    while (done < len)
+    {
+        slice = (len - done < FILEX_QOS_SLICE) ? len - done : FILEX_QOS_SLICE;
+        filex_qos_admit(slice);
+        result = _dfs_filex_read(file, (rt_uint8_t*)buf + done, slice);
+        if (result < 0)
+        {
+            return done ? (int)done : result;
+        }
+        if (result == 0)
+        {
+            break;
+        }
+        done += result;
+        if ((size_t)result < slice)
+        {
+            break;
+        }
+    }
+    return done;
+}
+
+static int _dfs_filex_write_sliced(struct dfs_fd* file, const void* buf, size_t len)
+{
+    size_t done = 0;
+    size_t slice;
+    int result;
+
+    if (!_filex_qos_sliced(file))
+    {
+        filex_qos_admit(len);
+        return _dfs_filex_write(file, buf, len);
+    }
+    while (done < len)
+    {
+        slice = (len - done < FILEX_QOS_SLICE) ? len - done : FILEX_QOS_SLICE;
+        filex_qos_admit(slice);
+        result = _dfs_filex_write(file, (const rt_uint8_t*)buf + done, slice);
+        if (result < 0)
+        {
+            return done ? (int)done : result;
+        }
+        done += result;
+        if ((size_t)result < slice)
+        {
+            break;
+        }
+    }
+    return done;
+}
+#endif /* FILEX_USING_QOS */
+
+#ifdef FILEX_USING_QOS
+#define _dfs_filex_read_fop             _dfs_filex_read_sliced
+#define _dfs_filex_write_fop            _dfs_filex_write_sliced
+#else
+#define _dfs_filex_read_fop             _dfs_filex_read
+#define _dfs_filex_write_fop            _dfs_filex_write
+#endif /* FILEX_USING_QOS */
+
+static int _dfs_filex_flush(struct dfs_fd* file)
+{
+    FX_FILE* file_entry = (FX_FILE*)file->data;
+    int result;
+
+    RT_ASSERT(file != RT_NULL);
+    RT_ASSERT(file->data != RT_NULL);
+    filex_lock();
+#ifdef FILEX_USING_RECORD
+    /* Staged data that did not reach the file fails the fsync.  */
+    result = filex_record_sync(file_entry);
+    if (result != FX_SUCCESS)
+    {
+        filex_unlock();
+        return _filex_result_to_dfs(result);
+    }
+#endif /* FILEX_USING_RECORD */
+#ifdef FILEX_USING_GROUP_COMMIT
+    /* fsync is a group boundary.  */
+    filex_group_commit(rt_container_of(file_entry->fx_file_media_ptr, filex_media_t, media));
+#endif /* FILEX_USING_GROUP_COMMIT */
+    result = fx_media_flush(file_entry->fx_file_media_ptr);
+
+    filex_unlock();
+    return _filex_result_to_dfs(result);
+}
+
+static int _dfs_filex_lseek(struct dfs_fd* file, rt_off_t offset)
+{
+    int result;
+    RT_ASSERT(file != RT_NULL);
+    RT_ASSERT(file->data != RT_NULL);
+    filex_lock();
+    if (file->type == FT_REGULAR)
+    {
+        result = _filex_file_seek(file, (ULONG64)offset);
+        if (result != FX_SUCCESS)
+        {
+            filex_unlock();
+            return _filex_result_to_dfs(result);
+        }
+    }
+    else if (file->type == FT_DIRECTORY)
+    {
+        file->pos = offset;
+    }
+    filex_unlock();
+    return (file->pos);
+}
+
+static int _dfs_filex_getdents(struct dfs_fd* file, struct dirent* dirp, uint32_t count)
+{
+    filex_dir_t *dir_entry;
+    int result;
+    ULONG index;
+    ULONG offset;
+    struct dirent* d;
+    FX_DIR_ENTRY dest_entry;
+
+    RT_ASSERT(file->data != RT_NULL);
+    
+
+    dir_entry = (filex_dir_t*)(file->data);
+
+    /* make integer count */
+    count = (count / sizeof(struct dirent)) * sizeof(struct dirent);
+    if (count == 0)
+    {
+        return -EINVAL;
+    }
+    filex_lock();
+    offset = file->pos / sizeof(struct dirent);
+
+    index = 0;
+    dest_entry.fx_dir_entry_name = filex_pool_alloc(FILEX_POOL_NAME, FX_MAX_LONG_NAME_LEN);
+    RT_ASSERT(dest_entry.fx_dir_entry_name);
+    while (1)
+    {
+        d = dirp + index;
+
+        dest_entry.fx_dir_entry_short_name[0] = 0;
+        result = _fx_directory_entry_read(dir_entry->media, dir_entry->is_root ? NULL : &dir_entry->entry, &offset, &dest_entry);
+        if (result != FX_SUCCESS)
+        {
+            break;
+        }
+
+#ifdef FX_ENABLE_EXFAT
+        if (dest_entry.fx_dir_entry_type == FX_EXFAT_DIR_ENTRY_TYPE_END_MARKER)
+#else
+        if ((UCHAR)dest_entry.fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_DONE)
+#endif /* FX_ENABLE_EXFAT */
+        {
+            break;
+        }
+
+        d->d_type = DT_UNKNOWN;
+
+        if(dest_entry.fx_dir_entry_attributes & FX_DIRECTORY)
+        {
+            d->d_type |= DT_DIR;
+        }
+        else
+        {
+            d->d_type |= DT_REG;
+        }
+        
+
+        d->d_namlen = (rt_uint8_t)rt_strlen(dest_entry.fx_dir_entry_name);
+        d->d_reclen = (rt_uint16_t)sizeof(struct dirent);
+        strncpy(d->d_name, dest_entry.fx_dir_entry_name, d->d_namlen + 1);
+
+        index++;
+        offset++;
+        if (index * sizeof(struct dirent) >= count)
+        {
+            break;
+        }
+    }
+
+    file->pos = offset * sizeof(struct dirent);
+    filex_pool_free(FILEX_POOL_NAME, dest_entry.fx_dir_entry_name);
+    filex_unlock();
+    return index * sizeof(struct dirent);
+}
+
+#ifdef FILEX_USING_TRACE
+/* Each call is recorded as it returns, with the position it started at.
+   Errors are kept as errno; counts and positions returned are not.  */
+static void _filex_trace(rt_uint8_t op, const char* path, rt_uint64_t offset, rt_uint32_t length, rt_uint32_t start,
+                         int result)
+{
+    filex_trace_add(op, path, offset, length, start, (rt_uint8_t)((result < 0) ? -result : 0));
+}
+
+/* The DFS position stops at FILEX_OFF_MAX, past it the FileX offset is
+   the one to record.  */
+static rt_uint64_t _filex_trace_pos(struct dfs_fd* file)
+{
+    if ((file->type == FT_REGULAR) && (file->data != RT_NULL) && ((ULONG64)file->pos == FILEX_OFF_MAX))
+    {
+        return ((FX_FILE*)file->data)->fx_file_current_file_offset;
+    }
+    return (rt_uint64_t)file->pos;
+}
+
+static int _dfs_filex_open_traced(struct dfs_fd* file)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    int result;
+
+    result = _dfs_filex_open(file);
+    _filex_trace(FILEX_TRACE_OPEN, file->path, 0, file->flags, start, result);
+    return result;
+}
+
+static int _dfs_filex_close_traced(struct dfs_fd* file)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    int result;
+
+    result = _dfs_filex_close(file);
+    _filex_trace(FILEX_TRACE_CLOSE, file->path, 0, 0, start, result);
+    return result;
+}
+
+static int _dfs_filex_read_traced(struct dfs_fd* file, void* buf, size_t len)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    rt_uint64_t pos = _filex_trace_pos(file);
+    int result;
+
+    result = _dfs_filex_read_fop(file, buf, len);
+    _filex_trace(FILEX_TRACE_READ, file->path, pos, len, start, result);
+    return result;
+}
+
+static int _dfs_filex_write_traced(struct dfs_fd* file, const void* buf, size_t len)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    rt_uint64_t pos = _filex_trace_pos(file);
+    int result;
+
+    result = _dfs_filex_write_fop(file, buf, len);
+    _filex_trace(FILEX_TRACE_WRITE, file->path, pos, len, start, result);
+    return result;
+}
+
+static int _dfs_filex_flush_traced(struct dfs_fd* file)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    int result;
+
+    result = _dfs_filex_flush(file);
+    _filex_trace(FILEX_TRACE_FLUSH, file->path, 0, 0, start, result);
+    return result;
+}
+
+static int _dfs_filex_lseek_traced(struct dfs_fd* file, rt_off_t offset)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    int result;
+
+    result = _dfs_filex_lseek(file, offset);
+    _filex_trace(FILEX_TRACE_LSEEK, file->path, (rt_uint64_t)offset, 0, start, result);
+    return result;
+}
+
+static int _dfs_filex_getdents_traced(struct dfs_fd* file, struct dirent* dirp, uint32_t count)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    rt_uint64_t pos = (rt_uint64_t)file->pos;
+    int result;
+
+    result = _dfs_filex_getdents(file, dirp, count);
+    _filex_trace(FILEX_TRACE_GETDENTS, file->path, pos, count, start, result);
+    return result;
+}
+
+static int _dfs_filex_unlink_traced(struct dfs_filesystem* dfs, const char* path)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    int result;
+
+    result = _dfs_filex_unlink(dfs, path);
+    _filex_trace(FILEX_TRACE_UNLINK, path, 0, 0, start, result);
+    return result;
+}
+
+static int _dfs_filex_stat_traced(struct dfs_filesystem* dfs, const char* path, struct stat* st)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    int result;
+
+    result = _dfs_filex_stat(dfs, path, st);
+    _filex_trace(FILEX_TRACE_STAT, path, 0, 0, start, result);
+    return result;
+}
+
+static int _dfs_filex_rename_traced(struct dfs_filesystem* dfs, const char* from, const char* to)
+{
+    rt_uint32_t start = FILEX_TRACE_CLOCK();
+    int result;
+
+    result = _dfs_filex_rename(dfs, from, to);
+    _filex_trace(FILEX_TRACE_RENAME, from, filex_trace_hash(to), 0, start, result);
+    return result;
+}
+#endif /* FILEX_USING_TRACE */
+
+static const struct dfs_file_ops _dfs_filex_fops = {
+#ifdef FILEX_USING_TRACE
+    _dfs_filex_open_traced,
+    _dfs_filex_close_traced,
+    _dfs_filex_ioctl,
+    _dfs_filex_read_traced,
+    _dfs_filex_write_traced,
+    _dfs_filex_flush_traced,
+    _dfs_filex_lseek_traced,
+    _dfs_filex_getdents_traced,
+#else
+    _dfs_filex_open,
+    _dfs_filex_close,
+    _dfs_filex_ioctl,
+    _dfs_filex_read_fop,
+    _dfs_filex_write_fop,
+    _dfs_filex_flush,
+    _dfs_filex_lseek,
+    _dfs_filex_getdents,
+#endif /* FILEX_USING_TRACE */
+    //    RT_NULL, /* poll interface */
+};
+
+static const struct dfs_filesystem_ops _dfs_filex_fat_ops = {
+    "fat",
+    DFS_FS_FLAG_DEFAULT,
+    &_dfs_filex_fops,
+
+    _dfs_filex_mount,
+    _dfs_filex_unmount,
+    _dfs_filex_fat_mkfs,
+    _dfs_filex_statfs,
+#ifdef FILEX_USING_TRACE
+    _dfs_filex_unlink_traced,
+    _dfs_filex_stat_traced,
+    _dfs_filex_rename_traced,
+#else
+    _dfs_filex_unlink,
+    _dfs_filex_stat,
+    _dfs_filex_rename,
+#endif /* FILEX_USING_TRACE */
+};
+
+#ifdef FX_ENABLE_EXFAT
+static const struct dfs_filesystem_ops _dfs_filex_exfat_ops = {
+    "exfat",
+    DFS_FS_FLAG_DEFAULT,
+    &_dfs_filex_fops,
+
+    _dfs_filex_mount,
+    _dfs_filex_unmount,
+    _dfs_filex_exfat_mkfs,
+    _dfs_filex_statfs,
+#ifdef FILEX_USING_TRACE
+    _dfs_filex_unlink_traced,
+    _dfs_filex_stat_traced,
+    _dfs_filex_rename_traced,
+#else
+    _dfs_filex_unlink,
+    _dfs_filex_stat,
+    _dfs_filex_rename,
+#endif /* FILEX_USING_TRACE */
+};
+
+#endif
+
+int dfs_filex_init(void)
+{
+#ifdef FILEX_USING_QOS
+    /* filex_lock is the QoS hand over lock.  */
+    if (filex_qos_init() != RT_EOK)
+    {
+        RT_ASSERT(0);
+    }
+#else
+    lock = rt_mutex_create("filex", RT_IPC_FLAG_FIFO);
+    RT_ASSERT(lock);
+#endif /* FILEX_USING_QOS */
+    fx_system_initialize();
+#ifdef FILEX_USING_MEMPOOL
+    filex_pool_init();
+#endif /* FILEX_USING_MEMPOOL */
+#ifdef FILEX_USING_DEFERRED_DELETE
+    filex_deferred_delete_init();
+#endif /* FILEX_USING_DEFERRED_DELETE */
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_commit_init();
+#endif /* FILEX_USING_GROUP_COMMIT */
+#ifdef FILEX_USING_IO_SCHED
+    filex_io_sched_init();
+#endif /* FILEX_USING_IO_SCHED */
+#ifdef FILEX_USING_BACKGROUND_CHECK
+    filex_check_init();
+#endif /* FILEX_USING_BACKGROUND_CHECK */
+#ifdef FILEX_USING_DEFRAG
+    filex_defrag_init();
+#endif /* FILEX_USING_DEFRAG */
+#ifdef FILEX_USING_COPY
+    filex_copy_init();
+#endif /* FILEX_USING_COPY */
+#ifdef FX_ENABLE_EXFAT
+    dfs_register(&_dfs_filex_exfat_ops);
+#endif
+    rt_list_init(&filex_media_list);
+    /* register ram file system */
+    return dfs_register(&_dfs_filex_fat_ops);
+}
+INIT_COMPONENT_EXPORT(dfs_filex_init);
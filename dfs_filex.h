@@ -0,0 +1,1118 @@
+#ifndef __DFS_FILEX_H__
+#define __DFS_FILEX_H__
+
+#include <rtthread.h>
+
+#include "fx_api.h"
+
+#ifndef FLIEX_MEDIA_MEMORY_SIZE
+#define FLIEX_MEDIA_MEMORY_SIZE 4096     /* Size */
+#endif /* FLIEX_MEDIA_MEMORY_SIZE */
+
+#ifndef FILEX_MKFS_FAT_COPIES
+#define FILEX_MKFS_FAT_COPIES   1        /* FATs written by mkfs */
+#endif /* FILEX_MKFS_FAT_COPIES */
+
+/* Deferred delete: unlink only removes the directory entry, the cluster chain
+   is released later by a low priority worker in bounded slices.  */
+#ifdef FILEX_USING_DEFERRED_DELETE
+
+#ifndef FILEX_DEFERRED_DELETE_QUEUE_SIZE
+#define FILEX_DEFERRED_DELETE_QUEUE_SIZE        16      /* Chains pending per media */
+#endif
+
+#ifndef FILEX_DEFERRED_DELETE_THRESHOLD
+#define FILEX_DEFERRED_DELETE_THRESHOLD         64      /* Smaller files are deleted in place */
+#endif
+
+#ifndef FILEX_DEFERRED_DELETE_SLICE
+#define FILEX_DEFERRED_DELETE_SLICE             512     /* Clusters released per slice */
+#endif
+
+#ifndef FILEX_DEFERRED_DELETE_INTERVAL
+#define FILEX_DEFERRED_DELETE_INTERVAL          10      /* Milliseconds between slices */
+#endif
+
+#ifndef FILEX_DEFERRED_DELETE_JOURNAL
+#define FILEX_DEFERRED_DELETE_JOURNAL           "FXDEFER.SYS"
+#endif
+
+#ifndef FILEX_DEFERRED_DELETE_THREAD_PRIORITY
+#define FILEX_DEFERRED_DELETE_THREAD_PRIORITY   (RT_THREAD_PRIORITY_MAX - 2)
+#endif
+
+#ifndef FILEX_DEFERRED_DELETE_THREAD_STACK_SIZE
+#define FILEX_DEFERRED_DELETE_THREAD_STACK_SIZE 2048
+#endif
+
+typedef struct filex_deferred_chain {
+    ULONG cluster;          /* Next cluster to release */
+    ULONG count;            /* Clusters left in a contiguous run, 0 follows the FAT */
+} filex_deferred_chain_t;
+
+#endif /* FILEX_USING_DEFERRED_DELETE */
+
+#ifndef FILEX_FAULT_TOLERANT_LOG_SIZE
+#define FILEX_FAULT_TOLERANT_LOG_SIZE           FLIEX_MEDIA_MEMORY_SIZE     /* Default log buffer per mount */
+#endif
+
+/* Passed as the data argument of dfs_mount, RT_NULL takes the defaults.  */
+#define FILEX_MOUNT_NO_FAULT_TOLERANT           0x01    /* Mount without the fault tolerant log */
+#define FILEX_MOUNT_FAT_MIRROR                  0x02    /* Keep the whole FAT in RAM, FILEX_USING_FAT_MIRROR */
+
+#ifndef MS_RDONLY
+#define MS_RDONLY                               1       /* rwflag of dfs_mount */
+#endif
+
+struct dfs_filex_mount_options
+{
+    rt_uint32_t flags;
+    rt_uint32_t fault_tolerant_log_size;    /* Log buffer bytes, 0 for FILEX_FAULT_TOLERANT_LOG_SIZE */
+    rt_uint32_t fat_map_sectors;            /* FAT sectors per secondary FAT dirty bit, 0 for FILEX_FAT_MAP_SECTORS */
+};
+
+/* Group commit: metadata operations share one fault tolerant transaction
+   that commits after a number of operations or a time window.  */
+#if defined(FILEX_USING_GROUP_COMMIT) && !defined(FX_ENABLE_FAULT_TOLERANT)
+#undef FILEX_USING_GROUP_COMMIT
+#endif
+
+#ifdef FILEX_USING_GROUP_COMMIT
+
+#ifndef FILEX_GROUP_COMMIT_OPS
+#define FILEX_GROUP_COMMIT_OPS                  16      /* Operations per transaction */
+#endif
+
+#ifndef FILEX_GROUP_COMMIT_WINDOW
+#define FILEX_GROUP_COMMIT_WINDOW               50      /* Milliseconds a group stays open at most */
+#endif
+
+#ifndef FILEX_GROUP_COMMIT_HEADROOM
+#define FILEX_GROUP_COMMIT_HEADROOM             50      /* Percent of the log kept free for the next operation */
+#endif
+
+#ifndef FILEX_GROUP_COMMIT_THREAD_PRIORITY
+#define FILEX_GROUP_COMMIT_THREAD_PRIORITY      (RT_THREAD_PRIORITY_MAX / 2)
+#endif
+
+#ifndef FILEX_GROUP_COMMIT_THREAD_STACK_SIZE
+#define FILEX_GROUP_COMMIT_THREAD_STACK_SIZE    1024
+#endif
+
+#endif /* FILEX_USING_GROUP_COMMIT */
+
+/* I/O scheduler: small writes are queued below the driver and written in
+   one elevator sweep, metadata first, with adjacent sectors merged.  */
+#ifdef FILEX_USING_IO_SCHED
+
+#ifndef FILEX_IO_SCHED_DEPTH
+#define FILEX_IO_SCHED_DEPTH                    16      /* Sectors queued per media, at most 255 */
+#endif
+
+#ifndef FILEX_IO_SCHED_MERGE_SECTORS
+#define FILEX_IO_SCHED_MERGE_SECTORS            8       /* Longest merged device write */
+#endif
+
+#ifndef FILEX_IO_SCHED_BYPASS_SECTORS
+#define FILEX_IO_SCHED_BYPASS_SECTORS           4       /* Longer writes go straight to the device */
+#endif
+
+#ifndef FILEX_IO_SCHED_DEADLINE
+#define FILEX_IO_SCHED_DEADLINE                 100     /* Milliseconds a sector stays queued at most */
+#endif
+
+#ifndef FILEX_IO_SCHED_THREAD_PRIORITY
+#define FILEX_IO_SCHED_THREAD_PRIORITY          (RT_THREAD_PRIORITY_MAX / 2)
+#endif
+
+#ifndef FILEX_IO_SCHED_THREAD_STACK_SIZE
+#define FILEX_IO_SCHED_THREAD_STACK_SIZE        1024
+#endif
+
+#if FILEX_IO_SCHED_DEPTH > 255
+#error "FILEX_IO_SCHED_DEPTH must not exceed 255"
+#endif
+
+typedef struct filex_io_slot {
+    ULONG sector;           /* Device sector, hidden sectors included */
+    rt_bool_t metadata;
+} filex_io_slot_t;
+
+typedef struct filex_io_sched {
+    filex_io_slot_t slots[FILEX_IO_SCHED_DEPTH];
+    UCHAR * buffer;         /* Allocated on the first write */
+    ULONG bytes_per_sector;
+    rt_uint32_t count;
+    rt_tick_t since;        /* Queue went non-empty */
+    ULONG head;             /* Sector after the last one written */
+    UINT error;             /* Failed background write, reported on flush */
+} filex_io_sched_t;
+
+#endif /* FILEX_USING_IO_SCHED */
+
+/* Sector cache: driver level, write through, split by the sector type
+   FileX tags each request with so data cannot evict metadata.  */
+#ifdef FILEX_USING_SECTOR_CACHE
+
+#ifndef FILEX_CACHE_SYSTEM_SECTORS
+#define FILEX_CACHE_SYSTEM_SECTORS              16      /* Boot and FAT sectors */
+#endif
+
+#ifndef FILEX_CACHE_DIRECTORY_SECTORS
+#define FILEX_CACHE_DIRECTORY_SECTORS           16
+#endif
+
+#ifndef FILEX_CACHE_DATA_SECTORS
+#define FILEX_CACHE_DATA_SECTORS                4       /* Recycle area for short data reads */
+#endif
+
+#ifndef FILEX_CACHE_STREAM_SECTORS
+#define FILEX_CACHE_STREAM_SECTORS              1       /* Longer data reads bypass the cache */
+#endif
+
+#define FILEX_CACHE_SYSTEM                      0
+#define FILEX_CACHE_DIRECTORY                   1
+#define FILEX_CACHE_DATA                        2
+#define FILEX_CACHE_PARTITIONS                  3
+
+#define FILEX_CACHE_LINES                       (FILEX_CACHE_SYSTEM_SECTORS + FILEX_CACHE_DIRECTORY_SECTORS + FILEX_CACHE_DATA_SECTORS)
+
+typedef struct filex_cache_line {
+    ULONG sector;           /* Device sector, hidden sectors included */
+    rt_uint32_t stamp;      /* Last use, 0 for an empty line */
+} filex_cache_line_t;
+
+typedef struct filex_sector_cache {
+    filex_cache_line_t lines[FILEX_CACHE_LINES];
+    UCHAR * buffer;         /* Allocated on the first request */
+    ULONG bytes_per_sector;
+    rt_uint32_t clock;
+    rt_uint32_t hits[FILEX_CACHE_PARTITIONS];
+    rt_uint32_t misses[FILEX_CACHE_PARTITIONS];
+    rt_uint32_t bypassed;
+} filex_sector_cache_t;
+
+struct filex_cache_stats
+{
+    rt_uint32_t hits[FILEX_CACHE_PARTITIONS];       /* In sectors */
+    rt_uint32_t misses[FILEX_CACHE_PARTITIONS];
+    rt_uint32_t lines[FILEX_CACHE_PARTITIONS];
+    rt_uint32_t bypassed;                           /* Streaming and unclassified reads */
+};
+
+#endif /* FILEX_USING_SECTOR_CACHE */
+
+/* Cache warm-up: the metadata sectors in the sector cache are listed at
+   unmount and read back in batches at the next mount.  */
+#ifdef FILEX_USING_CACHE_WARMUP
+
+#ifndef FILEX_USING_SECTOR_CACHE
+#error "FILEX_USING_CACHE_WARMUP needs FILEX_USING_SECTOR_CACHE"
+#endif
+
+#ifndef FILEX_WARMUP_FILE
+#define FILEX_WARMUP_FILE                       "FXWARM.SYS"
+#endif
+
+#ifndef FILEX_WARMUP_BATCH
+#define FILEX_WARMUP_BATCH                      16      /* Sectors per device read at most */
+#endif
+
+#endif /* FILEX_USING_CACHE_WARMUP */
+
+/* FAT mirror: the primary FAT, and the exFAT allocation bitmap, held in
+   RAM for the life of a mount; dirty sectors are written back on flush.  */
+#ifdef FILEX_USING_FAT_MIRROR
+
+#ifndef FILEX_FAT_MIRROR_MAX_SIZE
+#define FILEX_FAT_MIRROR_MAX_SIZE               (1024 * 1024)   /* Bytes per media, larger volumes mount without it */
+#endif
+
+#define FILEX_FAT_MIRROR_RANGES                 2
+
+typedef struct filex_mirror_range {
+    ULONG start;            /* Device sector, hidden sectors included */
+    ULONG sectors;
+    UCHAR * buffer;         /* RT_NULL when the range is unused */
+    ULONG dirty_first;      /* Dirty span relative to start, first > last when clean */
+    ULONG dirty_last;
+} filex_mirror_range_t;
+
+#endif /* FILEX_USING_FAT_MIRROR */
+
+/* Lazy secondary FAT: writes to the extra FAT copies are dropped and the
+   dirty parts of the primary FAT copied over on flush and unmount.  */
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+
+#ifndef FILEX_FAT_MAP_SECTORS
+#define FILEX_FAT_MAP_SECTORS                   1       /* Primary FAT sectors per dirty bit */
+#endif
+
+#endif /* FILEX_USING_LAZY_SECONDARY_FAT */
+
+/* Fixed block pools for what open, getdents and mount allocate every time.
+   A pool that runs dry falls back to the heap.  */
+#ifdef FILEX_USING_MEMPOOL
+
+#ifndef FILEX_POOL_FILE_BLOCKS
+#define FILEX_POOL_FILE_BLOCKS                  8       /* Open files */
+#endif
+#ifndef FILEX_POOL_DIR_BLOCKS
+#define FILEX_POOL_DIR_BLOCKS                   2       /* Open directories */
+#endif
+#ifndef FILEX_POOL_NAME_BLOCKS
+#define FILEX_POOL_NAME_BLOCKS                  2       /* getdents calls in progress */
+#endif
+#ifndef FILEX_POOL_MEDIA_BLOCKS
+#define FILEX_POOL_MEDIA_BLOCKS                 1       /* Mounted volumes */
+#endif
+
+#define FILEX_POOL_FILE                         0       /* FX_FILE */
+#define FILEX_POOL_DIR                          1       /* filex_dir_t */
+#define FILEX_POOL_NAME                         2       /* FX_MAX_LONG_NAME_LEN bytes */
+#define FILEX_POOL_MEDIA                        3       /* filex_media_t */
+#define FILEX_POOLS                             4
+
+struct filex_pool_stats
+{
+    rt_uint32_t blocks;         /* Pool size */
+    rt_uint32_t used;           /* Pool blocks allocated now */
+    rt_uint32_t pool_allocs;
+    rt_uint32_t heap_allocs;    /* Allocations the pool could not serve */
+};
+
+#endif /* FILEX_USING_MEMPOOL */
+
+/* Handle cache: files closed through DFS stay open in FileX for a while,
+   so the next open of the same path skips the directory search.  */
+#ifdef FILEX_USING_HANDLE_CACHE
+
+#ifndef FILEX_HANDLE_CACHE_SIZE
+#define FILEX_HANDLE_CACHE_SIZE                 8       /* Closed handles kept per media */
+#endif
+#ifndef FILEX_HANDLE_PATH_MAX
+#define FILEX_HANDLE_PATH_MAX                   64      /* Longer paths are not cached */
+#endif
+
+typedef struct filex_handle {
+    FX_FILE * file;         /* RT_NULL for an empty slot */
+    rt_uint32_t stamp;      /* Close order */
+    char path[FILEX_HANDLE_PATH_MAX];
+} filex_handle_t;
+
+#endif /* FILEX_USING_HANDLE_CACHE */
+
+/* Concurrent reads: on a read-only mount file reads skip filex_lock and
+   share a sector cache split in separately locked stripes.  */
+#ifdef FILEX_USING_CONCURRENT_READ
+
+#ifndef FILEX_READ_CACHE_STRIPES
+#define FILEX_READ_CACHE_STRIPES                4       /* Stripe of a sector is sector % stripes */
+#endif
+#ifndef FILEX_READ_CACHE_WAYS
+#define FILEX_READ_CACHE_WAYS                   4       /* Sectors per stripe */
+#endif
+
+typedef struct filex_read_stripe {
+    struct rt_mutex lock;
+    ULONG sector[FILEX_READ_CACHE_WAYS];
+    rt_uint32_t stamp[FILEX_READ_CACHE_WAYS];  /* Last use, 0 for an empty way */
+    rt_uint32_t clock;
+    UCHAR * buffer;         /* RT_NULL when the mount is not read-only */
+} filex_read_stripe_t;
+
+#endif /* FILEX_USING_CONCURRENT_READ */
+
+/* Block map: FileX sectors smaller than the device block, e.g. a 512 byte
+   sector volume on 4K native eMMC, written through a read-modify-write
+   buffer of one device block.  */
+#ifdef FILEX_USING_BLOCK_MAP
+
+#ifndef FILEX_MKFS_SECTOR_SIZE
+#define FILEX_MKFS_SECTOR_SIZE                  0       /* Sector size mkfs formats with, 0 for the device block */
+#endif
+
+typedef struct filex_block_map {
+    struct rt_mutex lock;
+    ULONG sector_size;      /* FileX bytes per sector, 0 until known */
+    ULONG block_size;       /* Device bytes per block */
+    UCHAR * buffer;         /* The block being assembled */
+    UCHAR * scratch;        /* Device copy for read-modify-write */
+    ULONG block;            /* Device block in buffer */
+    rt_uint32_t valid;      /* Sectors of buffer that are current, 0 for none */
+    rt_uint32_t dirty;      /* Sectors of buffer not written yet */
+    rt_uint32_t sector_reads;
+    rt_uint32_t sector_writes;
+    rt_uint32_t device_reads;
+    rt_uint32_t device_writes;
+    rt_uint32_t rmw_reads;  /* Device writes that needed a read first */
+} filex_block_map_t;
+
+#endif /* FILEX_USING_BLOCK_MAP */
+
+/* Recording mode: long sequential writes, such as video, staged and written
+   a buffer at a time into clusters allocated ahead a whole SD allocation
+   unit at a time, AU aligned.  The AU size cannot be read through the block
+   device, so it is configured here or per file.  */
+#ifdef FILEX_USING_RECORD
+
+#ifndef FILEX_RECORD_AU_SIZE
+#define FILEX_RECORD_AU_SIZE                    (4 * 1024 * 1024)   /* Allocation unit of the card */
+#endif
+#ifndef FILEX_RECORD_BUFFER_SIZE
+#define FILEX_RECORD_BUFFER_SIZE                (64 * 1024)         /* Must divide the AU size */
+#endif
+#ifndef FILEX_RECORD_FILES
+#define FILEX_RECORD_FILES                      2       /* Files recording at once per mount */
+#endif
+
+/* Argument of FILEX_IOCTL_RECORD; 0 takes the configured size.  */
+struct filex_record_mode
+{
+    rt_uint32_t au_size;
+    rt_uint32_t buffer_size;
+};
+
+typedef struct filex_record {
+    FX_FILE * file;         /* RT_NULL for a free slot */
+    UCHAR * buffer;
+    ULONG buffer_size;
+    ULONG used;             /* Bytes staged past the FileX offset */
+    ULONG au_size;
+    rt_bool_t allocated;    /* Clusters were allocated ahead */
+} filex_record_t;
+
+#endif /* FILEX_USING_RECORD */
+
+/* Ring log: a fixed size circular file, preallocated contiguous once, that
+   appends wrap around in without touching the FAT.  */
+#ifdef FILEX_USING_RING_LOG
+
+#ifndef FILEX_RING_FILES
+#define FILEX_RING_FILES                        2       /* Ring fds open at once per mount */
+#endif
+
+/* Argument of FILEX_IOCTL_RING, read only when the file is still empty.  */
+struct filex_ring_mode
+{
+    rt_uint32_t capacity;       /* Bytes, rounded up to whole clusters */
+    rt_uint32_t record_size;    /* Appends are whole records, 0 for bytes */
+};
+
+typedef struct filex_ring {
+    FX_FILE * file;         /* RT_NULL for a free slot */
+    UCHAR * sector;         /* Header and read-modify-write buffer */
+    ULONG base;             /* Logical sector of the header */
+    ULONG capacity;
+    ULONG record_size;
+    ULONG64 first;          /* Oldest byte held */
+    ULONG64 next;           /* Next byte appended */
+    ULONG64 read;           /* Read position of this fd */
+} filex_ring_t;
+
+#endif /* FILEX_USING_RING_LOG */
+
+/* Seek checkpoints: cluster pairs remembered along large files, so a seek
+   does not follow the chain from the first cluster.  */
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+
+#ifndef FILEX_SEEK_FILES
+#define FILEX_SEEK_FILES                        4       /* Open files mapped at once per mount */
+#endif
+#ifndef FILEX_SEEK_CHECKPOINTS
+#define FILEX_SEEK_CHECKPOINTS                  32      /* Per file, even */
+#endif
+
+typedef struct filex_seek_map {
+    FX_FILE * file;         /* RT_NULL for a free map */
+    rt_uint32_t stamp;      /* Last use */
+    ULONG interval;         /* Clusters covered by a slot */
+    ULONG relative[FILEX_SEEK_CHECKPOINTS];     /* 0 for an empty slot */
+    ULONG physical[FILEX_SEEK_CHECKPOINTS];
+} filex_seek_map_t;
+
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+
+/* Background check: fx_media_check done in bounded slices by a low
+   priority thread, FAT12/16/32 only.  A slice notices the media changed
+   under it by the FAT and directory entry write counts FileX keeps, so
+   this needs the FileX media statistics: leave FX_MEDIA_STATISTICS_DISABLE
+   undefined, which turns them on for every media, not only checked ones.  */
+#ifdef FILEX_USING_BACKGROUND_CHECK
+
+#ifdef FX_MEDIA_STATISTICS_DISABLE
+#error "FILEX_USING_BACKGROUND_CHECK needs the FileX media statistics, undefine FX_MEDIA_STATISTICS_DISABLE"
+#endif
+
+#ifndef FILEX_CHECK_SLICE
+#define FILEX_CHECK_SLICE                       5       /* Milliseconds of work per slice */
+#endif
+
+#ifndef FILEX_CHECK_INTERVAL
+#define FILEX_CHECK_INTERVAL                    20      /* Milliseconds between slices */
+#endif
+
+#ifndef FILEX_CHECK_BATCH
+#define FILEX_CHECK_BATCH                       64      /* FAT entries between looks at the clock */
+#endif
+
+#ifndef FILEX_CHECK_DEPTH
+#define FILEX_CHECK_DEPTH                       8       /* Directory levels followed */
+#endif
+
+#ifndef FILEX_CHECK_THREAD_PRIORITY
+#define FILEX_CHECK_THREAD_PRIORITY             (RT_THREAD_PRIORITY_MAX - 2)
+#endif
+
+#ifndef FILEX_CHECK_THREAD_STACK_SIZE
+#define FILEX_CHECK_THREAD_STACK_SIZE           2048
+#endif
+
+#define FILEX_CHECK_REPAIR                      0x01    /* Cut bad chains and free lost clusters */
+
+#define FILEX_CHECK_IDLE                        0
+#define FILEX_CHECK_ROOTS                       1       /* Root, open file and queued delete chains */
+#define FILEX_CHECK_TREE                        2
+#define FILEX_CHECK_LOST                        3
+#define FILEX_CHECK_DONE                        4
+
+struct filex_check_progress
+{
+    rt_uint32_t phase;
+    rt_uint32_t result;             /* FileX status once done */
+    rt_uint32_t clusters;           /* Followed so far */
+    rt_uint32_t total_clusters;
+    rt_uint32_t scanned;            /* FAT entries looked at for lost clusters */
+    rt_uint32_t files;
+    rt_uint32_t directories;
+    rt_uint32_t errors;
+    rt_uint32_t lost;
+    rt_uint32_t repaired;
+    rt_uint32_t restarts;           /* Started over after foreground writes */
+    rt_uint32_t slices;
+};
+
+typedef struct filex_check_level {
+    FX_DIR_ENTRY dir;
+    ULONG index;            /* Next entry to read */
+} filex_check_level_t;
+
+typedef struct filex_check {
+    rt_uint8_t * map;       /* Bit per cluster followed */
+    rt_uint32_t flags;
+    ULONG fat_writes;       /* FileX write counters after the last slice */
+    ULONG dir_writes;
+    rt_bool_t incomplete;   /* Part of the tree was not read, nothing is freed */
+    ULONG root;             /* Next chain of the roots phase */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    rt_bool_t log_done;     /* Fault tolerant log followed */
+#endif
+    ULONG cluster;          /* Next link of the chain followed, 0 for none; lost scan cursor */
+    ULONG count;
+    rt_bool_t repairable;
+    FX_DIR_ENTRY entry;     /* Owner of the chain followed */
+    CHAR name[FX_MAX_LONG_NAME_LEN];
+    int depth;              /* Levels on the stack, the root is the first */
+    filex_check_level_t levels[FILEX_CHECK_DEPTH];
+} filex_check_t;
+
+#endif /* FILEX_USING_BACKGROUND_CHECK */
+
+/* Online defragmenter: queued files are moved onto one contiguous cluster
+   run by a low priority thread, a bounded step at a time.  */
+#ifdef FILEX_USING_DEFRAG
+
+#ifndef FILEX_DEFRAG_QUEUE_SIZE
+#define FILEX_DEFRAG_QUEUE_SIZE                 4       /* Files waiting per media */
+#endif
+
+#ifndef FILEX_DEFRAG_PATH_MAX
+#define FILEX_DEFRAG_PATH_MAX                   64
+#endif
+
+#ifndef FILEX_DEFRAG_STEP
+#define FILEX_DEFRAG_STEP                       64      /* Clusters linked, copied or freed per step */
+#endif
+
+#ifndef FILEX_DEFRAG_INTERVAL
+#define FILEX_DEFRAG_INTERVAL                   20      /* Milliseconds between steps */
+#endif
+
+#ifndef FILEX_DEFRAG_THREAD_PRIORITY
+#define FILEX_DEFRAG_THREAD_PRIORITY            (RT_THREAD_PRIORITY_MAX - 2)
+#endif
+
+#ifndef FILEX_DEFRAG_THREAD_STACK_SIZE
+#define FILEX_DEFRAG_THREAD_STACK_SIZE          2048
+#endif
+
+#define FILEX_DEFRAG_MEASURE                    0
+#define FILEX_DEFRAG_SEARCH                     1       /* Looking for a free run */
+#define FILEX_DEFRAG_ALLOCATE                   2
+#define FILEX_DEFRAG_COPY                       3
+#define FILEX_DEFRAG_SWITCH                     4       /* Directory entry to the new run */
+#define FILEX_DEFRAG_RELEASE                    5       /* Freeing the old chain, or an abandoned run */
+#define FILEX_DEFRAG_DONE                       6
+
+struct filex_defrag_stats
+{
+    rt_uint32_t files;              /* Moved onto one run */
+    rt_uint32_t clusters_moved;
+    rt_uint32_t fragments_before;   /* Summed over the files moved */
+    rt_uint32_t fragments_after;
+    rt_uint32_t aborted;            /* Changed, removed or failed part way */
+    rt_uint32_t no_space;           /* No free run long enough */
+};
+
+/* Layout of a file's cluster chain.  */
+struct filex_fragments
+{
+    rt_uint32_t clusters;
+    rt_uint32_t fragments;          /* Contiguous runs, 1 for an unfragmented file */
+};
+
+typedef struct filex_defrag_job {
+    CHAR path[FILEX_DEFRAG_PATH_MAX];
+    int state;
+    rt_bool_t cancel;       /* Opened for writing since queued */
+    ULONG first;            /* First cluster when measured */
+    ULONG clusters;
+    ULONG fragments;
+    ULONG run;              /* First cluster of the new run */
+    ULONG linked;           /* Clusters of the run in its chain */
+    ULONG cursor;           /* Search position, or clusters copied */
+    ULONG old;              /* Next cluster of the chain copied or freed */
+    UCHAR * buffer;         /* One sector */
+} filex_defrag_job_t;
+
+#endif /* FILEX_USING_DEFRAG */
+
+/* File copy: FILEX_IOCTL_COPY moves data between two open files through a
+   driver side buffer, optionally on a worker thread.  */
+#ifdef FILEX_USING_COPY
+
+#ifndef FILEX_COPY_BUFFER_SIZE
+#define FILEX_COPY_BUFFER_SIZE                  (32 * 1024)     /* Bytes moved per filex_lock hold */
+#endif
+
+#ifndef FILEX_COPY_THREAD_PRIORITY
+#define FILEX_COPY_THREAD_PRIORITY              (RT_THREAD_PRIORITY_MAX - 3)
+#endif
+
+#ifndef FILEX_COPY_THREAD_STACK_SIZE
+#define FILEX_COPY_THREAD_STACK_SIZE            2048
+#endif
+
+struct filex_copy
+{
+    int source;                 /* Regular filex fd to copy from, at its position */
+    rt_uint64_t size;           /* Bytes to copy, 0 for up to the end of the source */
+    rt_sem_t done;              /* Released when an asynchronous copy ends, RT_NULL to wait */
+    rt_uint32_t status;         /* Out: FileX status */
+    rt_uint64_t copied;         /* Out: bytes copied */
+};
+
+#endif /* FILEX_USING_COPY */
+
+/* Striped volume: a block device spread over several member devices in
+   fixed size stripes, each member served by its own worker thread.  */
+#ifdef FILEX_USING_STRIPE
+
+#ifndef FILEX_STRIPE_MEMBERS
+#define FILEX_STRIPE_MEMBERS                    4       /* Devices per stripe set at most */
+#endif
+
+#ifndef FILEX_STRIPE_THREAD_PRIORITY
+#define FILEX_STRIPE_THREAD_PRIORITY            (RT_THREAD_PRIORITY_MAX / 3)
+#endif
+
+#ifndef FILEX_STRIPE_THREAD_STACK_SIZE
+#define FILEX_STRIPE_THREAD_STACK_SIZE          1024
+#endif
+
+#endif /* FILEX_USING_STRIPE */
+
+/* I/O classes: filex_lock goes to the highest class waiting, long reads
+   and writes are sliced, and classes can be held to a rate.  */
+#ifdef FILEX_USING_QOS
+
+#ifndef RT_USING_HOOK
+#error "FILEX_USING_QOS needs RT_USING_HOOK to drop exited threads from its table"
+#endif
+
+#ifndef FILEX_QOS_SLICE
+#define FILEX_QOS_SLICE                         (16 * 1024)     /* Bytes per hold of filex_lock */
+#endif
+
+#ifndef FILEX_QOS_THREADS
+#define FILEX_QOS_THREADS                       8       /* Threads not in the normal class */
+#endif
+
+#define FILEX_QOS_REALTIME                      0
+#define FILEX_QOS_NORMAL                        1
+#define FILEX_QOS_BACKGROUND                    2
+#define FILEX_QOS_CLASSES                       3
+
+struct filex_qos_stats
+{
+    rt_uint64_t bytes;              /* Read and written */
+    rt_uint32_t waits;              /* Times filex_lock was busy */
+    rt_uint32_t wait_ticks;         /* Spent waiting for it */
+    rt_uint32_t wait_max;
+    rt_uint32_t throttled_ticks;    /* Spent waiting for the rate limit */
+};
+
+#endif /* FILEX_USING_QOS */
+
+/* Workload trace: DFS calls and FileX driver requests are recorded in a
+   RAM ring that can be read out or dumped and replayed off target.  */
+#ifdef FILEX_USING_TRACE
+
+#ifndef FILEX_TRACE_RECORDS
+#define FILEX_TRACE_RECORDS                     512     /* Ring size, a power of 2 */
+#endif
+
+#ifndef FILEX_TRACE_DEFAULT_ON
+#define FILEX_TRACE_DEFAULT_ON                  0       /* Record from boot, not from filex_trace on */
+#endif
+
+/* A cycle counter may stand in for the tick, with its rate.  */
+#ifndef FILEX_TRACE_CLOCK
+#define FILEX_TRACE_CLOCK()                     rt_tick_get()
+#endif
+
+#ifndef FILEX_TRACE_CLOCK_HZ
+#define FILEX_TRACE_CLOCK_HZ                    RT_TICK_PER_SECOND
+#endif
+
+#define FILEX_TRACE_MAGIC                       0x52545846      /* "FXTR" */
+#define FILEX_TRACE_VERSION                     2       /* 2: 64-bit offset, 32 byte records */
+
+#define FILEX_TRACE_OPEN                        1
+#define FILEX_TRACE_CLOSE                       2
+#define FILEX_TRACE_READ                        3
+#define FILEX_TRACE_WRITE                       4
+#define FILEX_TRACE_FLUSH                       5
+#define FILEX_TRACE_LSEEK                       6
+#define FILEX_TRACE_GETDENTS                    7
+#define FILEX_TRACE_UNLINK                      8
+#define FILEX_TRACE_STAT                        9
+#define FILEX_TRACE_RENAME                      10
+#define FILEX_TRACE_DRIVER                      0x80    /* Plus the FX_DRIVER_ request */
+
+struct filex_trace_record
+{
+    rt_uint64_t offset;         /* Position; logical sector; hash of the new name for rename */
+    rt_uint32_t start;          /* FILEX_TRACE_CLOCK at entry */
+    rt_uint32_t duration;       /* FILEX_TRACE_CLOCK units */
+    rt_uint32_t hash;           /* Path in the file system, media name for driver requests */
+    rt_uint32_t length;         /* Bytes asked; sectors; flags for open */
+    rt_uint16_t thread;         /* Tells the calling threads apart */
+    rt_uint8_t op;              /* FILEX_TRACE_ */
+    rt_uint8_t status;          /* 0, errno of a DFS call, FileX status of a driver request */
+    rt_uint32_t reserved;       /* 0, the same size on every ABI */
+};
+
+/* A dump is the header followed by count records, oldest first.  */
+struct filex_trace_header
+{
+    rt_uint32_t magic;
+    rt_uint16_t version;
+    rt_uint16_t record_size;
+    rt_uint32_t clock_hz;
+    rt_uint32_t count;
+    rt_uint32_t lost;           /* Overwritten before the first record */
+};
+
+struct filex_trace_read
+{
+    rt_uint32_t sequence;       /* In: first record wanted, out: the one after the last copied */
+    rt_uint32_t count;          /* In: room in records, out: records copied */
+    rt_uint32_t lost;           /* Out: overwritten since sequence */
+    struct filex_trace_record * records;
+};
+
+#endif /* FILEX_USING_TRACE */
+
+/* Free slot tracking rides on the directory index scan.  */
+#if defined(FILEX_USING_DIR_FREE_SLOTS) && !defined(FILEX_USING_DIR_INDEX)
+#define FILEX_USING_DIR_INDEX
+#endif
+
+/* Directory index: in-RAM hash of case-folded long and short names per
+   directory, built on first lookup and bounded by a per media budget.  */
+#ifdef FILEX_USING_DIR_INDEX
+
+#ifndef FILEX_DIR_INDEX_MEMORY_SIZE
+#define FILEX_DIR_INDEX_MEMORY_SIZE             (64 * 1024)     /* Bytes per media */
+#endif
+
+typedef struct filex_index_slot {
+    ULONG hash;             /* Name hash, 0 for an empty slot */
+    ULONG entry;            /* First directory entry number of the name */
+} filex_index_slot_t;
+
+typedef struct filex_dir_index {
+    rt_list_t list;         /* Most recently used first */
+    ULONG cluster;          /* First cluster of the directory, 0 for the root */
+    ULONG size;             /* Slots, power of 2, 0 when over budget */
+    ULONG used;
+    filex_index_slot_t * slots;
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+    ULONG end;              /* First entry past the last one ever used */
+    ULONG first_free;       /* No deleted entry below this one */
+    ULONG deleted;          /* Deleted entries below end */
+    ULONG walk_index;       /* Last directory cluster looked up, by position */
+    ULONG walk_cluster;
+    rt_bool_t complete;     /* Every name in the directory is in the slots */
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+} filex_dir_index_t;
+
+/* An entry about to be deleted or renamed, taken before FileX changes it.  */
+typedef struct filex_dir_index_removal {
+    ULONG hash;             /* Long name hash, 0 when the index does not hold it */
+    ULONG short_hash;       /* 0 without a separate short name */
+    ULONG cluster;          /* Directory holding the entry */
+    ULONG start;            /* First entry number of the name */
+    ULONG last;             /* Entry number of the name itself */
+    ULONG directory;        /* First cluster of a directory entry, 0 for a file */
+} filex_dir_index_removal_t;
+
+#endif /* FILEX_USING_DIR_INDEX */
+
+/* Readdir plus: directory listing that carries the stat data of every
+   entry, and a recursive walker on top of it.  */
+#ifdef FILEX_USING_READDIR_PLUS
+
+#ifndef FILEX_WALK_BATCH
+#define FILEX_WALK_BATCH                        8       /* Entries fetched per ioctl while walking */
+#endif
+
+struct filex_dirent_plus
+{
+    rt_uint64_t size;
+    rt_uint32_t cluster;        /* First cluster, 0 for an empty file */
+    rt_uint16_t attributes;     /* FX_READ_ONLY, FX_DIRECTORY, ... */
+    rt_uint16_t modified_date;  /* Dates and times in FAT encoding */
+    rt_uint16_t modified_time;
+    rt_uint16_t created_date;
+    rt_uint16_t created_time;
+    rt_uint16_t accessed_date;
+    char name[FX_MAX_LONG_NAME_LEN];
+};
+
+struct filex_readdir_plus
+{
+    struct filex_dirent_plus * entries;
+    rt_uint32_t count;          /* Room for in, filled out, 0 at the end */
+};
+
+typedef int (*filex_walk_t)(const char * path, const struct filex_dirent_plus * entry, void * parameter);
+
+#endif /* FILEX_USING_READDIR_PLUS */
+
+typedef struct filex_media {
+    rt_list_t list;
+    FX_MEDIA media;
+    unsigned char media_memory[FLIEX_MEDIA_MEMORY_SIZE];
+    rt_bool_t read_only;    /* Mounted with MS_RDONLY */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    unsigned char * fault_tolerant_memory;  /* Allocated at mount */
+    rt_size_t fault_tolerant_size;
+#endif
+#ifdef FILEX_USING_DEFERRED_DELETE
+    filex_deferred_chain_t deferred[FILEX_DEFERRED_DELETE_QUEUE_SIZE];
+    rt_uint32_t deferred_count;
+#endif
+#ifdef FILEX_USING_DIR_INDEX
+    rt_list_t dir_index_list;
+    rt_size_t dir_index_memory;
+    FX_DIR_ENTRY index_dir;
+    UINT index_dir_valid;
+    CHAR index_dir_name[FX_MAX_LONG_NAME_LEN];
+    CHAR index_name[FX_MAX_LONG_NAME_LEN];
+#endif
+#ifdef FILEX_USING_GROUP_COMMIT
+    rt_uint32_t group_ops;
+    rt_bool_t group_open;
+    ULONG group_mark_size;          /* Log as the current operation began */
+    ULONG group_mark_logs;
+    ULONG group_mark_clusters;
+#endif
+#ifdef FILEX_USING_EXFAT_HASH
+    FX_DIR_ENTRY exfat_dir;
+    CHAR exfat_dir_name[FX_MAX_LONG_NAME_LEN];
+    CHAR exfat_name[FX_MAX_LONG_NAME_LEN];
+#endif
+#ifdef FILEX_USING_IO_SCHED
+    filex_io_sched_t io_sched;
+#endif
+#ifdef FILEX_USING_SECTOR_CACHE
+    filex_sector_cache_t sector_cache;
+#endif
+#ifdef FILEX_USING_FAT_MIRROR
+    filex_mirror_range_t fat_mirror[FILEX_FAT_MIRROR_RANGES];
+#endif
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+    rt_uint8_t * secondary_map;     /* Dirty bit per group of primary FAT sectors, RT_NULL when off */
+    UCHAR * secondary_buffer;
+    ULONG secondary_map_sectors;
+    rt_bool_t secondary_dirty;
+#endif
+#ifdef FILEX_USING_HANDLE_CACHE
+    filex_handle_t handles[FILEX_HANDLE_CACHE_SIZE];
+    rt_uint32_t handle_clock;
+    rt_uint32_t handle_hits;
+    rt_uint32_t handle_misses;
+#endif
+#ifdef FILEX_USING_CONCURRENT_READ
+    filex_read_stripe_t read_cache[FILEX_READ_CACHE_STRIPES];
+#endif
+#ifdef FILEX_USING_BLOCK_MAP
+    filex_block_map_t block_map;
+#endif
+#ifdef FILEX_USING_RECORD
+    filex_record_t records[FILEX_RECORD_FILES];
+#endif
+#ifdef FILEX_USING_RING_LOG
+    filex_ring_t rings[FILEX_RING_FILES];
+#endif
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+    filex_seek_map_t seek_maps[FILEX_SEEK_FILES];
+    rt_uint32_t seek_clock;
+#endif
+#ifdef FILEX_USING_BACKGROUND_CHECK
+    filex_check_t * check;          /* RT_NULL when no check runs */
+    struct filex_check_progress check_progress;
+#endif
+#ifdef FILEX_USING_CACHE_WARMUP
+    rt_uint32_t warmup_sectors;     /* Read in at mount */
+    rt_uint32_t warmup_reads;
+#endif
+#ifdef FILEX_USING_DEFRAG
+    filex_defrag_job_t defrag[FILEX_DEFRAG_QUEUE_SIZE];    /* Head is the one in progress */
+    ULONG defrag_count;
+    struct filex_defrag_stats defrag_stats;
+#endif
+} filex_media_t;
+
+typedef struct filex_dir {
+    FX_DIR_ENTRY entry;
+    char name_buffer[FX_MAX_LONG_NAME_LEN];
+    int is_root;
+    FX_MEDIA * media;
+} filex_dir_t;
+
+/* ioctl commands understood by the filex file operations.  */
+#define FILEX_IOCTL(n)                          (0x46580000 | (n))
+#define FILEX_IOCTL_DIR_COMPACT                 FILEX_IOCTL(1)      /* Directory fd, no argument */
+#define FILEX_IOCTL_DIR_READ_PLUS               FILEX_IOCTL(2)      /* Directory fd, struct filex_readdir_plus * */
+#define FILEX_IOCTL_CACHE_STATS                 FILEX_IOCTL(3)      /* Any fd, struct filex_cache_stats * */
+#define FILEX_IOCTL_RECORD                      FILEX_IOCTL(4)      /* File fd open for writing, struct filex_record_mode * or RT_NULL */
+#define FILEX_IOCTL_RING                        FILEX_IOCTL(5)      /* File fd, struct filex_ring_mode * or RT_NULL */
+#define FILEX_IOCTL_SEEK64                      FILEX_IOCTL(6)      /* File fd, struct filex_seek64 * */
+#define FILEX_IOCTL_CHECK_START                 FILEX_IOCTL(7)      /* Any fd, rt_uint32_t * FILEX_CHECK_ flags */
+#define FILEX_IOCTL_CHECK_PROGRESS              FILEX_IOCTL(8)      /* Any fd, struct filex_check_progress * */
+#define FILEX_IOCTL_DEFRAG                      FILEX_IOCTL(9)      /* File fd, no argument */
+#define FILEX_IOCTL_FRAGMENTS                   FILEX_IOCTL(10)     /* File fd, struct filex_fragments * */
+#define FILEX_IOCTL_DEFRAG_STATS                FILEX_IOCTL(11)     /* Any fd, struct filex_defrag_stats * */
+#define FILEX_IOCTL_COPY                        FILEX_IOCTL(12)     /* File fd open for writing, struct filex_copy * */
+#define FILEX_IOCTL_WARMUP_SAVE                 FILEX_IOCTL(13)     /* Any fd, no argument */
+#define FILEX_IOCTL_QOS_CLASS                   FILEX_IOCTL(14)     /* Any fd, int * FILEX_QOS_ class of the calling thread */
+#define FILEX_IOCTL_TRACE_READ                  FILEX_IOCTL(15)     /* Any fd, struct filex_trace_read * */
+
+/* lseek for positions an off_t cannot hold, such as past 4 GB on exFAT.  */
+struct filex_seek64
+{
+    rt_int64_t offset;
+    int whence;                 /* SEEK_SET, SEEK_CUR or SEEK_END */
+    rt_uint64_t position;       /* Out: the new position */
+};
+
+struct dfs_fd;
+
+extern rt_list_t filex_media_list;
+
+void filex_lock(void);
+void filex_unlock(void);
+void filex_search_cache_prime(FX_MEDIA * media, CHAR * path, FX_DIR_ENTRY * entry, FX_DIR_ENTRY * directory);
+void filex_fd_update(struct dfs_fd * file);
+
+#ifdef FILEX_USING_DEFERRED_DELETE
+int  filex_deferred_delete_init(void);
+UINT filex_deferred_delete(filex_media_t * filex_media, CHAR * path);
+void filex_deferred_delete_load(filex_media_t * filex_media);
+#endif /* FILEX_USING_DEFERRED_DELETE */
+
+#ifdef FILEX_USING_DIR_INDEX
+void filex_dir_index_reset(filex_media_t * filex_media);
+UINT filex_dir_index_search(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry);
+void filex_dir_index_add(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry);
+void filex_dir_index_locate(filex_media_t * filex_media, CHAR * path, filex_dir_index_removal_t * removal);
+void filex_dir_index_remove(filex_media_t * filex_media, filex_dir_index_removal_t * removal);
+void filex_dir_index_forget(filex_media_t * filex_media, CHAR * path);
+#endif /* FILEX_USING_DIR_INDEX */
+
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+UINT filex_dir_index_create(filex_media_t * filex_media, CHAR * path);
+UINT filex_dir_index_compact(filex_media_t * filex_media, FX_DIR_ENTRY * directory);
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+
+#ifdef FILEX_USING_GROUP_COMMIT
+int  filex_group_commit_init(void);
+void filex_group_begin(filex_media_t * filex_media);
+void filex_group_end(filex_media_t * filex_media, UINT result);
+UINT filex_group_commit(filex_media_t * filex_media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+
+#ifdef FILEX_USING_EXFAT_HASH
+UINT filex_exfat_search(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry);
+#endif /* FILEX_USING_EXFAT_HASH */
+
+#ifdef FILEX_USING_READDIR_PLUS
+int  filex_walk(const char * path, filex_walk_t walker, void * parameter);
+#endif /* FILEX_USING_READDIR_PLUS */
+
+#ifdef FILEX_USING_IO_SCHED
+int    filex_io_sched_init(void);
+size_t filex_io_sched_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors);
+size_t filex_io_sched_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors);
+UINT   filex_io_sched_flush(FX_MEDIA * media);
+void   filex_io_sched_abort(FX_MEDIA * media);
+UINT   filex_io_sched_uninit(FX_MEDIA * media);
+#endif /* FILEX_USING_IO_SCHED */
+
+#ifdef FILEX_USING_SECTOR_CACHE
+size_t filex_cache_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors);
+size_t filex_cache_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors);
+void   filex_cache_insert(FX_MEDIA * media, int partition, ULONG sector, const UCHAR * buffer);
+void   filex_cache_invalidate(FX_MEDIA * media);
+void   filex_cache_uninit(FX_MEDIA * media);
+void   filex_cache_stats_get(FX_MEDIA * media, struct filex_cache_stats * stats);
+ULONG  filex_cache_sectors_get(FX_MEDIA * media, int partition, ULONG * sectors, ULONG max);
+#endif /* FILEX_USING_SECTOR_CACHE */
+
+#ifdef FILEX_USING_CACHE_WARMUP
+UINT filex_warmup_save(filex_media_t * filex_media);
+void filex_warmup_load(filex_media_t * filex_media);
+#endif /* FILEX_USING_CACHE_WARMUP */
+
+#ifdef FILEX_USING_FAT_MIRROR
+UINT   filex_fat_mirror_load(filex_media_t * filex_media);
+size_t filex_fat_mirror_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors);
+size_t filex_fat_mirror_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors);
+UINT   filex_fat_mirror_flush(FX_MEDIA * media);
+void   filex_fat_mirror_release(FX_MEDIA * media);
+#endif /* FILEX_USING_FAT_MIRROR */
+
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+UINT   filex_secondary_fat_init(filex_media_t * filex_media, rt_uint32_t map_sectors);
+size_t filex_secondary_fat_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors);
+size_t filex_secondary_fat_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors);
+UINT   filex_secondary_fat_flush(FX_MEDIA * media);
+void   filex_secondary_fat_release(FX_MEDIA * media);
+#endif /* FILEX_USING_LAZY_SECONDARY_FAT */
+
+#ifdef FILEX_USING_HANDLE_CACHE
+FX_FILE * filex_handle_take(filex_media_t * filex_media, const char * path, UINT open_type);
+rt_bool_t filex_handle_put(filex_media_t * filex_media, const char * path, FX_FILE * file);
+void      filex_handle_evict(filex_media_t * filex_media, const char * path);
+void      filex_handle_release(filex_media_t * filex_media);
+#endif /* FILEX_USING_HANDLE_CACHE */
+
+#ifdef FILEX_USING_CONCURRENT_READ
+UINT filex_read_cache_init(filex_media_t * filex_media);
+void filex_read_cache_release(filex_media_t * filex_media);
+UINT filex_concurrent_read(FX_FILE * file, ULONG64 offset, UCHAR * buffer, ULONG size, ULONG * actual);
+#endif /* FILEX_USING_CONCURRENT_READ */
+
+#ifdef FILEX_USING_BLOCK_MAP
+size_t filex_block_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors);
+size_t filex_block_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors);
+UINT   filex_block_flush(FX_MEDIA * media);
+void   filex_block_abort(FX_MEDIA * media);
+UINT   filex_block_uninit(FX_MEDIA * media);
+UINT   filex_block_boot_read(FX_MEDIA * media, UCHAR * buffer);
+UINT   filex_block_boot_write(FX_MEDIA * media, const UCHAR * buffer);
+#endif /* FILEX_USING_BLOCK_MAP */
+
+#ifdef FILEX_USING_RECORD
+UINT      filex_record_start(FX_FILE * file, const struct filex_record_mode * mode);
+rt_bool_t filex_record_active(FX_FILE * file);
+ULONG     filex_record_staged(FX_FILE * file);
+UINT      filex_record_write(FX_FILE * file, const UCHAR * buffer, ULONG size);
+UINT      filex_record_sync(FX_FILE * file);
+UINT      filex_record_stop(FX_FILE * file);
+#endif /* FILEX_USING_RECORD */
+
+#ifdef FILEX_USING_RING_LOG
+UINT      filex_ring_attach(FX_FILE * file, const struct filex_ring_mode * mode);
+void      filex_ring_detach(FX_FILE * file);
+rt_bool_t filex_ring_active(FX_FILE * file);
+UINT      filex_ring_append(FX_FILE * file, const UCHAR * buffer, ULONG size);
+UINT      filex_ring_read(FX_FILE * file, UCHAR * buffer, ULONG size, ULONG * actual);
+ULONG     filex_ring_tell(FX_FILE * file);
+ULONG     filex_ring_seek(FX_FILE * file, ULONG offset);
+ULONG     filex_ring_used(FX_FILE * file);
+#endif /* FILEX_USING_RING_LOG */
+
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+void filex_seek_note(FX_FILE * file);
+void filex_seek_prepare(FX_FILE * file, ULONG64 offset);
+void filex_seek_forget(FX_FILE * file);
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+
+#ifdef FILEX_USING_BACKGROUND_CHECK
+int  filex_check_init(void);
+UINT filex_check_start(filex_media_t * filex_media, rt_uint32_t flags);
+void filex_check_stop(filex_media_t * filex_media);
+void filex_check_progress_get(filex_media_t * filex_media, struct filex_check_progress * progress);
+#endif /* FILEX_USING_BACKGROUND_CHECK */
+
+#ifdef FILEX_USING_DEFRAG
+int  filex_defrag_init(void);
+UINT filex_defrag_queue(filex_media_t * filex_media, const CHAR * path);
+void filex_defrag_cancel(filex_media_t * filex_media, const CHAR * path);
+void filex_defrag_release(filex_media_t * filex_media);
+UINT filex_defrag_measure(FX_MEDIA * media, ULONG cluster, ULONG * clusters, ULONG * fragments);
+ULONG filex_defrag_orphan(filex_media_t * filex_media, ULONG index);
+#endif /* FILEX_USING_DEFRAG */
+
+#ifdef FILEX_USING_COPY
+int  filex_copy_init(void);
+UINT filex_copy_start(struct dfs_fd * target, struct filex_copy * copy);
+void filex_copy_cancel(struct dfs_fd * fd);
+#endif /* FILEX_USING_COPY */
+
+#ifdef FILEX_USING_STRIPE
+rt_err_t filex_stripe_create(const char * name, const char * const * members, int count, rt_uint32_t stripe_sectors);
+#endif /* FILEX_USING_STRIPE */
+
+#ifdef FILEX_USING_QOS
+int  filex_qos_init(void);
+void filex_qos_admit(rt_size_t size);
+UINT filex_qos_set(rt_thread_t thread, int qos_class);
+UINT filex_qos_limit(int qos_class, rt_uint32_t rate, rt_uint32_t burst);
+void filex_qos_stats_get(int qos_class, struct filex_qos_stats * stats);
+#endif /* FILEX_USING_QOS */
+
+#ifdef FILEX_USING_TRACE
+void filex_trace_enable(rt_bool_t enable);
+rt_uint32_t filex_trace_hash(const char * path);
+void filex_trace_add(rt_uint8_t op, const char * path, rt_uint64_t offset, rt_uint32_t length, rt_uint32_t start,
+                     rt_uint8_t status);
+void filex_trace_read(struct filex_trace_read * request);
+#endif /* FILEX_USING_TRACE */
+
+/* Blocks come back zeroed, as from calloc.  */
+#ifdef FILEX_USING_MEMPOOL
+int    filex_pool_init(void);
+void * filex_pool_alloc(int pool, rt_size_t size);
+void   filex_pool_free(int pool, void * block);
+void   filex_pool_stats_get(int pool, struct filex_pool_stats * stats);
+#else
+#define filex_pool_alloc(pool, size)            calloc(size, 1)
+#define filex_pool_free(pool, block)            free(block)
+#endif /* FILEX_USING_MEMPOOL */
+
+#endif /* __DFS_FILEX_H__ */
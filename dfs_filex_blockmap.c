@@ -0,0 +1,437 @@
+#include <rtthread.h>
+#include <rtdevice.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_BLOCK_MAP
+
+/* The bottom of the driver stack: FileX sectors smaller than the device
+   block are gathered in a one block buffer.  Writes to the same block merge
+   there and reach the device once; only a block that is left partly written
+   is read first.  Sectors the size of a block, or larger, pass through.  */
+
+#define FILEX_BLOCK_BOOT_SIZE                   512     /* Boot record FileX reads and writes */
+
+static filex_block_map_t * _filex_block_map(FX_MEDIA * media)
+{
+    return &rt_container_of(media, filex_media_t, media)->block_map;
+}
+
+static ULONG _filex_block_device_size(rt_device_t disk_dev)
+{
+    struct rt_device_blk_geometry geometry;
+
+    switch (disk_dev->type)
+    {
+#ifdef RT_MTD_NOR_DEVICE
+    case RT_Device_Class_MTD:
+        return RT_MTD_NOR_DEVICE(disk_dev)->block_size;
+#endif
+    case RT_Device_Class_Block:
+        rt_memset(&geometry, 0, sizeof(geometry));
+        if (rt_device_control(disk_dev, RT_DEVICE_CTRL_BLK_GETGEOME, &geometry) != RT_EOK)
+        {
+            return 0;
+        }
+        return geometry.bytes_per_sector;
+    default:
+        return 0;
+    }
+}
+
+/* Buffers are set up on first use, the sector size once FileX knows it.  */
+static rt_bool_t _filex_block_ready(FX_MEDIA * media, filex_block_map_t * map)
+{
+    if (map->buffer == RT_NULL)
+    {
+        map->block_size = _filex_block_device_size(media->fx_media_driver_info);
+        if (map->block_size == 0)
+        {
+            return RT_FALSE;
+        }
+        map->buffer = rt_malloc(2 * map->block_size);
+        if (map->buffer == RT_NULL)
+        {
+            return RT_FALSE;
+        }
+        map->scratch = map->buffer + map->block_size;
+        map->valid = 0;
+        map->dirty = 0;
+        map->sector_size = 0;
+        rt_mutex_init(&map->lock, "fxblock", RT_IPC_FLAG_PRIO);
+    }
+
+    if ((map->sector_size != media->fx_media_bytes_per_sector) && (media->fx_media_bytes_per_sector != 0))
+    {
+        if ((map->block_size % media->fx_media_bytes_per_sector) &&
+            (media->fx_media_bytes_per_sector % map->block_size))
+        {
+            return RT_FALSE;
+        }
+        if (map->block_size / media->fx_media_bytes_per_sector > 32)
+        {
+            return RT_FALSE;
+        }
+        map->sector_size = media->fx_media_bytes_per_sector;
+        map->valid = 0;
+        map->dirty = 0;
+    }
+    return map->sector_size != 0;
+}
+
+rt_inline ULONG _filex_block_sectors(filex_block_map_t * map)
+{
+    return map->block_size / map->sector_size;
+}
+
+rt_inline rt_uint32_t _filex_block_mask(ULONG first, ULONG count)
+{
+    return ((count >= 32) ? 0xFFFFFFFF : ((1UL << count) - 1)) << first;
+}
+
+/* Completes the buffered block from the device under the sectors it holds.  */
+static rt_bool_t _filex_block_fill(FX_MEDIA * media, filex_block_map_t * map)
+{
+    rt_uint32_t full = _filex_block_mask(0, _filex_block_sectors(map));
+    ULONG i;
+
+    if (map->valid == full)
+    {
+        return RT_TRUE;
+    }
+
+    map->device_reads++;
+    if (rt_disk_read(media->fx_media_driver_info, map->block, map->scratch, 1) != 1)
+    {
+        return RT_FALSE;
+    }
+    for (i = 0; i < _filex_block_sectors(map); i++)
+    {
+        if (!(map->valid & (1UL << i)))
+        {
+            rt_memcpy(map->buffer + i * map->sector_size, map->scratch + i * map->sector_size, map->sector_size);
+        }
+    }
+    map->valid = full;
+    return RT_TRUE;
+}
+
+static rt_bool_t _filex_block_writeback(FX_MEDIA * media, filex_block_map_t * map)
+{
+    if (map->dirty == 0)
+    {
+        return RT_TRUE;
+    }
+
+    if (map->valid != _filex_block_mask(0, _filex_block_sectors(map)))
+    {
+        map->rmw_reads++;
+    }
+    if (!_filex_block_fill(media, map))
+    {
+        return RT_FALSE;
+    }
+    map->device_writes++;
+    if (rt_disk_write(media->fx_media_driver_info, map->block, map->buffer, 1) != 1)
+    {
+        return RT_FALSE;
+    }
+    map->dirty = 0;
+    return RT_TRUE;
+}
+
+/* Makes block the buffered one, writing out the block it replaces.  */
+static rt_bool_t _filex_block_select(FX_MEDIA * media, filex_block_map_t * map, ULONG block)
+{
+    if ((map->valid != 0) && (map->block == block))
+    {
+        return RT_TRUE;
+    }
+    if (!_filex_block_writeback(media, map))
+    {
+        return RT_FALSE;
+    }
+    map->block = block;
+    map->valid = 0;
+    return RT_TRUE;
+}
+
+size_t filex_block_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors)
+{
+    filex_block_map_t * map = _filex_block_map(media);
+    ULONG per_block;
+    ULONG first;
+    ULONG run;
+    size_t total = sectors;
+
+    if (!_filex_block_ready(media, map))
+    {
+        return 0;
+    }
+    if (map->block_size <= map->sector_size)
+    {
+        per_block = map->sector_size / map->block_size;
+        return rt_disk_read(media->fx_media_driver_info, sector * per_block, buffer, sectors * per_block) / per_block;
+    }
+
+    per_block = _filex_block_sectors(map);
+    rt_mutex_take(&map->lock, RT_WAITING_FOREVER);
+    map->sector_reads += sectors;
+    while (sectors)
+    {
+        first = sector % per_block;
+        if ((first == 0) && (sectors >= per_block) &&
+            ((map->dirty == 0) || (map->block < sector / per_block) || (map->block >= (sector + sectors) / per_block)))
+        {
+            /* Whole blocks the buffer holds nothing newer for.  */
+            run = sectors - sectors % per_block;
+            map->device_reads++;
+            if (rt_disk_read(media->fx_media_driver_info, sector / per_block, buffer, run / per_block) != run / per_block)
+            {
+                total = 0;
+                break;
+            }
+        }
+        else
+        {
+            run = per_block - first;
+            if (run > sectors)
+            {
+                run = sectors;
+            }
+            if (!_filex_block_select(media, map, sector / per_block) || !_filex_block_fill(media, map))
+            {
+                total = 0;
+                break;
+            }
+            rt_memcpy(buffer, map->buffer + first * map->sector_size, run * map->sector_size);
+        }
+
+        sector += run;
+        sectors -= run;
+        buffer += run * map->sector_size;
+    }
+    rt_mutex_release(&map->lock);
+    return total;
+}
+
+size_t filex_block_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors)
+{
+    filex_block_map_t * map = _filex_block_map(media);
+    rt_bool_t barrier;
+    ULONG per_block;
+    ULONG first;
+    ULONG run;
+    size_t written = 0;
+
+    if (!_filex_block_ready(media, map))
+    {
+        return 0;
+    }
+    if (map->block_size <= map->sector_size)
+    {
+        per_block = map->sector_size / map->block_size;
+        return rt_disk_write(media->fx_media_driver_info, sector * per_block, buffer, sectors * per_block) / per_block;
+    }
+
+    per_block = _filex_block_sectors(map);
+    rt_mutex_take(&map->lock, RT_WAITING_FOREVER);
+    map->sector_writes += sectors;
+
+    /* The fault tolerant log reaches the device in order with the rest.  */
+    barrier = rt_fx_disk_log_sector(media, sector, sectors);
+    if (barrier && !_filex_block_writeback(media, map))
+    {
+        rt_mutex_release(&map->lock);
+        return 0;
+    }
+
+    while (sectors)
+    {
+        first = sector % per_block;
+        if ((first == 0) && (sectors >= per_block))
+        {
+            run = sectors - sectors % per_block;
+            if ((map->valid != 0) && (map->block >= sector / per_block) && (map->block < (sector + run) / per_block))
+            {
+                /* Superseded as a whole.  */
+                map->valid = 0;
+                map->dirty = 0;
+            }
+            map->device_writes++;
+            if (rt_disk_write(media->fx_media_driver_info, sector / per_block, buffer, run / per_block) != run / per_block)
+            {
+                break;
+            }
+        }
+        else
+        {
+            run = per_block - first;
+            if (run > sectors)
+            {
+                run = sectors;
+            }
+            if (!_filex_block_select(media, map, sector / per_block))
+            {
+                break;
+            }
+            rt_memcpy(map->buffer + first * map->sector_size, buffer, run * map->sector_size);
+            map->valid |= _filex_block_mask(first, run);
+            map->dirty |= _filex_block_mask(first, run);
+
+            /* A block filled by consecutive writes goes out without a read.  */
+            if ((map->dirty == _filex_block_mask(0, per_block)) && !_filex_block_writeback(media, map))
+            {
+                break;
+            }
+        }
+
+        written += run;
+        sector += run;
+        sectors -= run;
+        buffer += run * map->sector_size;
+    }
+
+    if (barrier && (sectors == 0) && !_filex_block_writeback(media, map))
+    {
+        written = 0;
+    }
+    rt_mutex_release(&map->lock);
+    return written;
+}
+
+UINT filex_block_flush(FX_MEDIA * media)
+{
+    filex_block_map_t * map = _filex_block_map(media);
+    UINT result = FX_SUCCESS;
+
+    if (map->buffer == RT_NULL)
+    {
+        return FX_SUCCESS;
+    }
+    rt_mutex_take(&map->lock, RT_WAITING_FOREVER);
+    if (!_filex_block_writeback(media, map))
+    {
+        result = FX_IO_ERROR;
+    }
+    rt_mutex_release(&map->lock);
+    return result;
+}
+
+/* Drops the buffered block, written or not.  */
+void filex_block_abort(FX_MEDIA * media)
+{
+    filex_block_map_t * map = _filex_block_map(media);
+
+    map->valid = 0;
+    map->dirty = 0;
+}
+
+UINT filex_block_uninit(FX_MEDIA * media)
+{
+    filex_block_map_t * map = _filex_block_map(media);
+    UINT result;
+
+    result = filex_block_flush(media);
+    if (map->buffer != RT_NULL)
+    {
+        rt_mutex_detach(&map->lock);
+        rt_free(map->buffer);
+        map->buffer = RT_NULL;
+        map->scratch = RT_NULL;
+    }
+    return result;
+}
+
+/* The boot record is read and written before FileX knows the sector size:
+   it is the first FILEX_BLOCK_BOOT_SIZE bytes of block 0.  */
+UINT filex_block_boot_read(FX_MEDIA * media, UCHAR * buffer)
+{
+    filex_block_map_t * map = _filex_block_map(media);
+    UINT result = FX_SUCCESS;
+
+    _filex_block_ready(media, map);
+    if ((map->buffer == RT_NULL) || (map->block_size <= FILEX_BLOCK_BOOT_SIZE))
+    {
+        return (rt_disk_read(media->fx_media_driver_info, 0, buffer, 1) == 1) ? FX_SUCCESS : FX_IO_ERROR;
+    }
+
+    rt_mutex_take(&map->lock, RT_WAITING_FOREVER);
+    if (!_filex_block_writeback(media, map) ||
+        (rt_disk_read(media->fx_media_driver_info, 0, map->scratch, 1) != 1))
+    {
+        result = FX_IO_ERROR;
+    }
+    else
+    {
+        rt_memcpy(buffer, map->scratch, FILEX_BLOCK_BOOT_SIZE);
+    }
+    rt_mutex_release(&map->lock);
+    return result;
+}
+
+UINT filex_block_boot_write(FX_MEDIA * media, const UCHAR * buffer)
+{
+    filex_block_map_t * map = _filex_block_map(media);
+    UINT result = FX_SUCCESS;
+
+    _filex_block_ready(media, map);
+    if ((map->buffer == RT_NULL) || (map->block_size <= FILEX_BLOCK_BOOT_SIZE))
+    {
+        return (rt_disk_write(media->fx_media_driver_info, 0, buffer, 1) == 1) ? FX_SUCCESS : FX_IO_ERROR;
+    }
+
+    rt_mutex_take(&map->lock, RT_WAITING_FOREVER);
+    if (!_filex_block_writeback(media, map) ||
+        (rt_disk_read(media->fx_media_driver_info, 0, map->scratch, 1) != 1))
+    {
+        result = FX_IO_ERROR;
+    }
+    else
+    {
+        rt_memcpy(map->scratch, buffer, FILEX_BLOCK_BOOT_SIZE);
+        if (rt_disk_write(media->fx_media_driver_info, 0, map->scratch, 1) != 1)
+        {
+            result = FX_IO_ERROR;
+        }
+    }
+    if (map->block == 0)
+    {
+        map->valid = 0;
+    }
+    rt_mutex_release(&map->lock);
+    return result;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+static void filex_blocks(int argc, char ** argv)
+{
+    filex_media_t * filex_media;
+    filex_block_map_t * map;
+    rt_list_t * node;
+
+    filex_lock();
+    rt_list_for_each(node, &filex_media_list)
+    {
+        filex_media = rt_list_entry(node, filex_media_t, list);
+        map = &filex_media->block_map;
+        if (map->sector_size == 0)
+        {
+            continue;
+        }
+        rt_kprintf("%s: %u byte sectors on %u byte blocks\n", filex_media->media.fx_media_name,
+                   map->sector_size, map->block_size);
+        rt_kprintf("  %8u sectors read    %8u device reads\n", map->sector_reads, map->device_reads);
+        rt_kprintf("  %8u sectors written %8u device writes  %8u read-modify-write\n",
+                   map->sector_writes, map->device_writes, map->rmw_reads);
+    }
+    filex_unlock();
+}
+MSH_CMD_EXPORT(filex_blocks, show filex sector to device block translation counts);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_BLOCK_MAP */
@@ -0,0 +1,329 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_SECTOR_CACHE
+
+static const rt_uint16_t _filex_cache_first[FILEX_CACHE_PARTITIONS + 1] =
+{
+    0,
+    FILEX_CACHE_SYSTEM_SECTORS,
+    FILEX_CACHE_SYSTEM_SECTORS + FILEX_CACHE_DIRECTORY_SECTORS,
+    FILEX_CACHE_LINES,
+};
+
+static filex_sector_cache_t * _filex_cache_get(FX_MEDIA * media)
+{
+    return &rt_container_of(media, filex_media_t, media)->sector_cache;
+}
+
+/* Partition of the request FileX is making, -1 for sectors it does not
+   classify.  */
+static int _filex_cache_partition(FX_MEDIA * media)
+{
+    switch (media->fx_media_driver_sector_type)
+    {
+    case FX_BOOT_SECTOR:
+    case FX_FAT_SECTOR:
+        return FILEX_CACHE_SYSTEM;
+    case FX_DIRECTORY_SECTOR:
+        return FILEX_CACHE_DIRECTORY;
+    case FX_DATA_SECTOR:
+        return FILEX_CACHE_DATA;
+    default:
+        return media->fx_media_driver_data_sector_read ? FILEX_CACHE_DATA : -1;
+    }
+}
+
+static UCHAR * _filex_cache_data(filex_sector_cache_t * cache, rt_uint32_t line)
+{
+    return cache->buffer + line * cache->bytes_per_sector;
+}
+
+static int _filex_cache_find(filex_sector_cache_t * cache, int partition, ULONG sector)
+{
+    rt_uint32_t line;
+    rt_uint32_t first = (partition < 0) ? 0 : _filex_cache_first[partition];
+    rt_uint32_t end = (partition < 0) ? FILEX_CACHE_LINES : _filex_cache_first[partition + 1];
+
+    for (line = first; line < end; line++)
+    {
+        if (cache->lines[line].stamp && (cache->lines[line].sector == sector))
+        {
+            return (int)line;
+        }
+    }
+    return -1;
+}
+
+/* The line for sector in its partition: its own, an empty one, or the
+   least recently used.  */
+static rt_uint32_t _filex_cache_victim(filex_sector_cache_t * cache, int partition, ULONG sector)
+{
+    rt_uint32_t line;
+    rt_uint32_t victim = _filex_cache_first[partition];
+
+    for (line = _filex_cache_first[partition]; line < _filex_cache_first[partition + 1]; line++)
+    {
+        if (cache->lines[line].stamp == 0)
+        {
+            return line;
+        }
+        if (cache->lines[line].sector == sector)
+        {
+            return line;
+        }
+        if (cache->lines[line].stamp < cache->lines[victim].stamp)
+        {
+            victim = line;
+        }
+    }
+    return victim;
+}
+
+static void _filex_cache_touch(filex_sector_cache_t * cache, rt_uint32_t line)
+{
+    rt_uint32_t i;
+
+    /* Restart the clock rather than let stamps wrap into the empty value.  */
+    if (++cache->clock == 0)
+    {
+        for (i = 0; i < FILEX_CACHE_LINES; i++)
+        {
+            if (cache->lines[i].stamp)
+            {
+                cache->lines[i].stamp = 1;
+            }
+        }
+        cache->clock = 2;
+    }
+    cache->lines[line].stamp = cache->clock;
+}
+
+void filex_cache_insert(FX_MEDIA * media, int partition, ULONG sector, const UCHAR * buffer)
+{
+    filex_sector_cache_t * cache = _filex_cache_get(media);
+    rt_uint32_t line;
+    int other;
+
+    if ((cache->buffer == RT_NULL) || (partition < 0) ||
+        (_filex_cache_first[partition] == _filex_cache_first[partition + 1]))
+    {
+        return;
+    }
+
+    /* A sector is cached once, a cluster may change from directory to data.  */
+    other = _filex_cache_find(cache, -1, sector);
+    if ((other >= 0) && ((other < _filex_cache_first[partition]) || (other >= _filex_cache_first[partition + 1])))
+    {
+        cache->lines[other].stamp = 0;
+    }
+
+    line = _filex_cache_victim(cache, partition, sector);
+    cache->lines[line].sector = sector;
+    rt_memcpy(_filex_cache_data(cache, line), buffer, cache->bytes_per_sector);
+    _filex_cache_touch(cache, line);
+}
+
+static rt_bool_t _filex_cache_ready(FX_MEDIA * media, filex_sector_cache_t * cache)
+{
+    if (cache->buffer != RT_NULL)
+    {
+        return cache->bytes_per_sector == media->fx_media_bytes_per_sector;
+    }
+    if (media->fx_media_bytes_per_sector == 0)
+    {
+        return RT_FALSE;
+    }
+
+    cache->buffer = rt_malloc(FILEX_CACHE_LINES * media->fx_media_bytes_per_sector);
+    if (cache->buffer == RT_NULL)
+    {
+        return RT_FALSE;
+    }
+    cache->bytes_per_sector = media->fx_media_bytes_per_sector;
+    filex_cache_invalidate(media);
+    return RT_TRUE;
+}
+
+size_t filex_cache_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors)
+{
+    filex_sector_cache_t * cache = _filex_cache_get(media);
+    int partition = _filex_cache_partition(media);
+    int line;
+    ULONG i;
+
+    if (!_filex_cache_ready(media, cache))
+    {
+        return rt_fx_sched_read(media, sector, buffer, sectors);
+    }
+
+    /* Streaming reads and unclassified sectors go around the cache, so a
+       long file read cannot push out the FAT and directories.  */
+    if ((partition < 0) || ((partition == FILEX_CACHE_DATA) && (sectors > FILEX_CACHE_STREAM_SECTORS)))
+    {
+        cache->bypassed++;
+        return rt_fx_sched_read(media, sector, buffer, sectors);
+    }
+
+    for (i = 0; i < sectors; i++)
+    {
+        if (_filex_cache_find(cache, partition, sector + i) < 0)
+        {
+            break;
+        }
+    }
+
+    if (i == sectors)
+    {
+        for (i = 0; i < sectors; i++)
+        {
+            line = _filex_cache_find(cache, partition, sector + i);
+            rt_memcpy(buffer + i * cache->bytes_per_sector, _filex_cache_data(cache, line), cache->bytes_per_sector);
+            _filex_cache_touch(cache, line);
+        }
+        cache->hits[partition] += sectors;
+        return sectors;
+    }
+
+    cache->misses[partition] += sectors;
+    if (rt_fx_sched_read(media, sector, buffer, sectors) != sectors)
+    {
+        return 0;
+    }
+    for (i = 0; i < sectors; i++)
+    {
+        filex_cache_insert(media, partition, sector + i, buffer + i * cache->bytes_per_sector);
+    }
+    return sectors;
+}
+
+/* Write through: the device is written first, cached copies follow it.  */
+size_t filex_cache_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors)
+{
+    filex_sector_cache_t * cache = _filex_cache_get(media);
+    int partition = _filex_cache_partition(media);
+    size_t written;
+    int line;
+    ULONG i;
+
+    written = rt_fx_sched_write(media, sector, buffer, sectors);
+    if (!_filex_cache_ready(media, cache))
+    {
+        return written;
+    }
+
+    for (i = 0; i < sectors; i++)
+    {
+        line = _filex_cache_find(cache, -1, sector + i);
+        if (written != sectors)
+        {
+            /* The device content is unknown now.  */
+            if (line >= 0)
+            {
+                cache->lines[line].stamp = 0;
+            }
+        }
+        else if (line >= 0)
+        {
+            rt_memcpy(_filex_cache_data(cache, line), buffer + i * cache->bytes_per_sector, cache->bytes_per_sector);
+        }
+        else if ((partition == FILEX_CACHE_SYSTEM) || (partition == FILEX_CACHE_DIRECTORY))
+        {
+            /* Metadata just written is read back soon.  */
+            filex_cache_insert(media, partition, sector + i, buffer + i * cache->bytes_per_sector);
+        }
+    }
+    return written;
+}
+
+void filex_cache_invalidate(FX_MEDIA * media)
+{
+    filex_sector_cache_t * cache = _filex_cache_get(media);
+    rt_uint32_t line;
+
+    for (line = 0; line < FILEX_CACHE_LINES; line++)
+    {
+        cache->lines[line].stamp = 0;
+    }
+    cache->clock = 0;
+}
+
+void filex_cache_uninit(FX_MEDIA * media)
+{
+    filex_sector_cache_t * cache = _filex_cache_get(media);
+
+    if (cache->buffer != RT_NULL)
+    {
+        rt_free(cache->buffer);
+        cache->buffer = RT_NULL;
+    }
+    filex_cache_invalidate(media);
+}
+
+/* Sectors held in a partition, at most max of them.  */
+ULONG filex_cache_sectors_get(FX_MEDIA * media, int partition, ULONG * sectors, ULONG max)
+{
+    filex_sector_cache_t * cache = _filex_cache_get(media);
+    rt_uint32_t line;
+    ULONG count = 0;
+
+    for (line = _filex_cache_first[partition]; (line < _filex_cache_first[partition + 1]) && (count < max); line++)
+    {
+        if (cache->lines[line].stamp)
+        {
+            sectors[count++] = cache->lines[line].sector;
+        }
+    }
+    return count;
+}
+
+void filex_cache_stats_get(FX_MEDIA * media, struct filex_cache_stats * stats)
+{
+    filex_sector_cache_t * cache = _filex_cache_get(media);
+    int partition;
+
+    for (partition = 0; partition < FILEX_CACHE_PARTITIONS; partition++)
+    {
+        stats->hits[partition] = cache->hits[partition];
+        stats->misses[partition] = cache->misses[partition];
+        stats->lines[partition] = _filex_cache_first[partition + 1] - _filex_cache_first[partition];
+    }
+    stats->bypassed = cache->bypassed;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+static void filex_cache(int argc, char ** argv)
+{
+    static const char * const names[FILEX_CACHE_PARTITIONS] = {"boot/FAT", "directory", "data"};
+    struct filex_cache_stats stats;
+    filex_media_t * filex_media;
+    rt_uint32_t total;
+    rt_list_t * node;
+    int partition;
+
+    filex_lock();
+    rt_list_for_each(node, &filex_media_list)
+    {
+        filex_media = rt_list_entry(node, filex_media_t, list);
+        filex_cache_stats_get(&filex_media->media, &stats);
+
+        rt_kprintf("%s: %u streaming sectors bypassed\n", filex_media->media.fx_media_name, stats.bypassed);
+        for (partition = 0; partition < FILEX_CACHE_PARTITIONS; partition++)
+        {
+            total = stats.hits[partition] + stats.misses[partition];
+            rt_kprintf("  %-10s %3u lines  %8u hits  %8u misses  %3u%%\n", names[partition], stats.lines[partition],
+                       stats.hits[partition], stats.misses[partition],
+                       total ? (rt_uint32_t)((rt_uint64_t)stats.hits[partition] * 100 / total) : 0);
+        }
+    }
+    filex_unlock();
+}
+MSH_CMD_EXPORT(filex_cache, show filex sector cache hit rates per partition);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_SECTOR_CACHE */
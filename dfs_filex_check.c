@@ -0,0 +1,656 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "fx_directory.h"
+#include "fx_utility.h"
+#ifdef FX_ENABLE_FAULT_TOLERANT
+#include "fx_fault_tolerant.h"
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_BACKGROUND_CHECK
+
+/* Background media check: what fx_media_check does in one blocking call,
+   done by a low priority thread in slices of FILEX_CHECK_SLICE ms with
+   filex_lock given back in between.  Every cluster chain reachable from the
+   directory tree, the open files and the deferred delete queue is followed
+   and marked in a bitmap; chains that leave the FAT, run into a chain
+   already seen or end before the file does are cut or shortened, and what
+   is allocated but was never reached is freed.  Any FAT or directory
+   write by someone else between two slices starts the check over, since
+   the bitmap no longer describes the volume.  */
+
+static rt_sem_t check_sem;
+
+rt_inline rt_bool_t _filex_check_marked(filex_check_t * check, ULONG cluster)
+{
+    return (check->map[cluster >> 3] >> (cluster & 7)) & 1;
+}
+
+rt_inline void _filex_check_mark(filex_check_t * check, ULONG cluster)
+{
+    check->map[cluster >> 3] |= (rt_uint8_t)(1 << (cluster & 7));
+}
+
+/* The directory count includes entries the directory index writes itself.  */
+static rt_bool_t _filex_check_changed(FX_MEDIA * media, filex_check_t * check)
+{
+    return (media->fx_media_fat_entry_writes != check->fat_writes) ||
+           (media->fx_media_directory_entry_writes != check->dir_writes);
+}
+
+static void _filex_check_restart(filex_media_t * filex_media, filex_check_t * check)
+{
+    FX_MEDIA * media = &filex_media->media;
+    struct filex_check_progress * progress = &filex_media->check_progress;
+
+    rt_memset(check->map, 0, (media->fx_media_total_clusters + FX_FAT_ENTRY_START + 7) / 8);
+    check->incomplete = RT_FALSE;
+    check->root = 0;
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    check->log_done = RT_FALSE;
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+    check->cluster = 0;
+    check->depth = 0;
+    progress->phase = FILEX_CHECK_ROOTS;
+    progress->clusters = 0;
+    progress->files = 0;
+    progress->directories = 0;
+    progress->errors = 0;
+    progress->lost = 0;
+    progress->scanned = 0;
+}
+
+/* Starts following a chain.  Chains of open files and queued deletes are
+   never repaired: FileX or the delete worker still owns them.  */
+static void _filex_check_follow(filex_check_t * check, ULONG cluster, rt_bool_t repairable)
+{
+    check->cluster = cluster;
+    check->count = 0;
+    check->repairable = repairable;
+}
+
+static rt_bool_t _filex_check_repair(filex_check_t * check)
+{
+    return check->repairable && (check->flags & FILEX_CHECK_REPAIR);
+}
+
+/* Follows up to FILEX_CHECK_BATCH links of the chain in progress.  */
+static UINT _filex_check_chain(filex_media_t * filex_media, filex_check_t * check)
+{
+    FX_MEDIA * media = &filex_media->media;
+    struct filex_check_progress * progress = &filex_media->check_progress;
+    ULONG last_cluster = media->fx_media_total_clusters + FX_FAT_ENTRY_START;
+    ULONG cluster;
+    ULONG next;
+    UINT result;
+    int i;
+
+    for (i = 0; (i < FILEX_CHECK_BATCH) && check->cluster; i++)
+    {
+        cluster = check->cluster;
+        _filex_check_mark(check, cluster);
+        check->count++;
+        progress->clusters++;
+
+        result = _fx_utility_FAT_entry_read(media, cluster, &next);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if (next >= media->fx_media_fat_reserved)
+        {
+            check->cluster = 0;
+            break;
+        }
+
+        if ((next < FX_FAT_ENTRY_START) || (next >= last_cluster) || _filex_check_marked(check, next))
+        {
+            /* Cut the chain here; whatever follows is someone else's or
+               is found again as lost.  */
+            progress->errors++;
+            if (_filex_check_repair(check))
+            {
+                result = _fx_utility_FAT_entry_write(media, cluster, media->fx_media_fat_last);
+                if (result != FX_SUCCESS)
+                {
+                    return result;
+                }
+                progress->repaired++;
+            }
+            check->cluster = 0;
+            break;
+        }
+        check->cluster = next;
+    }
+    return FX_SUCCESS;
+}
+
+/* The chain of check->entry has been followed to its end.  */
+static UINT _filex_check_entry_done(filex_media_t * filex_media, filex_check_t * check)
+{
+    FX_MEDIA * media = &filex_media->media;
+    struct filex_check_progress * progress = &filex_media->check_progress;
+    ULONG64 size = (ULONG64)check->count * media->fx_media_bytes_per_sector * media->fx_media_sectors_per_cluster;
+
+    if (check->entry.fx_dir_entry_attributes & FX_DIRECTORY)
+    {
+        if (check->depth == FILEX_CHECK_DEPTH)
+        {
+            /* Below here is not seen, so nothing may be freed.  */
+            check->incomplete = RT_TRUE;
+            return FX_SUCCESS;
+        }
+        check->levels[check->depth].dir = check->entry;
+        check->levels[check->depth].index = 0;
+        check->depth++;
+        return FX_SUCCESS;
+    }
+
+    if (check->entry.fx_dir_entry_file_size > size)
+    {
+        progress->errors++;
+        if (_filex_check_repair(check))
+        {
+            check->entry.fx_dir_entry_file_size = size;
+            progress->repaired++;
+            return _fx_directory_entry_write(media, &check->entry);
+        }
+    }
+    return FX_SUCCESS;
+}
+
+static rt_bool_t _filex_check_open(FX_MEDIA * media, ULONG cluster)
+{
+    FX_FILE * file = media->fx_media_opened_file_list;
+    ULONG i;
+
+    for (i = 0; i < media->fx_media_opened_file_count; i++)
+    {
+        if (file->fx_file_first_physical_cluster == cluster)
+        {
+            return RT_TRUE;
+        }
+        file = file->fx_file_opened_next;
+    }
+    return RT_FALSE;
+}
+
+#ifdef FX_ENABLE_FAULT_TOLERANT
+/* First cluster of the fault tolerant log.  Only the boot sector points to
+   it, and it is there whether or not this mount enabled the log.  */
+static UINT _filex_check_log(FX_MEDIA * media, ULONG * cluster)
+{
+    UCHAR * sector;
+    UINT result;
+
+    if (media->fx_media_fault_tolerant_enabled)
+    {
+        *cluster = media->fx_media_fault_tolerant_start_cluster;
+        return FX_SUCCESS;
+    }
+
+    sector = rt_malloc(media->fx_media_bytes_per_sector);
+    if (sector == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    result = fx_media_read(media, 0, sector);
+    if (result == FX_SUCCESS)
+    {
+        *cluster = _fx_utility_32_unsigned_read(sector + FX_FAULT_TOLERANT_BOOT_INDEX);
+    }
+    rt_free(sector);
+    return result;
+}
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+/* The FAT32 root directory, open files, queued deletes, chains the
+   defragmenter holds, then the fault tolerant log.  */
+static void _filex_check_roots(filex_media_t * filex_media, filex_check_t * check)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_FILE * file;
+    ULONG cluster = 0;
+    ULONG root = check->root++;
+    ULONG i;
+#ifdef FILEX_USING_DEFRAG
+    ULONG roots = media->fx_media_opened_file_count;
+
+#ifdef FILEX_USING_DEFERRED_DELETE
+    roots += filex_media->deferred_count;
+#endif /* FILEX_USING_DEFERRED_DELETE */
+#endif /* FILEX_USING_DEFRAG */
+
+    if (root == 0)
+    {
+        if (media->fx_media_32_bit_FAT)
+        {
+            cluster = media->fx_media_root_cluster_32;
+        }
+    }
+    else if (root <= media->fx_media_opened_file_count)
+    {
+        file = media->fx_media_opened_file_list;
+        for (i = 1; i < root; i++)
+        {
+            file = file->fx_file_opened_next;
+        }
+        cluster = file->fx_file_first_physical_cluster;
+    }
+#ifdef FILEX_USING_DEFERRED_DELETE
+    else if (root <= media->fx_media_opened_file_count + filex_media->deferred_count)
+    {
+        cluster = filex_media->deferred[root - media->fx_media_opened_file_count - 1].cluster;
+    }
+#endif /* FILEX_USING_DEFERRED_DELETE */
+#ifdef FILEX_USING_DEFRAG
+    /* Runs being filled and chains being freed by the defragmenter.  */
+    else if (root <= roots + FILEX_DEFRAG_QUEUE_SIZE)
+    {
+        cluster = filex_defrag_orphan(filex_media, root - roots - 1);
+    }
+#endif /* FILEX_USING_DEFRAG */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    else if (!check->log_done)
+    {
+        check->log_done = RT_TRUE;
+        if (_filex_check_log(media, &cluster) != FX_SUCCESS)
+        {
+            /* The log may be anywhere, nothing can be called lost.  */
+            check->incomplete = RT_TRUE;
+        }
+    }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+    else
+    {
+        check->depth = 1;
+        filex_media->check_progress.phase = FILEX_CHECK_TREE;
+        return;
+    }
+
+    /* The same file open twice is followed once.  */
+    if ((cluster >= FX_FAT_ENTRY_START) && (cluster < media->fx_media_total_clusters + FX_FAT_ENTRY_START) &&
+        !_filex_check_marked(check, cluster))
+    {
+        _filex_check_follow(check, cluster, RT_FALSE);
+    }
+}
+
+/* Reads the next entry of the directory on top of the stack.  */
+static UINT _filex_check_tree(filex_media_t * filex_media, filex_check_t * check)
+{
+    FX_MEDIA * media = &filex_media->media;
+    struct filex_check_progress * progress = &filex_media->check_progress;
+    filex_check_level_t * level = &check->levels[check->depth - 1];
+    FX_DIR_ENTRY * entry = &check->entry;
+    ULONG cluster;
+    UINT result;
+
+    entry->fx_dir_entry_name = check->name;
+    entry->fx_dir_entry_short_name[0] = 0;
+    result = _fx_directory_entry_read(media, (check->depth == 1) ? FX_NULL : &level->dir, &level->index, entry);
+    level->index++;
+    if ((result != FX_SUCCESS) || ((UCHAR)entry->fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_DONE))
+    {
+        if (result != FX_SUCCESS)
+        {
+            check->incomplete = RT_TRUE;
+        }
+        if (--check->depth == 0)
+        {
+            progress->phase = FILEX_CHECK_LOST;
+            check->cluster = FX_FAT_ENTRY_START;
+        }
+        return FX_SUCCESS;
+    }
+
+    if (((UCHAR)entry->fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_FREE) ||
+        (entry->fx_dir_entry_attributes & FX_VOLUME) ||
+        ((entry->fx_dir_entry_name[0] == '.') &&
+         ((entry->fx_dir_entry_name[1] == 0) || ((entry->fx_dir_entry_name[1] == '.') && (entry->fx_dir_entry_name[2] == 0)))))
+    {
+        return FX_SUCCESS;
+    }
+
+    if (entry->fx_dir_entry_attributes & FX_DIRECTORY)
+    {
+        progress->directories++;
+    }
+    else
+    {
+        progress->files++;
+    }
+
+    cluster = entry->fx_dir_entry_cluster;
+    if (cluster == 0)
+    {
+        return FX_SUCCESS;
+    }
+    if ((cluster < FX_FAT_ENTRY_START) || (cluster >= media->fx_media_total_clusters + FX_FAT_ENTRY_START))
+    {
+        progress->errors++;
+        if ((check->flags & FILEX_CHECK_REPAIR) && !(entry->fx_dir_entry_attributes & FX_DIRECTORY))
+        {
+            entry->fx_dir_entry_cluster = 0;
+            entry->fx_dir_entry_file_size = 0;
+            progress->repaired++;
+            return _fx_directory_entry_write(media, entry);
+        }
+        return FX_SUCCESS;
+    }
+    if (_filex_check_marked(check, cluster))
+    {
+        /* Already followed as an open file, or shared with another entry,
+           which is reported but left to the user.  */
+        if (!_filex_check_open(media, cluster))
+        {
+            progress->errors++;
+        }
+        return FX_SUCCESS;
+    }
+
+    _filex_check_follow(check, cluster, !_filex_check_open(media, cluster));
+    return FX_SUCCESS;
+}
+
+/* Frees up to FILEX_CHECK_BATCH clusters allocated but never reached.  */
+static UINT _filex_check_lost(filex_media_t * filex_media, filex_check_t * check)
+{
+    FX_MEDIA * media = &filex_media->media;
+    struct filex_check_progress * progress = &filex_media->check_progress;
+    ULONG last_cluster = media->fx_media_total_clusters + FX_FAT_ENTRY_START;
+    ULONG value;
+    UINT result;
+    int i;
+
+    for (i = 0; (i < FILEX_CHECK_BATCH) && (check->cluster < last_cluster); i++, check->cluster++)
+    {
+        progress->scanned++;
+        if (_filex_check_marked(check, check->cluster))
+        {
+            continue;
+        }
+        result = _fx_utility_FAT_entry_read(media, check->cluster, &value);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        /* Reserved and bad cluster marks are not lost.  */
+        if ((value == FX_FREE_CLUSTER) ||
+            ((value >= media->fx_media_fat_reserved) && (value < media->fx_media_fat_reserved + 8)))
+        {
+            continue;
+        }
+
+        progress->lost++;
+        if ((check->flags & FILEX_CHECK_REPAIR) && !check->incomplete)
+        {
+#ifdef FX_ENABLE_FAULT_TOLERANT
+            /* The log was followed as a root, freeing it loses the journal.  */
+            RT_ASSERT(!media->fx_media_fault_tolerant_enabled ||
+                      (check->cluster < media->fx_media_fault_tolerant_start_cluster) ||
+                      (check->cluster >= media->fx_media_fault_tolerant_start_cluster +
+                                         media->fx_media_fault_tolerant_clusters));
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+            result = _fx_utility_FAT_entry_write(media, check->cluster, FX_FREE_CLUSTER);
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+            media->fx_media_available_clusters++;
+            progress->repaired++;
+        }
+    }
+
+    if (check->cluster >= last_cluster)
+    {
+        progress->phase = FILEX_CHECK_DONE;
+    }
+    return FX_SUCCESS;
+}
+
+/* One slice of at most FILEX_CHECK_SLICE ms.  RT_TRUE while there is more
+   to do.  */
+static rt_bool_t _filex_check_slice(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_check_t * check = filex_media->check;
+    struct filex_check_progress * progress = &filex_media->check_progress;
+    rt_tick_t start = rt_tick_get();
+    rt_tick_t budget = rt_tick_from_millisecond(FILEX_CHECK_SLICE);
+    ULONG repaired = progress->repaired;
+    UINT result = FX_SUCCESS;
+
+#ifdef FILEX_USING_GROUP_COMMIT
+    /* Repairs must not land in a foreground transaction.  */
+    if (check->flags & FILEX_CHECK_REPAIR)
+    {
+        filex_group_commit(filex_media);
+    }
+#endif /* FILEX_USING_GROUP_COMMIT */
+    if (_filex_check_changed(media, check))
+    {
+        progress->restarts++;
+        _filex_check_restart(filex_media, check);
+    }
+    progress->slices++;
+
+    while ((result == FX_SUCCESS) && (progress->phase != FILEX_CHECK_DONE) &&
+           (rt_tick_get() - start < budget))
+    {
+        if (check->cluster && (progress->phase != FILEX_CHECK_LOST))
+        {
+            result = _filex_check_chain(filex_media, check);
+            if ((result == FX_SUCCESS) && (check->cluster == 0) && (progress->phase == FILEX_CHECK_TREE))
+            {
+                result = _filex_check_entry_done(filex_media, check);
+            }
+        }
+        else if (progress->phase == FILEX_CHECK_ROOTS)
+        {
+            _filex_check_roots(filex_media, check);
+        }
+        else if (progress->phase == FILEX_CHECK_TREE)
+        {
+            result = _filex_check_tree(filex_media, check);
+        }
+        else
+        {
+            result = _filex_check_lost(filex_media, check);
+        }
+    }
+
+    if ((result == FX_SUCCESS) && (progress->repaired != repaired))
+    {
+        result = fx_media_flush(media);
+    }
+    check->fat_writes = media->fx_media_fat_entry_writes;
+    check->dir_writes = media->fx_media_directory_entry_writes;
+
+    if ((result != FX_SUCCESS) || (progress->phase == FILEX_CHECK_DONE))
+    {
+        progress->result = result;
+        if (result != FX_SUCCESS)
+        {
+            progress->phase = FILEX_CHECK_IDLE;
+        }
+        filex_check_stop(filex_media);
+        return RT_FALSE;
+    }
+    return RT_TRUE;
+}
+
+static void _filex_check_entry(void * parameter)
+{
+    rt_list_t * node;
+    filex_media_t * filex_media;
+    rt_bool_t pending;
+
+#ifdef FILEX_USING_QOS
+    filex_qos_set(RT_NULL, FILEX_QOS_BACKGROUND);
+#endif /* FILEX_USING_QOS */
+
+    while (1)
+    {
+        rt_sem_take(check_sem, RT_WAITING_FOREVER);
+
+        do
+        {
+            pending = RT_FALSE;
+
+            filex_lock();
+            rt_list_for_each(node, &filex_media_list)
+            {
+                filex_media = rt_list_entry(node, filex_media_t, list);
+                if ((filex_media->media.fx_media_id == FX_MEDIA_ID) && (filex_media->check != RT_NULL) &&
+                    _filex_check_slice(filex_media))
+                {
+                    pending = RT_TRUE;
+                }
+            }
+            filex_unlock();
+
+            if (pending)
+            {
+                rt_thread_mdelay(FILEX_CHECK_INTERVAL);
+            }
+        } while (pending);
+    }
+}
+
+/* Starts a check of the mount, or restarts one already running.  Called
+   with filex_lock held.  */
+UINT filex_check_start(filex_media_t * filex_media, rt_uint32_t flags)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_check_t * check;
+
+#ifdef FX_ENABLE_EXFAT
+    /* exFAT keeps allocation in a bitmap this check does not read.  */
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    if ((flags & FILEX_CHECK_REPAIR) && filex_media->read_only)
+    {
+        return FX_WRITE_PROTECT;
+    }
+
+    filex_check_stop(filex_media);
+    check = rt_malloc(sizeof(filex_check_t));
+    if (check == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    check->map = rt_malloc((media->fx_media_total_clusters + FX_FAT_ENTRY_START + 7) / 8);
+    if (check->map == RT_NULL)
+    {
+        rt_free(check);
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+
+    check->flags = flags;
+    check->fat_writes = media->fx_media_fat_entry_writes;
+    check->dir_writes = media->fx_media_directory_entry_writes;
+    rt_memset(&filex_media->check_progress, 0, sizeof(struct filex_check_progress));
+    filex_media->check_progress.total_clusters = media->fx_media_total_clusters;
+    filex_media->check = check;
+    _filex_check_restart(filex_media, check);
+
+    rt_sem_release(check_sem);
+    return FX_SUCCESS;
+}
+
+/* Drops a running check, before unmount or when it is done.  */
+void filex_check_stop(filex_media_t * filex_media)
+{
+    filex_check_t * check = filex_media->check;
+
+    if (check != RT_NULL)
+    {
+        filex_media->check = RT_NULL;
+        rt_free(check->map);
+        rt_free(check);
+    }
+}
+
+void filex_check_progress_get(filex_media_t * filex_media, struct filex_check_progress * progress)
+{
+    *progress = filex_media->check_progress;
+}
+
+int filex_check_init(void)
+{
+    rt_thread_t thread;
+
+    check_sem = rt_sem_create("fxcheck", 0, RT_IPC_FLAG_FIFO);
+    if (check_sem == RT_NULL)
+    {
+        return -RT_ENOMEM;
+    }
+
+    thread = rt_thread_create("fxcheck", _filex_check_entry, RT_NULL,
+                              FILEX_CHECK_THREAD_STACK_SIZE, FILEX_CHECK_THREAD_PRIORITY, 10);
+    if (thread == RT_NULL)
+    {
+        rt_sem_delete(check_sem);
+        check_sem = RT_NULL;
+        return -RT_ENOMEM;
+    }
+    return rt_thread_startup(thread);
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+static const char * const _filex_check_phases[] = {"idle", "roots", "tree", "lost", "done"};
+
+static void filex_check(int argc, char ** argv)
+{
+    struct filex_check_progress * progress;
+    filex_media_t * filex_media;
+    rt_list_t * node;
+    rt_uint32_t flags = 0;
+    rt_bool_t start = RT_FALSE;
+    UINT result;
+
+    if (argc > 1)
+    {
+        start = RT_TRUE;
+        if (rt_strcmp(argv[1], "repair") == 0)
+        {
+            flags = FILEX_CHECK_REPAIR;
+        }
+        else if (rt_strcmp(argv[1], "start") != 0)
+        {
+            rt_kprintf("usage: filex_check [start|repair]\n");
+            return;
+        }
+    }
+
+    filex_lock();
+    rt_list_for_each(node, &filex_media_list)
+    {
+        filex_media = rt_list_entry(node, filex_media_t, list);
+        if (start)
+        {
+            result = filex_check_start(filex_media, flags);
+            if (result != FX_SUCCESS)
+            {
+                rt_kprintf("%s: cannot start, error 0x%02x\n", filex_media->media.fx_media_name, result);
+            }
+        }
+        progress = &filex_media->check_progress;
+        rt_kprintf("%s: %s  %u/%u clusters  %u files  %u dirs  %u errors  %u lost  %u repaired  %u restarts\n",
+                   filex_media->media.fx_media_name, _filex_check_phases[progress->phase],
+                   progress->clusters, progress->total_clusters, progress->files, progress->directories,
+                   progress->errors, progress->lost, progress->repaired, progress->restarts);
+    }
+    filex_unlock();
+}
+MSH_CMD_EXPORT(filex_check, check filex mounts in the background: filex_check [start|repair]);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_BACKGROUND_CHECK */
@@ -0,0 +1,394 @@
+#include <rtthread.h>
+#include <dfs_file.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_COPY
+
+/* File copy inside the file system: the destination is allocated ahead in
+   one piece and the data moves through a driver side buffer of
+   FILEX_COPY_BUFFER_SIZE bytes, so FileX reads and writes whole sector
+   runs straight to the device instead of user sized pieces through the
+   sector cache.  filex_lock is taken once per buffer, not for the whole
+   copy.  Asynchronous copies run on a worker thread in the order queued;
+   a job holds a reference on both fds and closing either one drops the
+   job, or stops it and waits when it is running.  */
+
+typedef struct filex_copy_job {
+    rt_list_t list;
+    struct dfs_fd * target;
+    struct dfs_fd * source;
+    struct filex_copy * copy;
+    rt_bool_t cancel;
+} filex_copy_job_t;
+
+static rt_sem_t copy_sem;
+static rt_mutex_t copy_run;             /* Held by the worker while it runs a job */
+static rt_list_t copy_list;
+static filex_copy_job_t * copy_running;
+
+static UINT _filex_copy_prepare(FX_FILE * file)
+{
+#ifdef FILEX_USING_CONCURRENT_READ
+    filex_media_t * filex_media = rt_container_of(file->fx_file_media_ptr, filex_media_t, media);
+#endif /* FILEX_USING_CONCURRENT_READ */
+
+#ifdef FILEX_USING_RING_LOG
+    /* Ring data is not laid out in file order.  */
+    if (filex_ring_active(file))
+    {
+        return FX_INVALID_STATE;
+    }
+#endif /* FILEX_USING_RING_LOG */
+#ifdef FILEX_USING_CONCURRENT_READ
+    /* Concurrent reads keep the offset alone; FileX needs the cluster
+       position to match it.  */
+    if (filex_media->read_cache[0].buffer != RT_NULL)
+    {
+        return fx_file_extended_seek(file, file->fx_file_current_file_offset);
+    }
+#endif /* FILEX_USING_CONCURRENT_READ */
+#ifdef FILEX_USING_RECORD
+    return filex_record_sync(file);
+#else
+    return FX_SUCCESS;
+#endif /* FILEX_USING_RECORD */
+}
+
+/* Copies up to size bytes, or to the end of the source when size is 0,
+   from the position of source to the position of target.  Stops before
+   the next buffer once *cancel is set.  */
+static UINT _filex_copy(struct dfs_fd * target, struct dfs_fd * source, ULONG64 size, ULONG64 * copied,
+                        const rt_bool_t * cancel)
+{
+    FX_FILE * target_file = (FX_FILE *)target->data;
+    FX_FILE * source_file = (FX_FILE *)source->data;
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_media_t * filex_media = rt_container_of(target_file->fx_file_media_ptr, filex_media_t, media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+    rt_bool_t allocated = RT_FALSE;
+    ULONG bytes_per_sector = source_file->fx_file_media_ptr->fx_media_bytes_per_sector;
+    UCHAR * buffer;
+    ULONG64 end;
+    ULONG chunk;
+    ULONG actual;
+    UINT result;
+
+    *copied = 0;
+    buffer = rt_malloc(FILEX_COPY_BUFFER_SIZE);
+    if (buffer == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+
+    filex_lock();
+    result = _filex_copy_prepare(target_file);
+    if (result == FX_SUCCESS)
+    {
+        result = _filex_copy_prepare(source_file);
+    }
+    if (result == FX_SUCCESS)
+    {
+        end = source_file->fx_file_current_file_size;
+        if ((size != 0) && (end > source_file->fx_file_current_file_offset + size))
+        {
+            end = source_file->fx_file_current_file_offset + size;
+        }
+        size = (end > source_file->fx_file_current_file_offset) ? end - source_file->fx_file_current_file_offset : 0;
+
+        /* Failing to allocate in one piece is not an error: FileX then
+           allocates as it writes.  */
+        end = target_file->fx_file_current_file_offset + size;
+        if ((end > target_file->fx_file_current_available_size) &&
+            (fx_file_extended_allocate(target_file, end - target_file->fx_file_current_available_size) == FX_SUCCESS))
+        {
+            allocated = RT_TRUE;
+        }
+    }
+    filex_unlock();
+
+    while ((result == FX_SUCCESS) && (*copied < size))
+    {
+        /* The first buffer ends where the source reaches a sector
+           boundary, so every later read is in whole sectors.  */
+        chunk = FILEX_COPY_BUFFER_SIZE - (ULONG)(source_file->fx_file_current_file_offset % bytes_per_sector);
+        if (chunk > size - *copied)
+        {
+            chunk = (ULONG)(size - *copied);
+        }
+
+#ifdef FILEX_USING_QOS
+        filex_qos_admit(chunk);
+#endif /* FILEX_USING_QOS */
+        filex_lock();
+        if ((cancel != RT_NULL) && *cancel)
+        {
+            filex_unlock();
+            result = FX_NOT_OPEN;
+            break;
+        }
+#ifdef FILEX_USING_GROUP_COMMIT
+        filex_group_begin(filex_media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+        result = fx_file_read(source_file, buffer, chunk, &actual);
+        if ((result == FX_SUCCESS) && actual)
+        {
+            result = fx_file_write(target_file, buffer, actual);
+        }
+#ifdef FILEX_USING_GROUP_COMMIT
+        filex_group_end(filex_media, result);
+#endif /* FILEX_USING_GROUP_COMMIT */
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+        filex_seek_note(source_file);
+        filex_seek_note(target_file);
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
+        filex_fd_update(source);
+        filex_fd_update(target);
+        filex_unlock();
+
+        if (result == FX_SUCCESS)
+        {
+            *copied += actual;
+            if (actual != chunk)
+            {
+                /* Truncated under us.  */
+                break;
+            }
+        }
+    }
+
+    /* Give back what was allocated ahead and not written.  */
+    filex_lock();
+    if (allocated && (target_file->fx_file_current_available_size > target_file->fx_file_current_file_size))
+    {
+        fx_file_extended_truncate_release(target_file, target_file->fx_file_current_file_size);
+    }
+    filex_unlock();
+
+    rt_free(buffer);
+    return (result == FX_END_OF_FILE) ? FX_SUCCESS : result;
+}
+
+static void _filex_copy_finish(filex_copy_job_t * job, UINT status, ULONG64 copied)
+{
+    job->copy->status = status;
+    job->copy->copied = copied;
+    fd_put(job->target);
+    fd_put(job->source);
+    rt_sem_release(job->copy->done);
+    rt_free(job);
+}
+
+static void _filex_copy_entry_thread(void * parameter)
+{
+    filex_copy_job_t * job;
+    ULONG64 copied;
+    UINT status;
+
+#ifdef FILEX_USING_QOS
+    filex_qos_set(RT_NULL, FILEX_QOS_BACKGROUND);
+#endif /* FILEX_USING_QOS */
+
+    while (1)
+    {
+        rt_sem_take(copy_sem, RT_WAITING_FOREVER);
+
+        /* Taken before the job is, so a close that finds it running
+           waits for the whole of it.  */
+        rt_mutex_take(copy_run, RT_WAITING_FOREVER);
+        filex_lock();
+        if (rt_list_isempty(&copy_list))
+        {
+            /* Dropped by a close.  */
+            filex_unlock();
+            rt_mutex_release(copy_run);
+            continue;
+        }
+        job = rt_list_entry(copy_list.next, filex_copy_job_t, list);
+        rt_list_remove(&job->list);
+        copy_running = job;
+        filex_unlock();
+
+        status = _filex_copy(job->target, job->source, job->copy->size, &copied, &job->cancel);
+
+        filex_lock();
+        copy_running = RT_NULL;
+        filex_unlock();
+        rt_mutex_release(copy_run);
+        _filex_copy_finish(job, status, copied);
+    }
+}
+
+/* Copies from the fd copy->source into target, both regular filex files.
+   With copy->done set the copy is queued and done is released when it
+   ends, copy must stay valid until then.  Closing either fd first ends
+   the copy with FX_NOT_OPEN.  */
+UINT filex_copy_start(struct dfs_fd * target, struct filex_copy * copy)
+{
+    struct dfs_fd * source;
+    filex_copy_job_t * job;
+    ULONG64 copied;
+
+    source = fd_get(copy->source);
+    if (source == RT_NULL)
+    {
+        return FX_INVALID_OPTION;
+    }
+    if ((source == target) || (source->type != FT_REGULAR) || (source->fops != target->fops) ||
+        (source->data == RT_NULL))
+    {
+        fd_put(source);
+        return FX_INVALID_OPTION;
+    }
+
+    copy->copied = 0;
+    if (copy->done == RT_NULL)
+    {
+        copy->status = _filex_copy(target, source, copy->size, &copied, RT_NULL);
+        copy->copied = copied;
+        fd_put(source);
+        return copy->status;
+    }
+
+    job = rt_malloc(sizeof(filex_copy_job_t));
+    if (job == RT_NULL)
+    {
+        fd_put(source);
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    job->target = target;
+    job->source = source;
+    job->copy = copy;
+    job->cancel = RT_FALSE;
+
+    /* The reference fd_get takes on the source.  */
+    dfs_lock();
+    target->ref_count++;
+    dfs_unlock();
+
+    filex_lock();
+    rt_list_insert_before(&copy_list, &job->list);
+    filex_unlock();
+    rt_sem_release(copy_sem);
+    return FX_SUCCESS;
+}
+
+/* Called by close before fd's FX_FILE goes.  Queued copies from or to fd
+   end unrun; a running one stops after its current buffer and is waited
+   for.  Must not be called under filex_lock.  */
+void filex_copy_cancel(struct dfs_fd * fd)
+{
+    filex_copy_job_t * job;
+    rt_list_t * node;
+    rt_list_t dropped;
+    rt_bool_t running = RT_FALSE;
+
+    rt_list_init(&dropped);
+    filex_lock();
+    node = copy_list.next;
+    while (node != &copy_list)
+    {
+        job = rt_list_entry(node, filex_copy_job_t, list);
+        node = node->next;
+        if ((job->target == fd) || (job->source == fd))
+        {
+            rt_list_remove(&job->list);
+            rt_list_insert_before(&dropped, &job->list);
+        }
+    }
+    if ((copy_running != RT_NULL) && ((copy_running->target == fd) || (copy_running->source == fd)))
+    {
+        copy_running->cancel = RT_TRUE;
+        running = RT_TRUE;
+    }
+    filex_unlock();
+
+    while (!rt_list_isempty(&dropped))
+    {
+        job = rt_list_entry(dropped.next, filex_copy_job_t, list);
+        rt_list_remove(&job->list);
+        _filex_copy_finish(job, FX_NOT_OPEN, 0);
+    }
+    if (running)
+    {
+        rt_mutex_take(copy_run, RT_WAITING_FOREVER);
+        rt_mutex_release(copy_run);
+    }
+}
+
+int filex_copy_init(void)
+{
+    rt_thread_t thread;
+
+    rt_list_init(&copy_list);
+    copy_sem = rt_sem_create("fxcopy", 0, RT_IPC_FLAG_FIFO);
+    if (copy_sem == RT_NULL)
+    {
+        return -RT_ENOMEM;
+    }
+    copy_run = rt_mutex_create("fxcopy", RT_IPC_FLAG_PRIO);
+    if (copy_run == RT_NULL)
+    {
+        rt_sem_delete(copy_sem);
+        copy_sem = RT_NULL;
+        return -RT_ENOMEM;
+    }
+
+    thread = rt_thread_create("fxcopy", _filex_copy_entry_thread, RT_NULL,
+                              FILEX_COPY_THREAD_STACK_SIZE, FILEX_COPY_THREAD_PRIORITY, 10);
+    if (thread == RT_NULL)
+    {
+        rt_mutex_delete(copy_run);
+        copy_run = RT_NULL;
+        rt_sem_delete(copy_sem);
+        copy_sem = RT_NULL;
+        return -RT_ENOMEM;
+    }
+    return rt_thread_startup(thread);
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+#include <dfs_posix.h>
+
+static void filex_cp(int argc, char ** argv)
+{
+    struct filex_copy copy;
+    rt_tick_t tick;
+    int fd;
+
+    if (argc != 3)
+    {
+        rt_kprintf("usage: filex_cp <source> <target>\n");
+        return;
+    }
+
+    rt_memset(&copy, 0, sizeof(copy));
+    copy.source = open(argv[1], O_RDONLY, 0);
+    if (copy.source < 0)
+    {
+        rt_kprintf("%s: cannot open\n", argv[1]);
+        return;
+    }
+    fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0);
+    if (fd < 0)
+    {
+        rt_kprintf("%s: cannot open\n", argv[2]);
+        close(copy.source);
+        return;
+    }
+
+    tick = rt_tick_get();
+    if (ioctl(fd, FILEX_IOCTL_COPY, &copy) < 0)
+    {
+        rt_kprintf("copy failed, FileX status 0x%02x\n", copy.status);
+    }
+    rt_kprintf("%u bytes in %u ticks\n", (rt_uint32_t)copy.copied, rt_tick_get() - tick);
+    close(fd);
+    close(copy.source);
+}
+MSH_CMD_EXPORT(filex_cp, copy a file inside a filex file system: filex_cp <source> <target>);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_COPY */
@@ -0,0 +1,456 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "fx_directory.h"
+#include "fx_utility.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_DEFERRED_DELETE
+
+#define FILEX_DEFERRED_JOURNAL_MAGIC    0x46584444      /* "FXDD" */
+
+static rt_sem_t deferred_sem = RT_NULL;
+
+/* Clusters of the slice being released, only touched by the worker.  */
+static ULONG deferred_slice[FILEX_DEFERRED_DELETE_SLICE];
+
+/* With pending set the last chain is recorded together with the path of
+   the file it still belongs to, before the file lets go of it.  A mount
+   finding it reclaims the chain only if the file no longer holds it.  */
+static UINT _filex_deferred_journal_write(filex_media_t * filex_media, const CHAR * pending)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_FILE journal;
+    ULONG header[3];
+    ULONG size;
+    UINT result;
+#ifdef FILEX_USING_DIR_INDEX
+    filex_dir_index_removal_t removal;
+#endif /* FILEX_USING_DIR_INDEX */
+
+    /* Nothing left to reclaim, drop the journal.  */
+    if (filex_media->deferred_count == 0)
+    {
+#ifdef FILEX_USING_DIR_INDEX
+        filex_dir_index_locate(filex_media, FILEX_DEFERRED_DELETE_JOURNAL, &removal);
+#endif /* FILEX_USING_DIR_INDEX */
+        result = fx_file_delete(media, FILEX_DEFERRED_DELETE_JOURNAL);
+#ifdef FILEX_USING_DIR_INDEX
+        /* Deleted behind the back of the root index, like it was created.  */
+        if (result == FX_SUCCESS)
+        {
+            filex_dir_index_remove(filex_media, &removal);
+        }
+#endif /* FILEX_USING_DIR_INDEX */
+        if (result == FX_NOT_FOUND)
+        {
+            result = FX_SUCCESS;
+        }
+        return result;
+    }
+
+    result = fx_file_create(media, FILEX_DEFERRED_DELETE_JOURNAL);
+    if (result == FX_SUCCESS)
+    {
+        fx_file_attributes_set(media, FILEX_DEFERRED_DELETE_JOURNAL, FX_HIDDEN | FX_SYSTEM);
+    }
+    else if (result != FX_ALREADY_CREATED)
+    {
+        return result;
+    }
+
+    result = fx_file_open(media, &journal, FILEX_DEFERRED_DELETE_JOURNAL, FX_OPEN_FOR_WRITE);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+#ifdef FILEX_USING_DIR_INDEX
+    /* Created behind the back of the root index.  */
+    filex_dir_index_add(filex_media, FILEX_DEFERRED_DELETE_JOURNAL, &journal.fx_file_dir_entry);
+#endif /* FILEX_USING_DIR_INDEX */
+
+    header[0] = FILEX_DEFERRED_JOURNAL_MAGIC;
+    header[1] = filex_media->deferred_count;
+    header[2] = (pending != RT_NULL) ? rt_strlen(pending) : 0;
+    size = filex_media->deferred_count * sizeof(filex_deferred_chain_t);
+
+    result = fx_file_write(&journal, header, sizeof(header));
+    if (result == FX_SUCCESS)
+    {
+        result = fx_file_write(&journal, filex_media->deferred, size);
+    }
+    if ((result == FX_SUCCESS) && header[2])
+    {
+        result = fx_file_write(&journal, (VOID *)pending, header[2]);
+    }
+    if (result == FX_SUCCESS)
+    {
+        result = fx_file_truncate(&journal, sizeof(header) + size + header[2]);
+    }
+    fx_file_close(&journal);
+
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    return fx_media_flush(media);
+}
+
+static UINT _filex_deferred_release(FX_MEDIA * media, ULONG cluster, UINT use_fat)
+{
+    UINT result = FX_SUCCESS;
+
+    if (use_fat)
+    {
+        result = _fx_utility_FAT_entry_write(media, cluster, FX_FREE_CLUSTER);
+    }
+#ifdef FX_ENABLE_EXFAT
+    if ((result == FX_SUCCESS) && (media->fx_media_FAT_type == FX_exFAT))
+    {
+        result = _fx_utility_exFAT_cluster_state_set(media, cluster, FX_EXFAT_BITMAP_CLUSTER_FREE);
+    }
+#endif /* FX_ENABLE_EXFAT */
+    if (result == FX_SUCCESS)
+    {
+        /* Visible to statfs right away.  */
+        media->fx_media_available_clusters++;
+    }
+    return result;
+}
+
+static UINT _filex_deferred_step(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_deferred_chain_t * chain = &filex_media->deferred[0];
+    ULONG last_cluster = media->fx_media_total_clusters + FX_FAT_ENTRY_START;
+    ULONG cluster = chain->cluster;
+    ULONG next;
+    ULONG count = 0;
+    ULONG index;
+    UINT use_fat = FX_TRUE;
+    UINT result;
+
+#ifdef FILEX_USING_GROUP_COMMIT
+    /* The unlink that queued the chain must reach the media first.  */
+    filex_group_commit(filex_media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+
+    /* Collect the next slice and move the queued head past it before anything
+       is released, so a crash in between leaks at most this slice and never
+       frees a cluster twice.  */
+    if (chain->count)
+    {
+        /* Contiguous exFAT run, FileX never wrote a FAT chain for it.  */
+        use_fat = FX_FALSE;
+        count = chain->count < FILEX_DEFERRED_DELETE_SLICE ? chain->count : FILEX_DEFERRED_DELETE_SLICE;
+        chain->cluster = (chain->count > count) ? cluster + count : FX_FREE_CLUSTER;
+        chain->count -= count;
+    }
+    else
+    {
+        while ((count < FILEX_DEFERRED_DELETE_SLICE) &&
+               (cluster >= FX_FAT_ENTRY_START) && (cluster < last_cluster))
+        {
+            result = _fx_utility_FAT_entry_read(media, cluster, &next);
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+
+            deferred_slice[count++] = cluster;
+            if ((next == cluster) || (next >= media->fx_media_fat_reserved))
+            {
+                next = FX_FREE_CLUSTER;
+            }
+            cluster = next;
+        }
+        chain->cluster = cluster;
+    }
+
+    if ((chain->cluster < FX_FAT_ENTRY_START) || (chain->cluster >= last_cluster))
+    {
+        filex_media->deferred_count--;
+        rt_memmove(&filex_media->deferred[0], &filex_media->deferred[1],
+                   filex_media->deferred_count * sizeof(filex_deferred_chain_t));
+    }
+
+    result = _filex_deferred_journal_write(filex_media, RT_NULL);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+
+    for (index = 0; (index < count) && (result == FX_SUCCESS); index++)
+    {
+        if (use_fat)
+        {
+            result = _filex_deferred_release(media, deferred_slice[index], FX_TRUE);
+        }
+        else
+        {
+            result = _filex_deferred_release(media, cluster + index, FX_FALSE);
+        }
+    }
+
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    return fx_media_flush(media);
+}
+
+static void _filex_deferred_entry(void * parameter)
+{
+    rt_list_t * node;
+    filex_media_t * filex_media;
+    rt_bool_t pending;
+
+#ifdef FILEX_USING_QOS
+    filex_qos_set(RT_NULL, FILEX_QOS_BACKGROUND);
+#endif /* FILEX_USING_QOS */
+
+    while (1)
+    {
+        rt_sem_take(deferred_sem, RT_WAITING_FOREVER);
+
+        do
+        {
+            pending = RT_FALSE;
+
+            /* One slice per media, then give the lock back to foreground I/O.  */
+            filex_lock();
+            rt_list_for_each(node, &filex_media_list)
+            {
+                filex_media = rt_list_entry(node, filex_media_t, list);
+                if ((filex_media->media.fx_media_id != FX_MEDIA_ID) || (filex_media->deferred_count == 0))
+                {
+                    continue;
+                }
+                if ((_filex_deferred_step(filex_media) == FX_SUCCESS) && filex_media->deferred_count)
+                {
+                    pending = RT_TRUE;
+                }
+            }
+            filex_unlock();
+
+            if (pending)
+            {
+                rt_thread_mdelay(FILEX_DEFERRED_DELETE_INTERVAL);
+            }
+        } while (pending);
+    }
+}
+
+UINT filex_deferred_delete(filex_media_t * filex_media, CHAR * path)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_DIR_ENTRY dir_entry;
+    FX_FILE * file;
+    filex_deferred_chain_t chain;
+    ULONG64 file_size;
+    ULONG64 allocated;
+    ULONG bytes_per_cluster;
+    ULONG clusters;
+    ULONG index;
+    UINT result;
+
+    dir_entry.fx_dir_entry_name = media->fx_media_name_buffer + 2 * FX_MAX_LONG_NAME_LEN;
+    dir_entry.fx_dir_entry_short_name[0] = 0;
+    result = _fx_directory_search(media, path, &dir_entry, FX_NULL, FX_NULL);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+
+    /* Let FileX report directories, read-only entries and write protection.  */
+    if ((dir_entry.fx_dir_entry_attributes & (FX_DIRECTORY | FX_READ_ONLY)) ||
+        media->fx_media_driver_write_protect ||
+        (filex_media->deferred_count >= FILEX_DEFERRED_DELETE_QUEUE_SIZE) ||
+        (rt_strlen(path) >= FX_MAX_LONG_NAME_LEN))
+    {
+        return fx_file_delete(media, path);
+    }
+
+    /* exFAT files may hold clusters past their end.  */
+    file_size = dir_entry.fx_dir_entry_file_size;
+    allocated = file_size;
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        allocated = dir_entry.fx_dir_entry_available_file_size;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    bytes_per_cluster = media->fx_media_bytes_per_sector * media->fx_media_sectors_per_cluster;
+    clusters = (ULONG)((allocated + bytes_per_cluster - 1) / bytes_per_cluster);
+    if ((dir_entry.fx_dir_entry_cluster < FX_FAT_ENTRY_START) || (clusters < FILEX_DEFERRED_DELETE_THRESHOLD))
+    {
+        return fx_file_delete(media, path);
+    }
+
+    /* Open files are refused by FileX itself.  */
+    file = media->fx_media_opened_file_list;
+    for (index = 0; index < media->fx_media_opened_file_count; index++)
+    {
+        if ((file->fx_file_dir_entry.fx_dir_entry_log_sector == dir_entry.fx_dir_entry_log_sector) &&
+            (file->fx_file_dir_entry.fx_dir_entry_byte_offset == dir_entry.fx_dir_entry_byte_offset))
+        {
+            return fx_file_delete(media, path);
+        }
+        file = file->fx_file_opened_next;
+    }
+
+    chain.cluster = dir_entry.fx_dir_entry_cluster;
+    chain.count = 0;
+#ifdef FX_ENABLE_EXFAT
+    if (dir_entry.fx_dir_entry_dont_use_fat & 1)
+    {
+        chain.count = clusters;
+    }
+#endif /* FX_ENABLE_EXFAT */
+
+    /* Journal the chain as pending, then detach it and let FileX remove the
+       entry itself.  A crash anywhere in between is settled at the next
+       mount by looking at whether the file still holds the chain.  */
+    filex_media->deferred[filex_media->deferred_count++] = chain;
+    result = _filex_deferred_journal_write(filex_media, path);
+    if (result != FX_SUCCESS)
+    {
+        filex_media->deferred_count--;
+        return result;
+    }
+
+    dir_entry.fx_dir_entry_cluster = FX_FREE_CLUSTER;
+    dir_entry.fx_dir_entry_file_size = 0;
+#ifdef FX_ENABLE_EXFAT
+    dir_entry.fx_dir_entry_available_file_size = 0;
+#endif /* FX_ENABLE_EXFAT */
+    result = _fx_directory_entry_write(media, &dir_entry);
+    if (result != FX_SUCCESS)
+    {
+        filex_media->deferred_count--;
+        _filex_deferred_journal_write(filex_media, RT_NULL);
+        return result;
+    }
+
+#ifndef FX_MEDIA_DISABLE_SEARCH_CACHE
+    /* The search cache still holds the entry with its chain.  */
+    media->fx_media_last_found_name[0] = 0;
+#endif /* FX_MEDIA_DISABLE_SEARCH_CACHE */
+
+    result = fx_file_delete(media, path);
+    if (result != FX_SUCCESS)
+    {
+        dir_entry.fx_dir_entry_cluster = chain.cluster;
+        dir_entry.fx_dir_entry_file_size = file_size;
+#ifdef FX_ENABLE_EXFAT
+        dir_entry.fx_dir_entry_available_file_size = allocated;
+#endif /* FX_ENABLE_EXFAT */
+        if (_fx_directory_entry_write(media, &dir_entry) == FX_SUCCESS)
+        {
+            filex_media->deferred_count--;
+            _filex_deferred_journal_write(filex_media, RT_NULL);
+        }
+        else
+        {
+            /* The file stays detached, its chain goes like a deleted one.  */
+            rt_sem_release(deferred_sem);
+        }
+        return result;
+    }
+
+    /* The chain is queued either way; a journal still marking it pending
+       is settled the same at the next mount.  */
+    result = _filex_deferred_journal_write(filex_media, RT_NULL);
+    rt_sem_release(deferred_sem);
+    return result;
+}
+
+/* Drops the pending chain of a journal if its file still holds it: the
+   delete that queued it never took effect.  */
+static void _filex_deferred_settle(filex_media_t * filex_media, FX_FILE * journal, ULONG length)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_DIR_ENTRY dir_entry;
+    CHAR * path;
+    ULONG actual;
+
+    path = filex_pool_alloc(FILEX_POOL_NAME, FX_MAX_LONG_NAME_LEN);
+    if (path == RT_NULL)
+    {
+        /* Drop it, leaking clusters is better than freeing live ones.  */
+        filex_media->deferred_count--;
+        return;
+    }
+    if ((length >= FX_MAX_LONG_NAME_LEN) ||
+        (fx_file_read(journal, path, length, &actual) != FX_SUCCESS) || (actual != length))
+    {
+        filex_media->deferred_count--;
+        filex_pool_free(FILEX_POOL_NAME, path);
+        return;
+    }
+    path[length] = 0;
+
+    dir_entry.fx_dir_entry_name = media->fx_media_name_buffer + 2 * FX_MAX_LONG_NAME_LEN;
+    dir_entry.fx_dir_entry_short_name[0] = 0;
+    if ((_fx_directory_search(media, path, &dir_entry, FX_NULL, FX_NULL) == FX_SUCCESS) &&
+        (dir_entry.fx_dir_entry_cluster == filex_media->deferred[filex_media->deferred_count - 1].cluster))
+    {
+        filex_media->deferred_count--;
+    }
+    filex_pool_free(FILEX_POOL_NAME, path);
+}
+
+void filex_deferred_delete_load(filex_media_t * filex_media)
+{
+    FX_FILE journal;
+    ULONG header[3];
+    ULONG actual;
+
+    filex_media->deferred_count = 0;
+    if (fx_file_open(&filex_media->media, &journal, FILEX_DEFERRED_DELETE_JOURNAL, FX_OPEN_FOR_READ) != FX_SUCCESS)
+    {
+        return;
+    }
+
+    /* Chains left behind by an unmount or a crash are picked up again.  */
+    if ((fx_file_read(&journal, header, sizeof(header), &actual) == FX_SUCCESS) &&
+        (actual == sizeof(header)) &&
+        (header[0] == FILEX_DEFERRED_JOURNAL_MAGIC) &&
+        (header[1] <= FILEX_DEFERRED_DELETE_QUEUE_SIZE))
+    {
+        if ((fx_file_read(&journal, filex_media->deferred, header[1] * sizeof(filex_deferred_chain_t), &actual) == FX_SUCCESS) &&
+            (actual == header[1] * sizeof(filex_deferred_chain_t)))
+        {
+            filex_media->deferred_count = header[1];
+            if (header[2] && header[1])
+            {
+                _filex_deferred_settle(filex_media, &journal, header[2]);
+            }
+        }
+    }
+    fx_file_close(&journal);
+
+    if (filex_media->deferred_count)
+    {
+        rt_sem_release(deferred_sem);
+    }
+}
+
+int filex_deferred_delete_init(void)
+{
+    rt_thread_t tid;
+
+    deferred_sem = rt_sem_create("fxdefer", 0, RT_IPC_FLAG_FIFO);
+    RT_ASSERT(deferred_sem);
+
+    tid = rt_thread_create("fxdefer", _filex_deferred_entry, RT_NULL,
+                           FILEX_DEFERRED_DELETE_THREAD_STACK_SIZE,
+                           FILEX_DEFERRED_DELETE_THREAD_PRIORITY, 10);
+    if (tid == RT_NULL)
+    {
+        return -RT_ENOMEM;
+    }
+    return rt_thread_startup(tid);
+}
+
+#endif /* FILEX_USING_DEFERRED_DELETE */
@@ -0,0 +1,639 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "fx_directory.h"
+#include "fx_utility.h"
+#include "dfs_filex.h"
+
+#ifdef FX_ENABLE_FAULT_TOLERANT
+#include "fx_fault_tolerant.h"
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+#ifdef FILEX_USING_DEFRAG
+
+/* Online defragmenter: a queued file is measured, a free run as long as
+   its chain is found and linked, the data is copied over and then the
+   directory entry is pointed at the run, after which the old chain is
+   released.  Every step runs under filex_lock for at most
+   FILEX_DEFRAG_STEP clusters, in a fault tolerant transaction when the
+   log is enabled.  The entry write is the only switch: a crash before it
+   leaves the file on its old chain, a crash after it on the new one, and
+   either way the other chain is only lost clusters.  */
+
+static rt_sem_t defrag_sem;
+static CHAR defrag_name[FX_MAX_LONG_NAME_LEN];
+
+static char _filex_defrag_fold(char c)
+{
+    if (c == '\\')
+    {
+        return '/';
+    }
+    return ((c >= 'a') && (c <= 'z')) ? (char)(c - 'a' + 'A') : c;
+}
+
+static rt_bool_t _filex_defrag_match(const char * name, const char * path)
+{
+    while (*path && (_filex_defrag_fold(*name) == _filex_defrag_fold(*path)))
+    {
+        name++;
+        path++;
+    }
+    return (*name == '\0') && (*path == '\0');
+}
+
+static UINT _filex_defrag_begin(FX_MEDIA * media)
+{
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    if (media->fx_media_fault_tolerant_enabled)
+    {
+        return _fx_fault_tolerant_transaction_start(media);
+    }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+    return FX_SUCCESS;
+}
+
+static UINT _filex_defrag_end(FX_MEDIA * media, UINT result)
+{
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    if (media->fx_media_fault_tolerant_enabled)
+    {
+        if (result != FX_SUCCESS)
+        {
+            _fx_fault_tolerant_transaction_fail(media);
+            return result;
+        }
+        return _fx_fault_tolerant_transaction_end(media);
+    }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+    return result;
+}
+
+rt_inline ULONG _filex_defrag_sector(FX_MEDIA * media, ULONG cluster)
+{
+    return media->fx_media_data_sector_start + (cluster - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster;
+}
+
+/* Counts clusters and contiguous runs of the chain from cluster.  */
+UINT filex_defrag_measure(FX_MEDIA * media, ULONG cluster, ULONG * clusters, ULONG * fragments)
+{
+    ULONG last_cluster = media->fx_media_total_clusters + FX_FAT_ENTRY_START;
+    ULONG next;
+    UINT result;
+
+    *clusters = 0;
+    *fragments = 0;
+    while ((cluster >= FX_FAT_ENTRY_START) && (cluster < last_cluster) && (*clusters < media->fx_media_total_clusters))
+    {
+        result = _fx_utility_FAT_entry_read(media, cluster, &next);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if ((*clusters)++ == 0)
+        {
+            (*fragments)++;
+        }
+        if ((next >= FX_FAT_ENTRY_START) && (next < last_cluster) && (next != cluster + 1))
+        {
+            (*fragments)++;
+        }
+        cluster = next;
+    }
+    return FX_SUCCESS;
+}
+
+/* The chain a job holds outside the directory tree, for the media check:
+   the run being filled or waiting to be switched to, or the old chain
+   being released.  */
+ULONG filex_defrag_orphan(filex_media_t * filex_media, ULONG index)
+{
+    filex_defrag_job_t * job = &filex_media->defrag[index];
+
+    if (index >= filex_media->defrag_count)
+    {
+        return 0;
+    }
+    if ((job->state == FILEX_DEFRAG_ALLOCATE) || (job->state == FILEX_DEFRAG_COPY) ||
+        (job->state == FILEX_DEFRAG_SWITCH))
+    {
+        return job->linked ? job->run : 0;
+    }
+    if (job->state == FILEX_DEFRAG_RELEASE)
+    {
+        return job->old;
+    }
+    return 0;
+}
+
+static void _filex_defrag_pop(filex_media_t * filex_media)
+{
+    rt_free(filex_media->defrag[0].buffer);
+    filex_media->defrag_count--;
+    rt_memmove(&filex_media->defrag[0], &filex_media->defrag[1],
+               filex_media->defrag_count * sizeof(filex_defrag_job_t));
+}
+
+/* Drops a job; a run already linked is released first.  */
+static void _filex_defrag_abort(filex_media_t * filex_media, filex_defrag_job_t * job)
+{
+    filex_media->defrag_stats.aborted++;
+    if (((job->state == FILEX_DEFRAG_ALLOCATE) || (job->state == FILEX_DEFRAG_COPY) ||
+         (job->state == FILEX_DEFRAG_SWITCH)) && job->linked)
+    {
+        job->state = FILEX_DEFRAG_RELEASE;
+        job->old = job->run;
+        return;
+    }
+    job->state = FILEX_DEFRAG_DONE;
+}
+
+/* The file is still the one measured and nobody has it open.  */
+static UINT _filex_defrag_entry(filex_media_t * filex_media, filex_defrag_job_t * job, FX_DIR_ENTRY * entry)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_FILE * file;
+    ULONG i;
+    UINT result;
+
+#ifdef FILEX_USING_HANDLE_CACHE
+    filex_handle_evict(filex_media, job->path);
+#endif /* FILEX_USING_HANDLE_CACHE */
+    entry->fx_dir_entry_name = defrag_name;
+    entry->fx_dir_entry_short_name[0] = 0;
+    result = _fx_directory_search(media, job->path, entry, FX_NULL, FX_NULL);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    if ((entry->fx_dir_entry_attributes & FX_DIRECTORY) ||
+        ((job->state != FILEX_DEFRAG_MEASURE) && (entry->fx_dir_entry_cluster != job->first)))
+    {
+        return FX_NOT_FOUND;
+    }
+
+    file = media->fx_media_opened_file_list;
+    for (i = 0; i < media->fx_media_opened_file_count; i++)
+    {
+        if ((file->fx_file_dir_entry.fx_dir_entry_log_sector == entry->fx_dir_entry_log_sector) &&
+            (file->fx_file_dir_entry.fx_dir_entry_byte_offset == entry->fx_dir_entry_byte_offset))
+        {
+            return FX_ACCESS_ERROR;
+        }
+        file = file->fx_file_opened_next;
+    }
+    return FX_SUCCESS;
+}
+
+static UINT _filex_defrag_search(filex_media_t * filex_media, filex_defrag_job_t * job)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG last_cluster = media->fx_media_total_clusters + FX_FAT_ENTRY_START;
+    ULONG value;
+    ULONG i;
+    UINT result;
+
+    for (i = 0; (i < FILEX_DEFRAG_STEP * 16) && (job->cursor < last_cluster); i++, job->cursor++)
+    {
+        result = _fx_utility_FAT_entry_read(media, job->cursor, &value);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if (value != FX_FREE_CLUSTER)
+        {
+            job->run = job->cursor + 1;
+            continue;
+        }
+        if (job->cursor + 1 - job->run == job->clusters)
+        {
+            job->state = FILEX_DEFRAG_ALLOCATE;
+            job->cursor = job->run;
+            job->linked = 0;
+            return FX_SUCCESS;
+        }
+    }
+
+    if (job->cursor >= last_cluster)
+    {
+        filex_media->defrag_stats.no_space++;
+        job->state = FILEX_DEFRAG_DONE;
+    }
+    return FX_SUCCESS;
+}
+
+/* Links the next part of the run, ending it with a last cluster mark each
+   step so it is always a whole chain.  */
+static UINT _filex_defrag_allocate(filex_media_t * filex_media, filex_defrag_job_t * job)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG cluster = job->run + job->linked;
+    ULONG count = job->clusters - job->linked;
+    ULONG value;
+    ULONG i;
+    UINT result;
+
+    if (count > FILEX_DEFRAG_STEP)
+    {
+        count = FILEX_DEFRAG_STEP;
+    }
+    for (i = 0; i < count; i++)
+    {
+        result = _fx_utility_FAT_entry_read(media, cluster + i, &value);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if (value != FX_FREE_CLUSTER)
+        {
+            /* Taken by a foreground write since the search.  */
+            _filex_defrag_abort(filex_media, job);
+            return FX_SUCCESS;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        result = _fx_utility_FAT_entry_write(media, cluster + i, (i + 1 < count) ? cluster + i + 1 : media->fx_media_fat_last);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+    }
+    if (job->linked)
+    {
+        result = _fx_utility_FAT_entry_write(media, cluster - 1, cluster);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+    }
+    media->fx_media_available_clusters -= count;
+    job->linked += count;
+
+    if (job->linked == job->clusters)
+    {
+        job->state = FILEX_DEFRAG_COPY;
+        job->old = job->first;
+        job->cursor = 0;
+    }
+    return FX_SUCCESS;
+}
+
+static UINT _filex_defrag_copy(filex_media_t * filex_media, filex_defrag_job_t * job)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG source;
+    ULONG target;
+    ULONG sector;
+    ULONG next;
+    ULONG i;
+    UINT result;
+
+    for (i = 0; (i < FILEX_DEFRAG_STEP) && (job->cursor < job->clusters); i++)
+    {
+        source = _filex_defrag_sector(media, job->old);
+        target = _filex_defrag_sector(media, job->run + job->cursor);
+        for (sector = 0; sector < media->fx_media_sectors_per_cluster; sector++)
+        {
+            result = fx_media_read(media, source + sector, job->buffer);
+            if (result == FX_SUCCESS)
+            {
+                result = fx_media_write(media, target + sector, job->buffer);
+            }
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+        }
+
+        result = _fx_utility_FAT_entry_read(media, job->old, &next);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        job->old = next;
+        job->cursor++;
+    }
+
+    if (job->cursor == job->clusters)
+    {
+        job->state = FILEX_DEFRAG_SWITCH;
+    }
+    return FX_SUCCESS;
+}
+
+static UINT _filex_defrag_switch(filex_media_t * filex_media, filex_defrag_job_t * job, FX_DIR_ENTRY * entry)
+{
+    FX_MEDIA * media = &filex_media->media;
+    UINT result;
+
+    entry->fx_dir_entry_cluster = job->run;
+    result = _fx_directory_entry_write(media, entry);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+
+#ifndef FX_MEDIA_DISABLE_SEARCH_CACHE
+    /* The search cache still holds the entry with the old chain.  */
+    media->fx_media_last_found_name[0] = 0;
+#endif /* FX_MEDIA_DISABLE_SEARCH_CACHE */
+
+    filex_media->defrag_stats.files++;
+    filex_media->defrag_stats.clusters_moved += job->clusters;
+    filex_media->defrag_stats.fragments_before += job->fragments;
+    filex_media->defrag_stats.fragments_after++;
+    job->state = FILEX_DEFRAG_RELEASE;
+    job->old = job->first;
+    return FX_SUCCESS;
+}
+
+static UINT _filex_defrag_release(filex_media_t * filex_media, filex_defrag_job_t * job)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG last_cluster = media->fx_media_total_clusters + FX_FAT_ENTRY_START;
+    ULONG next;
+    ULONG i;
+    UINT result;
+
+    for (i = 0; (i < FILEX_DEFRAG_STEP) && (job->old >= FX_FAT_ENTRY_START) && (job->old < last_cluster); i++)
+    {
+        result = _fx_utility_FAT_entry_read(media, job->old, &next);
+        if (result == FX_SUCCESS)
+        {
+            result = _fx_utility_FAT_entry_write(media, job->old, FX_FREE_CLUSTER);
+        }
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        media->fx_media_available_clusters++;
+        job->old = (next < media->fx_media_fat_reserved) ? next : FX_FREE_CLUSTER;
+    }
+
+    if ((job->old < FX_FAT_ENTRY_START) || (job->old >= last_cluster))
+    {
+        job->state = FILEX_DEFRAG_DONE;
+    }
+    return FX_SUCCESS;
+}
+
+/* One step of the job at the head of the queue.  RT_TRUE while there is
+   more to do.  */
+static rt_bool_t _filex_defrag_step(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_defrag_job_t * job = &filex_media->defrag[0];
+    FX_DIR_ENTRY entry;
+    UINT result = FX_SUCCESS;
+
+#ifdef FILEX_USING_GROUP_COMMIT
+    filex_group_commit(filex_media);
+#endif /* FILEX_USING_GROUP_COMMIT */
+
+    if (job->cancel)
+    {
+        job->cancel = RT_FALSE;
+        _filex_defrag_abort(filex_media, job);
+    }
+    if (job->state <= FILEX_DEFRAG_SWITCH)
+    {
+        result = _filex_defrag_entry(filex_media, job, &entry);
+        if (result == FX_ACCESS_ERROR)
+        {
+            /* Open: try again next round.  */
+            return RT_TRUE;
+        }
+        if (result != FX_SUCCESS)
+        {
+            _filex_defrag_abort(filex_media, job);
+        }
+    }
+
+    if (job->state != FILEX_DEFRAG_DONE)
+    {
+        result = _filex_defrag_begin(media);
+        if (result == FX_SUCCESS)
+        {
+            switch (job->state)
+            {
+            case FILEX_DEFRAG_MEASURE:
+                job->first = entry.fx_dir_entry_cluster;
+                result = filex_defrag_measure(media, job->first, &job->clusters, &job->fragments);
+                job->state = (job->fragments > 1) ? FILEX_DEFRAG_SEARCH : FILEX_DEFRAG_DONE;
+                job->cursor = FX_FAT_ENTRY_START;
+                job->run = FX_FAT_ENTRY_START;
+                break;
+            case FILEX_DEFRAG_SEARCH:
+                result = _filex_defrag_search(filex_media, job);
+                break;
+            case FILEX_DEFRAG_ALLOCATE:
+                result = _filex_defrag_allocate(filex_media, job);
+                break;
+            case FILEX_DEFRAG_COPY:
+                result = _filex_defrag_copy(filex_media, job);
+                break;
+            case FILEX_DEFRAG_SWITCH:
+                result = _filex_defrag_switch(filex_media, job, &entry);
+                break;
+            default:
+                result = _filex_defrag_release(filex_media, job);
+                break;
+            }
+            result = _filex_defrag_end(media, result);
+        }
+        if (result == FX_SUCCESS)
+        {
+            result = fx_media_flush(media);
+        }
+        if (result != FX_SUCCESS)
+        {
+            /* The media is in trouble; leave the rest to a media check.  */
+            filex_media->defrag_stats.aborted++;
+            job->state = FILEX_DEFRAG_DONE;
+        }
+    }
+
+    if (job->state == FILEX_DEFRAG_DONE)
+    {
+        _filex_defrag_pop(filex_media);
+    }
+    return filex_media->defrag_count != 0;
+}
+
+static void _filex_defrag_entry_thread(void * parameter)
+{
+    rt_list_t * node;
+    filex_media_t * filex_media;
+    rt_bool_t pending;
+
+#ifdef FILEX_USING_QOS
+    filex_qos_set(RT_NULL, FILEX_QOS_BACKGROUND);
+#endif /* FILEX_USING_QOS */
+
+    while (1)
+    {
+        rt_sem_take(defrag_sem, RT_WAITING_FOREVER);
+
+        do
+        {
+            pending = RT_FALSE;
+
+            filex_lock();
+            rt_list_for_each(node, &filex_media_list)
+            {
+                filex_media = rt_list_entry(node, filex_media_t, list);
+                if ((filex_media->media.fx_media_id == FX_MEDIA_ID) && filex_media->defrag_count &&
+                    _filex_defrag_step(filex_media))
+                {
+                    pending = RT_TRUE;
+                }
+            }
+            filex_unlock();
+
+            if (pending)
+            {
+                rt_thread_mdelay(FILEX_DEFRAG_INTERVAL);
+            }
+        } while (pending);
+    }
+}
+
+/* Queues path, relative to the mount, for defragmenting.  Called with
+   filex_lock held.  */
+UINT filex_defrag_queue(filex_media_t * filex_media, const CHAR * path)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_defrag_job_t * job;
+    ULONG i;
+
+#ifdef FX_ENABLE_EXFAT
+    /* exFAT files FileX writes are contiguous runs without a chain.  */
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    if (filex_media->read_only)
+    {
+        return FX_WRITE_PROTECT;
+    }
+    if (rt_strlen(path) >= FILEX_DEFRAG_PATH_MAX)
+    {
+        return FX_INVALID_PATH;
+    }
+    for (i = 0; i < filex_media->defrag_count; i++)
+    {
+        if (_filex_defrag_match(filex_media->defrag[i].path, path))
+        {
+            return FX_SUCCESS;
+        }
+    }
+    if (filex_media->defrag_count >= FILEX_DEFRAG_QUEUE_SIZE)
+    {
+        return FX_NO_MORE_ENTRIES;
+    }
+
+    job = &filex_media->defrag[filex_media->defrag_count];
+    rt_memset(job, 0, sizeof(filex_defrag_job_t));
+    job->buffer = rt_malloc(media->fx_media_bytes_per_sector);
+    if (job->buffer == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    rt_strncpy(job->path, path, FILEX_DEFRAG_PATH_MAX);
+    job->state = FILEX_DEFRAG_MEASURE;
+    filex_media->defrag_count++;
+
+    rt_sem_release(defrag_sem);
+    return FX_SUCCESS;
+}
+
+/* A write open of path makes a copy in progress stale.  */
+void filex_defrag_cancel(filex_media_t * filex_media, const CHAR * path)
+{
+    ULONG i;
+
+    for (i = 0; i < filex_media->defrag_count; i++)
+    {
+        if (_filex_defrag_match(filex_media->defrag[i].path, path) &&
+            (filex_media->defrag[i].state != FILEX_DEFRAG_RELEASE))
+        {
+            filex_media->defrag[i].cancel = RT_TRUE;
+        }
+    }
+}
+
+/* Forgets queued jobs before unmount; what they linked is lost clusters.  */
+void filex_defrag_release(filex_media_t * filex_media)
+{
+    while (filex_media->defrag_count)
+    {
+        _filex_defrag_pop(filex_media);
+    }
+}
+
+int filex_defrag_init(void)
+{
+    rt_thread_t thread;
+
+    defrag_sem = rt_sem_create("fxdefrag", 0, RT_IPC_FLAG_FIFO);
+    if (defrag_sem == RT_NULL)
+    {
+        return -RT_ENOMEM;
+    }
+
+    thread = rt_thread_create("fxdefrag", _filex_defrag_entry_thread, RT_NULL,
+                              FILEX_DEFRAG_THREAD_STACK_SIZE, FILEX_DEFRAG_THREAD_PRIORITY, 10);
+    if (thread == RT_NULL)
+    {
+        rt_sem_delete(defrag_sem);
+        defrag_sem = RT_NULL;
+        return -RT_ENOMEM;
+    }
+    return rt_thread_startup(thread);
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+#include <dfs_posix.h>
+
+static void filex_defrag(int argc, char ** argv)
+{
+    struct filex_defrag_stats * stats;
+    filex_media_t * filex_media;
+    rt_list_t * node;
+    int fd;
+
+    if (argc > 1)
+    {
+        fd = open(argv[1], O_RDONLY, 0);
+        if (fd < 0)
+        {
+            rt_kprintf("%s: cannot open\n", argv[1]);
+            return;
+        }
+        if (ioctl(fd, FILEX_IOCTL_DEFRAG, RT_NULL) < 0)
+        {
+            rt_kprintf("%s: cannot queue, errno %d\n", argv[1], rt_get_errno());
+        }
+        close(fd);
+    }
+
+    filex_lock();
+    rt_list_for_each(node, &filex_media_list)
+    {
+        filex_media = rt_list_entry(node, filex_media_t, list);
+        stats = &filex_media->defrag_stats;
+        rt_kprintf("%s: %u queued  %u files  %u clusters moved  %u -> %u fragments  %u aborted  %u no space\n",
+                   filex_media->media.fx_media_name, filex_media->defrag_count, stats->files,
+                   stats->clusters_moved, stats->fragments_before, stats->fragments_after,
+                   stats->aborted, stats->no_space);
+    }
+    filex_unlock();
+}
+MSH_CMD_EXPORT(filex_defrag, defragment a filex file in the background: filex_defrag [path]);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_DEFRAG */
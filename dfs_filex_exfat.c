@@ -0,0 +1,266 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "fx_directory.h"
+#include "fx_utility.h"
+#include "dfs_filex.h"
+
+#include <string.h>
+
+#if defined(FILEX_USING_EXFAT_HASH) && defined(FX_ENABLE_EXFAT)
+
+#define FILEX_EXFAT_ENTRY_FILE      0x85
+#define FILEX_EXFAT_ENTRY_STREAM    0xC0
+#define FILEX_EXFAT_NAME_MAX        255
+
+#define FILEX_IS_SEPARATOR(c)       (((c) == '/') || ((c) == '\\'))
+#define FILEX_TO_UPPER(c)           ((((c) >= 'a') && ((c) <= 'z')) ? ((c) - 'a' + 'A') : (c))
+
+static const CHAR * _filex_exfat_component(const CHAR * path, rt_size_t * length)
+{
+    rt_size_t i = 0;
+
+    while (FILEX_IS_SEPARATOR(*path))
+    {
+        path++;
+    }
+    while (path[i] && !FILEX_IS_SEPARATOR(path[i]))
+    {
+        i++;
+    }
+    *length = i;
+    return path;
+}
+
+/* The stream extension name hash, computed once per component.  ASCII is
+   folded inline; anything else goes through the FileX up-case table.  */
+static USHORT _filex_exfat_hash(filex_media_t * filex_media, const CHAR * name, rt_size_t length, rt_bool_t * ascii)
+{
+    USHORT hash = 0;
+    rt_size_t i;
+
+    *ascii = RT_TRUE;
+    for (i = 0; i < length; i++)
+    {
+        if ((UCHAR)name[i] >= 0x80)
+        {
+            *ascii = RT_FALSE;
+            rt_memcpy(filex_media->exfat_name, name, length);
+            filex_media->exfat_name[length] = 0;
+            return _fx_utility_exFAT_name_hash_get(filex_media->exfat_name);
+        }
+
+        /* Each UTF-16 character hashes low byte first.  */
+        hash = (USHORT)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (UCHAR)FILEX_TO_UPPER(name[i]));
+        hash = (USHORT)(((hash & 1) ? 0x8000 : 0) + (hash >> 1));
+    }
+    return hash;
+}
+
+static rt_bool_t _filex_exfat_match(const CHAR * name, const CHAR * component, rt_size_t length)
+{
+    rt_size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        if (FILEX_TO_UPPER(name[i]) != FILEX_TO_UPPER(component[i]))
+        {
+            return RT_FALSE;
+        }
+    }
+    return name[length] == 0;
+}
+
+/* Scans the raw directory sectors, looking only at the hash and length in
+   each stream extension; FileX reads the full entry set of a candidate.
+   FX_NOT_FOUND is definite, FX_NOT_IMPLEMENTED when a non-ASCII candidate
+   could not be compared here.  */
+static UINT _filex_exfat_find(filex_media_t * filex_media, FX_DIR_ENTRY * source,
+                              const CHAR * name, rt_size_t length, FX_DIR_ENTRY * entry)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG bytes_per_cluster = media->fx_media_bytes_per_sector * media->fx_media_sectors_per_cluster;
+    ULONG clusters_left = 0;
+    ULONG cluster;
+    ULONG next;
+    ULONG sector;
+    ULONG offset;
+    ULONG number = 0;
+    ULONG file_number = 0xFFFFFFFFUL;
+    ULONG candidate;
+    ULONG64 logical_sector;
+    rt_bool_t contiguous = RT_FALSE;
+    rt_bool_t uncertain = RT_FALSE;
+    rt_bool_t ascii;
+    UCHAR * record;
+    USHORT hash;
+    UINT result;
+
+    hash = _filex_exfat_hash(filex_media, name, length, &ascii);
+
+    if (source == FX_NULL)
+    {
+        cluster = media->fx_media_root_cluster_32;
+    }
+    else
+    {
+        cluster = source->fx_dir_entry_cluster;
+        if (source->fx_dir_entry_dont_use_fat & 1)
+        {
+            contiguous = RT_TRUE;
+            clusters_left = (ULONG)((source->fx_dir_entry_file_size + bytes_per_cluster - 1) / bytes_per_cluster);
+        }
+    }
+
+    while ((cluster >= FX_FAT_ENTRY_START) && (cluster < media->fx_media_fat_reserved))
+    {
+        for (sector = 0; sector < media->fx_media_sectors_per_cluster; sector++)
+        {
+            logical_sector = media->fx_media_data_sector_start +
+                             (ULONG64)(cluster - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster + sector;
+            result = _fx_utility_logical_sector_read(media, logical_sector, media->fx_media_memory_buffer, 1, FX_DIRECTORY_SECTOR);
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+
+            for (offset = 0; offset < media->fx_media_bytes_per_sector; offset += FX_DIR_ENTRY_SIZE, number++)
+            {
+                record = media->fx_media_memory_buffer + offset;
+                if (record[0] == FX_EXFAT_DIR_ENTRY_TYPE_END_MARKER)
+                {
+                    return uncertain ? FX_NOT_IMPLEMENTED : FX_NOT_FOUND;
+                }
+                if (record[0] == FILEX_EXFAT_ENTRY_FILE)
+                {
+                    file_number = number;
+                    continue;
+                }
+                if ((record[0] != FILEX_EXFAT_ENTRY_STREAM) || (number != file_number + 1) ||
+                    (record[3] != length) || (_fx_utility_16_unsigned_read(&record[4]) != hash))
+                {
+                    continue;
+                }
+
+                candidate = file_number;
+                entry->fx_dir_entry_short_name[0] = 0;
+                result = _fx_directory_entry_read(media, source, &candidate, entry);
+                if (result != FX_SUCCESS)
+                {
+                    return result;
+                }
+                if (_filex_exfat_match(entry->fx_dir_entry_name, name, length))
+                {
+                    return FX_SUCCESS;
+                }
+                if (!ascii)
+                {
+                    uncertain = RT_TRUE;
+                }
+
+                /* The entry read moved the media buffer, get the sector back.  */
+                result = _fx_utility_logical_sector_read(media, logical_sector, media->fx_media_memory_buffer, 1, FX_DIRECTORY_SECTOR);
+                if (result != FX_SUCCESS)
+                {
+                    return result;
+                }
+            }
+        }
+
+        if (contiguous)
+        {
+            if (--clusters_left == 0)
+            {
+                break;
+            }
+            cluster++;
+        }
+        else
+        {
+            result = _fx_utility_FAT_entry_read(media, cluster, &next);
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+            if (next == cluster)
+            {
+                return FX_FAT_READ_ERROR;
+            }
+            cluster = next;
+        }
+    }
+
+    return uncertain ? FX_NOT_IMPLEMENTED : FX_NOT_FOUND;
+}
+
+UINT filex_exfat_search(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_DIR_ENTRY * source = FX_NULL;
+    FX_DIR_ENTRY found;
+    const CHAR * component;
+    const CHAR * next;
+    rt_size_t length;
+    rt_size_t next_length;
+    UINT result;
+
+    if (media->fx_media_FAT_type != FX_exFAT)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+
+    component = _filex_exfat_component(path, &length);
+    found.fx_dir_entry_name = filex_media->exfat_name;
+    while (1)
+    {
+        /* Root, dot names and overlong names are left to FileX.  */
+        if ((length == 0) || (length > FILEX_EXFAT_NAME_MAX) || (length >= FX_MAX_LONG_NAME_LEN) ||
+            ((component[0] == '.') && ((length == 1) || ((length == 2) && (component[1] == '.')))))
+        {
+            return FX_NOT_IMPLEMENTED;
+        }
+
+        next = _filex_exfat_component(component + length, &next_length);
+        if (next_length == 0)
+        {
+            result = _filex_exfat_find(filex_media, source, component, length, entry);
+            if (result == FX_SUCCESS)
+            {
+                filex_search_cache_prime(media, path, entry, source);
+            }
+            return result;
+        }
+
+        result = _filex_exfat_find(filex_media, source, component, length, &found);
+        if (result == FX_NOT_FOUND)
+        {
+            return FX_INVALID_PATH;
+        }
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if (!(found.fx_dir_entry_attributes & FX_DIRECTORY))
+        {
+            return FX_INVALID_PATH;
+        }
+
+        filex_media->exfat_dir = found;
+        filex_media->exfat_dir.fx_dir_entry_name = filex_media->exfat_dir_name;
+        rt_strncpy(filex_media->exfat_dir_name, found.fx_dir_entry_name, FX_MAX_LONG_NAME_LEN);
+        source = &filex_media->exfat_dir;
+
+        component = next;
+        length = next_length;
+    }
+}
+
+#elif defined(FILEX_USING_EXFAT_HASH)
+
+/* Built without exFAT support, every lookup stays with FileX.  */
+UINT filex_exfat_search(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry)
+{
+    return FX_NOT_IMPLEMENTED;
+}
+
+#endif /* FILEX_USING_EXFAT_HASH && FX_ENABLE_EXFAT */
@@ -0,0 +1,165 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_GROUP_COMMIT
+
+#include "fx_fault_tolerant.h"
+
+static rt_sem_t group_sem = RT_NULL;
+
+/* Failures FileX reports before it logs anything, they need no early commit.  */
+static rt_bool_t _filex_group_clean_failure(UINT result)
+{
+    switch (result)
+    {
+    case FX_NOT_FOUND:
+    case FX_ALREADY_CREATED:
+    case FX_INVALID_PATH:
+    case FX_INVALID_NAME:
+    case FX_NOT_A_FILE:
+    case FX_NOT_DIRECTORY:
+    case FX_DIR_NOT_EMPTY:
+    case FX_ACCESS_ERROR:
+    case FX_WRITE_PROTECT:
+        return RT_TRUE;
+    default:
+        return RT_FALSE;
+    }
+}
+
+static rt_bool_t _filex_group_log_low(FX_MEDIA * media)
+{
+    return media->fx_media_fault_tolerant_file_size * 100 >=
+           media->fx_media_fault_tolerant_memory_buffer_size * (100 - FILEX_GROUP_COMMIT_HEADROOM);
+}
+
+/* Opens the outer transaction of a group if none is open.  The transaction
+   FileX starts for the operation itself then only nests inside it, so its
+   log is written and applied once, when the group commits.  */
+void filex_group_begin(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+
+    if (!media->fx_media_fault_tolerant_enabled)
+    {
+        return;
+    }
+
+    /* Leave room for the next operation rather than fail it half way.  */
+    if (filex_media->group_open && _filex_group_log_low(media))
+    {
+        filex_group_commit(filex_media);
+    }
+
+    if (!filex_media->group_open)
+    {
+        if (_fx_fault_tolerant_transaction_start(media) != FX_SUCCESS)
+        {
+            return;
+        }
+        filex_media->group_open = RT_TRUE;
+        filex_media->group_ops = 0;
+        if (group_sem != RT_NULL)
+        {
+            rt_sem_release(group_sem);
+        }
+    }
+
+    filex_media->group_mark_size = media->fx_media_fault_tolerant_file_size;
+    filex_media->group_mark_logs = media->fx_media_fault_tolerant_total_logs;
+    filex_media->group_mark_clusters = media->fx_media_available_clusters;
+}
+
+/* Drops what the current operation logged, the way
+   _fx_fault_tolerant_transaction_fail drops a whole transaction, and keeps
+   the operations before it in the group.  */
+static void _filex_group_rewind(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+
+    media->fx_media_fault_tolerant_file_size = filex_media->group_mark_size;
+    media->fx_media_fault_tolerant_total_logs = filex_media->group_mark_logs;
+    media->fx_media_available_clusters = filex_media->group_mark_clusters;
+#ifndef FX_MEDIA_DISABLE_SEARCH_CACHE
+    /* It may hold an entry only the dropped log had.  */
+    media->fx_media_last_found_name[0] = 0;
+#endif /* FX_MEDIA_DISABLE_SEARCH_CACHE */
+}
+
+/* Only called after filex_group_begin.  A failed operation leaves nothing
+   of itself for the commit.  */
+void filex_group_end(filex_media_t * filex_media, UINT result)
+{
+    if (!filex_media->group_open)
+    {
+        return;
+    }
+
+    if ((result != FX_SUCCESS) && !_filex_group_clean_failure(result))
+    {
+        _filex_group_rewind(filex_media);
+    }
+    filex_media->group_ops++;
+    if (filex_media->group_ops >= FILEX_GROUP_COMMIT_OPS)
+    {
+        filex_group_commit(filex_media);
+    }
+}
+
+/* Writes, applies and resets the log of the open group.  */
+UINT filex_group_commit(filex_media_t * filex_media)
+{
+    if (!filex_media->group_open)
+    {
+        return FX_SUCCESS;
+    }
+
+    filex_media->group_open = RT_FALSE;
+    return _fx_fault_tolerant_transaction_end(&filex_media->media);
+}
+
+/* Closes every group still open one window after it was signalled.  */
+static void _filex_group_entry(void * parameter)
+{
+    rt_list_t * node;
+    filex_media_t * filex_media;
+
+    while (1)
+    {
+        rt_sem_take(group_sem, RT_WAITING_FOREVER);
+        rt_thread_mdelay(FILEX_GROUP_COMMIT_WINDOW);
+
+        filex_lock();
+        rt_list_for_each(node, &filex_media_list)
+        {
+            filex_media = rt_list_entry(node, filex_media_t, list);
+            filex_group_commit(filex_media);
+        }
+        filex_unlock();
+    }
+}
+
+int filex_group_commit_init(void)
+{
+    rt_thread_t thread;
+
+    group_sem = rt_sem_create("fxgroup", 0, RT_IPC_FLAG_FIFO);
+    if (group_sem == RT_NULL)
+    {
+        return -RT_ENOMEM;
+    }
+
+    thread = rt_thread_create("fxgroup", _filex_group_entry, RT_NULL,
+                              FILEX_GROUP_COMMIT_THREAD_STACK_SIZE, FILEX_GROUP_COMMIT_THREAD_PRIORITY, 10);
+    if (thread == RT_NULL)
+    {
+        rt_sem_delete(group_sem);
+        group_sem = RT_NULL;
+        return -RT_ENOMEM;
+    }
+    return rt_thread_startup(thread);
+}
+
+#endif /* FILEX_USING_GROUP_COMMIT */
@@ -0,0 +1,168 @@
+#include <rtthread.h>
+#include <stdlib.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_HANDLE_CACHE
+
+static char _filex_handle_fold(char c)
+{
+    if (c == '\\')
+    {
+        return '/';
+    }
+    return ((c >= 'a') && (c <= 'z')) ? (char)(c - 'a' + 'A') : c;
+}
+
+/* RT_TRUE when name is path, or with prefix also anything below path.
+   FAT names are case insensitive.  */
+static rt_bool_t _filex_handle_match(const char * name, const char * path, rt_bool_t prefix)
+{
+    while (*path && (_filex_handle_fold(*name) == _filex_handle_fold(*path)))
+    {
+        name++;
+        path++;
+    }
+    if (*path)
+    {
+        return RT_FALSE;
+    }
+    return (*name == '\0') || (prefix && (_filex_handle_fold(*name) == '/'));
+}
+
+static void _filex_handle_drop(filex_handle_t * handle)
+{
+    fx_file_close(handle->file);
+    filex_pool_free(FILEX_POOL_FILE, handle->file);
+    handle->file = RT_NULL;
+}
+
+/* The most recently closed handle of path opened the same way, taken out of
+   the cache; RT_NULL on a miss.  */
+FX_FILE * filex_handle_take(filex_media_t * filex_media, const char * path, UINT open_type)
+{
+    filex_handle_t * found = RT_NULL;
+    FX_FILE * file;
+    int i;
+
+    for (i = 0; i < FILEX_HANDLE_CACHE_SIZE; i++)
+    {
+        filex_handle_t * handle = &filex_media->handles[i];
+
+        if ((handle->file != RT_NULL) && (handle->file->fx_file_open_mode == open_type) &&
+            _filex_handle_match(handle->path, path, RT_FALSE) &&
+            ((found == RT_NULL) || (handle->stamp > found->stamp)))
+        {
+            found = handle;
+        }
+    }
+    if (found == RT_NULL)
+    {
+        filex_media->handle_misses++;
+        return RT_NULL;
+    }
+
+    filex_media->handle_hits++;
+    file = found->file;
+    found->file = RT_NULL;
+    return file;
+}
+
+/* Keeps a closed handle open in FileX, pushing out the least recently
+   closed one when full.  RT_FALSE when the caller must close it itself.  */
+rt_bool_t filex_handle_put(filex_media_t * filex_media, const char * path, FX_FILE * file)
+{
+    filex_handle_t * victim = &filex_media->handles[0];
+    int i;
+
+    if (rt_strlen(path) >= FILEX_HANDLE_PATH_MAX)
+    {
+        return RT_FALSE;
+    }
+
+    for (i = 0; i < FILEX_HANDLE_CACHE_SIZE; i++)
+    {
+        filex_handle_t * handle = &filex_media->handles[i];
+
+        if (handle->file == RT_NULL)
+        {
+            victim = handle;
+            break;
+        }
+        if (handle->stamp < victim->stamp)
+        {
+            victim = handle;
+        }
+    }
+    if (victim->file != RT_NULL)
+    {
+        _filex_handle_drop(victim);
+    }
+
+    victim->file = file;
+    victim->stamp = ++filex_media->handle_clock;
+    rt_strncpy(victim->path, path, FILEX_HANDLE_PATH_MAX);
+    return RT_TRUE;
+}
+
+/* Closes the cached handles of path and of everything below it, before it
+   is renamed, deleted, truncated or opened in a way that would conflict.  */
+void filex_handle_evict(filex_media_t * filex_media, const char * path)
+{
+    int i;
+
+    for (i = 0; i < FILEX_HANDLE_CACHE_SIZE; i++)
+    {
+        if ((filex_media->handles[i].file != RT_NULL) &&
+            _filex_handle_match(filex_media->handles[i].path, path, RT_TRUE))
+        {
+            _filex_handle_drop(&filex_media->handles[i]);
+        }
+    }
+}
+
+void filex_handle_release(filex_media_t * filex_media)
+{
+    int i;
+
+    for (i = 0; i < FILEX_HANDLE_CACHE_SIZE; i++)
+    {
+        if (filex_media->handles[i].file != RT_NULL)
+        {
+            _filex_handle_drop(&filex_media->handles[i]);
+        }
+    }
+    filex_media->handle_clock = 0;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+static void filex_handles(int argc, char ** argv)
+{
+    filex_media_t * filex_media;
+    rt_list_t * node;
+    int i;
+
+    filex_lock();
+    rt_list_for_each(node, &filex_media_list)
+    {
+        filex_media = rt_list_entry(node, filex_media_t, list);
+        rt_kprintf("%s: %u hits  %u misses\n", filex_media->media.fx_media_name,
+                   filex_media->handle_hits, filex_media->handle_misses);
+        for (i = 0; i < FILEX_HANDLE_CACHE_SIZE; i++)
+        {
+            if (filex_media->handles[i].file != RT_NULL)
+            {
+                rt_kprintf("  %s %s\n", filex_media->handles[i].file->fx_file_open_mode ? "rw" : "r ",
+                           filex_media->handles[i].path);
+            }
+        }
+    }
+    filex_unlock();
+}
+MSH_CMD_EXPORT(filex_handles, show filex cached file handles);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_HANDLE_CACHE */
@@ -0,0 +1,1243 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "fx_directory.h"
+#include "fx_system.h"
+#include "fx_utility.h"
+#include "dfs_filex.h"
+
+#include <string.h>
+
+#ifdef FILEX_USING_DIR_INDEX
+
+#define FILEX_DIR_INDEX_MIN_SLOTS   64
+
+#define FILEX_IS_SEPARATOR(c)       (((c) == '/') || ((c) == '\\'))
+#define FILEX_TO_UPPER(c)           ((((c) >= 'a') && ((c) <= 'z')) ? ((c) - 'a' + 'A') : (c))
+
+static ULONG _filex_dir_index_hash(const CHAR * name, rt_size_t length)
+{
+    ULONG hash = 2166136261UL;
+    rt_size_t i;
+
+    /* FNV-1a over the name folded the way FileX compares it.  */
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (UCHAR)FILEX_TO_UPPER(name[i]);
+        hash *= 16777619UL;
+    }
+
+    /* Zero marks an empty slot.  */
+    return hash ? hash : 1;
+}
+
+static rt_bool_t _filex_dir_index_match(const CHAR * name, const CHAR * component, rt_size_t length)
+{
+    rt_size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        if (FILEX_TO_UPPER(name[i]) != FILEX_TO_UPPER(component[i]))
+        {
+            return RT_FALSE;
+        }
+    }
+    return name[length] == 0;
+}
+
+static const CHAR * _filex_dir_index_component(const CHAR * path, rt_size_t * length)
+{
+    rt_size_t i = 0;
+
+    while (FILEX_IS_SEPARATOR(*path))
+    {
+        path++;
+    }
+    while (path[i] && !FILEX_IS_SEPARATOR(path[i]))
+    {
+        i++;
+    }
+    *length = i;
+    return path;
+}
+
+/* Number of slots an entry occupies ahead of the one FileX leaves the entry
+   number on after reading it.  */
+static ULONG _filex_dir_index_extra_slots(FX_MEDIA * media, FX_DIR_ENTRY * entry)
+{
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return entry->fx_dir_entry_secondary_count;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    if (entry->fx_dir_entry_long_name_present)
+    {
+        return (ULONG)((rt_strlen(entry->fx_dir_entry_name) + 12) / 13);
+    }
+    return 0;
+}
+
+static rt_bool_t _filex_dir_index_in_use(FX_MEDIA * media, FX_DIR_ENTRY * entry)
+{
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return entry->fx_dir_entry_type == FX_EXFAT_DIR_ENTRY_TYPE_FILE_DIRECTORY;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    if (((UCHAR)entry->fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_FREE) ||
+        (entry->fx_dir_entry_attributes & FX_VOLUME))
+    {
+        return RT_FALSE;
+    }
+    return RT_TRUE;
+}
+
+static rt_bool_t _filex_dir_index_is_end(FX_MEDIA * media, FX_DIR_ENTRY * entry)
+{
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return entry->fx_dir_entry_type == FX_EXFAT_DIR_ENTRY_TYPE_END_MARKER;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    return (UCHAR)entry->fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_DONE;
+}
+
+static void _filex_dir_index_free(filex_media_t * filex_media, filex_dir_index_t * index)
+{
+    rt_list_remove(&index->list);
+    filex_media->dir_index_memory -= sizeof(filex_dir_index_t) + index->size * sizeof(filex_index_slot_t);
+    if (index->slots)
+    {
+        rt_free(index->slots);
+    }
+    rt_free(index);
+}
+
+/* Evicts least recently used indexes until bytes more fit in the budget.  */
+static rt_bool_t _filex_dir_index_reserve(filex_media_t * filex_media, rt_size_t bytes, filex_dir_index_t * keep)
+{
+    rt_list_t * node = filex_media->dir_index_list.prev;
+    filex_dir_index_t * index;
+
+    while ((filex_media->dir_index_memory + bytes > FILEX_DIR_INDEX_MEMORY_SIZE) &&
+           (node != &filex_media->dir_index_list))
+    {
+        index = rt_list_entry(node, filex_dir_index_t, list);
+        node = node->prev;
+        if (index != keep)
+        {
+            _filex_dir_index_free(filex_media, index);
+        }
+    }
+    return filex_media->dir_index_memory + bytes <= FILEX_DIR_INDEX_MEMORY_SIZE;
+}
+
+/* Gives up on a directory that does not fit the budget; the empty index
+   stays in the list so it is not rebuilt on every lookup.  */
+static void _filex_dir_index_abandon(filex_media_t * filex_media, filex_dir_index_t * index)
+{
+    filex_media->dir_index_memory -= index->size * sizeof(filex_index_slot_t);
+    if (index->slots)
+    {
+        rt_free(index->slots);
+    }
+    index->slots = RT_NULL;
+    index->size = 0;
+    index->used = 0;
+}
+
+static void _filex_dir_index_insert_slot(filex_dir_index_t * index, ULONG hash, ULONG entry)
+{
+    ULONG mask = index->size - 1;
+    ULONG slot;
+
+    for (slot = hash & mask; index->slots[slot].hash; slot = (slot + 1) & mask)
+    {
+        if ((index->slots[slot].hash == hash) && (index->slots[slot].entry == entry))
+        {
+            return;
+        }
+    }
+    index->slots[slot].hash = hash;
+    index->slots[slot].entry = entry;
+    index->used++;
+}
+
+static rt_bool_t _filex_dir_index_put(filex_media_t * filex_media, filex_dir_index_t * index, ULONG hash, ULONG entry)
+{
+    filex_index_slot_t * slots;
+    ULONG size;
+    ULONG i;
+
+    if (index->size == 0)
+    {
+        return RT_FALSE;
+    }
+
+    /* Keep the load under 3/4 so probes stay short.  */
+    if ((index->used + 1) * 4 > index->size * 3)
+    {
+        size = index->size * 2;
+        if (!_filex_dir_index_reserve(filex_media, (size - index->size) * sizeof(filex_index_slot_t), index) ||
+            ((slots = rt_calloc(size, sizeof(filex_index_slot_t))) == RT_NULL))
+        {
+            _filex_dir_index_abandon(filex_media, index);
+            return RT_FALSE;
+        }
+        filex_media->dir_index_memory += (size - index->size) * sizeof(filex_index_slot_t);
+
+        /* Rehash from the stored hashes, no directory access needed.  */
+        {
+            filex_index_slot_t * old_slots = index->slots;
+
+            index->slots = slots;
+            index->size = size;
+            index->used = 0;
+            slots = old_slots;
+        }
+        for (i = 0; i < size / 2; i++)
+        {
+            if (slots[i].hash)
+            {
+                _filex_dir_index_insert_slot(index, slots[i].hash, slots[i].entry);
+            }
+        }
+        rt_free(slots);
+    }
+
+    _filex_dir_index_insert_slot(index, hash, entry);
+    return RT_TRUE;
+}
+
+static void _filex_dir_index_drop(filex_dir_index_t * index, ULONG hash, ULONG entry)
+{
+    ULONG mask = index->size - 1;
+    ULONG slot;
+    ULONG next;
+    ULONG home;
+
+    if (index->size == 0)
+    {
+        return;
+    }
+
+    for (slot = hash & mask; index->slots[slot].hash; slot = (slot + 1) & mask)
+    {
+        if ((index->slots[slot].hash == hash) && (index->slots[slot].entry == entry))
+        {
+            break;
+        }
+    }
+    if (index->slots[slot].hash == 0)
+    {
+        return;
+    }
+
+    /* Backward shift deletion keeps linear probing free of tombstones.  */
+    index->used--;
+    next = slot;
+    while (1)
+    {
+        index->slots[slot].hash = 0;
+        do
+        {
+            next = (next + 1) & mask;
+            if (index->slots[next].hash == 0)
+            {
+                return;
+            }
+            home = index->slots[next].hash & mask;
+        } while ((slot <= next) ? ((slot < home) && (home <= next)) : ((slot < home) || (home <= next)));
+
+        index->slots[slot] = index->slots[next];
+        slot = next;
+    }
+}
+
+static void _filex_dir_index_put_entry(filex_media_t * filex_media, filex_dir_index_t * index,
+                                       FX_DIR_ENTRY * entry, ULONG number)
+{
+    ULONG hash = _filex_dir_index_hash(entry->fx_dir_entry_name, rt_strlen(entry->fx_dir_entry_name));
+
+    if (!_filex_dir_index_put(filex_media, index, hash, number))
+    {
+        return;
+    }
+    if (entry->fx_dir_entry_short_name[0] &&
+        !_filex_dir_index_match(entry->fx_dir_entry_name, entry->fx_dir_entry_short_name,
+                                rt_strlen(entry->fx_dir_entry_short_name)))
+    {
+        hash = _filex_dir_index_hash(entry->fx_dir_entry_short_name, rt_strlen(entry->fx_dir_entry_short_name));
+        _filex_dir_index_put(filex_media, index, hash, number);
+    }
+}
+
+static filex_dir_index_t * _filex_dir_index_find(filex_media_t * filex_media, ULONG cluster)
+{
+    rt_list_t * node;
+    filex_dir_index_t * index;
+
+    rt_list_for_each(node, &filex_media->dir_index_list)
+    {
+        index = rt_list_entry(node, filex_dir_index_t, list);
+        if (index->cluster == cluster)
+        {
+            /* Most recently used first.  */
+            rt_list_remove(&index->list);
+            rt_list_insert_after(&filex_media->dir_index_list, &index->list);
+            return index;
+        }
+    }
+    return RT_NULL;
+}
+
+static filex_dir_index_t * _filex_dir_index_build(filex_media_t * filex_media, FX_DIR_ENTRY * source, ULONG cluster)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_dir_index_t * index;
+    FX_DIR_ENTRY entry;
+    ULONG number = 0;
+    ULONG start;
+    rt_size_t bytes = sizeof(filex_dir_index_t) + FILEX_DIR_INDEX_MIN_SLOTS * sizeof(filex_index_slot_t);
+
+    if (!_filex_dir_index_reserve(filex_media, bytes, RT_NULL))
+    {
+        return RT_NULL;
+    }
+    index = rt_calloc(1, sizeof(filex_dir_index_t));
+    if (index == RT_NULL)
+    {
+        return RT_NULL;
+    }
+    index->slots = rt_calloc(FILEX_DIR_INDEX_MIN_SLOTS, sizeof(filex_index_slot_t));
+    if (index->slots == RT_NULL)
+    {
+        rt_free(index);
+        return RT_NULL;
+    }
+    index->cluster = cluster;
+    index->size = FILEX_DIR_INDEX_MIN_SLOTS;
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+    index->first_free = 0xFFFFFFFFUL;
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+    filex_media->dir_index_memory += bytes;
+    rt_list_insert_after(&filex_media->dir_index_list, &index->list);
+
+    /* One linear pass, the same cost as a single missed search.  */
+    entry.fx_dir_entry_name = filex_media->index_name;
+    while (1)
+    {
+#ifndef FILEX_USING_DIR_FREE_SLOTS
+        /* Without slot tracking there is nothing left to learn.  */
+        if (index->size == 0)
+        {
+            break;
+        }
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+        start = number;
+        entry.fx_dir_entry_short_name[0] = 0;
+        if (_fx_directory_entry_read(media, source, &number, &entry) != FX_SUCCESS)
+        {
+            break;
+        }
+        if (_filex_dir_index_is_end(media, &entry))
+        {
+            break;
+        }
+        if (_filex_dir_index_in_use(media, &entry))
+        {
+            _filex_dir_index_put_entry(filex_media, index, &entry, start);
+        }
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+        else if ((UCHAR)entry.fx_dir_entry_name[0] == (UCHAR)FX_DIR_ENTRY_FREE)
+        {
+            index->deleted += number - start + 1;
+            if (index->first_free > start)
+            {
+                index->first_free = start;
+            }
+        }
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+        number++;
+    }
+
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+    /* start is the end marker, or the entry count of a full directory.  */
+    index->end = start;
+    if (index->first_free > index->end)
+    {
+        index->first_free = index->end;
+    }
+    index->complete = (index->size != 0);
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+
+    return index;
+}
+
+/* Reads the entry a slot points at and checks it still carries the name.  */
+static UINT _filex_dir_index_lookup(filex_media_t * filex_media, filex_dir_index_t * index, FX_DIR_ENTRY * source,
+                                    const CHAR * name, rt_size_t length, FX_DIR_ENTRY * entry, ULONG * start)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG hash = _filex_dir_index_hash(name, length);
+    ULONG stale = 0;
+    ULONG mask;
+    ULONG slot;
+    ULONG number;
+    rt_bool_t has_stale = RT_FALSE;
+    rt_bool_t found = RT_FALSE;
+
+    if (index->size == 0)
+    {
+        return FX_NOT_FOUND;
+    }
+
+    mask = index->size - 1;
+    for (slot = hash & mask; index->slots[slot].hash; slot = (slot + 1) & mask)
+    {
+        if (index->slots[slot].hash != hash)
+        {
+            continue;
+        }
+
+        number = index->slots[slot].entry;
+        entry->fx_dir_entry_short_name[0] = 0;
+        if ((_fx_directory_entry_read(media, source, &number, entry) == FX_SUCCESS) &&
+            _filex_dir_index_in_use(media, entry) &&
+            (number - _filex_dir_index_extra_slots(media, entry) == index->slots[slot].entry) &&
+            (_filex_dir_index_match(entry->fx_dir_entry_name, name, length) ||
+             _filex_dir_index_match(entry->fx_dir_entry_short_name, name, length)))
+        {
+            if (start)
+            {
+                *start = index->slots[slot].entry;
+            }
+            found = RT_TRUE;
+            break;
+        }
+        stale = index->slots[slot].entry;
+        has_stale = RT_TRUE;
+    }
+
+    /* The entry moved or went away behind the index, forget the slot.  */
+    if (has_stale && !found)
+    {
+        _filex_dir_index_drop(index, hash, stale);
+    }
+    return found ? FX_SUCCESS : FX_NOT_FOUND;
+}
+
+/* Resolves every directory of path through the indexes, leaving the parent
+   of the last component in filex_media->index_dir.  */
+static filex_dir_index_t * _filex_dir_index_parent(filex_media_t * filex_media, const CHAR * path,
+                                                   const CHAR ** name, rt_size_t * length, rt_bool_t build)
+{
+    FX_DIR_ENTRY * source = FX_NULL;
+    FX_DIR_ENTRY found;
+    filex_dir_index_t * index;
+    const CHAR * component;
+    const CHAR * next;
+    rt_size_t component_length;
+    rt_size_t next_length;
+    ULONG cluster = 0;
+
+    filex_media->index_dir_valid = FX_FALSE;
+    component = _filex_dir_index_component(path, &component_length);
+    if ((component_length == 0) || (component_length >= FX_MAX_LONG_NAME_LEN))
+    {
+        return RT_NULL;
+    }
+
+    found.fx_dir_entry_name = filex_media->index_name;
+    while (1)
+    {
+        next = _filex_dir_index_component(component + component_length, &next_length);
+
+        index = _filex_dir_index_find(filex_media, cluster);
+        if ((index == RT_NULL) && (build || next_length))
+        {
+            index = _filex_dir_index_build(filex_media, source, cluster);
+        }
+        if ((next_length == 0) || (index == RT_NULL))
+        {
+            *name = component;
+            *length = component_length;
+            return index;
+        }
+
+        if ((next_length >= FX_MAX_LONG_NAME_LEN) ||
+            (_filex_dir_index_lookup(filex_media, index, source, component, component_length, &found, RT_NULL) != FX_SUCCESS) ||
+            !(found.fx_dir_entry_attributes & FX_DIRECTORY))
+        {
+            return RT_NULL;
+        }
+
+        filex_media->index_dir = found;
+        filex_media->index_dir.fx_dir_entry_name = filex_media->index_dir_name;
+        rt_strncpy(filex_media->index_dir_name, found.fx_dir_entry_name, FX_MAX_LONG_NAME_LEN);
+        filex_media->index_dir_valid = FX_TRUE;
+
+        source = &filex_media->index_dir;
+        cluster = found.fx_dir_entry_cluster;
+        component = next;
+        component_length = next_length;
+    }
+}
+
+void filex_dir_index_reset(filex_media_t * filex_media)
+{
+    if (filex_media->dir_index_list.next == RT_NULL)
+    {
+        rt_list_init(&filex_media->dir_index_list);
+    }
+    while (!rt_list_isempty(&filex_media->dir_index_list))
+    {
+        _filex_dir_index_free(filex_media,
+                              rt_list_entry(filex_media->dir_index_list.next, filex_dir_index_t, list));
+    }
+    filex_media->dir_index_memory = 0;
+}
+
+UINT filex_dir_index_search(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry)
+{
+    FX_DIR_ENTRY * source;
+    filex_dir_index_t * index;
+    const CHAR * name;
+    rt_size_t length;
+
+    index = _filex_dir_index_parent(filex_media, path, &name, &length, RT_TRUE);
+    if (index == RT_NULL)
+    {
+        return FX_NOT_FOUND;
+    }
+
+    source = filex_media->index_dir_valid ? &filex_media->index_dir : FX_NULL;
+    if (_filex_dir_index_lookup(filex_media, index, source, name, length, entry, RT_NULL) != FX_SUCCESS)
+    {
+        return FX_NOT_FOUND;
+    }
+
+    filex_search_cache_prime(&filex_media->media, path, entry, source);
+    return FX_SUCCESS;
+}
+
+void filex_dir_index_add(filex_media_t * filex_media, CHAR * path, FX_DIR_ENTRY * entry)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_DIR_ENTRY * source;
+    FX_DIR_ENTRY check;
+    filex_dir_index_t * index;
+    const CHAR * name;
+    rt_size_t length;
+    ULONG start;
+    ULONG number;
+
+    /* Only directories that already have an index learn new names.  */
+    index = _filex_dir_index_parent(filex_media, path, &name, &length, RT_FALSE);
+    if ((index == RT_NULL) || (index->size == 0))
+    {
+        return;
+    }
+
+    /* Confirm the entry really starts where the slot will point.  */
+    start = entry->fx_dir_entry_number - _filex_dir_index_extra_slots(media, entry);
+    number = start;
+    source = filex_media->index_dir_valid ? &filex_media->index_dir : FX_NULL;
+    check.fx_dir_entry_name = filex_media->index_name;
+    check.fx_dir_entry_short_name[0] = 0;
+    if ((_fx_directory_entry_read(media, source, &number, &check) != FX_SUCCESS) ||
+        (number != entry->fx_dir_entry_number) ||
+        (!_filex_dir_index_match(check.fx_dir_entry_name, name, length) &&
+         !_filex_dir_index_match(check.fx_dir_entry_short_name, name, length)))
+    {
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+        /* A name is missing from the slots now, no more blind creates.  */
+        index->complete = RT_FALSE;
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+        return;
+    }
+
+    _filex_dir_index_put_entry(filex_media, index, &check, start);
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+    if (start >= index->end)
+    {
+        index->end = number + 1;
+    }
+    else
+    {
+        /* Reused a hole, the deleted count is only a hint from here on.  */
+        index->deleted = (index->deleted > number - start + 1) ? index->deleted - (number - start + 1) : 0;
+    }
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+}
+
+/* Notes what the index holds for path while its entry is still on disk.
+   FileX may yet refuse the delete or rename, so nothing changes here;
+   filex_dir_index_remove applies it once FileX has succeeded.  */
+void filex_dir_index_locate(filex_media_t * filex_media, CHAR * path, filex_dir_index_removal_t * removal)
+{
+    FX_DIR_ENTRY * source;
+    FX_DIR_ENTRY entry;
+    filex_dir_index_t * index;
+    const CHAR * name;
+    rt_size_t length;
+
+    removal->hash = 0;
+    index = _filex_dir_index_parent(filex_media, path, &name, &length, RT_FALSE);
+    if ((index == RT_NULL) || (index->size == 0))
+    {
+        return;
+    }
+
+    source = filex_media->index_dir_valid ? &filex_media->index_dir : FX_NULL;
+    entry.fx_dir_entry_name = filex_media->index_name;
+    if (_filex_dir_index_lookup(filex_media, index, source, name, length, &entry, &removal->start) != FX_SUCCESS)
+    {
+        return;
+    }
+
+    removal->cluster = index->cluster;
+    removal->last = entry.fx_dir_entry_number;
+    removal->hash = _filex_dir_index_hash(entry.fx_dir_entry_name, rt_strlen(entry.fx_dir_entry_name));
+    removal->short_hash = entry.fx_dir_entry_short_name[0] ?
+                          _filex_dir_index_hash(entry.fx_dir_entry_short_name, rt_strlen(entry.fx_dir_entry_short_name)) : 0;
+    removal->directory = (entry.fx_dir_entry_attributes & FX_DIRECTORY) ? entry.fx_dir_entry_cluster : 0;
+}
+
+void filex_dir_index_remove(filex_media_t * filex_media, filex_dir_index_removal_t * removal)
+{
+    filex_dir_index_t * index;
+
+    if (removal->hash == 0)
+    {
+        return;
+    }
+
+    index = _filex_dir_index_find(filex_media, removal->cluster);
+    if (index != RT_NULL)
+    {
+        _filex_dir_index_drop(index, removal->hash, removal->start);
+        if (removal->short_hash)
+        {
+            _filex_dir_index_drop(index, removal->short_hash, removal->start);
+        }
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+        index->deleted += removal->last - removal->start + 1;
+        if (index->first_free > removal->start)
+        {
+            index->first_free = removal->start;
+        }
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+    }
+
+    /* A removed directory takes its own index with it.  */
+    if (removal->directory && ((index = _filex_dir_index_find(filex_media, removal->directory)) != RT_NULL))
+    {
+        _filex_dir_index_free(filex_media, index);
+    }
+}
+
+/* Drops the index of the directory path lives in, for names FileX added
+   there without the index seeing them.  */
+void filex_dir_index_forget(filex_media_t * filex_media, CHAR * path)
+{
+    filex_dir_index_t * index;
+    const CHAR * name;
+    rt_size_t length;
+
+    index = _filex_dir_index_parent(filex_media, path, &name, &length, RT_FALSE);
+    if (index != RT_NULL)
+    {
+        _filex_dir_index_free(filex_media, index);
+    }
+}
+
+#ifdef FILEX_USING_DIR_FREE_SLOTS
+
+#define FILEX_DIR_LFN_ATTRIBUTES    0x0F
+#define FILEX_DIR_LFN_LAST          0x40
+#define FILEX_DIR_LFN_CHARS         13
+#define FILEX_DIR_ALIAS_TRIES       64
+
+/* Logical sector and byte offset of a directory entry number.  The walk
+   pair remembers the last cluster reached so sequential access stays
+   linear in long directory chains.  */
+static UINT _filex_dir_slot_locate(filex_media_t * filex_media, FX_DIR_ENTRY * source, ULONG number,
+                                   ULONG * walk_index, ULONG * walk_cluster, ULONG64 * sector, ULONG * offset)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG bytes_per_cluster = media->fx_media_bytes_per_sector * media->fx_media_sectors_per_cluster;
+    ULONG byte = number * FX_DIR_ENTRY_SIZE;
+    ULONG position;
+    ULONG cluster;
+    ULONG next;
+    ULONG i;
+    UINT result;
+
+    /* The FAT12/16 root directory is a fixed run of sectors.  */
+    if ((source == FX_NULL) && !media->fx_media_32_bit_FAT)
+    {
+        if (number >= media->fx_media_root_directory_entries)
+        {
+            return FX_NO_MORE_SPACE;
+        }
+        *sector = media->fx_media_root_sector_start + byte / media->fx_media_bytes_per_sector;
+        *offset = byte % media->fx_media_bytes_per_sector;
+        return FX_SUCCESS;
+    }
+
+    position = byte / bytes_per_cluster;
+    if (*walk_cluster && (position >= *walk_index))
+    {
+        cluster = *walk_cluster;
+        i = *walk_index;
+    }
+    else
+    {
+        cluster = source ? source->fx_dir_entry_cluster : media->fx_media_root_cluster_32;
+        i = 0;
+    }
+    while (i < position)
+    {
+        result = _fx_utility_FAT_entry_read(media, cluster, &next);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if ((next < FX_FAT_ENTRY_START) || (next == cluster) || (next >= media->fx_media_fat_reserved))
+        {
+            return FX_NO_MORE_SPACE;
+        }
+        cluster = next;
+        i++;
+    }
+    *walk_index = i;
+    *walk_cluster = cluster;
+
+    byte %= bytes_per_cluster;
+    *sector = media->fx_media_data_sector_start +
+              (ULONG64)(cluster - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster +
+              byte / media->fx_media_bytes_per_sector;
+    *offset = byte % media->fx_media_bytes_per_sector;
+    return FX_SUCCESS;
+}
+
+static UINT _filex_dir_slot_read(filex_media_t * filex_media, FX_DIR_ENTRY * source, ULONG number,
+                                 ULONG * walk_index, ULONG * walk_cluster, UCHAR * record)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG64 sector;
+    ULONG offset;
+    UINT result;
+
+    result = _filex_dir_slot_locate(filex_media, source, number, walk_index, walk_cluster, &sector, &offset);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    result = _fx_utility_logical_sector_read(media, sector, media->fx_media_memory_buffer, 1, FX_DIRECTORY_SECTOR);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    rt_memcpy(record, media->fx_media_memory_buffer + offset, FX_DIR_ENTRY_SIZE);
+    return FX_SUCCESS;
+}
+
+static UINT _filex_dir_slot_write(filex_media_t * filex_media, FX_DIR_ENTRY * source, ULONG number,
+                                  ULONG * walk_index, ULONG * walk_cluster, const UCHAR * record)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG64 sector;
+    ULONG offset;
+    UINT result;
+
+    result = _filex_dir_slot_locate(filex_media, source, number, walk_index, walk_cluster, &sector, &offset);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    result = _fx_utility_logical_sector_read(media, sector, media->fx_media_memory_buffer, 1, FX_DIRECTORY_SECTOR);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    rt_memcpy(media->fx_media_memory_buffer + offset, record, FX_DIR_ENTRY_SIZE);
+#ifndef FX_MEDIA_STATISTICS_DISABLE
+    /* Counted like a FileX entry write, a background check restarts on it.  */
+    media->fx_media_directory_entry_writes++;
+#endif /* FX_MEDIA_STATISTICS_DISABLE */
+    return _fx_utility_logical_sector_write(media, sector, media->fx_media_memory_buffer, 1, FX_DIRECTORY_SECTOR);
+}
+
+static rt_bool_t _filex_dir_short_char(CHAR c)
+{
+    return ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+           ((c != 0) && (strchr("!#$%&'()-@^_`{}~", c) != RT_NULL));
+}
+
+/* Printable ASCII names only, everything else is left to FileX.  */
+static rt_bool_t _filex_dir_name_plain(const CHAR * name, rt_size_t length)
+{
+    rt_size_t i;
+
+    if ((length == 0) || (length > 255) || (name[0] == ' ') ||
+        (name[length - 1] == '.') || (name[length - 1] == ' '))
+    {
+        return RT_FALSE;
+    }
+    for (i = 0; i < length; i++)
+    {
+        if ((name[i] < 0x20) || (name[i] >= 0x7F) || (strchr("\"*/:<>?\\|", name[i]) != RT_NULL))
+        {
+            return RT_FALSE;
+        }
+    }
+    return RT_TRUE;
+}
+
+/* Upper case 8.3 names go into a single entry without long name slots.  */
+static rt_bool_t _filex_dir_short_name(const CHAR * name, rt_size_t length, UCHAR * short_name)
+{
+    rt_size_t base = 0;
+    rt_size_t extension = 0;
+    rt_bool_t dot = RT_FALSE;
+    rt_size_t i;
+
+    rt_memset(short_name, ' ', 11);
+    for (i = 0; i < length; i++)
+    {
+        if (name[i] == '.')
+        {
+            if (dot || (base == 0))
+            {
+                return RT_FALSE;
+            }
+            dot = RT_TRUE;
+        }
+        else if (!_filex_dir_short_char(name[i]))
+        {
+            return RT_FALSE;
+        }
+        else if (dot)
+        {
+            if (extension == 3)
+            {
+                return RT_FALSE;
+            }
+            short_name[8 + extension++] = (UCHAR)name[i];
+        }
+        else
+        {
+            if (base == 8)
+            {
+                return RT_FALSE;
+            }
+            short_name[base++] = (UCHAR)name[i];
+        }
+    }
+    return !dot || extension;
+}
+
+static void _filex_dir_alias_basis(const CHAR * name, rt_size_t length, UCHAR * basis)
+{
+    rt_size_t dot = length;
+    rt_size_t i;
+    rt_size_t j;
+    CHAR c;
+
+    rt_memset(basis, ' ', 11);
+    for (i = 1; i < length; i++)
+    {
+        if (name[i] == '.')
+        {
+            dot = i;
+        }
+    }
+    for (i = 0, j = 0; (i < dot) && (j < 8); i++)
+    {
+        c = FILEX_TO_UPPER(name[i]);
+        if ((c != ' ') && (c != '.'))
+        {
+            basis[j++] = _filex_dir_short_char(c) ? (UCHAR)c : '_';
+        }
+    }
+    if (j == 0)
+    {
+        basis[0] = '_';
+    }
+    for (i = dot + 1, j = 8; (i < length) && (j < 11); i++)
+    {
+        c = FILEX_TO_UPPER(name[i]);
+        if ((c != ' ') && (c != '.'))
+        {
+            basis[j++] = _filex_dir_short_char(c) ? (UCHAR)c : '_';
+        }
+    }
+}
+
+/* BASIS~N for the first few attempts, then two basis characters and four
+   hex digits of the long name hash, so crowded directories do not probe
+   thousands of aliases.  */
+static void _filex_dir_alias_make(const UCHAR * basis, ULONG hash, ULONG attempt, UCHAR * alias)
+{
+    CHAR tail[8];
+    rt_size_t base;
+    rt_size_t tail_length;
+    rt_size_t i;
+
+    rt_memcpy(alias, basis, 11);
+    for (base = 0; (base < 8) && (basis[base] != ' '); base++);
+
+    if (attempt > 4)
+    {
+        hash = (hash ^ (attempt * 2654435761UL)) & 0xFFFF;
+        if (base > 2)
+        {
+            base = 2;
+        }
+        for (i = 0; i < 4; i++)
+        {
+            alias[base++] = "0123456789ABCDEF"[(hash >> (12 - 4 * i)) & 0xF];
+        }
+        attempt = 1;
+    }
+
+    tail_length = rt_snprintf(tail, sizeof(tail), "~%d", (int)attempt);
+    if (base > 8 - tail_length)
+    {
+        base = 8 - tail_length;
+    }
+    rt_memcpy(&alias[base], tail, tail_length);
+    for (i = base + tail_length; i < 8; i++)
+    {
+        alias[i] = ' ';
+    }
+}
+
+/* Short name the way FileX reports it, "NAME.EXT".  */
+static rt_size_t _filex_dir_short_format(const UCHAR * short_name, CHAR * text)
+{
+    rt_size_t i;
+    rt_size_t j = 0;
+
+    for (i = 0; (i < 8) && (short_name[i] != ' '); i++)
+    {
+        text[j++] = (CHAR)short_name[i];
+    }
+    if (short_name[8] != ' ')
+    {
+        text[j++] = '.';
+        for (i = 8; (i < 11) && (short_name[i] != ' '); i++)
+        {
+            text[j++] = (CHAR)short_name[i];
+        }
+    }
+    text[j] = 0;
+    return j;
+}
+
+static UCHAR _filex_dir_lfn_checksum(const UCHAR * short_name)
+{
+    UCHAR sum = 0;
+    rt_size_t i;
+
+    for (i = 0; i < 11; i++)
+    {
+        sum = (UCHAR)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    }
+    return sum;
+}
+
+static void _filex_dir_lfn_record(UCHAR * record, const CHAR * name, rt_size_t length,
+                                  ULONG ordinal, rt_bool_t last, UCHAR checksum)
+{
+    static const UCHAR offsets[FILEX_DIR_LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    rt_size_t position = (ordinal - 1) * FILEX_DIR_LFN_CHARS;
+    rt_size_t i;
+
+    rt_memset(record, 0, FX_DIR_ENTRY_SIZE);
+    record[0] = (UCHAR)(ordinal | (last ? FILEX_DIR_LFN_LAST : 0));
+    record[11] = FILEX_DIR_LFN_ATTRIBUTES;
+    record[13] = checksum;
+    for (i = 0; i < FILEX_DIR_LFN_CHARS; i++, position++)
+    {
+        /* One NUL after the name, 0xFFFF padding past it.  */
+        if (position < length)
+        {
+            record[offsets[i]] = (UCHAR)name[position];
+        }
+        else if (position > length)
+        {
+            record[offsets[i]] = 0xFF;
+            record[offsets[i] + 1] = 0xFF;
+        }
+    }
+}
+
+static void _filex_dir_short_record(UCHAR * record, const UCHAR * short_name)
+{
+    rt_memset(record, 0, FX_DIR_ENTRY_SIZE);
+    rt_memcpy(record, short_name, 11);
+    record[11] = FX_ARCHIVE;
+    _fx_utility_16_unsigned_write(&record[14], _fx_system_time);
+    _fx_utility_16_unsigned_write(&record[16], _fx_system_date);
+    _fx_utility_16_unsigned_write(&record[18], _fx_system_date);
+    _fx_utility_16_unsigned_write(&record[22], _fx_system_time);
+    _fx_utility_16_unsigned_write(&record[24], _fx_system_date);
+}
+
+/* Creates an empty file by appending its entries at the known end of the
+   parent directory, without the free slot scan of fx_file_create.  Returns
+   FX_NOT_IMPLEMENTED whenever the case is better left to FileX.  */
+UINT filex_dir_index_create(filex_media_t * filex_media, CHAR * path)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_DIR_ENTRY * source;
+    FX_DIR_ENTRY check;
+    filex_dir_index_t * index;
+    const CHAR * name;
+    rt_size_t length;
+    rt_size_t alias_length = 0;
+    UCHAR short_name[11];
+    UCHAR basis[11];
+    UCHAR record[FX_DIR_ENTRY_SIZE];
+    CHAR alias[13];
+    UCHAR checksum;
+    ULONG slots = 1;
+    ULONG attempt;
+    ULONG i;
+    UINT result;
+
+    if (media->fx_media_driver_write_protect)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+#endif /* FX_ENABLE_EXFAT */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    /* Raw directory writes would bypass the fault tolerant log.  */
+    if (media->fx_media_fault_tolerant_enabled)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+    index = _filex_dir_index_parent(filex_media, path, &name, &length, RT_TRUE);
+    if ((index == RT_NULL) || (index->size == 0) || !index->complete || !_filex_dir_name_plain(name, length))
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+    source = filex_media->index_dir_valid ? &filex_media->index_dir : FX_NULL;
+
+    /* A complete index answers existence without reading the directory.  */
+    check.fx_dir_entry_name = filex_media->index_name;
+    if (_filex_dir_index_lookup(filex_media, index, source, name, length, &check, RT_NULL) == FX_SUCCESS)
+    {
+        return FX_ALREADY_CREATED;
+    }
+
+    if (!_filex_dir_short_name(name, length, short_name))
+    {
+        _filex_dir_alias_basis(name, length, basis);
+        for (attempt = 1; attempt <= FILEX_DIR_ALIAS_TRIES; attempt++)
+        {
+            _filex_dir_alias_make(basis, _filex_dir_index_hash(name, length), attempt, short_name);
+            alias_length = _filex_dir_short_format(short_name, alias);
+            if (_filex_dir_index_lookup(filex_media, index, source, alias, alias_length, &check, RT_NULL) != FX_SUCCESS)
+            {
+                break;
+            }
+        }
+        if (attempt > FILEX_DIR_ALIAS_TRIES)
+        {
+            return FX_NOT_IMPLEMENTED;
+        }
+        slots += (length + FILEX_DIR_LFN_CHARS - 1) / FILEX_DIR_LFN_CHARS;
+    }
+
+    /* The run must still lie past the end marker; anything else means the
+       directory changed behind the index.  A full cluster is left to FileX,
+       which knows how to grow the directory.  */
+    for (i = 0; i < slots; i++)
+    {
+        if (_filex_dir_slot_read(filex_media, source, index->end + i,
+                                 &index->walk_index, &index->walk_cluster, record) != FX_SUCCESS)
+        {
+            return FX_NOT_IMPLEMENTED;
+        }
+        if (record[0] != (UCHAR)FX_DIR_ENTRY_DONE)
+        {
+            _filex_dir_index_free(filex_media, index);
+            return FX_NOT_IMPLEMENTED;
+        }
+    }
+
+    /* Long name slots first, highest ordinal on top, the short entry last
+       so an interrupted create leaves nothing a FAT reader would list.  */
+    checksum = _filex_dir_lfn_checksum(short_name);
+    for (i = slots - 1; i > 0; i--)
+    {
+        _filex_dir_lfn_record(record, name, length, i, i == slots - 1, checksum);
+        result = _filex_dir_slot_write(filex_media, source, index->end + slots - 1 - i,
+                                       &index->walk_index, &index->walk_cluster, record);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+    }
+    _filex_dir_short_record(record, short_name);
+    result = _filex_dir_slot_write(filex_media, source, index->end + slots - 1,
+                                   &index->walk_index, &index->walk_cluster, record);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+
+    _filex_dir_index_put(filex_media, index, _filex_dir_index_hash(name, length), index->end);
+    if (alias_length)
+    {
+        _filex_dir_index_put(filex_media, index, _filex_dir_index_hash(alias, alias_length), index->end);
+    }
+    index->end += slots;
+
+#ifndef FX_MEDIA_DISABLE_SEARCH_CACHE
+    media->fx_media_last_found_name[0] = 0;
+#endif /* FX_MEDIA_DISABLE_SEARCH_CACHE */
+    return FX_SUCCESS;
+}
+
+/* Slides the live entries of a directory over its deleted ones and moves
+   the end marker up behind them.  Each entry is copied before its old slot
+   is released, so a power cut can leave one entry listed twice but never
+   lose one.  */
+UINT filex_dir_index_compact(filex_media_t * filex_media, FX_DIR_ENTRY * directory)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_dir_index_t * index;
+    FX_FILE * file;
+    UCHAR record[FX_DIR_ENTRY_SIZE];
+    ULONG cluster = directory ? directory->fx_dir_entry_cluster : 0;
+    ULONG entries_per_sector = media->fx_media_bytes_per_sector / FX_DIR_ENTRY_SIZE;
+    ULONG read_index = 0;
+    ULONG read_cluster = 0;
+    ULONG write_index = 0;
+    ULONG write_cluster = 0;
+    ULONG64 sector;
+    ULONG offset;
+    ULONG read;
+    ULONG write;
+    ULONG i;
+    UINT result;
+
+    if (media->fx_media_driver_write_protect)
+    {
+        return FX_WRITE_PROTECT;
+    }
+#ifdef FX_ENABLE_EXFAT
+    if (media->fx_media_FAT_type == FX_exFAT)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+#endif /* FX_ENABLE_EXFAT */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+    if (media->fx_media_fault_tolerant_enabled)
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+    index = _filex_dir_index_find(filex_media, cluster);
+    if (index == RT_NULL)
+    {
+        index = _filex_dir_index_build(filex_media, directory, cluster);
+        if (index == RT_NULL)
+        {
+            return FX_NOT_ENOUGH_MEMORY;
+        }
+    }
+    if (index->first_free >= index->end)
+    {
+        return FX_SUCCESS;
+    }
+
+    /* Open files remember where their entry lives.  Every sector from the
+       one holding first_free on is checked.  */
+    for (read = index->first_free - index->first_free % entries_per_sector; read < index->end;
+         read += entries_per_sector)
+    {
+        result = _filex_dir_slot_locate(filex_media, directory, read, &read_index, &read_cluster, &sector, &offset);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        file = media->fx_media_opened_file_list;
+        for (i = 0; i < media->fx_media_opened_file_count; i++, file = file->fx_file_opened_next)
+        {
+            if (file->fx_file_dir_entry.fx_dir_entry_log_sector == sector)
+            {
+                return FX_ACCESS_ERROR;
+            }
+        }
+    }
+
+    read_index = 0;
+    read_cluster = 0;
+    write = index->first_free;
+    for (read = write; read < index->end; read++)
+    {
+        result = _filex_dir_slot_read(filex_media, directory, read, &read_index, &read_cluster, record);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if ((record[0] == (UCHAR)FX_DIR_ENTRY_FREE) || (record[0] == (UCHAR)FX_DIR_ENTRY_DONE))
+        {
+            continue;
+        }
+        if (write != read)
+        {
+            result = _filex_dir_slot_write(filex_media, directory, write, &write_index, &write_cluster, record);
+            if (result == FX_SUCCESS)
+            {
+                record[0] = (UCHAR)FX_DIR_ENTRY_FREE;
+                result = _filex_dir_slot_write(filex_media, directory, read, &read_index, &read_cluster, record);
+            }
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+        }
+        write++;
+    }
+
+    rt_memset(record, 0, sizeof(record));
+    for (read = write; read < index->end; read++)
+    {
+        result = _filex_dir_slot_write(filex_media, directory, read, &write_index, &write_cluster, record);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    /* Every entry number moved, index the directory afresh.  */
+    _filex_dir_index_free(filex_media, index);
+    _filex_dir_index_build(filex_media, directory, cluster);
+
+#ifndef FX_MEDIA_DISABLE_SEARCH_CACHE
+    media->fx_media_last_found_name[0] = 0;
+#endif /* FX_MEDIA_DISABLE_SEARCH_CACHE */
+    return fx_media_flush(media);
+}
+
+#endif /* FILEX_USING_DIR_FREE_SLOTS */
+
+#endif /* FILEX_USING_DIR_INDEX */
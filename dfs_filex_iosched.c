@@ -0,0 +1,326 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_IO_SCHED
+
+static rt_sem_t io_sched_sem = RT_NULL;
+
+static rt_bool_t _filex_io_sched_metadata(FX_MEDIA * media)
+{
+    return media->fx_media_driver_system_write ||
+           (media->fx_media_driver_sector_type == FX_BOOT_SECTOR) ||
+           (media->fx_media_driver_sector_type == FX_FAT_SECTOR) ||
+           (media->fx_media_driver_sector_type == FX_DIRECTORY_SECTOR);
+}
+
+
+static UCHAR * _filex_io_sched_data(filex_io_sched_t * sched, rt_uint32_t slot)
+{
+    return sched->buffer + slot * sched->bytes_per_sector;
+}
+
+static void _filex_io_sched_drop(filex_io_sched_t * sched, rt_uint32_t slot)
+{
+    sched->count--;
+    if (slot != sched->count)
+    {
+        sched->slots[slot] = sched->slots[sched->count];
+        rt_memcpy(_filex_io_sched_data(sched, slot), _filex_io_sched_data(sched, sched->count), sched->bytes_per_sector);
+    }
+}
+
+/* Dispatch order key: metadata before data, then one ascending sweep
+   starting at the sector after the last one written.  */
+static ULONG64 _filex_io_sched_key(filex_io_sched_t * sched, filex_io_slot_t * slot)
+{
+    ULONG64 key = slot->sector;
+
+    if (slot->sector < sched->head)
+    {
+        key |= (ULONG64)1 << 32;
+    }
+    if (!slot->metadata)
+    {
+        key |= (ULONG64)1 << 33;
+    }
+    return key;
+}
+
+/* Writes the whole queue, merging runs of adjacent sectors into one device
+   request.  A write error is kept for the next flush, since the caller
+   that queued the sector has long been told it succeeded.  */
+static UINT _filex_io_sched_drain(FX_MEDIA * media, filex_io_sched_t * sched)
+{
+    rt_uint8_t order[FILEX_IO_SCHED_DEPTH];
+    UCHAR * staging = _filex_io_sched_data(sched, FILEX_IO_SCHED_DEPTH);
+    ULONG64 key;
+    ULONG start;
+    rt_uint32_t run;
+    rt_uint32_t i;
+    rt_uint32_t j;
+    UINT result = FX_SUCCESS;
+
+    /* Insertion sort, the queue is short.  */
+    for (i = 0; i < sched->count; i++)
+    {
+        key = _filex_io_sched_key(sched, &sched->slots[i]);
+        for (j = i; (j > 0) && (_filex_io_sched_key(sched, &sched->slots[order[j - 1]]) > key); j--)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = (rt_uint8_t)i;
+    }
+
+    for (i = 0; i < sched->count; i += run)
+    {
+        start = sched->slots[order[i]].sector;
+        for (run = 0; (i + run < sched->count) && (run < FILEX_IO_SCHED_MERGE_SECTORS); run++)
+        {
+            if (sched->slots[order[i + run]].sector != start + run)
+            {
+                break;
+            }
+            rt_memcpy(staging + run * sched->bytes_per_sector,
+                      _filex_io_sched_data(sched, order[i + run]), sched->bytes_per_sector);
+        }
+
+        if (rt_fx_block_write(media, start, staging, run) != run)
+        {
+            result = FX_IO_ERROR;
+        }
+        sched->head = start + run;
+    }
+
+    sched->count = 0;
+    if (result != FX_SUCCESS)
+    {
+        sched->error = result;
+    }
+    return result;
+}
+
+static rt_bool_t _filex_io_sched_expired(filex_io_sched_t * sched)
+{
+    return (sched->count != 0) &&
+           (rt_tick_get() - sched->since >= rt_tick_from_millisecond(FILEX_IO_SCHED_DEADLINE));
+}
+
+static rt_bool_t _filex_io_sched_ready(FX_MEDIA * media, filex_io_sched_t * sched)
+{
+    if (sched->buffer != RT_NULL)
+    {
+        return RT_TRUE;
+    }
+    if (media->fx_media_bytes_per_sector == 0)
+    {
+        return RT_FALSE;
+    }
+
+    /* Queued sectors, then the staging area runs are merged into.  */
+    sched->buffer = rt_malloc((FILEX_IO_SCHED_DEPTH + FILEX_IO_SCHED_MERGE_SECTORS) * media->fx_media_bytes_per_sector);
+    if (sched->buffer == RT_NULL)
+    {
+        return RT_FALSE;
+    }
+    sched->bytes_per_sector = media->fx_media_bytes_per_sector;
+    sched->count = 0;
+    sched->head = 0;
+    sched->error = FX_SUCCESS;
+    return RT_TRUE;
+}
+
+size_t filex_io_sched_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors)
+{
+    filex_io_sched_t * sched = &rt_container_of(media, filex_media_t, media)->io_sched;
+    rt_bool_t metadata;
+    rt_uint32_t slot;
+    ULONG i;
+
+    if (!_filex_io_sched_ready(media, sched) || (sched->bytes_per_sector != media->fx_media_bytes_per_sector))
+    {
+        return rt_fx_block_write(media, sector, buffer, sectors);
+    }
+
+    /* The fault tolerant log must reach the device after everything queued
+       before it and before anything queued after it.  */
+    if (rt_fx_disk_log_sector(media, sector, sectors))
+    {
+        if ((sched->count != 0) && (_filex_io_sched_drain(media, sched) != FX_SUCCESS))
+        {
+            return 0;
+        }
+        return rt_fx_block_write(media, sector, buffer, sectors);
+    }
+
+    /* Long runs are sequential already, they only supersede what they cover.  */
+    if (sectors > FILEX_IO_SCHED_BYPASS_SECTORS)
+    {
+        for (slot = 0; slot < sched->count; )
+        {
+            if ((sched->slots[slot].sector >= sector) && (sched->slots[slot].sector < sector + sectors))
+            {
+                _filex_io_sched_drop(sched, slot);
+            }
+            else
+            {
+                slot++;
+            }
+        }
+        return rt_fx_block_write(media, sector, buffer, sectors);
+    }
+
+    metadata = _filex_io_sched_metadata(media);
+    for (i = 0; i < sectors; i++)
+    {
+        /* A rewrite of a queued sector replaces it in place.  */
+        for (slot = 0; slot < sched->count; slot++)
+        {
+            if (sched->slots[slot].sector == sector + i)
+            {
+                break;
+            }
+        }
+
+        if (slot == sched->count)
+        {
+            if (sched->count == FILEX_IO_SCHED_DEPTH)
+            {
+                if (_filex_io_sched_drain(media, sched) != FX_SUCCESS)
+                {
+                    return i;
+                }
+                slot = 0;
+            }
+            if (sched->count == 0)
+            {
+                sched->since = rt_tick_get();
+                if (io_sched_sem != RT_NULL)
+                {
+                    rt_sem_release(io_sched_sem);
+                }
+            }
+            sched->slots[slot].sector = sector + i;
+            sched->slots[slot].metadata = metadata;
+            sched->count++;
+        }
+        else if (metadata)
+        {
+            sched->slots[slot].metadata = RT_TRUE;
+        }
+
+        rt_memcpy(_filex_io_sched_data(sched, slot), buffer + i * sched->bytes_per_sector, sched->bytes_per_sector);
+    }
+
+    if (_filex_io_sched_expired(sched) && (_filex_io_sched_drain(media, sched) != FX_SUCCESS))
+    {
+        return 0;
+    }
+    return sectors;
+}
+
+/* Reads go to the device at once; sectors still queued are served from the
+   queue on top of what the device returned.  */
+size_t filex_io_sched_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors)
+{
+    filex_io_sched_t * sched = &rt_container_of(media, filex_media_t, media)->io_sched;
+    rt_uint32_t slot;
+
+    if (rt_fx_block_read(media, sector, buffer, sectors) != sectors)
+    {
+        return 0;
+    }
+
+    for (slot = 0; slot < sched->count; slot++)
+    {
+        if ((sched->slots[slot].sector >= sector) && (sched->slots[slot].sector < sector + sectors))
+        {
+            rt_memcpy(buffer + (sched->slots[slot].sector - sector) * sched->bytes_per_sector,
+                      _filex_io_sched_data(sched, slot), sched->bytes_per_sector);
+        }
+    }
+    return sectors;
+}
+
+UINT filex_io_sched_flush(FX_MEDIA * media)
+{
+    filex_io_sched_t * sched = &rt_container_of(media, filex_media_t, media)->io_sched;
+    UINT result;
+
+    if (sched->count != 0)
+    {
+        _filex_io_sched_drain(media, sched);
+    }
+    result = sched->error;
+    sched->error = FX_SUCCESS;
+    return result;
+}
+
+/* Drops whatever is queued, as an aborted media drops its sector cache.  */
+void filex_io_sched_abort(FX_MEDIA * media)
+{
+    rt_container_of(media, filex_media_t, media)->io_sched.count = 0;
+}
+
+UINT filex_io_sched_uninit(FX_MEDIA * media)
+{
+    filex_io_sched_t * sched = &rt_container_of(media, filex_media_t, media)->io_sched;
+    UINT result;
+
+    result = filex_io_sched_flush(media);
+    if (sched->buffer != RT_NULL)
+    {
+        rt_free(sched->buffer);
+        sched->buffer = RT_NULL;
+    }
+    return result;
+}
+
+/* Writes out every queue one deadline after it stopped being empty.  */
+static void _filex_io_sched_entry(void * parameter)
+{
+    rt_list_t * node;
+    filex_media_t * filex_media;
+
+    while (1)
+    {
+        rt_sem_take(io_sched_sem, RT_WAITING_FOREVER);
+        rt_thread_mdelay(FILEX_IO_SCHED_DEADLINE);
+
+        filex_lock();
+        rt_list_for_each(node, &filex_media_list)
+        {
+            filex_media = rt_list_entry(node, filex_media_t, list);
+            if (filex_media->io_sched.count != 0)
+            {
+                _filex_io_sched_drain(&filex_media->media, &filex_media->io_sched);
+            }
+        }
+        filex_unlock();
+    }
+}
+
+int filex_io_sched_init(void)
+{
+    rt_thread_t thread;
+
+    io_sched_sem = rt_sem_create("fxiosch", 0, RT_IPC_FLAG_FIFO);
+    if (io_sched_sem == RT_NULL)
+    {
+        return -RT_ENOMEM;
+    }
+
+    thread = rt_thread_create("fxiosch", _filex_io_sched_entry, RT_NULL,
+                              FILEX_IO_SCHED_THREAD_STACK_SIZE, FILEX_IO_SCHED_THREAD_PRIORITY, 10);
+    if (thread == RT_NULL)
+    {
+        rt_sem_delete(io_sched_sem);
+        io_sched_sem = RT_NULL;
+        return -RT_ENOMEM;
+    }
+    return rt_thread_startup(thread);
+}
+
+#endif /* FILEX_USING_IO_SCHED */
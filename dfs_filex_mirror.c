@@ -0,0 +1,251 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_FAT_MIRROR
+
+static filex_mirror_range_t * _filex_mirror_ranges(FX_MEDIA * media)
+{
+    return rt_container_of(media, filex_media_t, media)->fat_mirror;
+}
+
+/* The range holding sector, RT_NULL when no mirror covers it.  */
+static filex_mirror_range_t * _filex_mirror_find(FX_MEDIA * media, ULONG sector)
+{
+    filex_mirror_range_t * range = _filex_mirror_ranges(media);
+    int i;
+
+    for (i = 0; i < FILEX_FAT_MIRROR_RANGES; i++, range++)
+    {
+        if ((range->buffer != RT_NULL) && (sector >= range->start) && (sector < range->start + range->sectors))
+        {
+            return range;
+        }
+    }
+    return RT_NULL;
+}
+
+/* Sectors from sector on that are all inside or all outside the mirror.  */
+static ULONG _filex_mirror_run(FX_MEDIA * media, ULONG sector, ULONG sectors, filex_mirror_range_t ** found)
+{
+    filex_mirror_range_t * range;
+    ULONG run;
+
+    *found = _filex_mirror_find(media, sector);
+    if (*found != RT_NULL)
+    {
+        run = (*found)->start + (*found)->sectors - sector;
+        return (run < sectors) ? run : sectors;
+    }
+
+    for (run = 1; run < sectors; run++)
+    {
+        range = _filex_mirror_find(media, sector + run);
+        if (range != RT_NULL)
+        {
+            break;
+        }
+    }
+    return run;
+}
+
+static UINT _filex_mirror_add(filex_media_t * filex_media, ULONG start, ULONG sectors, rt_size_t * total)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_mirror_range_t * range;
+    int i;
+
+    for (i = 0, range = filex_media->fat_mirror; i < FILEX_FAT_MIRROR_RANGES; i++, range++)
+    {
+        if (range->buffer == RT_NULL)
+        {
+            break;
+        }
+    }
+    if ((i == FILEX_FAT_MIRROR_RANGES) || (sectors == 0))
+    {
+        return FX_NOT_IMPLEMENTED;
+    }
+
+    *total += sectors * media->fx_media_bytes_per_sector;
+    if (*total > FILEX_FAT_MIRROR_MAX_SIZE)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+
+    range->buffer = rt_malloc(sectors * media->fx_media_bytes_per_sector);
+    if (range->buffer == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    if (rt_fx_cache_read(media, start, range->buffer, sectors) != sectors)
+    {
+        rt_free(range->buffer);
+        range->buffer = RT_NULL;
+        return FX_IO_ERROR;
+    }
+
+    range->start = start;
+    range->sectors = sectors;
+    range->dirty_first = sectors;
+    range->dirty_last = 0;
+    return FX_SUCCESS;
+}
+
+/* Loads the primary FAT, and the allocation bitmap of an exFAT volume, into
+   RAM.  FileX keeps its own FAT entry cache on top; every sector it misses
+   is then served from memory instead of the device.  */
+UINT filex_fat_mirror_load(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+    UINT sector_type = media->fx_media_driver_sector_type;
+    rt_size_t total = 0;
+    UINT result;
+
+    /* Keep the bulk load out of the sector cache.  */
+    media->fx_media_driver_sector_type = FX_UNKNOWN_SECTOR;
+
+    result = _filex_mirror_add(filex_media, media->fx_media_hidden_sectors + media->fx_media_reserved_sectors,
+                               media->fx_media_sectors_per_FAT, &total);
+#ifdef FX_ENABLE_EXFAT
+    if ((result == FX_SUCCESS) && (media->fx_media_FAT_type == FX_exFAT))
+    {
+        result = _filex_mirror_add(filex_media, media->fx_media_hidden_sectors + media->fx_media_exfat_bitmap_start_sector,
+                                   (media->fx_media_exfat_bitmap_clusters * media->fx_media_sectors_per_cluster), &total);
+    }
+#endif /* FX_ENABLE_EXFAT */
+
+    media->fx_media_driver_sector_type = sector_type;
+    if (result != FX_SUCCESS)
+    {
+        filex_fat_mirror_release(media);
+    }
+    return result;
+}
+
+size_t filex_fat_mirror_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors)
+{
+    filex_mirror_range_t * range;
+    size_t total = sectors;
+    ULONG run;
+
+    while (sectors)
+    {
+        run = _filex_mirror_run(media, sector, sectors, &range);
+        if (range != RT_NULL)
+        {
+            rt_memcpy(buffer, range->buffer + (sector - range->start) * media->fx_media_bytes_per_sector,
+                      run * media->fx_media_bytes_per_sector);
+        }
+        else if (rt_fx_cache_read(media, sector, buffer, run) != run)
+        {
+            return 0;
+        }
+
+        sector += run;
+        sectors -= run;
+        buffer += run * media->fx_media_bytes_per_sector;
+    }
+    return total;
+}
+
+/* Mirrored sectors only reach the device on flush; with fault tolerance
+   they are also written out before the log is touched.  */
+size_t filex_fat_mirror_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors)
+{
+    filex_mirror_range_t * range;
+    size_t written = 0;
+    ULONG offset;
+    ULONG run;
+
+    if (rt_fx_disk_log_sector(media, sector, sectors) && (filex_fat_mirror_flush(media) != FX_SUCCESS))
+    {
+        return 0;
+    }
+
+    while (sectors)
+    {
+        run = _filex_mirror_run(media, sector, sectors, &range);
+        if (range != RT_NULL)
+        {
+            offset = sector - range->start;
+            rt_memcpy(range->buffer + offset * media->fx_media_bytes_per_sector, buffer,
+                      run * media->fx_media_bytes_per_sector);
+            if (offset < range->dirty_first)
+            {
+                range->dirty_first = offset;
+            }
+            if (offset + run - 1 > range->dirty_last)
+            {
+                range->dirty_last = offset + run - 1;
+            }
+        }
+        else if (rt_fx_cache_write(media, sector, buffer, run) != run)
+        {
+            return written;
+        }
+
+        written += run;
+        sector += run;
+        sectors -= run;
+        buffer += run * media->fx_media_bytes_per_sector;
+    }
+    return written;
+}
+
+/* Writes the dirty span of every range back in one request each.  */
+UINT filex_fat_mirror_flush(FX_MEDIA * media)
+{
+    filex_mirror_range_t * range = _filex_mirror_ranges(media);
+    UINT sector_type = media->fx_media_driver_sector_type;
+    UINT system_write = media->fx_media_driver_system_write;
+    ULONG sectors;
+    UINT result = FX_SUCCESS;
+    int i;
+
+    /* The layers below sort requests by what FileX says they are.  */
+    media->fx_media_driver_sector_type = FX_FAT_SECTOR;
+    media->fx_media_driver_system_write = FX_TRUE;
+
+    for (i = 0; i < FILEX_FAT_MIRROR_RANGES; i++, range++)
+    {
+        if ((range->buffer == RT_NULL) || (range->dirty_first > range->dirty_last))
+        {
+            continue;
+        }
+
+        sectors = range->dirty_last - range->dirty_first + 1;
+        if (rt_fx_cache_write(media, range->start + range->dirty_first,
+                              range->buffer + range->dirty_first * media->fx_media_bytes_per_sector, sectors) != sectors)
+        {
+            result = FX_IO_ERROR;
+            continue;
+        }
+        range->dirty_first = range->sectors;
+        range->dirty_last = 0;
+    }
+
+    media->fx_media_driver_sector_type = sector_type;
+    media->fx_media_driver_system_write = system_write;
+    return result;
+}
+
+/* Drops the mirror, dirty sectors included; flush first to keep them.  */
+void filex_fat_mirror_release(FX_MEDIA * media)
+{
+    filex_mirror_range_t * range = _filex_mirror_ranges(media);
+    int i;
+
+    for (i = 0; i < FILEX_FAT_MIRROR_RANGES; i++, range++)
+    {
+        if (range->buffer != RT_NULL)
+        {
+            rt_free(range->buffer);
+            range->buffer = RT_NULL;
+        }
+    }
+}
+
+#endif /* FILEX_USING_FAT_MIRROR */
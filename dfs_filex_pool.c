@@ -0,0 +1,115 @@
+#include <rtthread.h>
+#include <stdlib.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_MEMPOOL
+
+static const char * const _filex_pool_names[FILEX_POOLS] = {"fxfile", "fxdir", "fxname", "fxmedia"};
+
+static rt_mp_t filex_pools[FILEX_POOLS];
+static rt_uint32_t filex_pool_allocs[FILEX_POOLS];
+static rt_uint32_t filex_heap_allocs[FILEX_POOLS];
+
+static rt_bool_t _filex_pool_owns(rt_mp_t mp, void * block)
+{
+    return (mp != RT_NULL) &&
+           ((rt_uint8_t *)block >= (rt_uint8_t *)mp->start_address) &&
+           ((rt_uint8_t *)block < (rt_uint8_t *)mp->start_address + mp->size);
+}
+
+/* Every pool takes its memory in one piece at init, so opens and mounts
+   never touch the heap until a pool runs dry.  */
+int filex_pool_init(void)
+{
+    static const rt_size_t sizes[FILEX_POOLS] =
+    {
+        sizeof(FX_FILE), sizeof(filex_dir_t), FX_MAX_LONG_NAME_LEN, sizeof(filex_media_t),
+    };
+    static const rt_size_t blocks[FILEX_POOLS] =
+    {
+        FILEX_POOL_FILE_BLOCKS, FILEX_POOL_DIR_BLOCKS, FILEX_POOL_NAME_BLOCKS, FILEX_POOL_MEDIA_BLOCKS,
+    };
+    int result = RT_EOK;
+    int pool;
+
+    for (pool = 0; pool < FILEX_POOLS; pool++)
+    {
+        if (blocks[pool] == 0)
+        {
+            continue;
+        }
+        filex_pools[pool] = rt_mp_create(_filex_pool_names[pool], blocks[pool], sizes[pool]);
+        if (filex_pools[pool] == RT_NULL)
+        {
+            result = -RT_ENOMEM;
+        }
+    }
+    return result;
+}
+
+void * filex_pool_alloc(int pool, rt_size_t size)
+{
+    void * block = RT_NULL;
+
+    if (filex_pools[pool] != RT_NULL)
+    {
+        block = rt_mp_alloc(filex_pools[pool], RT_WAITING_NO);
+    }
+    if (block == RT_NULL)
+    {
+        filex_heap_allocs[pool]++;
+        return calloc(size, 1);
+    }
+
+    filex_pool_allocs[pool]++;
+    rt_memset(block, 0, size);
+    return block;
+}
+
+void filex_pool_free(int pool, void * block)
+{
+    if (block == RT_NULL)
+    {
+        return;
+    }
+    if (_filex_pool_owns(filex_pools[pool], block))
+    {
+        rt_mp_free(block);
+    }
+    else
+    {
+        free(block);
+    }
+}
+
+void filex_pool_stats_get(int pool, struct filex_pool_stats * stats)
+{
+    rt_mp_t mp = filex_pools[pool];
+
+    stats->blocks = (mp != RT_NULL) ? mp->block_total_count : 0;
+    stats->used = (mp != RT_NULL) ? mp->block_total_count - mp->block_free_count : 0;
+    stats->pool_allocs = filex_pool_allocs[pool];
+    stats->heap_allocs = filex_heap_allocs[pool];
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+static void filex_pool(int argc, char ** argv)
+{
+    struct filex_pool_stats stats;
+    int pool;
+
+    for (pool = 0; pool < FILEX_POOLS; pool++)
+    {
+        filex_pool_stats_get(pool, &stats);
+        rt_kprintf("%-8s %3u/%-3u blocks used  %8u pool  %8u heap allocations\n", _filex_pool_names[pool],
+                   stats.used, stats.blocks, stats.pool_allocs, stats.heap_allocs);
+    }
+}
+MSH_CMD_EXPORT(filex_pool, show filex object pool usage and heap fallbacks);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_MEMPOOL */
@@ -0,0 +1,346 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_QOS
+
+/* I/O classes: filex_lock hands the lock over to waiters of the highest
+   class first, in arrival order within a class, instead of in plain
+   arrival order.  Reads and writes are cut into FILEX_QOS_SLICE pieces
+   with the lock let go in between, so a real-time caller waits for one
+   slice of a background transfer at most.  Each class can also be held to
+   a rate by a token bucket, charged before the lock is taken.  Threads
+   are normal unless set otherwise; a thread leaves the table when its
+   object is detached or deleted, so a new thread given the same control
+   block starts out normal.  This takes the object detach hook.
+
+   Like the mutex it replaces, the lock lends its owner the priority of
+   the most urgent thread waiting, so a background owner preempted by
+   middle priority threads cannot hold up a real-time waiter.  */
+
+typedef struct filex_qos_thread {
+    rt_thread_t thread;
+    rt_uint8_t qos_class;
+} filex_qos_thread_t;
+
+typedef struct filex_qos_waiter {
+    rt_list_t list;
+    rt_thread_t thread;
+} filex_qos_waiter_t;
+
+typedef struct filex_qos_bucket {
+    rt_uint32_t rate;           /* Bytes per second, 0 for no limit */
+    rt_uint32_t burst;          /* Tokens held at most */
+    rt_uint32_t tokens;
+    rt_tick_t stamp;            /* Last refill */
+} filex_qos_bucket_t;
+
+static struct
+{
+    rt_thread_t owner;          /* filex_qos_handed while passing to a waiter */
+    rt_uint32_t depth;
+    rt_uint8_t priority;        /* The owner's own priority */
+    rt_list_t waiters;
+    rt_uint32_t waiting[FILEX_QOS_CLASSES];
+    rt_sem_t wake[FILEX_QOS_CLASSES];
+    filex_qos_thread_t threads[FILEX_QOS_THREADS];
+    filex_qos_bucket_t buckets[FILEX_QOS_CLASSES];
+    struct filex_qos_stats stats[FILEX_QOS_CLASSES];
+} qos;
+
+static struct rt_thread filex_qos_handed;
+
+/* Called inside a critical section.  */
+static int _filex_qos_class(rt_thread_t thread)
+{
+    int i;
+
+    for (i = 0; i < FILEX_QOS_THREADS; i++)
+    {
+        if (qos.threads[i].thread == thread)
+        {
+            return qos.threads[i].qos_class;
+        }
+    }
+    return FILEX_QOS_NORMAL;
+}
+
+/* Raises the owner to the priority of the most urgent waiter.  Called
+   inside a critical section.  */
+static void _filex_qos_boost(void)
+{
+    filex_qos_waiter_t * waiter;
+    rt_list_t * node;
+    rt_uint8_t priority;
+
+    if ((qos.owner == RT_NULL) || (qos.owner == &filex_qos_handed))
+    {
+        return;
+    }
+    priority = qos.owner->current_priority;
+    rt_list_for_each(node, &qos.waiters)
+    {
+        waiter = rt_list_entry(node, filex_qos_waiter_t, list);
+        if (waiter->thread->current_priority < priority)
+        {
+            priority = waiter->thread->current_priority;
+        }
+    }
+    if (priority != qos.owner->current_priority)
+    {
+        rt_thread_control(qos.owner, RT_THREAD_CTRL_CHANGE_PRIORITY, &priority);
+    }
+}
+
+void filex_lock(void)
+{
+    rt_thread_t self = rt_thread_self();
+    filex_qos_waiter_t waiter;
+    rt_tick_t start;
+    rt_tick_t waited;
+    int qos_class;
+
+    rt_enter_critical();
+    if (qos.owner == self)
+    {
+        qos.depth++;
+        rt_exit_critical();
+        return;
+    }
+    if (qos.owner == RT_NULL)
+    {
+        qos.owner = self;
+        qos.depth = 1;
+        qos.priority = self->current_priority;
+        rt_exit_critical();
+        return;
+    }
+    qos_class = _filex_qos_class(self);
+    qos.waiting[qos_class]++;
+    waiter.thread = self;
+    rt_list_insert_before(&qos.waiters, &waiter.list);
+    _filex_qos_boost();
+    rt_exit_critical();
+
+    start = rt_tick_get();
+    rt_sem_take(qos.wake[qos_class], RT_WAITING_FOREVER);
+    waited = rt_tick_get() - start;
+
+    /* filex_unlock handed the lock to this class and left it marked.  */
+    rt_enter_critical();
+    rt_list_remove(&waiter.list);
+    qos.owner = self;
+    qos.depth = 1;
+    qos.priority = self->current_priority;
+    _filex_qos_boost();
+    qos.stats[qos_class].waits++;
+    qos.stats[qos_class].wait_ticks += waited;
+    if (waited > qos.stats[qos_class].wait_max)
+    {
+        qos.stats[qos_class].wait_max = waited;
+    }
+    rt_exit_critical();
+}
+
+void filex_unlock(void)
+{
+    int qos_class;
+
+    rt_enter_critical();
+    if (--qos.depth)
+    {
+        rt_exit_critical();
+        return;
+    }
+    if (qos.owner->current_priority != qos.priority)
+    {
+        rt_thread_control(qos.owner, RT_THREAD_CTRL_CHANGE_PRIORITY, &qos.priority);
+    }
+    for (qos_class = 0; qos_class < FILEX_QOS_CLASSES; qos_class++)
+    {
+        if (qos.waiting[qos_class])
+        {
+            qos.waiting[qos_class]--;
+            qos.owner = &filex_qos_handed;
+            rt_sem_release(qos.wake[qos_class]);
+            rt_exit_critical();
+            return;
+        }
+    }
+    qos.owner = RT_NULL;
+    rt_exit_critical();
+}
+
+/* Takes size bytes from the bucket of the calling thread's class, sleeping
+   until it has them.  Called without filex_lock.  */
+void filex_qos_admit(rt_size_t size)
+{
+    filex_qos_bucket_t * bucket;
+    rt_uint64_t added;
+    rt_tick_t now;
+    rt_tick_t wait;
+    int qos_class;
+
+    rt_enter_critical();
+    qos_class = _filex_qos_class(rt_thread_self());
+    bucket = &qos.buckets[qos_class];
+    qos.stats[qos_class].bytes += size;
+    while (bucket->rate)
+    {
+        now = rt_tick_get();
+        added = (rt_uint64_t)(now - bucket->stamp) * bucket->rate / RT_TICK_PER_SECOND;
+        if (added)
+        {
+            bucket->tokens = (bucket->tokens + added > bucket->burst) ? bucket->burst : (rt_uint32_t)(bucket->tokens + added);
+            bucket->stamp = now;
+        }
+
+        /* A request larger than the bucket goes once it is full.  */
+        if ((bucket->tokens >= size) || (bucket->tokens == bucket->burst))
+        {
+            bucket->tokens -= (bucket->tokens >= size) ? size : bucket->tokens;
+            break;
+        }
+
+        wait = (rt_tick_t)((rt_uint64_t)(((size < bucket->burst) ? size : bucket->burst) - bucket->tokens) *
+                           RT_TICK_PER_SECOND / bucket->rate) + 1;
+        qos.stats[qos_class].throttled_ticks += wait;
+        rt_exit_critical();
+        rt_thread_delay(wait);
+        rt_enter_critical();
+    }
+    rt_exit_critical();
+}
+
+/* Puts thread, RT_NULL for the caller, in a class.  Normal threads are not
+   kept in the table.  */
+UINT filex_qos_set(rt_thread_t thread, int qos_class)
+{
+    int free = -1;
+    int i;
+
+    if ((qos_class < 0) || (qos_class >= FILEX_QOS_CLASSES))
+    {
+        return FX_INVALID_OPTION;
+    }
+    if (thread == RT_NULL)
+    {
+        thread = rt_thread_self();
+    }
+
+    rt_enter_critical();
+    for (i = 0; i < FILEX_QOS_THREADS; i++)
+    {
+        if (qos.threads[i].thread == thread)
+        {
+            break;
+        }
+        if ((qos.threads[i].thread == RT_NULL) && (free < 0))
+        {
+            free = i;
+        }
+    }
+    if (i == FILEX_QOS_THREADS)
+    {
+        if ((qos_class == FILEX_QOS_NORMAL) || (free < 0))
+        {
+            rt_exit_critical();
+            return (qos_class == FILEX_QOS_NORMAL) ? FX_SUCCESS : FX_NO_MORE_ENTRIES;
+        }
+        i = free;
+    }
+    qos.threads[i].thread = (qos_class == FILEX_QOS_NORMAL) ? RT_NULL : thread;
+    qos.threads[i].qos_class = (rt_uint8_t)qos_class;
+    rt_exit_critical();
+    return FX_SUCCESS;
+}
+
+/* Limits a class to rate bytes per second in bursts of up to burst bytes;
+   rate 0 lifts the limit.  */
+UINT filex_qos_limit(int qos_class, rt_uint32_t rate, rt_uint32_t burst)
+{
+    filex_qos_bucket_t * bucket;
+
+    if ((qos_class < 0) || (qos_class >= FILEX_QOS_CLASSES))
+    {
+        return FX_INVALID_OPTION;
+    }
+
+    rt_enter_critical();
+    bucket = &qos.buckets[qos_class];
+    bucket->rate = rate;
+    bucket->burst = burst ? burst : FILEX_QOS_SLICE;
+    bucket->tokens = bucket->burst;
+    bucket->stamp = rt_tick_get();
+    rt_exit_critical();
+    return FX_SUCCESS;
+}
+
+void filex_qos_stats_get(int qos_class, struct filex_qos_stats * stats)
+{
+    rt_enter_critical();
+    *stats = qos.stats[qos_class];
+    rt_exit_critical();
+}
+
+static void _filex_qos_detach_hook(struct rt_object * object)
+{
+    int i;
+
+    if (rt_object_get_type(object) != RT_Object_Class_Thread)
+    {
+        return;
+    }
+    rt_enter_critical();
+    for (i = 0; i < FILEX_QOS_THREADS; i++)
+    {
+        if (qos.threads[i].thread == (rt_thread_t)object)
+        {
+            qos.threads[i].thread = RT_NULL;
+            break;
+        }
+    }
+    rt_exit_critical();
+}
+
+int filex_qos_init(void)
+{
+    char name[RT_NAME_MAX];
+    int i;
+
+    rt_list_init(&qos.waiters);
+    for (i = 0; i < FILEX_QOS_CLASSES; i++)
+    {
+        rt_snprintf(name, sizeof(name), "filex%d", i);
+        qos.wake[i] = rt_sem_create(name, 0, RT_IPC_FLAG_FIFO);
+        if (qos.wake[i] == RT_NULL)
+        {
+            return -RT_ENOMEM;
+        }
+    }
+    rt_object_detach_sethook(_filex_qos_detach_hook);
+    return RT_EOK;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+static void filex_qos(int argc, char ** argv)
+{
+    static const char * const names[FILEX_QOS_CLASSES] = {"real-time", "normal", "background"};
+    struct filex_qos_stats stats;
+    int qos_class;
+
+    for (qos_class = 0; qos_class < FILEX_QOS_CLASSES; qos_class++)
+    {
+        filex_qos_stats_get(qos_class, &stats);
+        rt_kprintf("%-10s %10u bytes  %8u waits  %u/%u ticks avg/max  %u ticks throttled\n", names[qos_class],
+                   (rt_uint32_t)stats.bytes, stats.waits, stats.waits ? stats.wait_ticks / stats.waits : 0,
+                   stats.wait_max, stats.throttled_ticks);
+    }
+}
+MSH_CMD_EXPORT(filex_qos, show filex lock waits and throttling per I/O class);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_QOS */
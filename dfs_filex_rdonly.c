@@ -0,0 +1,292 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "fx_utility.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_CONCURRENT_READ
+
+/* Reads of a read-only mount go around FileX and filex_lock.  Nothing on
+   the volume changes, so the directory entry and the cluster chain a handle
+   saw at open stay valid; FAT and partial sectors come from a small cache
+   split in stripes with a mutex each, so readers of different sectors do
+   not wait on one another.  */
+
+UINT filex_read_cache_init(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_read_stripe_t * stripe;
+    int i;
+
+    for (i = 0; i < FILEX_READ_CACHE_STRIPES; i++)
+    {
+        stripe = &filex_media->read_cache[i];
+        rt_memset(stripe->sector, 0, sizeof(stripe->sector));
+        rt_memset(stripe->stamp, 0, sizeof(stripe->stamp));
+        stripe->clock = 0;
+        stripe->buffer = rt_malloc(FILEX_READ_CACHE_WAYS * media->fx_media_bytes_per_sector);
+        if (stripe->buffer == RT_NULL)
+        {
+            filex_read_cache_release(filex_media);
+            return FX_NOT_ENOUGH_MEMORY;
+        }
+        rt_mutex_init(&stripe->lock, "fxread", RT_IPC_FLAG_PRIO);
+    }
+    return FX_SUCCESS;
+}
+
+void filex_read_cache_release(filex_media_t * filex_media)
+{
+    filex_read_stripe_t * stripe;
+    int i;
+
+    for (i = 0; i < FILEX_READ_CACHE_STRIPES; i++)
+    {
+        stripe = &filex_media->read_cache[i];
+        if (stripe->buffer != RT_NULL)
+        {
+            rt_mutex_detach(&stripe->lock);
+            rt_free(stripe->buffer);
+            stripe->buffer = RT_NULL;
+        }
+    }
+}
+
+/* The way holding sector in its stripe, read in on a miss.  Called with the
+   stripe locked.  */
+static int _filex_read_way(FX_MEDIA * media, filex_read_stripe_t * stripe, ULONG sector)
+{
+    int victim = 0;
+    int way;
+
+    for (way = 0; way < FILEX_READ_CACHE_WAYS; way++)
+    {
+        if (stripe->stamp[way] && (stripe->sector[way] == sector))
+        {
+            break;
+        }
+        if (stripe->stamp[way] < stripe->stamp[victim])
+        {
+            victim = way;
+        }
+    }
+
+    if (way == FILEX_READ_CACHE_WAYS)
+    {
+        way = victim;
+        if (rt_fx_block_read(media, media->fx_media_hidden_sectors + sector,
+                         stripe->buffer + way * media->fx_media_bytes_per_sector, 1) != 1)
+        {
+            stripe->stamp[way] = 0;
+            return -1;
+        }
+        stripe->sector[way] = sector;
+    }
+
+    if (++stripe->clock == 0)
+    {
+        for (victim = 0; victim < FILEX_READ_CACHE_WAYS; victim++)
+        {
+            if (stripe->stamp[victim])
+            {
+                stripe->stamp[victim] = 1;
+            }
+        }
+        stripe->clock = 2;
+    }
+    stripe->stamp[way] = stripe->clock;
+    return way;
+}
+
+/* Copies size bytes starting offset bytes into logical sector.  */
+static UINT _filex_read_copy(filex_media_t * filex_media, ULONG sector, ULONG offset, UCHAR * buffer, ULONG size)
+{
+    FX_MEDIA * media = &filex_media->media;
+    filex_read_stripe_t * stripe;
+    ULONG copy;
+    int way;
+
+    sector += offset / media->fx_media_bytes_per_sector;
+    offset %= media->fx_media_bytes_per_sector;
+    while (size)
+    {
+        copy = media->fx_media_bytes_per_sector - offset;
+        if (copy > size)
+        {
+            copy = size;
+        }
+
+        stripe = &filex_media->read_cache[sector % FILEX_READ_CACHE_STRIPES];
+        rt_mutex_take(&stripe->lock, RT_WAITING_FOREVER);
+        way = _filex_read_way(media, stripe, sector);
+        if (way < 0)
+        {
+            rt_mutex_release(&stripe->lock);
+            return FX_IO_ERROR;
+        }
+        rt_memcpy(buffer, stripe->buffer + way * media->fx_media_bytes_per_sector + offset, copy);
+        rt_mutex_release(&stripe->lock);
+
+        buffer += copy;
+        size -= copy;
+        sector++;
+        offset = 0;
+    }
+    return FX_SUCCESS;
+}
+
+static UINT _filex_read_fat_entry(filex_media_t * filex_media, ULONG cluster, ULONG * next)
+{
+    FX_MEDIA * media = &filex_media->media;
+    UCHAR entry[4];
+    ULONG offset;
+    UINT result;
+
+#ifdef FX_ENABLE_EXFAT
+    if ((media->fx_media_FAT_type == FX_exFAT) || media->fx_media_32_bit_FAT)
+#else
+    if (media->fx_media_32_bit_FAT)
+#endif /* FX_ENABLE_EXFAT */
+    {
+        result = _filex_read_copy(filex_media, media->fx_media_reserved_sectors, cluster * 4, entry, 4);
+        *next = _fx_utility_32_unsigned_read(entry);
+        if (media->fx_media_32_bit_FAT)
+        {
+            *next &= FX_32_BIT_FAT_MASK;
+        }
+    }
+    else if (media->fx_media_12_bit_FAT)
+    {
+        offset = cluster + (cluster >> 1);
+        result = _filex_read_copy(filex_media, media->fx_media_reserved_sectors, offset, entry, 2);
+        *next = _fx_utility_16_unsigned_read(entry);
+        *next = (cluster & 1) ? (*next >> 4) : (*next & 0xFFF);
+    }
+    else
+    {
+        result = _filex_read_copy(filex_media, media->fx_media_reserved_sectors, cluster * 2, entry, 2);
+        *next = _fx_utility_16_unsigned_read(entry);
+    }
+    return result;
+}
+
+/* Physical cluster of the relative-th cluster of the file.  The current
+   cluster pair of the handle is the cursor, reading forward never walks the
+   chain from its start again.  */
+static UINT _filex_read_cluster(filex_media_t * filex_media, FX_FILE * file, ULONG relative, ULONG * cluster)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG next;
+    UINT result;
+
+    if ((relative < file->fx_file_current_relative_cluster) ||
+        (file->fx_file_current_physical_cluster < FX_FAT_ENTRY_START))
+    {
+        file->fx_file_current_relative_cluster = 0;
+        file->fx_file_current_physical_cluster = file->fx_file_first_physical_cluster;
+    }
+
+    while (file->fx_file_current_relative_cluster < relative)
+    {
+#ifdef FX_ENABLE_EXFAT
+        if (file->fx_file_dir_entry.fx_dir_entry_dont_use_fat & 1)
+        {
+            next = file->fx_file_current_physical_cluster + 1;
+        }
+        else
+#endif /* FX_ENABLE_EXFAT */
+        {
+            result = _filex_read_fat_entry(filex_media, file->fx_file_current_physical_cluster, &next);
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+        }
+        if ((next < FX_FAT_ENTRY_START) || (next >= media->fx_media_fat_reserved))
+        {
+            return FX_FILE_CORRUPT;
+        }
+        file->fx_file_current_physical_cluster = next;
+        file->fx_file_current_relative_cluster++;
+    }
+
+    *cluster = file->fx_file_current_physical_cluster;
+    return FX_SUCCESS;
+}
+
+/* Reads at offset without taking filex_lock.  Whole sectors go straight to
+   the caller's buffer, the ends of the request through the stripes.  */
+UINT filex_concurrent_read(FX_FILE * file, ULONG64 offset, UCHAR * buffer, ULONG size, ULONG * actual)
+{
+    FX_MEDIA * media = file->fx_file_media_ptr;
+    filex_media_t * filex_media = rt_container_of(media, filex_media_t, media);
+    ULONG bytes_per_cluster = media->fx_media_bytes_per_sector * media->fx_media_sectors_per_cluster;
+    ULONG cluster;
+    ULONG sector;
+    ULONG within;
+    ULONG copy;
+    ULONG sectors;
+    UINT result;
+
+    *actual = 0;
+    if (offset >= file->fx_file_current_file_size)
+    {
+        return FX_SUCCESS;
+    }
+    if (size > file->fx_file_current_file_size - offset)
+    {
+        size = (ULONG)(file->fx_file_current_file_size - offset);
+    }
+
+    while (size)
+    {
+        result = _filex_read_cluster(filex_media, file, (ULONG)(offset / bytes_per_cluster), &cluster);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+
+        within = (ULONG)(offset % bytes_per_cluster);
+        sector = (cluster - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster +
+                 media->fx_media_data_sector_start + within / media->fx_media_bytes_per_sector;
+        within %= media->fx_media_bytes_per_sector;
+
+        if ((within == 0) && (size >= media->fx_media_bytes_per_sector))
+        {
+            sectors = size / media->fx_media_bytes_per_sector;
+            copy = (ULONG)((bytes_per_cluster - offset % bytes_per_cluster) / media->fx_media_bytes_per_sector);
+            if (sectors > copy)
+            {
+                sectors = copy;
+            }
+            if (rt_fx_block_read(media, media->fx_media_hidden_sectors + sector,
+                             buffer, sectors) != sectors)
+            {
+                return FX_IO_ERROR;
+            }
+            copy = sectors * media->fx_media_bytes_per_sector;
+        }
+        else
+        {
+            copy = media->fx_media_bytes_per_sector - within;
+            if (copy > size)
+            {
+                copy = size;
+            }
+            result = _filex_read_copy(filex_media, sector, within, buffer, copy);
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+        }
+
+        buffer += copy;
+        offset += copy;
+        size -= copy;
+        *actual += copy;
+    }
+    return FX_SUCCESS;
+}
+
+#endif /* FILEX_USING_CONCURRENT_READ */
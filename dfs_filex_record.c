@@ -0,0 +1,245 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_RECORD
+
+/* Recording mode: a file written in long sequential runs, as by a video
+   recorder.  Writes are staged and handed to FileX a whole buffer at a
+   time, at file offsets that are multiples of the buffer size.  Clusters
+   are allocated ahead one allocation unit at a time, contiguous and
+   starting on an AU boundary of the card, so FileX updates the FAT once per
+   AU rather than once per cluster and the card sees whole AUs written in
+   order.  What is allocated ahead and not written is released on close.  */
+
+static filex_record_t * _filex_record_find(FX_FILE * file)
+{
+    filex_media_t * filex_media = rt_container_of(file->fx_file_media_ptr, filex_media_t, media);
+    int i;
+
+    for (i = 0; i < FILEX_RECORD_FILES; i++)
+    {
+        if (filex_media->records[i].file == file)
+        {
+            return &filex_media->records[i];
+        }
+    }
+    return RT_NULL;
+}
+
+/* Points the FileX free cluster search at the next cluster after the file,
+   or for an empty file at the first free one that starts an AU.  */
+static void _filex_record_search_start(FX_FILE * file, ULONG au_size)
+{
+    FX_MEDIA * media = file->fx_file_media_ptr;
+    ULONG au_sectors = au_size / media->fx_media_bytes_per_sector;
+    ULONG start = media->fx_media_cluster_search_start;
+    ULONG sector;
+    ULONG skip;
+
+    if (file->fx_file_last_physical_cluster >= FX_FAT_ENTRY_START)
+    {
+        start = file->fx_file_last_physical_cluster + 1;
+    }
+    else if (au_sectors != 0)
+    {
+        sector = media->fx_media_hidden_sectors + media->fx_media_data_sector_start +
+                 (start - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster;
+        skip = (au_sectors - sector % au_sectors) % au_sectors;
+
+        /* Clusters that straddle AUs cannot be aligned.  */
+        if (skip % media->fx_media_sectors_per_cluster)
+        {
+            return;
+        }
+        start += skip / media->fx_media_sectors_per_cluster;
+    }
+
+    if (start < media->fx_media_total_clusters + FX_FAT_ENTRY_START)
+    {
+        media->fx_media_cluster_search_start = start;
+    }
+}
+
+/* Hands the staged bytes to FileX, allocating whole AUs ahead first.  An
+   allocation failure is not an error: FileX then allocates as it writes.  */
+static UINT _filex_record_flush(filex_record_t * record)
+{
+    FX_FILE * file = record->file;
+    ULONG64 end = file->fx_file_current_file_offset + record->used;
+    ULONG64 missing;
+    UINT result;
+
+    if (record->used == 0)
+    {
+        return FX_SUCCESS;
+    }
+
+    if (end > file->fx_file_current_available_size)
+    {
+        missing = end - file->fx_file_current_available_size;
+        missing = (missing + record->au_size - 1) / record->au_size * record->au_size;
+        _filex_record_search_start(file, record->au_size);
+        if (fx_file_extended_allocate(file, missing) == FX_SUCCESS)
+        {
+            record->allocated = RT_TRUE;
+        }
+    }
+
+    result = fx_file_write(file, record->buffer, record->used);
+    if (result == FX_SUCCESS)
+    {
+        record->used = 0;
+    }
+    return result;
+}
+
+UINT filex_record_start(FX_FILE * file, const struct filex_record_mode * mode)
+{
+    filex_media_t * filex_media = rt_container_of(file->fx_file_media_ptr, filex_media_t, media);
+    filex_record_t * record = _filex_record_find(file);
+    ULONG au_size = FILEX_RECORD_AU_SIZE;
+    ULONG buffer_size = FILEX_RECORD_BUFFER_SIZE;
+    int i;
+
+    if (file->fx_file_open_mode != FX_OPEN_FOR_WRITE)
+    {
+        return FX_ACCESS_ERROR;
+    }
+    if (record != RT_NULL)
+    {
+        return FX_SUCCESS;
+    }
+
+    if (mode != RT_NULL)
+    {
+        if (mode->au_size)
+        {
+            au_size = mode->au_size;
+        }
+        if (mode->buffer_size)
+        {
+            buffer_size = mode->buffer_size;
+        }
+    }
+    /* Buffers must end on AU boundaries too.  */
+    if ((buffer_size == 0) || (au_size % buffer_size) || (buffer_size % file->fx_file_media_ptr->fx_media_bytes_per_sector))
+    {
+        return FX_INVALID_OPTION;
+    }
+
+    for (i = 0; i < FILEX_RECORD_FILES; i++)
+    {
+        if (filex_media->records[i].file == RT_NULL)
+        {
+            record = &filex_media->records[i];
+            break;
+        }
+    }
+    if (record == RT_NULL)
+    {
+        return FX_NO_MORE_ENTRIES;
+    }
+
+    record->buffer = rt_malloc(buffer_size);
+    if (record->buffer == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    record->file = file;
+    record->buffer_size = buffer_size;
+    record->au_size = au_size;
+    record->used = 0;
+    record->allocated = RT_FALSE;
+    return FX_SUCCESS;
+}
+
+rt_bool_t filex_record_active(FX_FILE * file)
+{
+    return _filex_record_find(file) != RT_NULL;
+}
+
+/* Bytes staged and not yet written to FileX, past its current offset.  */
+ULONG filex_record_staged(FX_FILE * file)
+{
+    filex_record_t * record = _filex_record_find(file);
+
+    return (record != RT_NULL) ? record->used : 0;
+}
+
+UINT filex_record_write(FX_FILE * file, const UCHAR * buffer, ULONG size)
+{
+    filex_record_t * record = _filex_record_find(file);
+    ULONG room;
+    UINT result;
+
+    if (record == RT_NULL)
+    {
+        return fx_file_write(file, (VOID *)buffer, size);
+    }
+
+    while (size)
+    {
+        /* Up to the next multiple of the buffer size in the file.  */
+        room = record->buffer_size - (ULONG)((file->fx_file_current_file_offset + record->used) % record->buffer_size);
+        if (room > record->buffer_size - record->used)
+        {
+            room = record->buffer_size - record->used;
+        }
+        if (room > size)
+        {
+            room = size;
+        }
+
+        rt_memcpy(record->buffer + record->used, buffer, room);
+        record->used += room;
+        buffer += room;
+        size -= room;
+
+        if (((file->fx_file_current_file_offset + record->used) % record->buffer_size == 0) ||
+            (record->used == record->buffer_size))
+        {
+            result = _filex_record_flush(record);
+            if (result != FX_SUCCESS)
+            {
+                return result;
+            }
+        }
+    }
+    return FX_SUCCESS;
+}
+
+/* Writes out what is staged, before anything else looks at the file.  */
+UINT filex_record_sync(FX_FILE * file)
+{
+    filex_record_t * record = _filex_record_find(file);
+
+    return (record != RT_NULL) ? _filex_record_flush(record) : FX_SUCCESS;
+}
+
+/* Leaves recording mode, giving back the clusters allocated ahead.  */
+UINT filex_record_stop(FX_FILE * file)
+{
+    filex_record_t * record = _filex_record_find(file);
+    UINT result;
+
+    if (record == RT_NULL)
+    {
+        return FX_SUCCESS;
+    }
+
+    result = _filex_record_flush(record);
+    if ((result == FX_SUCCESS) && record->allocated &&
+        (file->fx_file_current_available_size > file->fx_file_current_file_size))
+    {
+        result = fx_file_extended_truncate_release(file, file->fx_file_current_file_size);
+    }
+
+    rt_free(record->buffer);
+    record->buffer = RT_NULL;
+    record->file = RT_NULL;
+    return result;
+}
+
+#endif /* FILEX_USING_RECORD */
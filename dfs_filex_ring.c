@@ -0,0 +1,413 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "fx_utility.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_RING_LOG
+
+/* Ring log: a file preallocated once as one contiguous cluster run, its
+   first sector a header and the rest a circular data area.  Appends write
+   the data sectors in place and then the header, so the FAT and the
+   directory entry are never touched after the ring is made.  Positions are
+   64-bit sequence numbers of bytes ever appended; the header keeps the
+   first one still held and the next one to write.  */
+
+#define FILEX_RING_MAGIC                        0x474E5246      /* "FRNG" */
+
+#define FILEX_RING_OFFSET_MAGIC                 0
+#define FILEX_RING_OFFSET_CAPACITY              4
+#define FILEX_RING_OFFSET_RECORD                8
+#define FILEX_RING_OFFSET_FIRST                 16
+#define FILEX_RING_OFFSET_NEXT                  24
+
+static filex_ring_t * _filex_ring_find(FX_FILE * file)
+{
+    filex_media_t * filex_media = rt_container_of(file->fx_file_media_ptr, filex_media_t, media);
+    int i;
+
+    for (i = 0; i < FILEX_RING_FILES; i++)
+    {
+        if (filex_media->rings[i].file == file)
+        {
+            return &filex_media->rings[i];
+        }
+    }
+    return RT_NULL;
+}
+
+static UINT _filex_ring_header_write(filex_ring_t * ring)
+{
+    FX_MEDIA * media = ring->file->fx_file_media_ptr;
+
+    rt_memset(ring->sector, 0, media->fx_media_bytes_per_sector);
+    _fx_utility_32_unsigned_write(ring->sector + FILEX_RING_OFFSET_MAGIC, FILEX_RING_MAGIC);
+    _fx_utility_32_unsigned_write(ring->sector + FILEX_RING_OFFSET_CAPACITY, ring->capacity);
+    _fx_utility_32_unsigned_write(ring->sector + FILEX_RING_OFFSET_RECORD, ring->record_size);
+    _fx_utility_64_unsigned_write(ring->sector + FILEX_RING_OFFSET_FIRST, ring->first);
+    _fx_utility_64_unsigned_write(ring->sector + FILEX_RING_OFFSET_NEXT, ring->next);
+    return fx_media_write(media, ring->base, ring->sector);
+}
+
+static UINT _filex_ring_header_read(filex_ring_t * ring)
+{
+    FX_MEDIA * media = ring->file->fx_file_media_ptr;
+    UINT result;
+
+    result = fx_media_read(media, ring->base, ring->sector);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+    if (_fx_utility_32_unsigned_read(ring->sector + FILEX_RING_OFFSET_MAGIC) != FILEX_RING_MAGIC)
+    {
+        return FX_NOT_FOUND;
+    }
+
+    ring->capacity = _fx_utility_32_unsigned_read(ring->sector + FILEX_RING_OFFSET_CAPACITY);
+    ring->record_size = _fx_utility_32_unsigned_read(ring->sector + FILEX_RING_OFFSET_RECORD);
+    ring->first = _fx_utility_64_unsigned_read(ring->sector + FILEX_RING_OFFSET_FIRST);
+    ring->next = _fx_utility_64_unsigned_read(ring->sector + FILEX_RING_OFFSET_NEXT);
+    if ((ring->capacity == 0) || (ring->record_size == 0) || (ring->first > ring->next) ||
+        (ring->next - ring->first > ring->capacity) ||
+        ((ULONG64)ring->capacity + media->fx_media_bytes_per_sector > ring->file->fx_file_current_available_size))
+    {
+        return FX_FILE_CORRUPT;
+    }
+    return FX_SUCCESS;
+}
+
+/* Sectors are addressed from base, so the header and the data area must
+   sit in one cluster run.  A copied ring, or any file that happens to
+   start with the magic, may not.  */
+static UINT _filex_ring_contiguous(filex_ring_t * ring)
+{
+    FX_MEDIA * media = ring->file->fx_file_media_ptr;
+    ULONG bytes_per_cluster = media->fx_media_bytes_per_sector * media->fx_media_sectors_per_cluster;
+    ULONG clusters = (ULONG)(((ULONG64)ring->capacity + media->fx_media_bytes_per_sector + bytes_per_cluster - 1) /
+                             bytes_per_cluster);
+    ULONG cluster = ring->file->fx_file_first_physical_cluster;
+    ULONG next;
+    UINT result;
+
+#ifdef FX_ENABLE_EXFAT
+    /* An exFAT file without a FAT chain is one run by definition.  */
+    if (ring->file->fx_file_dir_entry.fx_dir_entry_dont_use_fat & 1)
+    {
+        return FX_SUCCESS;
+    }
+#endif /* FX_ENABLE_EXFAT */
+    while (--clusters)
+    {
+        result = _fx_utility_FAT_entry_read(media, cluster, &next);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+        if (next != cluster + 1)
+        {
+            return FX_FILE_CORRUPT;
+        }
+        cluster = next;
+    }
+    return FX_SUCCESS;
+}
+
+/* Preallocates an empty file as a ring of at least capacity bytes.  The
+   ring takes the whole allocation, rounded down to whole records.  */
+static UINT _filex_ring_format(filex_ring_t * ring, ULONG capacity, ULONG record_size)
+{
+    FX_FILE * file = ring->file;
+    FX_MEDIA * media = file->fx_file_media_ptr;
+    UINT result;
+
+    if (file->fx_file_open_mode != FX_OPEN_FOR_WRITE)
+    {
+        return FX_ACCESS_ERROR;
+    }
+    if ((capacity == 0) || (record_size == 0) || (capacity < record_size))
+    {
+        return FX_INVALID_OPTION;
+    }
+
+    /* One allocation: fx_file_extended_allocate takes contiguous clusters
+       or fails.  */
+    result = fx_file_extended_allocate(file, (ULONG64)capacity + media->fx_media_bytes_per_sector);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+
+    ring->base = media->fx_media_data_sector_start +
+                 (file->fx_file_first_physical_cluster - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster;
+    ring->capacity = (ULONG)(file->fx_file_current_available_size - media->fx_media_bytes_per_sector);
+    ring->capacity -= ring->capacity % record_size;
+    ring->record_size = record_size;
+    ring->first = 0;
+    ring->next = 0;
+
+    /* The file spans the whole ring, so it can be copied off as it is;
+       attaching to a copy checks it is still one run.  */
+    file->fx_file_current_file_size = file->fx_file_current_available_size;
+    file->fx_file_dir_entry.fx_dir_entry_file_size = file->fx_file_current_file_size;
+    file->fx_file_modified = FX_TRUE;
+    return _filex_ring_header_write(ring);
+}
+
+UINT filex_ring_attach(FX_FILE * file, const struct filex_ring_mode * mode)
+{
+    FX_MEDIA * media = file->fx_file_media_ptr;
+    filex_media_t * filex_media = rt_container_of(media, filex_media_t, media);
+    filex_ring_t * ring = _filex_ring_find(file);
+    UINT result;
+    int i;
+
+    if (ring != RT_NULL)
+    {
+        return FX_SUCCESS;
+    }
+    /* Reads of a read-only mount bypass filex_lock and the ring with it.  */
+    if (filex_media->read_only)
+    {
+        return FX_WRITE_PROTECT;
+    }
+
+    for (i = 0; i < FILEX_RING_FILES; i++)
+    {
+        if (filex_media->rings[i].file == RT_NULL)
+        {
+            ring = &filex_media->rings[i];
+            break;
+        }
+    }
+    if (ring == RT_NULL)
+    {
+        return FX_NO_MORE_ENTRIES;
+    }
+
+    ring->sector = rt_malloc(media->fx_media_bytes_per_sector);
+    if (ring->sector == RT_NULL)
+    {
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    ring->file = file;
+
+    if (file->fx_file_first_physical_cluster >= FX_FAT_ENTRY_START)
+    {
+        ring->base = media->fx_media_data_sector_start +
+                     (file->fx_file_first_physical_cluster - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster;
+        result = _filex_ring_header_read(ring);
+        if (result == FX_SUCCESS)
+        {
+            result = _filex_ring_contiguous(ring);
+        }
+        else if (result == FX_NOT_FOUND)
+        {
+            /* Any other file with data is not ours to overwrite.  */
+            result = FX_INVALID_STATE;
+        }
+    }
+    else if (mode != RT_NULL)
+    {
+        result = _filex_ring_format(ring, mode->capacity, mode->record_size ? mode->record_size : 1);
+    }
+    else
+    {
+        result = FX_INVALID_OPTION;
+    }
+
+    if (result != FX_SUCCESS)
+    {
+        filex_ring_detach(file);
+        return result;
+    }
+    ring->read = ring->first;
+    return FX_SUCCESS;
+}
+
+void filex_ring_detach(FX_FILE * file)
+{
+    filex_ring_t * ring = _filex_ring_find(file);
+
+    if (ring != RT_NULL)
+    {
+        rt_free(ring->sector);
+        ring->sector = RT_NULL;
+        ring->file = RT_NULL;
+    }
+}
+
+rt_bool_t filex_ring_active(FX_FILE * file)
+{
+    return _filex_ring_find(file) != RT_NULL;
+}
+
+/* Appends whole records, dropping the oldest ones to make room.  */
+UINT filex_ring_append(FX_FILE * file, const UCHAR * buffer, ULONG size)
+{
+    filex_ring_t * ring = _filex_ring_find(file);
+    FX_MEDIA * media = file->fx_file_media_ptr;
+    ULONG bytes_per_sector = media->fx_media_bytes_per_sector;
+    ULONG64 next;
+    ULONG offset;
+    ULONG sector;
+    ULONG within;
+    ULONG copy;
+    UINT result;
+
+    if (file->fx_file_open_mode != FX_OPEN_FOR_WRITE)
+    {
+        return FX_ACCESS_ERROR;
+    }
+    if ((size % ring->record_size) || (size > ring->capacity))
+    {
+        return FX_INVALID_OPTION;
+    }
+
+    /* The header moves past the records first, so a reboot part way
+       through never finds them half overwritten.  */
+    if (ring->next + size - ring->first > ring->capacity)
+    {
+        ring->first = ring->next + size - ring->capacity;
+        result = _filex_ring_header_write(ring);
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    next = ring->next;
+    while (size)
+    {
+        offset = (ULONG)(next % ring->capacity);
+        sector = ring->base + 1 + offset / bytes_per_sector;
+        within = offset % bytes_per_sector;
+        copy = bytes_per_sector - within;
+        if (copy > ring->capacity - offset)
+        {
+            copy = ring->capacity - offset;
+        }
+        if (copy > size)
+        {
+            copy = size;
+        }
+
+        if (copy == bytes_per_sector)
+        {
+            result = fx_media_write(media, sector, (VOID *)buffer);
+        }
+        else
+        {
+            result = fx_media_read(media, sector, ring->sector);
+            if (result == FX_SUCCESS)
+            {
+                rt_memcpy(ring->sector + within, buffer, copy);
+                result = fx_media_write(media, sector, ring->sector);
+            }
+        }
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+
+        buffer += copy;
+        size -= copy;
+        next += copy;
+    }
+
+    ring->next = next;
+    return _filex_ring_header_write(ring);
+}
+
+/* Reads oldest first from the read position, which skips ahead to the
+   oldest record held when the records under it were dropped.  */
+UINT filex_ring_read(FX_FILE * file, UCHAR * buffer, ULONG size, ULONG * actual)
+{
+    filex_ring_t * ring = _filex_ring_find(file);
+    FX_MEDIA * media = file->fx_file_media_ptr;
+    ULONG bytes_per_sector = media->fx_media_bytes_per_sector;
+    ULONG offset;
+    ULONG sector;
+    ULONG within;
+    ULONG copy;
+    UINT result;
+
+    *actual = 0;
+    if (ring->read < ring->first)
+    {
+        ring->read = ring->first;
+    }
+    if (size > ring->next - ring->read)
+    {
+        size = (ULONG)(ring->next - ring->read);
+    }
+
+    while (size)
+    {
+        offset = (ULONG)(ring->read % ring->capacity);
+        sector = ring->base + 1 + offset / bytes_per_sector;
+        within = offset % bytes_per_sector;
+        copy = bytes_per_sector - within;
+        if (copy > ring->capacity - offset)
+        {
+            copy = ring->capacity - offset;
+        }
+        if (copy > size)
+        {
+            copy = size;
+        }
+
+        if (copy == bytes_per_sector)
+        {
+            result = fx_media_read(media, sector, buffer);
+        }
+        else
+        {
+            result = fx_media_read(media, sector, ring->sector);
+            if (result == FX_SUCCESS)
+            {
+                rt_memcpy(buffer, ring->sector + within, copy);
+            }
+        }
+        if (result != FX_SUCCESS)
+        {
+            return result;
+        }
+
+        buffer += copy;
+        size -= copy;
+        ring->read += copy;
+        *actual += copy;
+    }
+    return FX_SUCCESS;
+}
+
+/* Positions are bytes from the oldest record held.  */
+ULONG filex_ring_tell(FX_FILE * file)
+{
+    filex_ring_t * ring = _filex_ring_find(file);
+
+    return (ring->read > ring->first) ? (ULONG)(ring->read - ring->first) : 0;
+}
+
+ULONG filex_ring_seek(FX_FILE * file, ULONG offset)
+{
+    filex_ring_t * ring = _filex_ring_find(file);
+
+    if (offset > ring->next - ring->first)
+    {
+        offset = (ULONG)(ring->next - ring->first);
+    }
+    ring->read = ring->first + offset;
+    return offset;
+}
+
+/* Bytes held, for the DFS file size.  */
+ULONG filex_ring_used(FX_FILE * file)
+{
+    filex_ring_t * ring = _filex_ring_find(file);
+
+    return (ULONG)(ring->next - ring->first);
+}
+
+#endif /* FILEX_USING_RING_LOG */
@@ -0,0 +1,279 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+
+#define FILEX_SECONDARY_PRIMARY     0
+#define FILEX_SECONDARY_COPY        1
+#define FILEX_SECONDARY_OTHER       2
+
+/* Which FAT a sector belongs to, and its offset inside that FAT.  */
+static int _filex_secondary_locate(FX_MEDIA * media, ULONG sector, ULONG * offset)
+{
+    ULONG start = media->fx_media_hidden_sectors + media->fx_media_reserved_sectors;
+    ULONG copy;
+
+    if ((sector < start) || (media->fx_media_sectors_per_FAT == 0))
+    {
+        return FILEX_SECONDARY_OTHER;
+    }
+
+    copy = (sector - start) / media->fx_media_sectors_per_FAT;
+    *offset = (sector - start) % media->fx_media_sectors_per_FAT;
+    if (copy >= media->fx_media_number_of_FATs)
+    {
+        return FILEX_SECONDARY_OTHER;
+    }
+    return (copy == 0) ? FILEX_SECONDARY_PRIMARY : FILEX_SECONDARY_COPY;
+}
+
+static rt_bool_t _filex_secondary_dirty(filex_media_t * filex_media, ULONG offset)
+{
+    ULONG bit = offset / filex_media->secondary_map_sectors;
+
+    return (filex_media->secondary_map[bit >> 3] & (1 << (bit & 7))) != 0;
+}
+
+static void _filex_secondary_mark(filex_media_t * filex_media, ULONG offset)
+{
+    ULONG bit = offset / filex_media->secondary_map_sectors;
+
+    filex_media->secondary_map[bit >> 3] |= (rt_uint8_t)(1 << (bit & 7));
+}
+
+static rt_bool_t _filex_secondary_outside(FX_MEDIA * media, ULONG sector, ULONG sectors)
+{
+    ULONG start = media->fx_media_hidden_sectors + media->fx_media_reserved_sectors;
+
+    return (sector + sectors <= start) ||
+           (sector >= start + media->fx_media_number_of_FATs * media->fx_media_sectors_per_FAT);
+}
+
+/* Sectors from sector on in the same FAT, or all outside the FATs.  */
+static ULONG _filex_secondary_run(FX_MEDIA * media, ULONG sector, ULONG sectors, int * type)
+{
+    ULONG offset;
+    ULONG run;
+
+    *type = _filex_secondary_locate(media, sector, &offset);
+    for (run = 1; run < sectors; run++)
+    {
+        if ((_filex_secondary_locate(media, sector + run, &offset) != *type) ||
+            ((*type != FILEX_SECONDARY_OTHER) && (offset == 0)))
+        {
+            break;
+        }
+    }
+    return run;
+}
+
+/* Tracks writes with one dirty bit per map_sectors primary FAT sectors.
+   Nothing to do on a volume with a single FAT.  */
+UINT filex_secondary_fat_init(filex_media_t * filex_media, rt_uint32_t map_sectors)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG bits;
+
+    if ((media->fx_media_number_of_FATs < 2) || (media->fx_media_FAT_type == FX_exFAT))
+    {
+        return FX_SUCCESS;
+    }
+
+    if (map_sectors == 0)
+    {
+        map_sectors = FILEX_FAT_MAP_SECTORS;
+    }
+    bits = (media->fx_media_sectors_per_FAT + map_sectors - 1) / map_sectors;
+
+    filex_media->secondary_map = rt_calloc(1, (bits + 7) / 8);
+    filex_media->secondary_buffer = rt_malloc(media->fx_media_bytes_per_sector);
+    if ((filex_media->secondary_map == RT_NULL) || (filex_media->secondary_buffer == RT_NULL))
+    {
+        filex_secondary_fat_release(media);
+        return FX_NOT_ENOUGH_MEMORY;
+    }
+    filex_media->secondary_map_sectors = map_sectors;
+    return FX_SUCCESS;
+}
+
+/* A stale secondary sector is read from the primary FAT instead.  */
+size_t filex_secondary_fat_read(FX_MEDIA * media, ULONG sector, UCHAR * buffer, ULONG sectors)
+{
+    filex_media_t * filex_media = rt_container_of(media, filex_media_t, media);
+    size_t total = sectors;
+    ULONG offset;
+    ULONG run;
+    int type;
+
+    if ((filex_media->secondary_map == RT_NULL) || _filex_secondary_outside(media, sector, sectors))
+    {
+        return rt_fx_mirror_read(media, sector, buffer, sectors);
+    }
+
+    while (sectors)
+    {
+        run = _filex_secondary_run(media, sector, sectors, &type);
+        if (type == FILEX_SECONDARY_COPY)
+        {
+            /* One by one, a run may mix dirty and clean groups.  */
+            run = 1;
+            _filex_secondary_locate(media, sector, &offset);
+            if (_filex_secondary_dirty(filex_media, offset))
+            {
+                if (rt_fx_mirror_read(media, media->fx_media_hidden_sectors + media->fx_media_reserved_sectors + offset,
+                                      buffer, 1) != 1)
+                {
+                    return 0;
+                }
+            }
+            else if (rt_fx_mirror_read(media, sector, buffer, 1) != 1)
+            {
+                return 0;
+            }
+        }
+        else if (rt_fx_mirror_read(media, sector, buffer, run) != run)
+        {
+            return 0;
+        }
+
+        sector += run;
+        sectors -= run;
+        buffer += run * media->fx_media_bytes_per_sector;
+    }
+    return total;
+}
+
+/* Primary FAT writes go down and mark their group; writes to the other
+   copies are dropped and redone from the primary on flush.  */
+size_t filex_secondary_fat_write(FX_MEDIA * media, ULONG sector, const UCHAR * buffer, ULONG sectors)
+{
+    filex_media_t * filex_media = rt_container_of(media, filex_media_t, media);
+    size_t written = 0;
+    ULONG offset;
+    ULONG run;
+    ULONG i;
+    int type;
+
+    if ((filex_media->secondary_map == RT_NULL) || _filex_secondary_outside(media, sector, sectors))
+    {
+        return rt_fx_mirror_write(media, sector, buffer, sectors);
+    }
+
+    while (sectors)
+    {
+        run = _filex_secondary_run(media, sector, sectors, &type);
+        if (type != FILEX_SECONDARY_OTHER)
+        {
+            _filex_secondary_locate(media, sector, &offset);
+            for (i = 0; i < run; i++)
+            {
+                _filex_secondary_mark(filex_media, offset + i);
+            }
+            filex_media->secondary_dirty = RT_TRUE;
+        }
+        if ((type != FILEX_SECONDARY_COPY) && (rt_fx_mirror_write(media, sector, buffer, run) != run))
+        {
+            return written;
+        }
+
+        written += run;
+        sector += run;
+        sectors -= run;
+        buffer += run * media->fx_media_bytes_per_sector;
+    }
+    return written;
+}
+
+/* Copies every dirty group of the primary FAT to the other FATs.  */
+UINT filex_secondary_fat_flush(FX_MEDIA * media)
+{
+    filex_media_t * filex_media = rt_container_of(media, filex_media_t, media);
+    ULONG start = media->fx_media_hidden_sectors + media->fx_media_reserved_sectors;
+    UINT sector_type = media->fx_media_driver_sector_type;
+    UINT system_write = media->fx_media_driver_system_write;
+    UINT result = FX_SUCCESS;
+    UINT status;
+    ULONG offset;
+    ULONG bits;
+    ULONG bit;
+    ULONG end;
+    UINT copy;
+
+    if ((filex_media->secondary_map == RT_NULL) || !filex_media->secondary_dirty)
+    {
+        return FX_SUCCESS;
+    }
+
+    /* Still metadata to the scheduler, but kept out of the sector cache:
+       FileX never reads the copies back.  */
+    media->fx_media_driver_sector_type = FX_UNKNOWN_SECTOR;
+    media->fx_media_driver_system_write = FX_TRUE;
+
+    bits = (media->fx_media_sectors_per_FAT + filex_media->secondary_map_sectors - 1) / filex_media->secondary_map_sectors;
+    for (bit = 0; bit < bits; bit++)
+    {
+        if (!(filex_media->secondary_map[bit >> 3] & (1 << (bit & 7))))
+        {
+            continue;
+        }
+
+        status = FX_SUCCESS;
+        offset = bit * filex_media->secondary_map_sectors;
+        end = offset + filex_media->secondary_map_sectors;
+        if (end > media->fx_media_sectors_per_FAT)
+        {
+            end = media->fx_media_sectors_per_FAT;
+        }
+        for (; offset < end; offset++)
+        {
+            if (rt_fx_mirror_read(media, start + offset, filex_media->secondary_buffer, 1) != 1)
+            {
+                status = FX_IO_ERROR;
+                break;
+            }
+            for (copy = 1; copy < media->fx_media_number_of_FATs; copy++)
+            {
+                if (rt_fx_mirror_write(media, start + copy * media->fx_media_sectors_per_FAT + offset,
+                                       filex_media->secondary_buffer, 1) != 1)
+                {
+                    status = FX_IO_ERROR;
+                }
+            }
+        }
+
+        /* A failed group stays dirty for the next flush, the groups after
+           it are still copied.  The first error is returned.  */
+        if (status == FX_SUCCESS)
+        {
+            filex_media->secondary_map[bit >> 3] &= (rt_uint8_t)~(1 << (bit & 7));
+        }
+        else if (result == FX_SUCCESS)
+        {
+            result = status;
+        }
+    }
+    if (result == FX_SUCCESS)
+    {
+        filex_media->secondary_dirty = RT_FALSE;
+    }
+
+    media->fx_media_driver_sector_type = sector_type;
+    media->fx_media_driver_system_write = system_write;
+    return result;
+}
+
+void filex_secondary_fat_release(FX_MEDIA * media)
+{
+    filex_media_t * filex_media = rt_container_of(media, filex_media_t, media);
+
+    rt_free(filex_media->secondary_map);
+    rt_free(filex_media->secondary_buffer);
+    filex_media->secondary_map = RT_NULL;
+    filex_media->secondary_buffer = RT_NULL;
+    filex_media->secondary_dirty = RT_FALSE;
+}
+
+#endif /* FILEX_USING_LAZY_SECONDARY_FAT */
@@ -0,0 +1,138 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_SEEK_CHECKPOINTS
+
+/* Seek checkpoints: FileX finds a file position by following the cluster
+   chain, from the start of the file for any backward seek.  On a file of
+   millions of clusters that is millions of FAT reads.  The relative and
+   physical cluster pairs the handle passes through are kept here, spread
+   evenly over the file, and a seek starts from the nearest one below the
+   target instead.  */
+
+static filex_seek_map_t * _filex_seek_find(FX_FILE * file, rt_bool_t create)
+{
+    filex_media_t * filex_media = rt_container_of(file->fx_file_media_ptr, filex_media_t, media);
+    filex_seek_map_t * victim = &filex_media->seek_maps[0];
+    int i;
+
+    for (i = 0; i < FILEX_SEEK_FILES; i++)
+    {
+        filex_seek_map_t * map = &filex_media->seek_maps[i];
+
+        if (map->file == file)
+        {
+            map->stamp = ++filex_media->seek_clock;
+            return map;
+        }
+        if ((victim->file != RT_NULL) && ((map->file == RT_NULL) || (map->stamp < victim->stamp)))
+        {
+            victim = map;
+        }
+    }
+    if (!create)
+    {
+        return RT_NULL;
+    }
+
+    rt_memset(victim, 0, sizeof(filex_seek_map_t));
+    victim->file = file;
+    victim->interval = file->fx_file_total_clusters / FILEX_SEEK_CHECKPOINTS + 1;
+    victim->stamp = ++filex_media->seek_clock;
+    return victim;
+}
+
+/* Records where the handle is now.  Called after every read, write and
+   seek with filex_lock held.  */
+void filex_seek_note(FX_FILE * file)
+{
+    filex_seek_map_t * map;
+    ULONG relative = file->fx_file_current_relative_cluster;
+    ULONG slot;
+    ULONG i;
+
+    if ((relative == 0) || (file->fx_file_current_physical_cluster < FX_FAT_ENTRY_START))
+    {
+        return;
+    }
+    map = _filex_seek_find(file, RT_TRUE);
+
+    /* The file grew past the map: double the spacing, keeping the lower
+       checkpoint of every pair of slots.  */
+    while (relative / map->interval >= FILEX_SEEK_CHECKPOINTS)
+    {
+        for (i = 0; i < FILEX_SEEK_CHECKPOINTS / 2; i++)
+        {
+            map->relative[i] = map->relative[2 * i] ? map->relative[2 * i] : map->relative[2 * i + 1];
+            map->physical[i] = map->relative[2 * i] ? map->physical[2 * i] : map->physical[2 * i + 1];
+        }
+        rt_memset(&map->relative[FILEX_SEEK_CHECKPOINTS / 2], 0, sizeof(map->relative) / 2);
+        map->interval *= 2;
+    }
+
+    slot = relative / map->interval;
+    if (map->relative[slot] == 0)
+    {
+        map->relative[slot] = relative;
+        map->physical[slot] = file->fx_file_current_physical_cluster;
+    }
+}
+
+/* Moves the handle to the last checkpoint at or below offset when that is
+   closer than where FileX would start walking from.  */
+void filex_seek_prepare(FX_FILE * file, ULONG64 offset)
+{
+    FX_MEDIA * media = file->fx_file_media_ptr;
+    ULONG bytes_per_cluster = media->fx_media_bytes_per_sector * media->fx_media_sectors_per_cluster;
+    filex_seek_map_t * map = _filex_seek_find(file, RT_FALSE);
+    ULONG target;
+    ULONG from;
+    int slot;
+
+    if ((map == RT_NULL) || (bytes_per_cluster == 0))
+    {
+        return;
+    }
+
+    target = (ULONG)(offset / bytes_per_cluster);
+    from = (offset < file->fx_file_current_file_offset) ? 0 : file->fx_file_current_relative_cluster;
+    slot = (int)(target / map->interval);
+    if (slot >= FILEX_SEEK_CHECKPOINTS)
+    {
+        slot = FILEX_SEEK_CHECKPOINTS - 1;
+    }
+    for (; slot >= 0; slot--)
+    {
+        if ((map->relative[slot] != 0) && (map->relative[slot] <= target))
+        {
+            break;
+        }
+    }
+    if ((slot < 0) || (map->relative[slot] <= from))
+    {
+        return;
+    }
+
+    /* The state a read leaves at the first byte of that cluster.  */
+    file->fx_file_current_relative_cluster = map->relative[slot];
+    file->fx_file_current_physical_cluster = map->physical[slot];
+    file->fx_file_current_relative_sector = 0;
+    file->fx_file_current_logical_sector = media->fx_media_data_sector_start +
+        ((ULONG64)(map->physical[slot] - FX_FAT_ENTRY_START) * media->fx_media_sectors_per_cluster);
+    file->fx_file_current_logical_offset = 0;
+    file->fx_file_current_file_offset = (ULONG64)map->relative[slot] * bytes_per_cluster;
+}
+
+void filex_seek_forget(FX_FILE * file)
+{
+    filex_seek_map_t * map = _filex_seek_find(file, RT_FALSE);
+
+    if (map != RT_NULL)
+    {
+        map->file = RT_NULL;
+    }
+}
+
+#endif /* FILEX_USING_SEEK_CHECKPOINTS */
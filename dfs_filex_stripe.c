@@ -0,0 +1,420 @@
+#include <rtthread.h>
+#include <rtdevice.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_STRIPE
+
+/* Striped volume: a block device whose sectors are dealt out across
+   several member devices in stripes of stripe_sectors, the first stripe to
+   the first member, the next to the second and so on, so FileX can be
+   mounted on it like on any card.  A request that covers more than one
+   member is handed to one worker thread per member and the members are
+   read or written at the same time.  Members may be block or MTD devices
+   but must have the same sector size; each gives the stripe set as many
+   sectors as the smallest one holds.  */
+
+typedef struct filex_stripe_member {
+    rt_device_t device;
+    rt_uint32_t base;           /* First sector used, block_start on MTD */
+    rt_sem_t start;
+    rt_thread_t thread;
+    rt_bool_t failed;           /* The last request came short */
+} filex_stripe_member_t;
+
+typedef struct filex_stripe {
+    struct rt_device parent;
+    filex_stripe_member_t members[FILEX_STRIPE_MEMBERS];
+    int count;
+    rt_uint32_t stripe_sectors;
+    rt_uint32_t bytes_per_sector;
+    rt_uint32_t sector_count;
+    rt_mutex_t lock;            /* One request at a time */
+    rt_sem_t done;              /* Released by each member worker */
+    rt_bool_t write;            /* The request in progress */
+    rt_off_t pos;
+    rt_size_t size;
+    rt_uint8_t * buffer;
+} filex_stripe_t;
+
+typedef struct filex_stripe_worker {
+    filex_stripe_t * stripe;
+    int index;
+} filex_stripe_worker_t;
+
+static rt_err_t _filex_stripe_member_geometry(rt_device_t device, rt_uint32_t * base,
+                                              rt_uint32_t * count, rt_uint32_t * size)
+{
+    struct rt_device_blk_geometry geometry;
+
+    switch (device->type)
+    {
+#ifdef RT_MTD_NOR_DEVICE
+    case RT_Device_Class_MTD:
+        *base = RT_MTD_NOR_DEVICE(device)->block_start;
+        *count = RT_MTD_NOR_DEVICE(device)->block_end - RT_MTD_NOR_DEVICE(device)->block_start;
+        *size = RT_MTD_NOR_DEVICE(device)->block_size;
+        return RT_EOK;
+#endif
+    case RT_Device_Class_Block:
+        rt_memset(&geometry, 0, sizeof(geometry));
+        if (rt_device_control(device, RT_DEVICE_CTRL_BLK_GETGEOME, &geometry) != RT_EOK)
+        {
+            return -RT_EIO;
+        }
+        *base = 0;
+        *count = geometry.sector_count;
+        *size = geometry.bytes_per_sector;
+        return RT_EOK;
+    default:
+        return -RT_EINVAL;
+    }
+}
+
+/* Moves the stripes of the request in progress that belong to one member,
+   one call to the member per stripe.  */
+static void _filex_stripe_transfer(filex_stripe_t * stripe, int index)
+{
+    filex_stripe_member_t * member = &stripe->members[index];
+    rt_off_t sector = stripe->pos;
+    rt_off_t end = stripe->pos + stripe->size;
+    rt_uint8_t * buffer;
+    rt_uint32_t unit;
+    rt_uint32_t within;
+    rt_uint32_t block;
+    rt_size_t number;
+    rt_size_t result;
+
+    member->failed = RT_FALSE;
+    while (sector < end)
+    {
+        unit = sector / stripe->stripe_sectors;
+        within = sector % stripe->stripe_sectors;
+        number = stripe->stripe_sectors - within;
+        if (number > (rt_size_t)(end - sector))
+        {
+            number = end - sector;
+        }
+
+        if (unit % stripe->count == (rt_uint32_t)index)
+        {
+            block = member->base + (unit / stripe->count) * stripe->stripe_sectors + within;
+            buffer = stripe->buffer + (sector - stripe->pos) * stripe->bytes_per_sector;
+            if (stripe->write)
+            {
+                result = rt_disk_write(member->device, block, buffer, number);
+            }
+            else
+            {
+                result = rt_disk_read(member->device, block, buffer, number);
+            }
+            if (result != number)
+            {
+                member->failed = RT_TRUE;
+                return;
+            }
+        }
+        sector += number;
+    }
+}
+
+static void _filex_stripe_entry_thread(void * parameter)
+{
+    filex_stripe_worker_t * worker = (filex_stripe_worker_t *)parameter;
+    filex_stripe_t * stripe = worker->stripe;
+
+    while (1)
+    {
+        rt_sem_take(stripe->members[worker->index].start, RT_WAITING_FOREVER);
+        _filex_stripe_transfer(stripe, worker->index);
+        rt_sem_release(stripe->done);
+    }
+}
+
+static rt_size_t _filex_stripe_io(filex_stripe_t * stripe, rt_bool_t write, rt_off_t pos, void * buffer, rt_size_t size)
+{
+    rt_uint32_t first;
+    rt_uint32_t last;
+    int involved;
+    int i;
+
+    if ((size == 0) || (pos < 0) || ((rt_uint32_t)pos >= stripe->sector_count) ||
+        (size > stripe->sector_count - (rt_uint32_t)pos))
+    {
+        return 0;
+    }
+
+    rt_mutex_take(stripe->lock, RT_WAITING_FOREVER);
+    stripe->write = write;
+    stripe->pos = pos;
+    stripe->size = size;
+    stripe->buffer = (rt_uint8_t *)buffer;
+
+    first = pos / stripe->stripe_sectors;
+    last = (pos + size - 1) / stripe->stripe_sectors;
+    involved = (last - first + 1 < (rt_uint32_t)stripe->count) ? (int)(last - first + 1) : stripe->count;
+
+    if (involved == 1)
+    {
+        /* Nothing to overlap: no hand over to a worker.  */
+        _filex_stripe_transfer(stripe, first % stripe->count);
+    }
+    else
+    {
+        for (i = 0; i < involved; i++)
+        {
+            rt_sem_release(stripe->members[(first + i) % stripe->count].start);
+        }
+        for (i = 0; i < involved; i++)
+        {
+            rt_sem_take(stripe->done, RT_WAITING_FOREVER);
+        }
+    }
+
+    for (i = 0; i < involved; i++)
+    {
+        if (stripe->members[(first + i) % stripe->count].failed)
+        {
+            size = 0;
+        }
+    }
+    rt_mutex_release(stripe->lock);
+    return size;
+}
+
+static rt_err_t _filex_stripe_open(rt_device_t dev, rt_uint16_t oflag)
+{
+    filex_stripe_t * stripe = (filex_stripe_t *)dev;
+    int i;
+
+    for (i = 0; i < stripe->count; i++)
+    {
+        if (rt_device_open(stripe->members[i].device, RT_DEVICE_OFLAG_RDWR) != RT_EOK)
+        {
+            while (i--)
+            {
+                rt_device_close(stripe->members[i].device);
+            }
+            return -RT_EIO;
+        }
+    }
+    return RT_EOK;
+}
+
+static rt_err_t _filex_stripe_close(rt_device_t dev)
+{
+    filex_stripe_t * stripe = (filex_stripe_t *)dev;
+    int i;
+
+    for (i = 0; i < stripe->count; i++)
+    {
+        rt_device_close(stripe->members[i].device);
+    }
+    return RT_EOK;
+}
+
+static rt_size_t _filex_stripe_read(rt_device_t dev, rt_off_t pos, void * buffer, rt_size_t size)
+{
+    return _filex_stripe_io((filex_stripe_t *)dev, RT_FALSE, pos, buffer, size);
+}
+
+static rt_size_t _filex_stripe_write(rt_device_t dev, rt_off_t pos, const void * buffer, rt_size_t size)
+{
+    return _filex_stripe_io((filex_stripe_t *)dev, RT_TRUE, pos, (void *)buffer, size);
+}
+
+static rt_err_t _filex_stripe_control(rt_device_t dev, int cmd, void * args)
+{
+    filex_stripe_t * stripe = (filex_stripe_t *)dev;
+    struct rt_device_blk_geometry * geometry;
+    rt_err_t result = RT_EOK;
+    int i;
+
+    switch (cmd)
+    {
+    case RT_DEVICE_CTRL_BLK_GETGEOME:
+        geometry = (struct rt_device_blk_geometry *)args;
+        if (geometry == RT_NULL)
+        {
+            return -RT_EINVAL;
+        }
+        geometry->sector_count = stripe->sector_count;
+        geometry->bytes_per_sector = stripe->bytes_per_sector;
+        geometry->block_size = stripe->bytes_per_sector;
+        return RT_EOK;
+    case RT_DEVICE_CTRL_BLK_SYNC:
+        rt_mutex_take(stripe->lock, RT_WAITING_FOREVER);
+        for (i = 0; i < stripe->count; i++)
+        {
+            if ((stripe->members[i].device->type == RT_Device_Class_Block) &&
+                (rt_device_control(stripe->members[i].device, RT_DEVICE_CTRL_BLK_SYNC, RT_NULL) != RT_EOK))
+            {
+                result = -RT_EIO;
+            }
+        }
+        rt_mutex_release(stripe->lock);
+        return result;
+    default:
+        return -RT_ENOSYS;
+    }
+}
+
+#ifdef RT_USING_DEVICE_OPS
+static const struct rt_device_ops _filex_stripe_ops =
+{
+    RT_NULL,
+    _filex_stripe_open,
+    _filex_stripe_close,
+    _filex_stripe_read,
+    _filex_stripe_write,
+    _filex_stripe_control
+};
+#endif /* RT_USING_DEVICE_OPS */
+
+/* Registers block device name striped over the count devices named in
+   members, stripe_sectors member sectors at a time.  */
+rt_err_t filex_stripe_create(const char * name, const char * const * members, int count, rt_uint32_t stripe_sectors)
+{
+    filex_stripe_t * stripe;
+    filex_stripe_worker_t * workers;
+    rt_uint32_t member_count = 0;
+    rt_uint32_t sectors;
+    rt_uint32_t size;
+    rt_err_t result = -RT_EINVAL;
+    char object_name[RT_NAME_MAX];
+    int i;
+
+    if ((count < 2) || (count > FILEX_STRIPE_MEMBERS) || (stripe_sectors == 0))
+    {
+        return -RT_EINVAL;
+    }
+
+    stripe = rt_calloc(1, sizeof(filex_stripe_t));
+    workers = rt_calloc(count, sizeof(filex_stripe_worker_t));
+    if ((stripe == RT_NULL) || (workers == RT_NULL))
+    {
+        rt_free(stripe);
+        rt_free(workers);
+        return -RT_ENOMEM;
+    }
+    stripe->count = count;
+    stripe->stripe_sectors = stripe_sectors;
+
+    for (i = 0; i < count; i++)
+    {
+        stripe->members[i].device = rt_device_find(members[i]);
+        if ((stripe->members[i].device == RT_NULL) ||
+            (_filex_stripe_member_geometry(stripe->members[i].device, &stripe->members[i].base, &sectors, &size) != RT_EOK))
+        {
+            rt_kprintf("filex: stripe member %s not usable\n", members[i]);
+            goto _error;
+        }
+        if ((i != 0) && (size != stripe->bytes_per_sector))
+        {
+            rt_kprintf("filex: stripe member %s has %u byte sectors, not %u\n", members[i], size, stripe->bytes_per_sector);
+            goto _error;
+        }
+        stripe->bytes_per_sector = size;
+        if ((i == 0) || (sectors < member_count))
+        {
+            member_count = sectors;
+        }
+    }
+    /* Whole stripes only.  */
+    stripe->sector_count = member_count / stripe_sectors * stripe_sectors * count;
+    if (stripe->sector_count == 0)
+    {
+        goto _error;
+    }
+
+    stripe->lock = rt_mutex_create(name, RT_IPC_FLAG_PRIO);
+    stripe->done = rt_sem_create(name, 0, RT_IPC_FLAG_FIFO);
+    if ((stripe->lock == RT_NULL) || (stripe->done == RT_NULL))
+    {
+        result = -RT_ENOMEM;
+        goto _error;
+    }
+    for (i = 0; i < count; i++)
+    {
+        rt_snprintf(object_name, sizeof(object_name), "fxst%d", i);
+        stripe->members[i].start = rt_sem_create(object_name, 0, RT_IPC_FLAG_FIFO);
+        workers[i].stripe = stripe;
+        workers[i].index = i;
+        stripe->members[i].thread = rt_thread_create(object_name, _filex_stripe_entry_thread, &workers[i],
+                                                     FILEX_STRIPE_THREAD_STACK_SIZE, FILEX_STRIPE_THREAD_PRIORITY, 10);
+        if ((stripe->members[i].start == RT_NULL) || (stripe->members[i].thread == RT_NULL))
+        {
+            result = -RT_ENOMEM;
+            goto _error;
+        }
+        rt_thread_startup(stripe->members[i].thread);
+    }
+
+    stripe->parent.type = RT_Device_Class_Block;
+#ifdef RT_USING_DEVICE_OPS
+    stripe->parent.ops = &_filex_stripe_ops;
+#else
+    stripe->parent.open = _filex_stripe_open;
+    stripe->parent.close = _filex_stripe_close;
+    stripe->parent.read = _filex_stripe_read;
+    stripe->parent.write = _filex_stripe_write;
+    stripe->parent.control = _filex_stripe_control;
+#endif /* RT_USING_DEVICE_OPS */
+    result = rt_device_register(&stripe->parent, name, RT_DEVICE_FLAG_RDWR | RT_DEVICE_FLAG_STANDALONE);
+    if (result == RT_EOK)
+    {
+        return RT_EOK;
+    }
+
+_error:
+    /* Workers go before their semaphores: deleting a semaphore wakes
+       the thread parked on it.  */
+    for (i = 0; i < count; i++)
+    {
+        if (stripe->members[i].thread != RT_NULL)
+        {
+            rt_thread_delete(stripe->members[i].thread);
+        }
+        if (stripe->members[i].start != RT_NULL)
+        {
+            rt_sem_delete(stripe->members[i].start);
+        }
+    }
+    if (stripe->lock != RT_NULL)
+    {
+        rt_mutex_delete(stripe->lock);
+    }
+    if (stripe->done != RT_NULL)
+    {
+        rt_sem_delete(stripe->done);
+    }
+    rt_free(workers);
+    rt_free(stripe);
+    return result;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+#include <stdlib.h>
+
+static void filex_stripe(int argc, char ** argv)
+{
+    rt_err_t result;
+
+    if (argc < 5)
+    {
+        rt_kprintf("usage: filex_stripe <name> <stripe sectors> <device> <device> ...\n");
+        return;
+    }
+    result = filex_stripe_create(argv[1], (const char * const *)&argv[3], argc - 3, (rt_uint32_t)atoi(argv[2]));
+    if (result != RT_EOK)
+    {
+        rt_kprintf("%s: not created: %d\n", argv[1], result);
+    }
+}
+MSH_CMD_EXPORT(filex_stripe, stripe a block device over several: filex_stripe <name> <stripe sectors> <device> <device> ...);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_STRIPE */
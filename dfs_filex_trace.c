@@ -0,0 +1,193 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#ifdef FILEX_USING_TRACE
+
+#if (FILEX_TRACE_RECORDS & (FILEX_TRACE_RECORDS - 1)) != 0
+#error "FILEX_TRACE_RECORDS must be a power of 2"
+#endif
+
+/* Workload trace: every DFS call into filex and every request FileX makes
+   of the driver adds a fixed size record to a RAM ring, overwriting the
+   oldest.  Paths are kept as hashes, data not at all, so a trace can be
+   taken from the field.  Records are added as calls return, so they are
+   in completion order; start orders them by arrival.  The ring is read
+   out with FILEX_IOCTL_TRACE_READ or dumped to a file by filex_trace.
+   Nothing is recorded until filex_trace on, unless FILEX_TRACE_DEFAULT_ON
+   is set.  */
+
+#define FILEX_TRACE_MASK                        (FILEX_TRACE_RECORDS - 1)
+
+static struct filex_trace_record trace_ring[FILEX_TRACE_RECORDS];
+static rt_uint32_t trace_next;              /* Sequence of the next record */
+static rt_bool_t trace_enabled = FILEX_TRACE_DEFAULT_ON ? RT_TRUE : RT_FALSE;
+
+void filex_trace_enable(rt_bool_t enable)
+{
+    trace_enabled = enable;
+}
+
+/* FNV-1a over the path folded the way FileX compares names.  */
+rt_uint32_t filex_trace_hash(const char * path)
+{
+    rt_uint32_t hash = 2166136261UL;
+    char c;
+
+    while ((c = *path++) != 0)
+    {
+        if ((c >= 'a') && (c <= 'z'))
+        {
+            c = c - 'a' + 'A';
+        }
+        else if (c == '\\')
+        {
+            c = '/';
+        }
+        hash ^= (rt_uint8_t)c;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+void filex_trace_add(rt_uint8_t op, const char * path, rt_uint64_t offset, rt_uint32_t length, rt_uint32_t start,
+                     rt_uint8_t status)
+{
+    struct filex_trace_record record;
+
+    if (!trace_enabled)
+    {
+        return;
+    }
+
+    record.start = start;
+    record.duration = FILEX_TRACE_CLOCK() - start;
+    record.hash = (path != RT_NULL) ? filex_trace_hash(path) : 0;
+    record.offset = offset;
+    record.length = length;
+    record.thread = (rt_uint16_t)((rt_ubase_t)rt_thread_self() >> 2);
+    record.op = op;
+    record.status = status;
+    record.reserved = 0;
+
+    rt_enter_critical();
+    trace_ring[trace_next & FILEX_TRACE_MASK] = record;
+    trace_next++;
+    rt_exit_critical();
+}
+
+/* Copies records from request->sequence on.  A reader that fell behind
+   skips to the oldest record still held and is told how many it lost.  */
+void filex_trace_read(struct filex_trace_read * request)
+{
+    rt_uint32_t count = 0;
+
+    rt_enter_critical();
+    request->lost = 0;
+    if (trace_next - request->sequence > FILEX_TRACE_RECORDS)
+    {
+        request->lost = trace_next - FILEX_TRACE_RECORDS - request->sequence;
+        request->sequence = trace_next - FILEX_TRACE_RECORDS;
+    }
+    while ((count < request->count) && (request->sequence != trace_next))
+    {
+        request->records[count++] = trace_ring[request->sequence & FILEX_TRACE_MASK];
+        request->sequence++;
+    }
+    rt_exit_critical();
+    request->count = count;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+#include <dfs_posix.h>
+
+#define FILEX_TRACE_DUMP_RECORDS                16
+
+/* Writes what the ring holds to path.  Tracing stops meanwhile, the dump
+   would otherwise record itself.  */
+static int _filex_trace_dump(const char * path)
+{
+    struct filex_trace_record records[FILEX_TRACE_DUMP_RECORDS];
+    struct filex_trace_header header;
+    struct filex_trace_read request;
+    rt_bool_t enabled = trace_enabled;
+    rt_uint32_t written = 0;
+    int result = -1;
+    int fd;
+
+    trace_enabled = RT_FALSE;
+
+    rt_enter_critical();
+    header.count = (trace_next < FILEX_TRACE_RECORDS) ? trace_next : FILEX_TRACE_RECORDS;
+    header.lost = trace_next - header.count;
+    rt_exit_critical();
+    header.magic = FILEX_TRACE_MAGIC;
+    header.version = FILEX_TRACE_VERSION;
+    header.record_size = sizeof(struct filex_trace_record);
+    header.clock_hz = FILEX_TRACE_CLOCK_HZ;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0);
+    if (fd >= 0)
+    {
+        if (write(fd, &header, sizeof(header)) == sizeof(header))
+        {
+            /* A record on its way in as tracing stopped is left out, the
+               header has the count.  */
+            request.sequence = header.lost;
+            request.records = records;
+            while (written < header.count)
+            {
+                request.count = header.count - written;
+                if (request.count > FILEX_TRACE_DUMP_RECORDS)
+                {
+                    request.count = FILEX_TRACE_DUMP_RECORDS;
+                }
+                filex_trace_read(&request);
+                if ((request.count == 0) ||
+                    (write(fd, records, request.count * sizeof(records[0])) != request.count * sizeof(records[0])))
+                {
+                    break;
+                }
+                written += request.count;
+            }
+            result = (written == header.count) ? 0 : -1;
+        }
+        close(fd);
+    }
+
+    trace_enabled = enabled;
+    return result;
+}
+
+static void filex_trace(int argc, char ** argv)
+{
+    if ((argc == 2) && (rt_strcmp(argv[1], "on") == 0))
+    {
+        filex_trace_enable(RT_TRUE);
+    }
+    else if ((argc == 2) && (rt_strcmp(argv[1], "off") == 0))
+    {
+        filex_trace_enable(RT_FALSE);
+    }
+    else if ((argc == 3) && (rt_strcmp(argv[1], "dump") == 0))
+    {
+        if (_filex_trace_dump(argv[2]) != 0)
+        {
+            rt_kprintf("%s: cannot write\n", argv[2]);
+        }
+    }
+    else if (argc != 1)
+    {
+        rt_kprintf("usage: filex_trace [on|off|dump <file>]\n");
+        return;
+    }
+
+    rt_kprintf("trace %s, %u records taken, %u held\n", trace_enabled ? "on" : "off", trace_next,
+               (trace_next < FILEX_TRACE_RECORDS) ? trace_next : FILEX_TRACE_RECORDS);
+}
+MSH_CMD_EXPORT(filex_trace, record filex calls and driver requests: filex_trace [on|off|dump <file>]);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_TRACE */
@@ -0,0 +1,172 @@
+#include <rtthread.h>
+#include <dfs_posix.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+#include <string.h>
+
+#ifdef FILEX_USING_READDIR_PLUS
+
+/* Holds one directory fd per level of the tree while descending.  */
+static int _filex_walk(char * path, rt_size_t length, filex_walk_t walker, void * parameter,
+                       struct filex_dirent_plus * entries)
+{
+    struct filex_readdir_plus request;
+    struct filex_dirent_plus * entry;
+    rt_size_t name_length;
+    rt_size_t base;
+    rt_uint32_t i;
+    int result = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY, 0);
+    if (fd < 0)
+    {
+        return -rt_get_errno();
+    }
+
+    /* No separator to add after the root.  */
+    base = (path[length - 1] == '/') ? length : length + 1;
+
+    while (result == 0)
+    {
+        request.entries = entries;
+        request.count = FILEX_WALK_BATCH;
+        if (ioctl(fd, FILEX_IOCTL_DIR_READ_PLUS, &request) < 0)
+        {
+            result = -rt_get_errno();
+            break;
+        }
+        if (request.count == 0)
+        {
+            break;
+        }
+
+        for (i = 0; (i < request.count) && (result == 0); i++)
+        {
+            entry = &entries[i];
+            if ((strcmp(entry->name, ".") == 0) || (strcmp(entry->name, "..") == 0))
+            {
+                continue;
+            }
+            name_length = rt_strlen(entry->name);
+            if (base + name_length >= DFS_PATH_MAX)
+            {
+                result = -ENAMETOOLONG;
+                break;
+            }
+            path[length] = '/';
+            rt_memcpy(&path[base], entry->name, name_length + 1);
+
+            result = walker(path, entry, parameter);
+            if ((result == 0) && (entry->attributes & FX_DIRECTORY))
+            {
+                /* This level is still walking its own batch.  */
+                struct filex_dirent_plus * children;
+
+                children = rt_malloc(FILEX_WALK_BATCH * sizeof(struct filex_dirent_plus));
+                if (children == RT_NULL)
+                {
+                    result = -ENOMEM;
+                    break;
+                }
+                result = _filex_walk(path, base + name_length, walker, parameter, children);
+                rt_free(children);
+            }
+            path[length] = 0;
+        }
+    }
+
+    path[length] = 0;
+    close(fd);
+    return result;
+}
+
+/* Calls walker for every entry below path, parents before children.  A
+   non-zero return from walker stops the walk and is returned.  */
+int filex_walk(const char * path, filex_walk_t walker, void * parameter)
+{
+    struct filex_dirent_plus * entries;
+    rt_size_t length;
+    char * buffer;
+    int result;
+
+    RT_ASSERT(path != RT_NULL);
+    RT_ASSERT(walker != RT_NULL);
+
+    length = rt_strlen(path);
+    if ((length == 0) || (length >= DFS_PATH_MAX))
+    {
+        return -EINVAL;
+    }
+
+    buffer = rt_malloc(DFS_PATH_MAX);
+    entries = rt_malloc(FILEX_WALK_BATCH * sizeof(struct filex_dirent_plus));
+    if ((buffer == RT_NULL) || (entries == RT_NULL))
+    {
+        rt_free(buffer);
+        rt_free(entries);
+        return -ENOMEM;
+    }
+
+    rt_memcpy(buffer, path, length + 1);
+    while ((length > 1) && (buffer[length - 1] == '/'))
+    {
+        buffer[--length] = 0;
+    }
+    result = _filex_walk(buffer, length, walker, parameter, entries);
+
+    rt_free(entries);
+    rt_free(buffer);
+    return result;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+struct filex_du
+{
+    rt_uint64_t bytes;
+    rt_uint32_t files;
+    rt_uint32_t directories;
+};
+
+static int _filex_du_entry(const char * path, const struct filex_dirent_plus * entry, void * parameter)
+{
+    struct filex_du * du = (struct filex_du *)parameter;
+
+    if (entry->attributes & FX_DIRECTORY)
+    {
+        du->directories++;
+    }
+    else
+    {
+        du->files++;
+        du->bytes += entry->size;
+    }
+    return 0;
+}
+
+static void filex_du(int argc, char ** argv)
+{
+    struct filex_du du = {0};
+    rt_tick_t tick;
+    int result;
+
+    tick = rt_tick_get();
+    result = filex_walk((argc > 1) ? argv[1] : "/", _filex_du_entry, &du);
+    tick = rt_tick_get() - tick;
+
+    if (result != 0)
+    {
+        rt_kprintf("filex_du failed: %d\n", result);
+        return;
+    }
+    rt_kprintf("%u files, %u directories, %u KB in %u ms\n", du.files, du.directories,
+               (rt_uint32_t)(du.bytes >> 10), (rt_uint32_t)(tick * 1000 / RT_TICK_PER_SECOND));
+}
+MSH_CMD_EXPORT(filex_du, summarize a filex directory tree: filex_du [path]);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_READDIR_PLUS */
@@ -0,0 +1,195 @@
+#include <rtthread.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+#include "rtthread_driver.h"
+
+#ifdef FILEX_USING_CACHE_WARMUP
+
+/* Cache warm-up: the boot, FAT and directory sectors held by the sector
+   cache are listed in a hidden file at unmount, or when asked, and read
+   back into the cache at the next mount.  Listed sectors close together
+   are fetched in one device read of up to FILEX_WARMUP_BATCH sectors, so
+   the first walk of a deep tree after boot finds its metadata cached
+   instead of reading it a sector at a time.  The list only says what to
+   read; a stale one costs some reads and never serves stale data.  */
+
+#define FILEX_WARMUP_MAGIC                      0x4D525746      /* "FWRM" */
+
+#define FILEX_WARMUP_SECTORS                    (FILEX_CACHE_SYSTEM_SECTORS + FILEX_CACHE_DIRECTORY_SECTORS)
+
+static ULONG warmup_sectors[FILEX_WARMUP_SECTORS];
+
+static void _filex_warmup_sort(ULONG * sectors, ULONG count)
+{
+    ULONG sector;
+    ULONG i;
+    ULONG j;
+
+    for (i = 1; i < count; i++)
+    {
+        sector = sectors[i];
+        for (j = i; (j > 0) && (sectors[j - 1] > sector); j--)
+        {
+            sectors[j] = sectors[j - 1];
+        }
+        sectors[j] = sector;
+    }
+}
+
+/* Lists what the cache holds now.  Called with filex_lock held.  */
+UINT filex_warmup_save(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_FILE list;
+    ULONG header[3];
+    UINT result;
+
+    if (filex_media->read_only)
+    {
+        return FX_WRITE_PROTECT;
+    }
+
+    header[0] = FILEX_WARMUP_MAGIC;
+    header[1] = filex_cache_sectors_get(media, FILEX_CACHE_SYSTEM, warmup_sectors, FILEX_CACHE_SYSTEM_SECTORS);
+    header[2] = filex_cache_sectors_get(media, FILEX_CACHE_DIRECTORY, warmup_sectors + header[1], FILEX_CACHE_DIRECTORY_SECTORS);
+    _filex_warmup_sort(warmup_sectors, header[1]);
+    _filex_warmup_sort(warmup_sectors + header[1], header[2]);
+
+    result = fx_file_create(media, FILEX_WARMUP_FILE);
+    if (result == FX_SUCCESS)
+    {
+        fx_file_attributes_set(media, FILEX_WARMUP_FILE, FX_HIDDEN | FX_SYSTEM);
+    }
+    else if (result != FX_ALREADY_CREATED)
+    {
+        return result;
+    }
+
+    result = fx_file_open(media, &list, FILEX_WARMUP_FILE, FX_OPEN_FOR_WRITE);
+    if (result != FX_SUCCESS)
+    {
+        return result;
+    }
+#ifdef FILEX_USING_DIR_INDEX
+    /* Created behind the back of the root index.  */
+    filex_dir_index_add(filex_media, FILEX_WARMUP_FILE, &list.fx_file_dir_entry);
+#endif /* FILEX_USING_DIR_INDEX */
+
+    result = fx_file_write(&list, header, sizeof(header));
+    if (result == FX_SUCCESS)
+    {
+        result = fx_file_write(&list, warmup_sectors, (header[1] + header[2]) * sizeof(ULONG));
+    }
+    if (result == FX_SUCCESS)
+    {
+        result = fx_file_truncate(&list, sizeof(header) + (header[1] + header[2]) * sizeof(ULONG));
+    }
+    fx_file_close(&list);
+    return result;
+}
+
+/* Reads the sorted sectors of one partition into the cache.  */
+static void _filex_warmup_fetch(filex_media_t * filex_media, int partition, const ULONG * sectors, ULONG count,
+                                UCHAR * buffer)
+{
+    FX_MEDIA * media = &filex_media->media;
+    ULONG64 end = (ULONG64)media->fx_media_hidden_sectors + media->fx_media_total_sectors;
+    ULONG first;
+    ULONG last;
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < count; i = j)
+    {
+        /* Whatever lies between listed sectors is read along, it is
+           cheaper than another request.  */
+        first = sectors[i];
+        for (j = i + 1; (j < count) && (sectors[j] - first < FILEX_WARMUP_BATCH); j++)
+        {
+        }
+        last = sectors[j - 1];
+        if (last >= end)
+        {
+            return;
+        }
+
+        if (rt_fx_sched_read(media, first, buffer, last - first + 1) != last - first + 1)
+        {
+            return;
+        }
+        filex_media->warmup_reads++;
+        for (; i < j; i++)
+        {
+            filex_cache_insert(media, partition, sectors[i], buffer + (sectors[i] - first) * media->fx_media_bytes_per_sector);
+            filex_media->warmup_sectors++;
+        }
+    }
+}
+
+/* Called at mount with filex_lock held.  */
+void filex_warmup_load(filex_media_t * filex_media)
+{
+    FX_MEDIA * media = &filex_media->media;
+    FX_FILE list;
+    ULONG header[3];
+    ULONG actual;
+    UCHAR * buffer;
+
+    filex_media->warmup_sectors = 0;
+    filex_media->warmup_reads = 0;
+    if (fx_file_open(media, &list, FILEX_WARMUP_FILE, FX_OPEN_FOR_READ) != FX_SUCCESS)
+    {
+        return;
+    }
+    if ((fx_file_read(&list, header, sizeof(header), &actual) != FX_SUCCESS) || (actual != sizeof(header)) ||
+        (header[0] != FILEX_WARMUP_MAGIC) || (header[1] > FILEX_CACHE_SYSTEM_SECTORS) ||
+        (header[2] > FILEX_CACHE_DIRECTORY_SECTORS) ||
+        (fx_file_read(&list, warmup_sectors, (header[1] + header[2]) * sizeof(ULONG), &actual) != FX_SUCCESS) ||
+        (actual != (header[1] + header[2]) * sizeof(ULONG)))
+    {
+        fx_file_close(&list);
+        return;
+    }
+    fx_file_close(&list);
+
+    buffer = rt_malloc(FILEX_WARMUP_BATCH * media->fx_media_bytes_per_sector);
+    if (buffer == RT_NULL)
+    {
+        return;
+    }
+    _filex_warmup_fetch(filex_media, FILEX_CACHE_SYSTEM, warmup_sectors, header[1], buffer);
+    _filex_warmup_fetch(filex_media, FILEX_CACHE_DIRECTORY, warmup_sectors + header[1], header[2], buffer);
+    rt_free(buffer);
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+
+static void filex_warmup(int argc, char ** argv)
+{
+    filex_media_t * filex_media;
+    rt_list_t * node;
+    UINT result;
+
+    filex_lock();
+    rt_list_for_each(node, &filex_media_list)
+    {
+        filex_media = rt_list_entry(node, filex_media_t, list);
+        if ((argc > 1) && (rt_strcmp(argv[1], "save") == 0))
+        {
+            result = filex_warmup_save(filex_media);
+            if (result != FX_SUCCESS)
+            {
+                rt_kprintf("%s: not saved: 0x%02x\n", filex_media->media.fx_media_name, result);
+            }
+        }
+        rt_kprintf("%s: %u sectors warmed in %u reads at mount\n", filex_media->media.fx_media_name,
+                   filex_media->warmup_sectors, filex_media->warmup_reads);
+    }
+    filex_unlock();
+}
+MSH_CMD_EXPORT(filex_warmup, show or save the filex cache warm-up list: filex_warmup [save]);
+#endif /* RT_USING_FINSH */
+
+#endif /* FILEX_USING_CACHE_WARMUP */
@@ -1,6 +1,7 @@
 #include "fx_api.h"
 #include "rtthread.h"
 #include "rtdevice.h"
+#include "rtthread_driver.h"
 #include <stdio.h>
 static size_t rt_disk_erase(rt_device_t disk_dev, off_t block_off, size_t number_of_block)
 {
@@ -25,7 +26,7 @@ static size_t rt_disk_erase(rt_device_t disk_dev, off_t block_off, size_t number
     }
 }
 
-static size_t rt_disk_write(rt_device_t disk_dev, off_t block_off, const void * buffer, size_t number_of_block)
+size_t rt_disk_write(rt_device_t disk_dev, off_t block_off, const void * buffer, size_t number_of_block)
 {
     size_t size;
     if(number_of_block == 0)return 0;
@@ -52,7 +53,25 @@ static size_t rt_disk_write(rt_device_t disk_dev, off_t block_off, const void *
     return 0;
 }
 
-static size_t rt_disk_read(rt_device_t disk_dev, off_t block_off, void * buffer, size_t number_of_block)
+#ifdef FX_ENABLE_FAULT_TOLERANT
+rt_bool_t rt_fx_disk_log_sector(FX_MEDIA *media_ptr, ULONG sector, ULONG number)
+{
+    ULONG start;
+    ULONG end;
+
+    if (!media_ptr->fx_media_fault_tolerant_enabled || (media_ptr->fx_media_fault_tolerant_start_cluster < FX_FAT_ENTRY_START))
+    {
+        return RT_FALSE;
+    }
+
+    start = media_ptr->fx_media_data_sector_start + media_ptr->fx_media_hidden_sectors +
+            (media_ptr->fx_media_fault_tolerant_start_cluster - FX_FAT_ENTRY_START) * media_ptr->fx_media_sectors_per_cluster;
+    end = start + media_ptr->fx_media_fault_tolerant_clusters * media_ptr->fx_media_sectors_per_cluster;
+    return (sector < end) && (sector + number > start);
+}
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+size_t rt_disk_read(rt_device_t disk_dev, off_t block_off, void * buffer, size_t number_of_block)
 {
     size_t size;
     if(number_of_block == 0)return 0;
@@ -80,6 +99,9 @@ static size_t rt_disk_read(rt_device_t disk_dev, off_t block_off, void * buffer,
 VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
 {
     rt_device_t disk_dev = media_ptr->fx_media_driver_info;
+#ifdef FILEX_USING_TRACE
+    rt_uint32_t trace_start = FILEX_TRACE_CLOCK();
+#endif
     RT_ASSERT(media_ptr != RT_NULL);
     RT_ASSERT(disk_dev != RT_NULL);
     RT_ASSERT(disk_dev->type == RT_Device_Class_MTD || disk_dev->type == RT_Device_Class_Block);
@@ -170,7 +192,7 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
     case FX_DRIVER_READ:
     {
         media_ptr -> fx_media_driver_status =  FX_SUCCESS;
-        if(rt_disk_read(disk_dev, media_ptr -> fx_media_driver_logical_sector + media_ptr -> fx_media_hidden_sectors, media_ptr->fx_media_driver_buffer, media_ptr->fx_media_driver_sectors) != media_ptr->fx_media_driver_sectors)
+        if(rt_fx_disk_read(media_ptr, media_ptr -> fx_media_driver_logical_sector + media_ptr -> fx_media_hidden_sectors, media_ptr->fx_media_driver_buffer, media_ptr->fx_media_driver_sectors) != media_ptr->fx_media_driver_sectors)
         {
             media_ptr -> fx_media_driver_status = FX_IO_ERROR;
         }
@@ -181,7 +203,7 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
     case FX_DRIVER_WRITE:
     {
         media_ptr -> fx_media_driver_status =  FX_SUCCESS;
-        if(rt_disk_write(disk_dev, media_ptr -> fx_media_driver_logical_sector + media_ptr -> fx_media_hidden_sectors, media_ptr->fx_media_driver_buffer, media_ptr->fx_media_driver_sectors) != media_ptr->fx_media_driver_sectors)
+        if(rt_fx_disk_write(media_ptr, media_ptr -> fx_media_driver_logical_sector + media_ptr -> fx_media_hidden_sectors, media_ptr->fx_media_driver_buffer, media_ptr->fx_media_driver_sectors) != media_ptr->fx_media_driver_sectors)
         {
             media_ptr -> fx_media_driver_status = FX_IO_ERROR;
         }
@@ -193,6 +215,27 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
 
         /* Return driver success.  */
         media_ptr -> fx_media_driver_status =  FX_SUCCESS;
+#ifdef FILEX_USING_FAT_MIRROR
+        media_ptr -> fx_media_driver_status =  filex_fat_mirror_flush(media_ptr);
+#endif
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+        if(filex_secondary_fat_flush(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+        }
+#endif
+#ifdef FILEX_USING_IO_SCHED
+        if(filex_io_sched_flush(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+        }
+#endif
+#ifdef FILEX_USING_BLOCK_MAP
+        if(filex_block_flush(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+        }
+#endif
         break;
     }
 
@@ -201,6 +244,21 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
 
         /* Return driver success.  */
         media_ptr -> fx_media_driver_status =  FX_SUCCESS;
+#ifdef FILEX_USING_FAT_MIRROR
+        filex_fat_mirror_release(media_ptr);
+#endif
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+        filex_secondary_fat_release(media_ptr);
+#endif
+#ifdef FILEX_USING_IO_SCHED
+        filex_io_sched_abort(media_ptr);
+#endif
+#ifdef FILEX_USING_BLOCK_MAP
+        filex_block_abort(media_ptr);
+#endif
+#ifdef FILEX_USING_SECTOR_CACHE
+        filex_cache_invalidate(media_ptr);
+#endif
         break;
     }
 
@@ -238,6 +296,32 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
 
         /* Successful driver request.  */
         media_ptr -> fx_media_driver_status =  FX_SUCCESS;
+#ifdef FILEX_USING_FAT_MIRROR
+        media_ptr -> fx_media_driver_status =  filex_fat_mirror_flush(media_ptr);
+        filex_fat_mirror_release(media_ptr);
+#endif
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+        if(filex_secondary_fat_flush(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+        }
+        filex_secondary_fat_release(media_ptr);
+#endif
+#ifdef FILEX_USING_IO_SCHED
+        if(filex_io_sched_uninit(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+        }
+#endif
+#ifdef FILEX_USING_BLOCK_MAP
+        if(filex_block_uninit(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+        }
+#endif
+#ifdef FILEX_USING_SECTOR_CACHE
+        filex_cache_uninit(media_ptr);
+#endif
         break;
     }
 
@@ -247,10 +331,22 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
         /* Read the boot record and return to the caller.  */
 
         media_ptr -> fx_media_driver_status =  FX_SUCCESS;
+#ifdef FILEX_USING_IO_SCHED
+        /* The boot sector is addressed below the queue, write it out first.  */
+        if(filex_io_sched_flush(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+            break;
+        }
+#endif
+#ifdef FILEX_USING_BLOCK_MAP
+        media_ptr -> fx_media_driver_status = filex_block_boot_read(media_ptr, media_ptr->fx_media_driver_buffer);
+#else
         if(rt_disk_read(disk_dev, 0, media_ptr->fx_media_driver_buffer, 1) != 1)
         {
             media_ptr -> fx_media_driver_status = FX_IO_ERROR;
         }
+#endif
         break;
     }
 
@@ -258,10 +354,24 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
     {
 
         media_ptr -> fx_media_driver_status =  FX_SUCCESS;
+#ifdef FILEX_USING_IO_SCHED
+        if(filex_io_sched_flush(media_ptr) != FX_SUCCESS)
+        {
+            media_ptr -> fx_media_driver_status = FX_IO_ERROR;
+            break;
+        }
+#endif
+#ifdef FILEX_USING_BLOCK_MAP
+        media_ptr -> fx_media_driver_status = filex_block_boot_write(media_ptr, media_ptr->fx_media_driver_buffer);
+#else
         if(rt_disk_write(disk_dev, 0, media_ptr->fx_media_driver_buffer, 1) != 1)
         {
             media_ptr -> fx_media_driver_status = FX_IO_ERROR;
         }
+#endif
+#ifdef FILEX_USING_SECTOR_CACHE
+        filex_cache_invalidate(media_ptr);
+#endif
         break;
     }
 
@@ -273,4 +383,11 @@ VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr)
         break;
     }
     }
+
+#ifdef FILEX_USING_TRACE
+    /* The sector fields are only meaningful for reads, writes and releases.  */
+    filex_trace_add(FILEX_TRACE_DRIVER + media_ptr -> fx_media_driver_request, media_ptr -> fx_media_name,
+                    media_ptr -> fx_media_driver_logical_sector, media_ptr -> fx_media_driver_sectors, trace_start,
+                    (rt_uint8_t)media_ptr -> fx_media_driver_status);
+#endif
 }
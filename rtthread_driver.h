@@ -0,0 +1,68 @@
+#ifndef __RTTHREAD_DRIVER_H__
+#define __RTTHREAD_DRIVER_H__
+
+#include <rtthread.h>
+#include <rtdevice.h>
+
+#include "fx_api.h"
+#include "dfs_filex.h"
+
+/* Block offsets and counts are in device sectors, hidden sectors included.
+   Both return the number of blocks transferred, 0 on error.  */
+size_t rt_disk_write(rt_device_t disk_dev, off_t block_off, const void * buffer, size_t number_of_block);
+size_t rt_disk_read(rt_device_t disk_dev, off_t block_off, void * buffer, size_t number_of_block);
+
+VOID  rt_fx_disk_driver(FX_MEDIA *media_ptr);
+
+/* RT_TRUE when the sectors overlap the fault tolerant log, whose writes
+   order everything written before and after them.  */
+#ifdef FX_ENABLE_FAULT_TOLERANT
+rt_bool_t rt_fx_disk_log_sector(FX_MEDIA *media_ptr, ULONG sector, ULONG number);
+#else
+#define rt_fx_disk_log_sector(media_ptr, sector, number)    RT_FALSE
+#endif /* FX_ENABLE_FAULT_TOLERANT */
+
+/* Sector I/O of the driver is stacked, each layer only calls the one
+   below it: secondary FAT, FAT mirror, sector cache, I/O scheduler, block
+   map, device.  Below the block map sectors are device blocks.  */
+#ifdef FILEX_USING_BLOCK_MAP
+#define rt_fx_block_read(media_ptr, sector, buffer, number)     filex_block_read(media_ptr, sector, buffer, number)
+#define rt_fx_block_write(media_ptr, sector, buffer, number)    filex_block_write(media_ptr, sector, buffer, number)
+#else
+#define rt_fx_block_read(media_ptr, sector, buffer, number)     rt_disk_read((media_ptr)->fx_media_driver_info, sector, buffer, number)
+#define rt_fx_block_write(media_ptr, sector, buffer, number)    rt_disk_write((media_ptr)->fx_media_driver_info, sector, buffer, number)
+#endif /* FILEX_USING_BLOCK_MAP */
+
+#ifdef FILEX_USING_IO_SCHED
+#define rt_fx_sched_read(media_ptr, sector, buffer, number)     filex_io_sched_read(media_ptr, sector, buffer, number)
+#define rt_fx_sched_write(media_ptr, sector, buffer, number)    filex_io_sched_write(media_ptr, sector, buffer, number)
+#else
+#define rt_fx_sched_read(media_ptr, sector, buffer, number)     rt_fx_block_read(media_ptr, sector, buffer, number)
+#define rt_fx_sched_write(media_ptr, sector, buffer, number)    rt_fx_block_write(media_ptr, sector, buffer, number)
+#endif /* FILEX_USING_IO_SCHED */
+
+#ifdef FILEX_USING_SECTOR_CACHE
+#define rt_fx_cache_read(media_ptr, sector, buffer, number)     filex_cache_read(media_ptr, sector, buffer, number)
+#define rt_fx_cache_write(media_ptr, sector, buffer, number)    filex_cache_write(media_ptr, sector, buffer, number)
+#else
+#define rt_fx_cache_read(media_ptr, sector, buffer, number)     rt_fx_sched_read(media_ptr, sector, buffer, number)
+#define rt_fx_cache_write(media_ptr, sector, buffer, number)    rt_fx_sched_write(media_ptr, sector, buffer, number)
+#endif /* FILEX_USING_SECTOR_CACHE */
+
+#ifdef FILEX_USING_FAT_MIRROR
+#define rt_fx_mirror_read(media_ptr, sector, buffer, number)    filex_fat_mirror_read(media_ptr, sector, buffer, number)
+#define rt_fx_mirror_write(media_ptr, sector, buffer, number)   filex_fat_mirror_write(media_ptr, sector, buffer, number)
+#else
+#define rt_fx_mirror_read(media_ptr, sector, buffer, number)    rt_fx_cache_read(media_ptr, sector, buffer, number)
+#define rt_fx_mirror_write(media_ptr, sector, buffer, number)   rt_fx_cache_write(media_ptr, sector, buffer, number)
+#endif /* FILEX_USING_FAT_MIRROR */
+
+#ifdef FILEX_USING_LAZY_SECONDARY_FAT
+#define rt_fx_disk_read(media_ptr, sector, buffer, number)      filex_secondary_fat_read(media_ptr, sector, buffer, number)
+#define rt_fx_disk_write(media_ptr, sector, buffer, number)     filex_secondary_fat_write(media_ptr, sector, buffer, number)
+#else
+#define rt_fx_disk_read(media_ptr, sector, buffer, number)      rt_fx_mirror_read(media_ptr, sector, buffer, number)
+#define rt_fx_disk_write(media_ptr, sector, buffer, number)     rt_fx_mirror_write(media_ptr, sector, buffer, number)
+#endif /* FILEX_USING_LAZY_SECONDARY_FAT */
+
+#endif /* __RTTHREAD_DRIVER_H__ */